@@ -23,6 +23,23 @@
 /* $ModDepends: core 1.1 */
 /* $ModVersion: $Rev: 78 $ */
 
+/** Part of a replacement line, parsed when the config is read
+ */
+class FantasySegment
+{
+ public:
+	enum Type { TEXT, WORD, REST, NICK, IDENT, HOST, VHOST, CHAN };
+	Type type;
+	/** The parameter number for WORD and REST, counting from 1 */
+	unsigned int index;
+	/** The literal text for TEXT */
+	std::string text;
+
+	FantasySegment(Type t, unsigned int i = 0, const std::string &txt = "") : type(t), index(i), text(txt) { }
+};
+
+typedef std::vector<FantasySegment> FantasyLine;
+
 /** Fantasy command definition
  */
 class FantasyCommand : public classbase
@@ -38,6 +55,8 @@ class FantasyCommand : public classbase
 	bool case_sensitive;
 	/** Format that must be matched for use */
 	std::string format;
+	/** replace_with split into lines and parsed into segments */
+	std::vector<FantasyLine> lines;
 };
 
 class ModuleAlias : public Module
@@ -45,9 +64,65 @@ class ModuleAlias : public Module
  private:
 	/** We cant use a map, there may be multiple aliases with the same name */
 	std::vector<FantasyCommand> FantasyCommands;
-	std::map<std::string, int> FantasyMap;
+	/** The indexes into FantasyCommands of the commands for each verb, in config order */
+	nspace::hash_map<std::string, std::vector<unsigned int> > FantasyMap;
 	std::vector<std::string> pars;
 
+	static void ParseLine(const std::string &line, FantasyLine &out)
+	{
+		static const struct { const char* name; FantasySegment::Type type; } specials[] = {
+			{ "nick", FantasySegment::NICK }, { "ident", FantasySegment::IDENT }, { "host", FantasySegment::HOST },
+			{ "vhost", FantasySegment::VHOST }, { "chan", FantasySegment::CHAN }
+		};
+
+		std::string text;
+		std::string::size_type i = 0;
+		while (i < line.length())
+		{
+			if (line[i] != '$')
+			{
+				text += line[i++];
+				continue;
+			}
+
+			FantasySegment seg(FantasySegment::TEXT);
+			std::string::size_type len = 0;
+			if ((i + 1 < line.length()) && (line[i + 1] >= '1') && (line[i + 1] <= '9'))
+			{
+				bool rest = (i + 2 < line.length()) && (line[i + 2] == '-');
+				seg = FantasySegment(rest ? FantasySegment::REST : FantasySegment::WORD, line[i + 1] - '0');
+				len = rest ? 3 : 2;
+			}
+			else
+			{
+				for (unsigned int s = 0; s < sizeof(specials) / sizeof(specials[0]); s++)
+				{
+					if (!line.compare(i + 1, strlen(specials[s].name), specials[s].name))
+					{
+						seg = FantasySegment(specials[s].type);
+						len = strlen(specials[s].name) + 1;
+						break;
+					}
+				}
+			}
+
+			/* not a variable, the $ is kept as it is */
+			if (!len)
+			{
+				text += line[i++];
+				continue;
+			}
+
+			if (!text.empty())
+				out.push_back(FantasySegment(FantasySegment::TEXT, 0, text));
+			text.clear();
+			out.push_back(seg);
+			i += len;
+		}
+		if (!text.empty())
+			out.push_back(FantasySegment(FantasySegment::TEXT, 0, text));
+	}
+
 	virtual void ReadAliases()
 	{
 		ConfigReader MyConf(ServerInstance);
@@ -65,8 +140,17 @@ class ModuleAlias : public Module
 			a.operonly = MyConf.ReadFlag("fcommand", "operonly", i);
 			a.format = MyConf.ReadValue("fcommand", "format", i);
 			a.case_sensitive = MyConf.ReadFlag("fcommands", "matchcase", i);
+
+			irc::sepstream commands(a.replace_with, '\n');
+			std::string command;
+			while (commands.GetToken(command))
+			{
+				a.lines.push_back(FantasyLine());
+				ParseLine(command, a.lines.back());
+			}
+
+			FantasyMap[txt].push_back(FantasyCommands.size());
 			FantasyCommands.push_back(a);
-			FantasyMap[txt] = 1;
 		}
 	}
 
@@ -92,42 +176,6 @@ class ModuleAlias : public Module
 		return Version(1,1,0,1,VF_VENDOR,API_VERSION);
 	}
 
-	std::string GetVar(std::string varname, const std::string &original_line)
-	{
-		irc::spacesepstream ss(original_line);
-		varname.erase(varname.begin());
-		int index = *(varname.begin()) - 48;
-		varname.erase(varname.begin());
-		bool everything_after = (varname == "-");
-		std::string word;
-
-		for (int j = 0; j < index; j++)
-			ss.GetToken(word);
-
-		if (everything_after)
-		{
-			std::string more;
-			while (ss.GetToken(more))
-			{
-				word.append(" ");
-				word.append(more);
-			}
-		}
-
-		return word;
-	}
-
-	void SearchAndReplace(std::string& newline, const std::string &find, const std::string &replace)
-	{
-		std::string::size_type x = newline.find(find);
-		while (x != std::string::npos)
-		{
-			newline.erase(x, find.length());
-			newline.insert(x, replace);
-			x = newline.find(find);
-		}
-	}
-
 	virtual int OnUserPreMessage(userrec* user,void* dest,int target_type, std::string &text, char status, CUList &exempt_list)
 	{
 		if (target_type != TYPE_CHANNEL)
@@ -171,7 +219,8 @@ class ModuleAlias : public Module
 		ServerInstance->Log(DEBUG, "fantasy: now got %s", fcommand.c_str());
 
 		/* We dont have any commands looking like this, no point continuing.. */
-		if (FantasyMap.find(fcommand) == FantasyMap.end())
+		nspace::hash_map<std::string, std::vector<unsigned int> >::iterator cmds = FantasyMap.find(fcommand);
+		if (cmds == FantasyMap.end())
 			return 0;
 
 		ServerInstance->Log(DEBUG, "fantasy: in the map");
@@ -181,96 +230,83 @@ class ModuleAlias : public Module
 		while (*(compare.c_str()) == ' ')
 			compare.erase(compare.begin());
 
-		std::string safe(compare);
-
-		/* Escape out any $ symbols in the user provided text (ugly, but better than crashy) */
-		SearchAndReplace(safe, "$", "\r");
+		/* The words are split once, the segments pick them out as needed */
+		std::vector<std::string> words;
+		irc::spacesepstream params(compare);
+		std::string word;
+		while (params.GetToken(word))
+			words.push_back(word);
 
-		ServerInstance->Log(DEBUG, "fantasy: compare is %s and safe is %s", compare.c_str(), safe.c_str());
+		ServerInstance->Log(DEBUG, "fantasy: compare is %s", compare.c_str());
 
-		for (unsigned int i = 0; i < FantasyCommands.size(); i++)
+		for (std::vector<unsigned int>::iterator i = cmds->second.begin(); i != cmds->second.end(); i++)
 		{
-			ServerInstance->Log(DEBUG, "fantasy: looking for %s, current item is %s", fcommand.c_str(), FantasyCommands[i].text.c_str());
-			if (!strcasecmp(FantasyCommands[i].text.c_str(), fcommand.c_str())) // XXX a stl comparison would be nicer, but I can't get it working right now.
-			{
-				/* Does it match the pattern? */
-				if (!FantasyCommands[i].format.empty())
-				{
-					if (!match(FantasyCommands[i].case_sensitive, compare.c_str(), FantasyCommands[i].format.c_str()))
-					{
-						ServerInstance->Log(DEBUG, "fantasy: no match on pattern %s (comparing %s)", FantasyCommands[i].format.c_str(), compare.c_str());
-						continue;
-					}
-				}
+			FantasyCommand &cmd = FantasyCommands[*i];
 
-				if ((FantasyCommands[i].operonly) && (!IS_OPER(user)))
+			/* Does it match the pattern? */
+			if (!cmd.format.empty())
+			{
+				if (!match(cmd.case_sensitive, compare.c_str(), cmd.format.c_str()))
 				{
-					ServerInstance->Log(DEBUG, "fantasy: oper only");
-					return 0;
+					ServerInstance->Log(DEBUG, "fantasy: no match on pattern %s (comparing %s)", cmd.format.c_str(), compare.c_str());
+					continue;
 				}
+			}
 
-				/* Now, search and replace in a copy of the original_line, replacing $1 through $9 and $1- etc */
-				std::string::size_type crlf = FantasyCommands[i].replace_with.find('\n');
-
-				if (crlf == std::string::npos)
-				{
-					ServerInstance->Log(DEBUG, "fantasy: running it");
-					DoCommand(FantasyCommands[i].replace_with, user, c, safe);
-					return 0;
-				}
-				else
-				{
-					irc::sepstream commands(FantasyCommands[i].replace_with, '\n');
-					std::string command;
-					while (commands.GetToken(command))
-					{
-						DoCommand(command, user, c, safe);
-					}
-					return 0;
-				}
+			if ((cmd.operonly) && (!IS_OPER(user)))
+			{
+				ServerInstance->Log(DEBUG, "fantasy: oper only");
+				return 0;
 			}
+
+			ServerInstance->Log(DEBUG, "fantasy: running it");
+			for (std::vector<FantasyLine>::iterator line = cmd.lines.begin(); line != cmd.lines.end(); line++)
+				DoCommand(*line, user, c, words);
+			return 0;
 		}
 		return 0;
 	}
 
-	void DoCommand(std::string newline, userrec* user, chanrec *c,const std::string &original_line)
+	void DoCommand(const FantasyLine &line, userrec* user, chanrec *c, const std::vector<std::string> &words)
 	{
-		for (int v = 1; v < 10; v++)
+		std::string newline;
+		for (FantasyLine::const_iterator seg = line.begin(); seg != line.end(); seg++)
 		{
-			std::string var = "$";
-			var.append(ConvToStr(v));
-			var.append("-");
-			std::string::size_type x = newline.find(var);
-
-			while (x != std::string::npos)
+			switch (seg->type)
 			{
-				newline.erase(x, var.length());
-				newline.insert(x, GetVar(var, original_line));
-				x = newline.find(var);
-			}
-
-			var = "$";
-			var.append(ConvToStr(v));
-			x = newline.find(var);
-
-			while (x != std::string::npos)
-			{
-				newline.erase(x, var.length());
-				newline.insert(x, GetVar(var, original_line));
-				x = newline.find(var);
+				case FantasySegment::TEXT:
+					newline.append(seg->text);
+				break;
+				case FantasySegment::WORD:
+					if (seg->index <= words.size())
+						newline.append(words[seg->index - 1]);
+				break;
+				case FantasySegment::REST:
+					for (unsigned int w = seg->index - 1; w < words.size(); w++)
+					{
+						if (w != seg->index - 1)
+							newline.append(" ");
+						newline.append(words[w]);
+					}
+				break;
+				case FantasySegment::NICK:
+					newline.append(user->nick);
+				break;
+				case FantasySegment::IDENT:
+					newline.append(user->ident);
+				break;
+				case FantasySegment::HOST:
+					newline.append(user->host);
+				break;
+				case FantasySegment::VHOST:
+					newline.append(user->dhost);
+				break;
+				case FantasySegment::CHAN:
+					newline.append(c->name);
+				break;
 			}
 		}
 
-		/* Special variables */
-		SearchAndReplace(newline, "$nick", user->nick);
-		SearchAndReplace(newline, "$ident", user->ident);
-		SearchAndReplace(newline, "$host", user->host);
-		SearchAndReplace(newline, "$vhost", user->dhost);
-		SearchAndReplace(newline, "$chan", c->name);
-
-		/* Unescape any variable names in the user text before sending */
-		SearchAndReplace(newline, "\r", "$");
-
 		irc::tokenstream ss(newline);
 		const char* parv[127];
 		int x = 0;
@@ -281,6 +317,9 @@ class ModuleAlias : public Module
 			x++;
 		}
 
+		if (!x)
+			return;
+
 		ServerInstance->Parser->CallHandler(parv[0], &parv[1], x-1, user);
 	}
  
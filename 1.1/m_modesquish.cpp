@@ -50,14 +50,15 @@ class module_modesquish : public Module
 	{
 		if (validated && command == "MODE" && pcnt > 1)
 		{
-			class squishy
+			/* a mode change which survived squishing so far, params point into parameters[] */
+			struct squishy
 			{
-				public:
-				squishy() {};
-				~squishy() {};
 				bool adding;
+				bool removed;
 				unsigned char flag;
-				std::string *param;
+				const char* param;
+				/* the previous change with the same letter, or -1 */
+				int next;
 			};
 
 			/*
@@ -68,10 +69,6 @@ class module_modesquish : public Module
 			ModeType type;
 			ModeHandler* handler;
 			bool adding = true;
-			bool abort = false;
-
-			squishy* squish;
-			std::vector<void*> squish_list;
 
 			if (targetchannel)
 				type = MODETYPE_CHANNEL;
@@ -79,15 +76,23 @@ class module_modesquish : public Module
 				type = MODETYPE_USER;
 			else	return 0;
 
-			std::string mode_sequence = parameters[1];
+			const char* mode_sequence = parameters[1];
+
+			/* the line is at most MAXBUF long so that bounds the number of changes */
+			squishy squish_list[MAXBUF];
+			int squish_count = 0;
+
+			/* the most recent change for each mode letter */
+			int heads[256];
+			for (int i = 0; i < 256; i++)
+				heads[i] = -1;
 
-			std::string parameter;
 			int parameter_index = 2;
 
 			/*
 			 * Loop through all the flags
 			 */
-			for (std::string::const_iterator letter = mode_sequence.begin(); letter != mode_sequence.end(); letter++)
+			for (const char* letter = mode_sequence; *letter && squish_count < MAXBUF; letter++)
 			{
 				unsigned char modechar = *letter;
 				switch (modechar)
@@ -99,7 +104,7 @@ class module_modesquish : public Module
 
 					default:
 					handler = ServerInstance->Modes->FindMode(modechar, type);
-					parameter.clear();
+					const char* parameter = "";
 
 					/*
 					 * Grab us a param ?
@@ -108,22 +113,18 @@ class module_modesquish : public Module
 						&& handler->GetNumParams(adding) && parameter_index < pcnt)
 						parameter = parameters[parameter_index++];
 
-					squish = NULL;
-					abort = false;
-					for (std::vector<void*>::iterator i = squish_list.begin(); i != squish_list.end(); i++)
+					/*
+					 * Only the earlier changes of the same letter can make this one redundant
+					 */
+					bool abort = false;
+					for (int i = heads[modechar]; i != -1; i = squish_list[i].next)
 					{
-						squish = (squishy*)(*i);
-						if (squish->flag == modechar && ((squish->param->empty() && parameter.empty())
-							|| !strcmp(squish->param->c_str(),parameter.c_str())))
+						squishy &squish = squish_list[i];
+						if (!squish.removed && !strcmp(squish.param, parameter))
 						{
 							abort = true;
-							if (adding != squish->adding)
-							{
-								squish_list.erase(i);
-								delete squish->param;
-								delete squish;
-							}
-							
+							if (adding != squish.adding)
+								squish.removed = true;
 							break;
 						}
 					}
@@ -134,13 +135,13 @@ class module_modesquish : public Module
 					/*
 					 * Add it to our squish list
 					 */
-					squish = new squishy();
-					squish->flag = modechar;
-					squish->adding = adding;
-					squish_list.push_back((void*)squish);
-					if (!parameter.empty())
-						squish->param = new std::string (parameter);
-					else	squish->param = new std::string ();
+					squishy &squish = squish_list[squish_count];
+					squish.flag = modechar;
+					squish.adding = adding;
+					squish.removed = false;
+					squish.param = parameter;
+					squish.next = heads[modechar];
+					heads[modechar] = squish_count++;
 					
 					break;
 				}
@@ -153,45 +154,37 @@ class module_modesquish : public Module
 
 			const char *squish_p[127];
 			int squish_pcnt = 2;
-			std::string squish_mode_sequence;
+			/* at most a sign and a letter for each change */
+			char squish_mode_sequence[MAXBUF * 2 + 1];
+			int squish_length = 0;
 
 			squish_p[0] = parameters[0]; /* target */
 			adding = true;
 
-			for (std::vector<void*>::iterator i = squish_list.begin(); i != squish_list.end(); i++)
+			for (int i = 0; i < squish_count; i++)
 			{
-				squish = (squishy*)(*i);
+				const squishy &squish = squish_list[i];
+				if (squish.removed)
+					continue;
 				
-				if (squish_mode_sequence.empty() || adding != squish->adding)
-					squish_mode_sequence.append((squish->adding ? "+" : "-"));
-				adding = squish->adding;
-				squish_mode_sequence.append(1, squish->flag);
+				if (!squish_length || adding != squish.adding)
+					squish_mode_sequence[squish_length++] = (squish.adding ? '+' : '-');
+				adding = squish.adding;
+				squish_mode_sequence[squish_length++] = squish.flag;
 
-				if (!squish->param->empty())
-					squish_p[squish_pcnt++] = squish->param->c_str();
+				if (*squish.param)
+					squish_p[squish_pcnt++] = squish.param;
 			}
 
-			squish_p[1] = squish_mode_sequence.c_str();
+			squish_mode_sequence[squish_length] = 0;
+			squish_p[1] = squish_mode_sequence;
 
 			/*
 			 * Finally, send out our new and improved mode!
 			 * (provided we didn't squish it to nothingness)
 			 */
-			if (!squish_mode_sequence.empty())
+			if (squish_length)
 				ServerInstance->CallCommandHandler("MODE", squish_p, squish_pcnt, user);
-				
-
-			/*
-			 * Clean up
-			 */
-			for (std::vector<void*>::iterator i = squish_list.begin(); i != squish_list.end(); i++)
-			{
-				squish = (squishy*)(*i);
-
-				delete squish->param;
-				delete squish;
-			}
-			squish_list.clear();
 
 			/*
 			 * And stop *this* MODE getting through
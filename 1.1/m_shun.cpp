@@ -4,6 +4,9 @@
 #include <vector>
 #include <string>
 #include <sstream>
+#include <map>
+#include <set>
+#include <queue>
 #include "inspircd.h"
 #include "modules.h"
 #include "hashcomp.h"
@@ -27,51 +30,114 @@ public:
 	Shun() { }
 
 	Shun(std::string bm, std::string sb, time_t so, long ln, std::string rs) : banmask(bm), set_by(sb), set_on(so), length(ln), reason(rs) { }
-	
-	bool operator<(const Shun &ban2) const
-	{
-		return ((this->set_on + this->length) < (ban2.set_on + ban2.length));
-	}
 };
 
-typedef std::vector<Shun> shunlist;
+/* shuns by mask, a mask without wildcards is found by looking up the user's host */
+typedef std::map<irc::string, Shun> shunlist;
+
+/* when a timed shun expires, the mask says which one */
+typedef std::pair<time_t, std::string> shunexpiry;
+typedef std::priority_queue<shunexpiry, std::vector<shunexpiry>, std::greater<shunexpiry> > expiryheap;
 
 class ModuleShunBase
 {
  public:
 	/* shuns is declared here, as our type is right above. Don't try move it. */
 	shunlist shuns;
+
+	/* the masks with wildcards, which have to be matched one by one */
+	std::set<std::string> globs;
+
+	/* timed shuns by expiry time, entries for shuns which were removed are skipped when they come up */
+	expiryheap expiries;
  
  	InspIRCd* Srv;
 	 
-	std::string EncodeShun(const Shun &shun)
+	static std::string NumToStr(long value)
 	{
-		std::ostringstream stream;	
-		stream << shun.banmask << " " << shun.set_by << " " << shun.set_on << " " << shun.length << " " << shun.reason;
-		return stream.str();	
+		char buf[32];
+		snprintf(buf, sizeof(buf), "%ld", value);
+		return buf;
 	}
 
-	Shun DecodeShun(const std::string &data)
+	std::string EncodeShun(const Shun &shun)
 	{
-		Shun res;
-		std::istringstream stream(data);
-		stream >> res.banmask;
-		stream >> res.set_by;
-		stream >> res.set_on;
-		stream >> res.length;
-		res.reason = stream.str();
-	
+		std::string res;
+		res.reserve(shun.banmask.length() + shun.set_by.length() + shun.reason.length() + 32);
+		res.append(shun.banmask).append(" ").append(shun.set_by).append(" ").append(NumToStr(shun.set_on));
+		res.append(" ").append(NumToStr(shun.length)).append(" ").append(shun.reason);
 		return res;
 	}
 
+	bool DecodeShun(const std::string &data, Shun &res)
+	{
+		/* mask setby seton length reason, the reason may contain spaces */
+		std::string::size_type pos[4];
+		std::string::size_type start = 0;
+		for (int i = 0; i < 4; i++)
+		{
+			pos[i] = data.find(' ', start);
+			if (pos[i] == std::string::npos)
+				return false;
+			start = pos[i] + 1;
+		}
+
+		res.banmask.assign(data, 0, pos[0]);
+		res.set_by.assign(data, pos[0] + 1, pos[1] - pos[0] - 1);
+		res.set_on = atol(data.c_str() + pos[1] + 1);
+		res.length = atol(data.c_str() + pos[2] + 1);
+		res.reason.assign(data, pos[3] + 1, std::string::npos);
+		return true;
+	}
+
+	bool AddShun(const Shun &shun)
+	{
+		if (!shuns.insert(std::make_pair(irc::string(shun.banmask.c_str()), shun)).second)
+			return false;
+
+		if (shun.banmask.find_first_of("*?") != std::string::npos)
+			globs.insert(shun.banmask);
+
+		if (shun.length)
+			expiries.push(shunexpiry(shun.set_on + shun.length, shun.banmask));
+		return true;
+	}
+
+	void DelShun(shunlist::iterator iter)
+	{
+		globs.erase(iter->second.banmask);
+		shuns.erase(iter);
+	}
+
+	bool IsShunned(userrec* user)
+	{
+		std::string fullhost = user->GetFullHost();
+		std::string fullrealhost = user->GetFullRealHost();
+
+		if ((shuns.find(fullhost.c_str()) != shuns.end()) || (shuns.find(fullrealhost.c_str()) != shuns.end()))
+			return true;
+
+		for (std::set<std::string>::iterator iter = globs.begin(); iter != globs.end(); iter++)
+			if (Srv->MatchText(fullhost, *iter) || Srv->MatchText(fullrealhost, *iter))
+				return true;
+
+		return false;
+	}
+
 	void ExpireBans()
 	{
-		while(shuns.size() && shuns.begin()->length && ((shuns.begin()->set_on + shuns.begin()->length) <= Srv->Time()))
+		while (!expiries.empty() && (expiries.top().first <= Srv->Time()))
 		{
-			shunlist::iterator iter = shuns.begin();
-		
-			Srv->WriteOpers("*** %d second shun on '%s' (%s) set by %s %d seconds ago expired", iter->length, iter->banmask.c_str(), iter->reason.c_str(), iter->set_by.c_str(), Srv->Time() - iter->set_on);
-			shuns.erase(iter);
+			shunexpiry expiry = expiries.top();
+			expiries.pop();
+
+			/* the shun may have been removed, or removed and set again with a different length */
+			shunlist::iterator iter = shuns.find(expiry.second.c_str());
+			if ((iter == shuns.end()) || !iter->second.length || (iter->second.set_on + iter->second.length != expiry.first))
+				continue;
+
+			Srv->WriteOpers("*** %d second shun on '%s' (%s) set by %s %d seconds ago expired", iter->second.length, iter->second.banmask.c_str(), iter->second.reason.c_str(), iter->second.set_by.c_str(), Srv->Time() - iter->second.set_on);
+			DelShun(iter);
 		}
 	}
 };
@@ -99,14 +165,12 @@ class cmd_shun : public command_t
 		if(pcnt == 1)
 		{
 			/* form: SHUN mask removes a SHUN */
-			for(shunlist::iterator iter = base->shuns.begin(); iter != base->shuns.end(); iter++)
+			shunlist::iterator iter = base->shuns.find(parameters[0]);
+			if (iter != base->shuns.end())
 			{
-				if(parameters[0] == iter->banmask)
-				{
-					Srv->WriteOpers("*** %s removed shun '%s', set %d seconds ago with reason '%s'", user->nick, iter->banmask.c_str(), Srv->Time() - iter->set_on, iter->reason.c_str());
-					base->shuns.erase(iter);
-					return CMD_SUCCESS;
-				}
+				Srv->WriteOpers("*** %s removed shun '%s', set %d seconds ago with reason '%s'", user->nick, iter->second.banmask.c_str(), Srv->Time() - iter->second.set_on, iter->second.reason.c_str());
+				base->DelShun(iter);
+				return CMD_SUCCESS;
 			}
 
 			user->WriteServ("NOTICE %s :*** The mask %s is not currently shunned, try /stats s", user->nick, parameters[0]);
@@ -120,22 +184,15 @@ class cmd_shun : public command_t
 				// parameters[0] = Foamy!*@*
 				// parameters[1] = 1h3m2s
 				// parameters[2] = Tortoise abuser
-				for(shunlist::iterator iter = base->shuns.begin(); iter != base->shuns.end(); iter++)
-				{
-					if (parameters[0] == iter->banmask)
-					{
-						user->WriteServ("NOTICE %s :*** Shun on %s already exists", user->nick, parameters[0]);
-						return CMD_FAILURE;
-					}
-				}
-				
 				long length = Srv->Duration(parameters[1]);
 				
 				std::string reason = (pcnt > 2) ? parameters[2] : "No reason supplied";
 				
-				base->shuns.push_back(Shun(parameters[0], user->nick, Srv->Time(), length, reason));
-					
-				std::sort(base->shuns.begin(), base->shuns.end());
+				if (!base->AddShun(Shun(parameters[0], user->nick, Srv->Time(), length, reason)))
+				{
+					user->WriteServ("NOTICE %s :*** Shun on %s already exists", user->nick, parameters[0]);
+					return CMD_FAILURE;
+				}
 				
 				if(length > 0)
 					Srv->WriteOpers("*** %s added %d second shun on '%s' (%s)", user->nick, length, parameters[0], reason.c_str());
@@ -181,7 +238,7 @@ class ModuleShun : public Module, public ModuleShunBase
 			for(shunlist::iterator iter = shuns.begin(); iter != shuns.end(); iter++)
 			{
 				std::ostringstream format;
-				format << Srv->Config->ServerName << " 223 " << user->nick << " :" << iter->banmask << " " << iter->set_on << " " << iter->length << " " << iter->set_by << " " << iter->reason;
+				format << Srv->Config->ServerName << " 223 " << user->nick << " :" << iter->second.banmask << " " << iter->second.set_on << " " << iter->second.length << " " << iter->second.set_by << " " << iter->second.reason;
 				out.push_back(format.str());
 			}
 		}
@@ -195,9 +252,8 @@ class ModuleShun : public Module, public ModuleShunBase
 		{
 			ExpireBans();
 		
-			for(shunlist::iterator iter = shuns.begin(); iter != shuns.end(); iter++)
-				if(Srv->MatchText(user->GetFullHost(), iter->banmask) || Srv->MatchText(user->GetFullRealHost(), iter->banmask))
-					return 1;
+			if (IsShunned(user))
+				return 1;
 		}
 		
 		return 0;
@@ -205,18 +261,19 @@ class ModuleShun : public Module, public ModuleShunBase
 
 	virtual void OnSyncOtherMetaData(Module* proto, void* opaque, bool displayable)
 	{
-		for(shunlist::iterator iter = shuns.begin(); iter != shuns.end(); iter++)
+		for (shunlist::iterator iter = shuns.begin(); iter != shuns.end(); iter++)
 		{
-			proto->ProtoSendMetaData(opaque, TYPE_OTHER, NULL, "shun", EncodeShun(*iter));
+			proto->ProtoSendMetaData(opaque, TYPE_OTHER, NULL, "shun", EncodeShun(iter->second));
 		}
 	}
 
 	virtual void OnDecodeMetaData(int target_type, void* target, const std::string &extname, const std::string &extdata)
 	{
-		if((target_type == TYPE_OTHER) && (extname == "shun"))
+		if ((target_type == TYPE_OTHER) && (extname == "shun"))
 		{
-			shuns.push_back(DecodeShun(extdata));
-			std::sort(shuns.begin(), shuns.end());
+			Shun shun;
+			if (DecodeShun(extdata, shun))
+				AddShun(shun);
 		}
 	}
 
@@ -37,11 +37,71 @@
 /* $ModDepends: core 1.1 */
 /* $ModVersion: $Rev: 78 $ */
 
+/* the most bans announced in one MODE line */
+#define SYNCBANS_MAXMODES 12
+
 class ModuleSyncBans : public Module
 {
  private:
 	std::map<std::string,std::string*> ChannelList;
 	bool doingprop;
+
+	/* ban changes which have been applied but not announced yet, by channel and the user which set them.
+	 * the user is kept rather than the nick so a nick change or reuse can't move the changes to someone
+	 * else; server changes come from a temporary fake client, so they are kept under NULL instead.
+	 */
+	typedef std::vector<std::pair<bool, std::string> > ChangeList;
+	typedef std::map<std::pair<std::string, userrec*>, ChangeList> PendingMap;
+	PendingMap pending;
+
+	void Announce(chanrec *channel, userrec *source, const std::string &modes, const std::string &params)
+	{
+		// Handle server modes properly
+		if (source)
+			channel->WriteChannel(source, "MODE %s %s%s", channel->name, modes.c_str(), params.c_str());
+		else
+			channel->WriteChannelWithServ(NULL, "MODE %s %s%s", channel->name, modes.c_str(), params.c_str());
+	}
+
+	/* sends the queued changes to each channel as stacked MODE lines */
+	void Flush()
+	{
+		for (PendingMap::iterator i = pending.begin(); i != pending.end(); i++)
+		{
+			chanrec *channel = ServerInstance->FindChan(i->first.first);
+			if (!channel)
+				continue;
+
+			userrec *source = i->first.second;
+
+			std::string modes, params;
+			char sign = 0;
+			int count = 0;
+			for (ChangeList::iterator c = i->second.begin(); c != i->second.end(); c++)
+			{
+				char want = c->first ? '+' : '-';
+				if (sign != want)
+				{
+					modes += want;
+					sign = want;
+				}
+				modes += 'b';
+				params.append(" ").append(c->second);
+
+				if (++count == SYNCBANS_MAXMODES)
+				{
+					Announce(channel, source, modes, params);
+					modes.clear();
+					params.clear();
+					sign = 0;
+					count = 0;
+				}
+			}
+			if (count)
+				Announce(channel, source, modes, params);
+		}
+		pending.clear();
+	}
 	
  public:
 	ModuleSyncBans(InspIRCd *Me)
@@ -64,7 +124,7 @@ class ModuleSyncBans : public Module
 
 	void Implements(char *List)
 	{
-		List[I_OnAddBan] = List[I_OnDelBan] = List[I_OnRehash] = 1;
+		List[I_OnAddBan] = List[I_OnDelBan] = List[I_OnRehash] = List[I_OnMode] = List[I_OnPostCommand] = List[I_OnUserQuit] = List[I_OnBackgroundTimer] = 1;
 	}
 	
 	virtual void OnRehash(userrec *user, const std::string &parameter)
@@ -98,6 +158,8 @@ class ModuleSyncBans : public Module
 		if (!mh)
 			return;
 		
+		userrec *setter = (source->GetFd() == FD_MAGIC_NUMBER) ? NULL : source;
+		
 		irc::sepstream sep(channelset, ',');
 		std::string sch;
 		doingprop = true;
@@ -114,16 +176,40 @@ class ModuleSyncBans : public Module
 				else
 					mh->DelBan(source, banmaskc, schannel, 0);
 				
-				// Handle server modes properly
-				if (*source->nick)
-					schannel->WriteChannel(source, "MODE %s %cb %s", schannel->name, (adding) ? '+' : '-', banmask.c_str());
-				else
-					schannel->WriteChannelWithServ(NULL, "MODE %s %cb %s", schannel->name, (adding) ? '+' : '-', banmask.c_str());
+				/* the ban applies now, the MODE line goes out with the rest of this command's changes */
+				pending[std::make_pair(std::string(schannel->name), setter)].push_back(std::make_pair(adding, banmask));
 			}
 		}
 		doingprop = false;
 	}
 	
+	/* called once a MODE or FMODE has been applied, local or remote, including those in a burst */
+	virtual void OnMode(userrec *user, void *dest, int target_type, const std::string &text)
+	{
+		if (!pending.empty())
+			Flush();
+	}
+
+	virtual void OnPostCommand(const std::string &command, const char** parameters, int pcnt, userrec *user, CmdResult result, const std::string &original_line)
+	{
+		if (!pending.empty())
+			Flush();
+	}
+
+	/* announce anything the user set before they go, so the pointer is never used after they are freed */
+	virtual void OnUserQuit(userrec *user, const std::string &message, const std::string &oper_message)
+	{
+		if (!pending.empty())
+			Flush();
+	}
+
+	/* catches bans added some other way than a mode change, e.g. directly by another module */
+	virtual void OnBackgroundTimer(time_t curtime)
+	{
+		if (!pending.empty())
+			Flush();
+	}
+
 	virtual int OnAddBan(userrec *source, chanrec *channel, const std::string &banmask)
 	{
 		if (doingprop)
@@ -7,6 +7,42 @@
  
 class ModuleBanDetails : public Module
 {
+	private:
+		/* The ban list of the channel whose details were last received, indexed by
+		 * lowercase mask. A burst sends the details of a channel's bans together so
+		 * this avoids a scan of the list for every one of them.
+		 */
+		typedef std::map<std::string, BanList::iterator> BanIndex;
+		Channel* indexed;
+		BanIndex index;
+
+		static std::string LowerCase(const std::string& mask)
+		{
+			std::string lower(mask);
+			std::transform(lower.begin(), lower.end(), lower.begin(), ::tolower);
+			return lower;
+		}
+
+		void Reset()
+		{
+			indexed = NULL;
+			index.clear();
+		}
+
+		BanItem* Find(Channel* chan, const std::string& banmask)
+		{
+			if (indexed != chan)
+			{
+				Reset();
+				indexed = chan;
+				for (BanList::iterator i = chan->bans.begin(); i != chan->bans.end(); i++)
+					index.insert(std::make_pair(LowerCase(i->data), i));
+			}
+
+			BanIndex::iterator entry = index.find(LowerCase(banmask));
+			return entry == index.end() ? NULL : &*entry->second;
+		}
+
 	public:
 
 		virtual void OnSyncChannel (Channel *chan, Module *proto, void *opaque)
@@ -31,22 +67,40 @@ class ModuleBanDetails : public Module
 				list.GetToken(sb);
 				list.GetToken(st);
 
-				for (BanList::iterator i = chan->bans.begin(); i != chan->bans.end(); i++)
+				BanItem* ban = Find(chan, banmask);
+				if (ban)
 				{
-					if (!strcasecmp(i->data.c_str(), banmask.c_str()))
-					{
-						i->set_time=ConvToInt(st);
-						i->set_by=sb;
-						break;
-					}
+					ban->set_time=ConvToInt(st);
+					ban->set_by=sb;
 				}
 			}
 		}
 
-		ModuleBanDetails(InspIRCd* Me) : Module(Me)
+		/* Any change to a ban list could invalidate the index. */
+		virtual int OnAddBan(User* source, Channel* channel, const std::string &banmask)
+		{
+			if (channel == indexed)
+				Reset();
+			return 0;
+		}
+
+		virtual int OnDelBan(User* source, Channel* channel, const std::string &banmask)
+		{
+			if (channel == indexed)
+				Reset();
+			return 0;
+		}
+
+		virtual void OnChannelDelete(Channel* chan)
+		{
+			if (chan == indexed)
+				Reset();
+		}
+
+		ModuleBanDetails(InspIRCd* Me) : Module(Me), indexed(NULL)
 		{
-			Implementation eventlist[] = { I_OnSyncChannel,I_OnDecodeMetaData};
-			ServerInstance->Modules->Attach(eventlist, this, 2);
+			Implementation eventlist[] = { I_OnSyncChannel, I_OnDecodeMetaData, I_OnAddBan, I_OnDelBan, I_OnChannelDelete };
+			ServerInstance->Modules->Attach(eventlist, this, 5);
 		}
 
 		virtual Version GetVersion()
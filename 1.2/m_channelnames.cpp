@@ -20,9 +20,14 @@
 class ModuleChannelNames: public Module
 {
  private:
+	/* Whether each byte may appear in a channel name. */
+	bool allowedchars[256];
+
  public:
 	ModuleChannelNames(InspIRCd* Me) : Module(Me)
 	{
+		for (unsigned int i = 0; i < 256; i++)
+			allowedchars[i] = (i > 0x20 && i < 0x7F);
 		ServerInstance->Modules->Attach(I_OnUserPreJoin, this);
 	}
 
@@ -35,11 +40,9 @@ class ModuleChannelNames: public Module
 	{
 		if (chan)
 			return 0;
-		const char* walk = name;
-		while (*walk)
+		for (const unsigned char* walk = (const unsigned char*)name; *walk; walk++)
 		{
-			char c = *walk++;
-			if (c <= 0x20 || c >= 0x7F)
+			if (!allowedchars[*walk])
 			{
 				user->WriteNumeric(ERR_NOSUCHCHANNEL, "%s %s :Cannot join channel (invalid name)", user->nick.c_str(), name);
 				return 1;
@@ -32,8 +32,12 @@ struct io_iconv
     std::string encoding;
     char * intable;
     char * outtable;
+    bool inwide, outwide;	/* tables hold TABLE_ENTRY bytes per input byte rather than one */
     };
 
+/* a wide table entry: the length of the sequence followed by up to 4 bytes of it */
+#define TABLE_ENTRY 5
+
 /* a read buffer for incomplete multibyte characters. As they are just characters and they are incomplete, it's 3 bytes long :) */
 struct io_buffer
     {
@@ -57,6 +61,18 @@ static hash_save save_hash;
 static hash_buffer buffer_hash;
 static std::vector<io_iconv> recode; /* the main encoding storage */
 
+/* a conversion descriptor and its table, shared by every encoding record that converts between the same pair */
+struct iconv_pair
+    {
+    iconv_t cd;
+    char * table;
+    bool wide;
+    unsigned int refs;
+    };
+
+typedef std::map<std::string, iconv_pair> hash_pool;		/* "from>to"			-> shared descriptor */
+static hash_pool pool;
+
 char toUpper_ (char c) { return std::toupper(c); }
 void ToUpper(std::string& s) {std::transform(s.begin(), s.end(), s.begin(),toUpper_);}
 
@@ -342,34 +358,101 @@ class ModuleCodepage : public Module
 		    }
 		}
 		
-		void makeitable(iconv_t cd, char * &table)
+		/* converts a line through a wide table, returns the number of bytes written (never more than max) */
+		int iwtableconvert(char* table, char* dest, const char* source, int n, int max)
+		{
+		int written=0;
+		for (int i=0;i<n;++i)
+		    {
+		    const char* entry=table+TABLE_ENTRY*(unsigned char)source[i];
+		    int len=entry[0];
+		    if (written+len>max)
+			break;
+		    memcpy(dest+written,entry+1,len);
+		    written+=len;
+		    }
+		return written;
+		}
+		
+		/* builds a lookup table when the source encoding is single-byte; wide is set when some byte
+		 * maps to more than one output byte (e.g. cp1251 -> utf-8). table is NULL for multibyte sources. */
+		void makeitable(iconv_t cd, char * &table, bool &wide)
 		{
 		int i;
 		char tmp[2]; tmp[1]=0; /* trailing 0 */
 
-		table=new char[256];
+		wide=false;
+		table=new char[TABLE_ENTRY*0x100];
 		for (i=0;i<0x100;++i)
 		{
 		    tmp[0]=(char)i;
 		    char * src=tmp;
-		    char * dest=table+i;
-		    size_t inbytesleft=1,outbytesleft=1;
+		    char * entry=table+TABLE_ENTRY*i;
+		    char * dest=entry+1;
+		    size_t inbytesleft=1,outbytesleft=TABLE_ENTRY-1;
 		    size_t ret_val = iconv(cd, &src, &inbytesleft, &dest, &outbytesleft);
 		    if (ret_val==size_t(-1))
 		    {
 			if (errno==EILSEQ)
-			    table[i]='?';
-			else
+			{
+			    entry[0]=1;
+			    entry[1]='?';
+			}
+			else /* an incomplete character, the source encoding is multibyte */
 			{
 			    delete [] table;
 			    table=NULL;
 			    break;
 			}
 		    }
+		    else
+			entry[0]=(char)(TABLE_ENTRY-1-outbytesleft);
+		    if (entry[0]!=1)
+			wide=true;
+		    iconv(cd, NULL, NULL, NULL, NULL); /* reset any shift state before the next byte */
+		}
+		
+		if ((table!=NULL) && (!wide))
+		{
+		    /* every byte maps to exactly one byte, compact it for itableconvert */
+		    for (i=0;i<0x100;++i)
+			table[i]=table[TABLE_ENTRY*i+1];
 		}
 		return;
 		}
 		
+		/* returns the shared descriptor for a pair, opening it if nobody is using it yet */
+		bool acquire(const std::string &from, const std::string &to, iconv_t &cd, char * &table, bool &wide)
+		{
+		    std::string key=from+">"+to;
+		    hash_pool::iterator iter=pool.find(key);
+		    if (iter==pool.end())
+		    {
+			iconv_pair pair;
+			if ((pair.cd = iconv_open(to.c_str(), from.c_str())) == (iconv_t)-1)
+			    return false;
+			makeitable(pair.cd, pair.table, pair.wide);
+			pair.refs=0;
+			iter=pool.insert(std::make_pair(key, pair)).first;
+		    }
+		    iter->second.refs++;
+		    cd=iter->second.cd;
+		    table=iter->second.table;
+		    wide=iter->second.wide;
+		    return true;
+		}
+		
+		void release(const std::string &from, const std::string &to)
+		{
+		    hash_pool::iterator iter=pool.find(from+">"+to);
+		    if ((iter==pool.end()) || (--iter->second.refs))
+			return;
+		    iconv_close(iter->second.cd);
+		    if (iter->second.table!=NULL)
+			delete [] iter->second.table;
+		    pool.erase(iter);
+		}
+		
 		unsigned int addavailable(const std::string &codepage)
 		{
 		    io_iconv tmpio;
@@ -378,16 +461,18 @@ class ModuleCodepage : public Module
 				
 		    if (iter==name_hash.end()) /* not found, so let's create it */
 		    { /* wrong convertion, assuming default (0) */
-                        if  (((tmpio.in  = iconv_open(icodepage.c_str(), codepage.c_str())) == (iconv_t)-1) ||
-                            ((tmpio.out = iconv_open(codepage.c_str(), icodepage.c_str())) == (iconv_t)-1))
-                        {
-                            ServerInstance->Logs->Log("m_codepage.so",DEFAULT, "WARNING: wrong conversion between %s and %s. Assuming internal codepage!",icodepage.c_str(), codepage.c_str());
-                        }
+			if (!acquire(codepage, icodepage, tmpio.in, tmpio.intable, tmpio.inwide))
+			{
+			    ServerInstance->Logs->Log("m_codepage.so",DEFAULT, "WARNING: wrong conversion between %s and %s. Assuming internal codepage!",icodepage.c_str(), codepage.c_str());
+			}
+			else if (!acquire(icodepage, codepage, tmpio.out, tmpio.outtable, tmpio.outwide))
+			{
+			    release(codepage, icodepage);
+			    ServerInstance->Logs->Log("m_codepage.so",DEFAULT, "WARNING: wrong conversion between %s and %s. Assuming internal codepage!",icodepage.c_str(), codepage.c_str());
+			}
 			else /* right convertion, pushing it into the vector */
 			{
 			    tmpio.encoding=codepage;
-			    makeitable(tmpio.in ,tmpio.intable );
-			    makeitable(tmpio.out,tmpio.outtable);
 			    name_hash[codepage]=recode.size();
 			    recode.push_back(tmpio);
 			    return recode.size()-1;
@@ -404,7 +489,10 @@ class ModuleCodepage : public Module
 		virtual void OnRehash(User* user)
 		{	
 			SaveExisting();
-			iClose();
+			/* keep the old descriptors until the new set has been acquired so unchanged pairs are reused */
+			std::vector<io_iconv> oldrecode;
+			oldrecode.swap(recode);
+			std::string oldcodepage=icodepage;
 			fd_hash.clear(); port_hash.clear(); name_hash.clear(); recode.clear(); buffer_hash.clear();
 		    	ConfigReader* conf = new ConfigReader(ServerInstance);
 			icodepage="";
@@ -426,6 +514,7 @@ class ModuleCodepage : public Module
 			    {
 			    /* NO internal encoding set*/
 			    ServerInstance->Logs->Log("m_codepage",DEBUG,"WARNING: no internal encoding is set but module loaded");
+			    iClose(oldrecode, oldcodepage);
 			    return;
 			    }
 			
@@ -452,6 +541,7 @@ class ModuleCodepage : public Module
 			tmpio.encoding=icodepage; 
 			tmpio.in=tmpio.out=(iconv_t)-1;
 			tmpio.intable=tmpio.outtable=NULL;
+			tmpio.inwide=tmpio.outwide=false;
 			name_hash[icodepage]=0;
 			recode.push_back(tmpio);
 			
@@ -511,6 +601,7 @@ class ModuleCodepage : public Module
 		
 			delete conf;
 			HookExisting();
+			iClose(oldrecode, oldcodepage);
 		}
     		
     		virtual void OnRawSocketClose(int fd)
@@ -570,6 +661,7 @@ class ModuleCodepage : public Module
                         char* dest1=dest;
                         if (cd!=(iconv_t)-1)
                             {
+				iconv(cd, NULL, NULL, NULL, NULL); /* the descriptor is shared, drop another user's shift state */
 				for(;inbytesleft && !((ret_val==(size_t)-1)&&((errno==E2BIG)||(errno==EINVAL)));--inbytesleft,++src1)
 				{
                         	    ret_val = iconv(cd, &src1, &inbytesleft, &dest1, &outbytesleft);
@@ -594,7 +686,7 @@ class ModuleCodepage : public Module
     		virtual int OnRawSocketRead(int fd, char* buffer, unsigned int count, int &readresult)		
 		{
 		    
-		    io_iconv tmpio;
+		    io_iconv* tmpio=NULL;
 		    int result;
             	    User* user = dynamic_cast<User*>(ServerInstance->SE->GetRef(fd));
 
@@ -614,17 +706,15 @@ class ModuleCodepage : public Module
 			}
 		    
  		    hash_common::iterator iter=fd_hash.find(fd);
-		    if (iter==fd_hash.end()) /* no any value in a hash? */
-			tmpio.in=(iconv_t)-1;
-		    else
-			tmpio=recode[iter->second];
+		    if (iter!=fd_hash.end()) /* no any value in a hash? */
+			tmpio=&recode[iter->second];
 
             	    if ((result == -1) && (errno == EAGAIN))
                         return -1;
             	    else if (result < 1)
                         return 0;
 		    
-		    if (tmpio.in!=(iconv_t)-1)
+		    if ((tmpio!=NULL) && (tmpio->in!=(iconv_t)-1))
 			{
 			/* translating encodings here */
 			char * tmpbuffer=new char[count+4];
@@ -640,13 +730,17 @@ class ModuleCodepage : public Module
 			
 			memcpy(writestart,buffer,readresult);
 			
-			if (tmpio.intable!=NULL)
+			if ((tmpio->intable!=NULL) && (tmpio->inwide))
 			{
-			    itableconvert(tmpio.intable, buffer, tmpbuffer, readresult);
+			    readresult=iwtableconvert(tmpio->intable, buffer, tmpbuffer, readresult, count);
+			}
+			else if (tmpio->intable!=NULL)
+			{
+			    itableconvert(tmpio->intable, buffer, tmpbuffer, readresult);
 			}
 			else
 			{
-			    size_t cnt=i_convert(tmpio.in,buffer,tmpbuffer,readresult,readresult, false, fd);
+			    size_t cnt=i_convert(tmpio->in,buffer,tmpbuffer,readresult,readresult, false, fd);
 			    readresult=cnt;
 			}
 			delete [] tmpbuffer;
@@ -662,30 +756,33 @@ class ModuleCodepage : public Module
 		    hash_io::iterator iter2;
 		    iter2=io_hash.find(fd);
 		    
-		    io_iconv tmpio;
+		    io_iconv* tmpio=NULL;
             	    User* user = dynamic_cast<User*>(ServerInstance->SE->GetRef(fd));
 
             	    if (user == NULL)
                         return -1;
 
 		    hash_common::iterator iter=fd_hash.find(fd);
-		    if (iter==fd_hash.end()) /* no any value in a hash? */
-			tmpio.out=(iconv_t)-1;
-		    else
-			tmpio=recode[iter->second];
+		    if (iter!=fd_hash.end()) /* no any value in a hash? */
+			tmpio=&recode[iter->second];
 			
 		    size_t cnt=count;
 		    char * tmpbuffer=new char[count*4+1]; /* assuming UTF-8 is 4 chars wide max. */
-		    if (tmpio.out!=(iconv_t)-1)
+		    if ((tmpio!=NULL) && (tmpio->out!=(iconv_t)-1))
 			{
 			/* translating encodings here */
-			if (tmpio.outtable!=NULL)
+			if ((tmpio->outtable!=NULL) && (tmpio->outwide))
+			{
+			    cnt=iwtableconvert(tmpio->outtable, tmpbuffer, buffer, count, count*4);
+			    tmpbuffer[cnt]=0;
+			}
+			else if (tmpio->outtable!=NULL)
 			{
-			    itableconvert(tmpio.outtable, tmpbuffer, buffer, count);
+			    itableconvert(tmpio->outtable, tmpbuffer, buffer, count);
 			    tmpbuffer[count]=0;
 			}
 			else
-			    cnt=i_convert(tmpio.out,tmpbuffer,(char *)buffer,count,count*4);
+			    cnt=i_convert(tmpio->out,tmpbuffer,(char *)buffer,count,count*4);
 			}
 		    else
 			{
@@ -786,21 +883,16 @@ class ModuleCodepage : public Module
 		    
 		}
 		
-		void iClose()
+		void iClose(std::vector<io_iconv> &list, const std::string &internal)
 		{
-			for (std::vector<io_iconv>::iterator iter=recode.begin();iter!=recode.end();iter++)
+			for (std::vector<io_iconv>::iterator iter=list.begin();iter!=list.end();iter++)
 			    {
 			    if ((*iter).in!=(iconv_t)-1)
-				{
-				iconv_close((*iter).in);
-				if ((*iter).intable!=NULL)
-				    delete [] (*iter).intable;
-				}
+				release((*iter).encoding, internal);
 			    if ((*iter).out!=(iconv_t)-1)
-				iconv_close((*iter).out);
-				if ((*iter).outtable!=NULL)
-				    delete [] (*iter).outtable;
+				release(internal, (*iter).encoding);
 			    }
+			list.clear();
 		}
 		
 		virtual ~ModuleCodepage()
@@ -813,7 +905,7 @@ class ModuleCodepage : public Module
 			    user->DelIOHook();
 			    user->AddIOHook(iter->second);
 			    }
-			iClose();
+			iClose(recode, icodepage);
             		save_hash.clear(); fd_hash.clear(); port_hash.clear(); name_hash.clear(); recode.clear(); io_hash.clear(); buffer_hash.clear();
 		}
 
@@ -18,6 +18,30 @@
 /* $ModAuthor: danieldg */
 /* $ModDepends: core 1.2-1.3 */
 
+/* Join times of the members which are still being held back, kept on the channel */
+typedef std::map<User*, time_t> DelayList;
+
+static const std::string delayext = "delaymsg";
+
+/* Frees the join times of a channel */
+static void ClearDelays(Channel* channel)
+{
+	DelayList* list;
+	if (channel->GetExt(delayext, list))
+	{
+		channel->Shrink(delayext);
+		delete list;
+	}
+}
+
+/* Forgets the join time of a member */
+static void ClearDelay(User* user, Channel* channel)
+{
+	DelayList* list;
+	if (channel->GetExt(delayext, list))
+		list->erase(user);
+}
+
 class DelayMsgMode : public ModeHandler
 {
  private:
@@ -51,14 +75,16 @@ class ModuleDelayMsg : public Module
 	{
 		if (!ServerInstance->Modes->AddMode(&djm))
 			throw ModuleException("Could not add new modes!");
-		Implementation eventlist[] = { I_OnUserJoin, I_OnUserPart, I_OnUserKick, I_OnCleanup, I_OnUserPreMessage};
-		ServerInstance->Modules->Attach(eventlist, this, 5);
+		Implementation eventlist[] = { I_OnUserJoin, I_OnUserPart, I_OnUserKick, I_OnUserQuit, I_OnChannelDelete, I_OnCleanup, I_OnUserPreMessage};
+		ServerInstance->Modules->Attach(eventlist, this, 7);
 	}
 	virtual ~ModuleDelayMsg();
 	virtual Version GetVersion();
 	void OnUserJoin(User* user, Channel* channel, bool sync, bool &silent);
 	void OnUserPart(User* user, Channel* channel, std::string &partmessage, bool &silent);
 	void OnUserKick(User* source, User* user, Channel* chan, const std::string &reason, bool &silent);
+	void OnUserQuit(User* user, const std::string &message, const std::string &oper_message);
+	void OnChannelDelete(Channel* chan);
 	void OnCleanup(int target_type, void* item);
 	int OnUserPreMessage(User* user, void* dest, int target_type, std::string &text, char status, CUList &exempt_list);
 };
@@ -81,9 +107,7 @@ ModeAction DelayMsgMode::OnModeChange(User* source, User* dest, Channel* channel
 		/*
 		 * Clean up metadata
 		 */
-		CUList* names = channel->GetUsers();
-		for (CUListIter n = names->begin(); n != names->end(); ++n)
-			n->first->Shrink("delaymsg_" + channel->name);
+		ClearDelays(channel);
 	}
 	channel->SetModeParam('d', adding ? parameter : "");
 	return MODEACTION_ALLOW;
@@ -101,31 +125,43 @@ Version ModuleDelayMsg::GetVersion()
 
 void ModuleDelayMsg::OnUserJoin(User* user, Channel* channel, bool sync, bool &silent)
 {
-	if (channel->IsModeSet('d'))
-		user->Extend("delaymsg_"+channel->name, reinterpret_cast<char*>(ServerInstance->Time()));
+	if (!channel->IsModeSet('d') || !atoi(channel->GetModeParameter('d').c_str()))
+		return;
+
+	DelayList* list;
+	if (!channel->GetExt(delayext, list))
+	{
+		list = new DelayList;
+		channel->Extend(delayext, list);
+	}
+	(*list)[user] = ServerInstance->Time();
 }
 
 void ModuleDelayMsg::OnUserPart(User* user, Channel* channel, std::string &partmessage, bool &silent)
 {
-	user->Shrink("delaymsg_"+channel->name);
+	ClearDelay(user, channel);
 }
 
 void ModuleDelayMsg::OnUserKick(User* source, User* user, Channel* chan, const std::string &reason, bool &silent)
 {
-	user->Shrink("delaymsg_"+chan->name);
+	ClearDelay(user, chan);
+}
+
+void ModuleDelayMsg::OnUserQuit(User* user, const std::string &message, const std::string &oper_message)
+{
+	for (UCListIter f = user->chans.begin(); f != user->chans.end(); f++)
+		ClearDelay(user, f->first);
+}
+
+void ModuleDelayMsg::OnChannelDelete(Channel* chan)
+{
+	ClearDelays(chan);
 }
 
 void ModuleDelayMsg::OnCleanup(int target_type, void* item)
 {
-	if (target_type == TYPE_USER)
-	{
-		User* user = (User*)item;
-		for (UCListIter f = user->chans.begin(); f != user->chans.end(); f++)
-		{
-			Channel* chan = f->first;
-			user->Shrink("delaymsg_"+chan->name);
-		}
-	}
+	if (target_type == TYPE_CHANNEL)
+		ClearDelays((Channel*)item);
 }
 
 int ModuleDelayMsg::OnUserPreMessage(User* user, void* dest, int target_type, std::string &text, char status, CUList &exempt_list)
@@ -139,16 +175,17 @@ int ModuleDelayMsg::OnUserPreMessage(User* user, void* dest, int target_type, st
 
 	Channel* channel = (Channel*) dest;
 
-	void* jointime_as_ptr;
-
-	if (!user->GetExt("delaymsg_"+channel->name, jointime_as_ptr))
+	DelayList* list;
+	if (!channel->GetExt(delayext, list))
 		return false;
 
-	time_t jointime = reinterpret_cast<time_t>(jointime_as_ptr);
+	DelayList::iterator entry = list->find(user);
+	if (entry == list->end())
+		return false;
 
 	std::string len = channel->GetModeParameter('d');
 
-	if (jointime + atoi(len.c_str()) > ServerInstance->Time())
+	if (entry->second + atoi(len.c_str()) > ServerInstance->Time())
 	{
 		if (channel->GetStatus(user) < STATUS_VOICE)
 		{
@@ -160,7 +197,7 @@ int ModuleDelayMsg::OnUserPreMessage(User* user, void* dest, int target_type, st
 	else
 	{
 		/* Timer has expired, we can stop checking now */
-		user->Shrink("delaymsg_"+channel->name);
+		list->erase(entry);
 	}
 	return false;
 }
@@ -25,6 +25,15 @@
 /* $ModAuthor: cytrix */
 /* $ModDepends: core 1.2-1.3 */
 
+/* Verdicts are cached for each IP and list. The TTLs can be set on each
+ * <dnsbl> tag with hitcache="1h", misscache="10m" and timeoutcache="1m"
+ * (the defaults). Setting one to 0 disables caching of that verdict.
+ *
+ * Registering users are held until every list has answered, for at most
+ * <dnsblconfig wait="5"> seconds. A wait of 0 lets users through without
+ * waiting, as before.
+ */
+
 /* Class holding data for a single entry */
 class DNSBLConfEntry : public classbase
 {
@@ -37,159 +46,353 @@ class DNSBLConfEntry : public classbase
 		long duration;
 		int bitmask;
 		unsigned char records[256];
-		unsigned long stats_hits, stats_misses;
-		DNSBLConfEntry(): type(A_BITMASK),duration(86400),bitmask(0),stats_hits(0), stats_misses(0) {}
+		unsigned long stats_hits, stats_misses, stats_timeouts;
+
+		/* How long hits, misses and timeouts are cached for each IP */
+		time_t hitttl, missttl, timeoutttl;
+
+		/* Answers which took under 1, 2, 4, ... milliseconds */
+		static const unsigned int latency_buckets = 16;
+		unsigned long stats_latency[latency_buckets];
+
+		DNSBLConfEntry(): type(A_BITMASK),duration(86400),bitmask(0),stats_hits(0), stats_misses(0), stats_timeouts(0), hitttl(3600), missttl(600), timeoutttl(60)
+		{
+			for (unsigned int i = 0; i < latency_buckets; i++)
+				stats_latency[i] = 0;
+		}
 		~DNSBLConfEntry() { }
+
+		void AddLatency(long ms)
+		{
+			unsigned int bucket = 0;
+			while (bucket < latency_buckets - 1 && ms >= (1L << bucket))
+				bucket++;
+			stats_latency[bucket]++;
+		}
+
+		/* Returns the upper bound in milliseconds of the given percentile of answers */
+		long GetLatency(unsigned int percent) const
+		{
+			unsigned long total = 0;
+			for (unsigned int i = 0; i < latency_buckets; i++)
+				total += stats_latency[i];
+			if (!total)
+				return 0;
+
+			unsigned long wanted = (total * percent + 99) / 100;
+			unsigned long seen = 0;
+			unsigned int bucket = 0;
+			for (; bucket < latency_buckets - 1; bucket++)
+			{
+				seen += stats_latency[bucket];
+				if (seen >= wanted)
+					break;
+			}
+			return 1L << bucket;
+		}
 };
 
 
-/** Resolver for CGI:IRC hostnames encoded in ident/GECOS
+/** Applies the action of a DNSBL to a user who is listed on it, returns
+ * true if the action removes the user from the server
+ */
+static bool ApplyHit(InspIRCd* ServerInstance, User* them, DNSBLConfEntry* ConfEntry, unsigned int result)
+{
+	ConfEntry->stats_hits++;
+
+	std::string reason = ConfEntry->reason;
+	std::string::size_type x = reason.find("%ip%");
+	while (x != std::string::npos)
+	{
+		reason.erase(x, 4);
+		reason.insert(x, them->GetIPString());
+		x = reason.find("%ip%");
+	}
+
+	switch (ConfEntry->banaction)
+	{
+		case DNSBLConfEntry::I_KILL:
+		{
+			ServerInstance->Users->QuitUser(them, std::string("Killed (") + reason + ")");
+			break;
+		}
+		case DNSBLConfEntry::I_MARK:
+		{
+			if (!ConfEntry->ident.empty())
+			{
+				them->WriteServ("304 " + them->nick + " :Your ident has been set to " + ConfEntry->ident + " because you matched " + reason);
+				them->ChangeIdent(ConfEntry->ident.c_str());
+			}
+
+			if (!ConfEntry->host.empty())
+			{
+				them->WriteServ("304 " + them->nick + " :Your host has been set to " + ConfEntry->host + " because you matched " + reason);
+				them->ChangeDisplayedHost(ConfEntry->host.c_str());
+			}
+
+			break;
+		}
+		case DNSBLConfEntry::I_KLINE:
+		{
+			KLine* kl = new KLine(ServerInstance, ServerInstance->Time(), ConfEntry->duration, ServerInstance->Config->ServerName, reason.c_str(),
+					"*", them->GetIPString());
+			if (ServerInstance->XLines->AddLine(kl,NULL))
+			{
+				ServerInstance->SNO->WriteToSnoMask('x',"m_dnsbl added K:line on *@%s to expire on %s (%s).", 
+					them->GetIPString(), ServerInstance->TimeString(kl->expiry).c_str(), reason.c_str());
+				ServerInstance->XLines->ApplyLines();
+			}
+			else
+				delete kl;
+			break;
+		}
+		case DNSBLConfEntry::I_GLINE:
+		{
+			GLine* gl = new GLine(ServerInstance, ServerInstance->Time(), ConfEntry->duration, ServerInstance->Config->ServerName, reason.c_str(),
+					"*", them->GetIPString());
+			if (ServerInstance->XLines->AddLine(gl,NULL))
+			{
+				ServerInstance->SNO->WriteToSnoMask('x',"m_dnsbl added G:line on *@%s to expire on %s (%s).", 
+					them->GetIPString(), ServerInstance->TimeString(gl->expiry).c_str(), reason.c_str());
+				ServerInstance->XLines->ApplyLines();
+			}
+			else
+				delete gl;
+			break;
+		}
+		case DNSBLConfEntry::I_ZLINE:
+		{
+			ZLine* zl = new ZLine(ServerInstance, ServerInstance->Time(), ConfEntry->duration, ServerInstance->Config->ServerName, reason.c_str(),
+					them->GetIPString());
+			if (ServerInstance->XLines->AddLine(zl,NULL))
+			{
+				ServerInstance->SNO->WriteToSnoMask('x',"m_dnsbl added Z:line on *@%s to expire on %s (%s).", 
+					them->GetIPString(), ServerInstance->TimeString(zl->expiry).c_str(), reason.c_str());
+				ServerInstance->XLines->ApplyLines();
+			}
+			else
+				delete zl;
+			break;
+		}
+		case DNSBLConfEntry::I_UNKNOWN:
+		{
+			break;
+		}
+		break;
+	}
+
+	ServerInstance->SNO->WriteGlobalSno('a', "Connecting user %s detected as being on a DNS blacklist (%s) with result %d", them->GetFullRealHost().c_str(), ConfEntry->domain.c_str(), result);
+	return (ConfEntry->banaction != DNSBLConfEntry::I_MARK && ConfEntry->banaction != DNSBLConfEntry::I_UNKNOWN);
+}
+
+/** Cached verdicts by list and IP, and the users waiting on lookups which are
+ * still in flight, so reconnecting users from one IP only cost one lookup
+ * for each list.
+ */
+class DNSBLCache
+{
+ public:
+	struct Verdict
+	{
+		time_t expires;
+		bool hit;
+		unsigned int result;
+	};
+
+	/* A user who is held until their lookups finish or the deadline passes */
+	struct Pending
+	{
+		unsigned int lookups;
+		time_t deadline;
+	};
+
+	typedef std::map<std::string, Verdict> VerdictMap;
+	typedef std::map<std::string, std::vector<std::string> > WaiterMap;
+	typedef std::map<std::string, Pending> PendingMap;
+
+	VerdictMap verdicts;
+	WaiterMap waiters;
+	PendingMap pending;
+
+	/* Bumped on rehash so lookups started with the old entries are ignored */
+	unsigned long generation;
+
+	DNSBLCache() : generation(0) { }
+
+	void Clear()
+	{
+		verdicts.clear();
+		waiters.clear();
+		pending.clear();
+		generation++;
+	}
+
+	/* Called when one of the lookups a user is waiting on has finished */
+	void Done(const std::string &uuid)
+	{
+		PendingMap::iterator p = pending.find(uuid);
+		if (p != pending.end() && p->second.lookups)
+			p->second.lookups--;
+	}
+
+	void Expire(time_t now)
+	{
+		for (VerdictMap::iterator i = verdicts.begin(); i != verdicts.end(); )
+		{
+			if (i->second.expires <= now)
+				verdicts.erase(i++);
+			else
+				++i;
+		}
+	}
+
+	void Store(const std::string &key, time_t ttl, bool hit, unsigned int result, time_t now)
+	{
+		if (ttl <= 0)
+			return;
+
+		Verdict& v = verdicts[key];
+		v.expires = now + ttl;
+		v.hit = hit;
+		v.result = result;
+	}
+};
+
+/** Resolver for DNSBL lookups, shared by every user waiting on the same
+ * list and IP.
  */
 class DNSBLResolver : public Resolver
 {
-	int theirfd;
-	User* them;
+	std::string key;
 	DNSBLConfEntry *ConfEntry;
+	DNSBLCache *cache;
+	unsigned long generation;
+	struct timeval started;
+	bool answered;
+	bool done;
+
+	/* Only the first answer is timed as there can be one for each A record */
+	void Answered()
+	{
+		if (answered)
+			return;
+		answered = true;
+
+		struct timeval now;
+		gettimeofday(&now, NULL);
+		ConfEntry->AddLatency(((now.tv_sec - started.tv_sec) * 1000) + ((now.tv_usec - started.tv_usec) / 1000));
+	}
+
+	bool Valid()
+	{
+		return (cache && cache->generation == generation);
+	}
+
+	/* Hands the verdict to everyone waiting on this lookup and caches it */
+	void Finish(bool hit, unsigned int result, time_t ttl)
+	{
+		if (done || !Valid())
+			return;
+		done = true;
+
+		cache->Store(key, ttl, hit, result, ServerInstance->Time());
+
+		DNSBLCache::WaiterMap::iterator w = cache->waiters.find(key);
+		if (w == cache->waiters.end())
+			return;
+
+		std::vector<std::string> uuids;
+		uuids.swap(w->second);
+		cache->waiters.erase(w);
+
+		for (std::vector<std::string>::iterator i = uuids.begin(); i != uuids.end(); ++i)
+		{
+			cache->Done(*i);
+
+			User* them = ServerInstance->FindUUID(*i);
+			if (!them || them->quitting)
+				continue;
+
+			if (!hit)
+				ConfEntry->stats_misses++;
+			else if (ApplyHit(ServerInstance, them, ConfEntry, result))
+				cache->pending.erase(*i);
+		}
+	}
 
  public:
 
-	DNSBLResolver(Module *me, InspIRCd *Instance, const std::string &hostname, User* u, int userfd, DNSBLConfEntry *conf, bool &cached)
-		: Resolver(Instance, hostname, DNS_QUERY_A, cached, me)
+	DNSBLResolver(Module *me, InspIRCd *Instance, const std::string &hostname, const std::string &cachekey, DNSBLConfEntry *conf, DNSBLCache *c, bool &cached)
+		: Resolver(Instance, hostname, DNS_QUERY_A, cached, me), key(cachekey), ConfEntry(conf), cache(c), generation(c->generation), done(false)
 	{
-		theirfd = userfd;
-		them = u;
-		ConfEntry = conf;
+		answered = cached;
+		gettimeofday(&started, NULL);
 	}
 
 	/* Note: This may be called multiple times for multiple A record results */
 	virtual void OnLookupComplete(const std::string &result, unsigned int ttl, bool cached)
 	{
-		/* Check the user still exists */
-		if ((them) && (them == ServerInstance->SE->GetRef(theirfd)))
-		{
-			// Now we calculate the bitmask: 256*(256*(256*a+b)+c)+d
-			if(result.length())
-			{
-				unsigned int bitmask = 0, record = 0;
-				bool match = false;
-				in_addr resultip;
+		if (done || !Valid())
+			return;
 
-				inet_aton(result.c_str(), &resultip);
+		if (!cached)
+			Answered();
 
-				switch (ConfEntry->type)
-				{
-					case DNSBLConfEntry::A_BITMASK:
-						bitmask = resultip.s_addr >> 24; /* Last octet (network byte order) */
-						bitmask &= ConfEntry->bitmask;
-						match = (bitmask != 0);
-					break;
-					case DNSBLConfEntry::A_RECORD:
-						record = resultip.s_addr >> 24; /* Last octet */
-						match = (ConfEntry->records[record] == 1);
-					break;
-				}
+		// Now we calculate the bitmask: 256*(256*(256*a+b)+c)+d
+		if (result.length())
+		{
+			unsigned int bitmask = 0, record = 0;
+			bool match = false;
+			in_addr resultip;
 
-				if (match)
-				{
-					std::string reason = ConfEntry->reason;
-					std::string::size_type x = reason.find("%ip%");
-					while (x != std::string::npos)
-					{
-						reason.erase(x, 4);
-						reason.insert(x, them->GetIPString());
-						x = reason.find("%ip%");
-					}
-
-					ConfEntry->stats_hits++;
-
-					switch (ConfEntry->banaction)
-					{
-						case DNSBLConfEntry::I_KILL:
-						{
-							ServerInstance->Users->QuitUser(them, std::string("Killed (") + reason + ")");
-							break;
-						}
-						case DNSBLConfEntry::I_MARK:
-						{
-							if (!ConfEntry->ident.empty())
-							{
-								them->WriteServ("304 " + them->nick + " :Your ident has been set to " + ConfEntry->ident + " because you matched " + reason);
-								them->ChangeIdent(ConfEntry->ident.c_str());
-							}
-
-							if (!ConfEntry->host.empty())
-							{
-								them->WriteServ("304 " + them->nick + " :Your host has been set to " + ConfEntry->host + " because you matched " + reason);
-								them->ChangeDisplayedHost(ConfEntry->host.c_str());
-							}
-
-							break;
-						}
-						case DNSBLConfEntry::I_KLINE:
-						{
-							KLine* kl = new KLine(ServerInstance, ServerInstance->Time(), ConfEntry->duration, ServerInstance->Config->ServerName, reason.c_str(),
-									"*", them->GetIPString());
-							if (ServerInstance->XLines->AddLine(kl,NULL))
-							{
-								ServerInstance->SNO->WriteToSnoMask('x',"m_dnsbl added K:line on *@%s to expire on %s (%s).", 
-									them->GetIPString(), ServerInstance->TimeString(kl->expiry).c_str(), reason.c_str());
-								ServerInstance->XLines->ApplyLines();
-							}
-							else
-								delete kl;
-							break;
-						}
-						case DNSBLConfEntry::I_GLINE:
-						{
-							GLine* gl = new GLine(ServerInstance, ServerInstance->Time(), ConfEntry->duration, ServerInstance->Config->ServerName, reason.c_str(),
-									"*", them->GetIPString());
-							if (ServerInstance->XLines->AddLine(gl,NULL))
-							{
-								ServerInstance->SNO->WriteToSnoMask('x',"m_dnsbl added G:line on *@%s to expire on %s (%s).", 
-									them->GetIPString(), ServerInstance->TimeString(gl->expiry).c_str(), reason.c_str());
-								ServerInstance->XLines->ApplyLines();
-							}
-							else
-								delete gl;
-							break;
-						}
-						case DNSBLConfEntry::I_ZLINE:
-						{
-							ZLine* zl = new ZLine(ServerInstance, ServerInstance->Time(), ConfEntry->duration, ServerInstance->Config->ServerName, reason.c_str(),
-									them->GetIPString());
-							if (ServerInstance->XLines->AddLine(zl,NULL))
-							{
-								ServerInstance->SNO->WriteToSnoMask('x',"m_dnsbl added Z:line on *@%s to expire on %s (%s).", 
-									them->GetIPString(), ServerInstance->TimeString(zl->expiry).c_str(), reason.c_str());
-								ServerInstance->XLines->ApplyLines();
-							}
-							else
-								delete zl;
-							break;
-						}
-						case DNSBLConfEntry::I_UNKNOWN:
-						{
-							break;
-						}
-						break;
-					}
-
-					ServerInstance->SNO->WriteGlobalSno('a', "Connecting user %s detected as being on a DNS blacklist (%s) with result %d", them->GetFullRealHost().c_str(), ConfEntry->domain.c_str(), (ConfEntry->type==DNSBLConfEntry::A_BITMASK) ? bitmask : record);
-				}
-				else
-					ConfEntry->stats_misses++;
+			inet_aton(result.c_str(), &resultip);
+
+			switch (ConfEntry->type)
+			{
+				case DNSBLConfEntry::A_BITMASK:
+					bitmask = resultip.s_addr >> 24; /* Last octet (network byte order) */
+					bitmask &= ConfEntry->bitmask;
+					match = (bitmask != 0);
+				break;
+				case DNSBLConfEntry::A_RECORD:
+					record = resultip.s_addr >> 24; /* Last octet */
+					match = (ConfEntry->records[record] == 1);
+				break;
 			}
-			else
-				ConfEntry->stats_misses++;
+
+			if (match)
+				Finish(true, (ConfEntry->type==DNSBLConfEntry::A_BITMASK) ? bitmask : record, ConfEntry->hitttl);
 		}
 	}
 
 	virtual void OnError(ResolverError e, const std::string &errormessage)
 	{
+		if (e == RESOLVER_FORCEUNLOAD)
+		{
+			cache = NULL;
+			return;
+		}
+
+		if (done || !Valid())
+			return;
+
+		if (e == RESOLVER_TIMEOUT)
+		{
+			ConfEntry->stats_timeouts++;
+			Finish(false, 0, ConfEntry->timeoutttl);
+		}
+		else
+		{
+			Answered();
+			Finish(false, 0, ConfEntry->missttl);
+		}
 	}
 
 	virtual ~DNSBLResolver()
 	{
+		/* None of the records matched */
+		if (Valid())
+			Finish(false, 0, ConfEntry->missttl);
 	}
 };
 
@@ -197,6 +400,10 @@ class ModuleDNSBL : public Module
 {
  private:
 	std::vector<DNSBLConfEntry *> DNSBLConfEntries;
+	DNSBLCache cache;
+
+	/* How long a registering user may be held waiting for lookups */
+	time_t waittime;
 
 	/*
 	 *	Convert a string to EnumBanaction
@@ -220,8 +427,8 @@ class ModuleDNSBL : public Module
 	ModuleDNSBL(InspIRCd *Me) : Module(Me)
 	{
 		ReadConf();
-		Implementation eventlist[] = { I_OnRehash, I_OnUserRegister, I_OnStats };
-		ServerInstance->Modules->Attach(eventlist, this, 3);
+		Implementation eventlist[] = { I_OnRehash, I_OnUserRegister, I_OnCheckReady, I_OnUserDisconnect, I_OnStats, I_OnBackgroundTimer };
+		ServerInstance->Modules->Attach(eventlist, this, 6);
 	}
 
 	virtual ~ModuleDNSBL()
@@ -249,8 +456,11 @@ class ModuleDNSBL : public Module
 	virtual void ReadConf()
 	{
 		ConfigReader *MyConf = new ConfigReader(ServerInstance);
+		cache.Clear();
 		ClearEntries();
 
+		waittime = ServerInstance->Duration(MyConf->ReadValue("dnsblconfig", "wait", "5", 0));
+
 		for (int i=0; i< MyConf->Enumerate("dnsbl"); i++)
 		{
 			DNSBLConfEntry *e = new DNSBLConfEntry();
@@ -278,6 +488,9 @@ class ModuleDNSBL : public Module
 
 			e->banaction = str2banaction(MyConf->ReadValue("dnsbl", "action", i));
 			e->duration = ServerInstance->Duration(MyConf->ReadValue("dnsbl", "duration", "60", i));
+			e->hitttl = ServerInstance->Duration(MyConf->ReadValue("dnsbl", "hitcache", "1h", i));
+			e->missttl = ServerInstance->Duration(MyConf->ReadValue("dnsbl", "misscache", "10m", i));
+			e->timeoutttl = ServerInstance->Duration(MyConf->ReadValue("dnsbl", "timeoutcache", "1m", i));
 
 			/* Use portparser for record replies */
 
@@ -352,16 +565,60 @@ class ModuleDNSBL : public Module
 			snprintf(reversedipbuf, 128, "%d.%d.%d.%d", d, c, b, a);
 			reversedip = std::string(reversedipbuf);
 
+			/* Hold the user in OnCheckReady until their lookups finish or the deadline passes.
+			 * This is added first as lookups with a cached answer finish straight away.
+			 */
+			if (waittime > 0)
+			{
+				DNSBLCache::Pending& hold = cache.pending[user->uuid];
+				hold.lookups = 0;
+				hold.deadline = ServerInstance->Time() + waittime;
+			}
+
 			// For each DNSBL, we will run through this lookup
 			for (std::vector<DNSBLConfEntry *>::iterator i = DNSBLConfEntries.begin(); i != DNSBLConfEntries.end(); i++)
 			{
+				/* No point looking them up on the other lists if a hit has removed them */
+				if (user->quitting)
+					break;
+
 				// Fill hostname with a dnsbl style host (d.c.b.a.domain.tld)
 				std::string hostname = reversedip + "." + (*i)->domain;
 
+				std::string key = (*i)->name + " " + hostname;
+
+				/* Use the verdict from an earlier connection from this IP if we have one */
+				DNSBLCache::VerdictMap::iterator v = cache.verdicts.find(key);
+				if (v != cache.verdicts.end() && v->second.expires > ServerInstance->Time())
+				{
+					if (!v->second.hit)
+						(*i)->stats_misses++;
+					else
+						ApplyHit(ServerInstance, user, *i, v->second.result);
+					continue;
+				}
+
+				/* Wait on a lookup which is already in flight for this IP */
+				std::vector<std::string>& waiting = cache.waiters[key];
+				waiting.push_back(user->uuid);
+				DNSBLCache::PendingMap::iterator hold = cache.pending.find(user->uuid);
+				if (hold != cache.pending.end())
+					hold->second.lookups++;
+				if (waiting.size() > 1)
+					continue;
+
 				/* now we'd need to fire off lookups for `hostname'. */
-				bool cached;
-				DNSBLResolver *r = new DNSBLResolver(this, ServerInstance, hostname, user, user->GetFd(), *i, cached);
-				ServerInstance->AddResolver(r, cached);
+				try
+				{
+					bool cached;
+					DNSBLResolver *r = new DNSBLResolver(this, ServerInstance, hostname, key, *i, &cache, cached);
+					ServerInstance->AddResolver(r, cached);
+				}
+				catch (ModuleException&)
+				{
+					cache.waiters.erase(key);
+					cache.Done(user->uuid);
+				}
 			}
 		}
 
@@ -369,6 +626,29 @@ class ModuleDNSBL : public Module
 		return 0;
 	}
 
+	virtual bool OnCheckReady(User* user)
+	{
+		DNSBLCache::PendingMap::iterator p = cache.pending.find(user->uuid);
+		if (p == cache.pending.end())
+			return true;
+
+		if (p->second.lookups && p->second.deadline > ServerInstance->Time())
+			return false;
+
+		cache.pending.erase(p);
+		return true;
+	}
+
+	virtual void OnUserDisconnect(User* user)
+	{
+		cache.pending.erase(user->uuid);
+	}
+
+	virtual void OnBackgroundTimer(time_t curtime)
+	{
+		cache.Expire(curtime);
+	}
+
 	virtual int OnStats(char symbol, User* user, string_list &results)
 	{
 		if (symbol != 'd')
@@ -383,6 +663,8 @@ class ModuleDNSBL : public Module
 
 			results.push_back(std::string(ServerInstance->Config->ServerName) + " 304 " + user->nick + " :DNSBLSTATS DNSbl \"" + (*i)->name + "\" had " +
 					ConvToStr((*i)->stats_hits) + " hits and " + ConvToStr((*i)->stats_misses) + " misses");
+			results.push_back(std::string(ServerInstance->Config->ServerName) + " 304 " + user->nick + " :DNSBLSTATS DNSbl \"" + (*i)->name + "\" timed out " +
+					ConvToStr((*i)->stats_timeouts) + " times, p50 under " + ConvToStr((*i)->GetLatency(50)) + "ms and p99 under " + ConvToStr((*i)->GetLatency(99)) + "ms");
 		}
 
 		results.push_back(std::string(ServerInstance->Config->ServerName) + " 304 " + user->nick + " :DNSBLSTATS Total hits: " + ConvToStr(total_hits));
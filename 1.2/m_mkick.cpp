@@ -22,13 +22,50 @@
 
 class CommandMkick : public Command {
 	
+	/* a kick which has been queued for a later chunk */
+	struct PendingKick
+	{
+		std::string source;
+		std::string channel;
+		std::string target;
+		std::string reason;
+	};
+
+	std::deque<PendingKick> pending;
+	
+	void Kick(const PendingKick &kick)
+	{
+		User* source = ServerInstance->FindUUID(kick.source);
+		User* target = ServerInstance->FindUUID(kick.target);
+		Channel* channel = ServerInstance->FindChan(kick.channel);
+
+		/* anyone may have left or been opped since the kick was queued */
+		if (!source || !target || !channel || !channel->HasUser(target) || channel->GetPrefixValue(target) >= OP_VALUE)
+			return;
+
+		channel->KickUser(source, target, kick.reason.c_str());
+	}
+	
 	public:
+		/* the most kicks sent per chunk, one chunk goes out per background timer tick */
+		static const unsigned int chunksize = 500;
+		
 		CommandMkick (InspIRCd* Instance) : Command(Instance, "MKICK", 0, 1, 2, false)
 		{
 			this->source = "m_kick.so";
 			syntax = "<#channel> [reason]";
 		}
 		
+		void SendChunk()
+		{
+			for (unsigned int i = 0; i < chunksize && !pending.empty(); ++i)
+			{
+				PendingKick kick = pending.front();
+				pending.pop_front();
+				Kick(kick);
+			}
+		}
+		
 		CmdResult Handle (const std::vector<std::string>& parameters, User* user)
 		{
 			Channel* channel = ServerInstance->FindChan(parameters[0]);
@@ -41,15 +78,24 @@ class CommandMkick : public Command {
 				
 				CUList* ulist = channel->GetUsers();
 				
+				/* the member list changes as users are kicked, so queue the targets first */
 				for (CUList::iterator i = ulist->begin(); i != ulist->end(); i++)
 				{
 					if (IS_LOCAL(i->first))
 					{
 						if (i->first->nick != user->nick && channel->GetPrefixValue(i->first) < OP_VALUE)
-							channel->KickUser(user, i->first, reason.c_str());
+						{
+							PendingKick kick;
+							kick.source = user->uuid;
+							kick.channel = channel->name;
+							kick.target = i->first->uuid;
+							kick.reason = reason;
+							pending.push_back(kick);
+						}
 					}
 				}
 				
+				SendChunk();
 				return CMD_SUCCESS;
 				
 			}
@@ -72,10 +118,17 @@ class ModuleMkick : public Module {
 		{
 			mycommand = new CommandMkick(ServerInstance);
 			ServerInstance->AddCommand(mycommand);
+			Implementation eventlist[] = { I_OnBackgroundTimer };
+			ServerInstance->Modules->Attach(eventlist, this, 1);
 		}
 		
 		virtual ~ModuleMkick(){ }
 		
+		virtual void OnBackgroundTimer(time_t curtime)
+		{
+			mycommand->SendChunk();
+		}
+		
 		virtual Version GetVersion()
 		{
 			return Version("m_mkick ver 1.0 - synmuffin", 0, API_VERSION);
@@ -84,4 +137,3 @@ class ModuleMkick : public Module {
 };
 		
 MODULE_INIT(ModuleMkick)
-
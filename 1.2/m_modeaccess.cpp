@@ -290,17 +290,19 @@ class ModuleModeAccess : public Module
 
         virtual int OnRawMode(User* source, Channel* channel, const char modechar, const std::string &param, bool adding, int pcnt, bool servermode)
 			{
-			/* We're only concerned with channel modes */
-			if(!channel)
+			/* We're only concerned with channel modes which have rules */
+			if(!channel || ((unsigned char)modechar >= perms.size()))
 				return ACR_DEFAULT;
 
-			Srv->Logs->Log("m_modeaccess.so",DEBUG, "OnRawMode(%s, %s, %c, %s, %s, %d)", source->nick.c_str(), channel->name.c_str(), modechar, param.c_str(), adding ? "true" : "false", pcnt);
+			PermSet& criteria = perms[(unsigned char)modechar];
+			if(criteria.empty())
+				return ACR_DEFAULT;
 
 			/* We don't care about remote users, this module on the remote server handles them */
 			if(!IS_LOCAL(source))
 				return ACR_DEFAULT;
 
-			PermSet& criteria = perms[modechar];
+			Srv->Logs->Log("m_modeaccess.so",DEBUG, "OnRawMode(%s, %s, %c, %s, %s, %d)", source->nick.c_str(), channel->name.c_str(), modechar, param.c_str(), adding ? "true" : "false", pcnt);
 			char error[MAXBUF];
 			*error = '\0';
 
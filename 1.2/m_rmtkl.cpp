@@ -92,24 +92,43 @@ class CommandRMTKL : public Command
 				}
 			}
 
+			/* a mask without wildcards can only be one line of each type, so it is looked up directly */
+			bool literal=(parameters[1].find_first_of("*?")==std::string::npos);
+			bool anyreason=(matchreason=="*");
+
 			for (std::list<std::string>::iterator iter=matchtypes.begin();iter!=matchtypes.end();++iter)
 			{
 				XLineLookup* lookup = ServerInstance->XLines->GetAll(*iter);
 
 				if (lookup)
 				{
-					for (LookupIter i = lookup->begin(); i != lookup->end(); ++i)
+					/* DelLine changes the lookup so the matching lines are collected first */
+					std::vector<std::string> todel;
+
+					if (literal)
+					{
+						LookupIter i = lookup->find(parameters[1].c_str());
+						if ((i != lookup->end()) && (i->second->IsBurstable()||IS_LOCAL(user)) && (anyreason||InspIRCd::Match(i->second->reason,matchreason)))
+							todel.push_back(i->first.c_str());
+					}
+					else
 					{
-						/*K-lines etc. are local*/
+						for (LookupIter i = lookup->begin(); i != lookup->end(); ++i)
+						{
+							/*K-lines etc. are local*/
 
-						if (!i->second->IsBurstable()&&(!IS_LOCAL(user)))
-							break;
+							if (!i->second->IsBurstable()&&(!IS_LOCAL(user)))
+								break;
 
-						if (InspIRCd::Match(i->second->Displayable(),parameters[1])&&InspIRCd::Match(i->second->reason,matchreason))
-							ServerInstance->XLines->DelLine(i->first.c_str(), *iter, user);
+							if (InspIRCd::Match(i->second->Displayable(),parameters[1])&&(anyreason||InspIRCd::Match(i->second->reason,matchreason)))
+								todel.push_back(i->first.c_str());
 
+						}
 					}
 
+					for (std::vector<std::string>::iterator i = todel.begin(); i != todel.end(); ++i)
+						ServerInstance->XLines->DelLine(i->c_str(), *iter, user);
+
 				}
 			}
 
@@ -16,23 +16,93 @@
 /* $ModDesc: Creates a snomask with notices for channel creation, join, part, and kick */
 /* $ModAuthor: cytrix */
 /* $ModDepends: core 1.2-1.3 */
+/* $ModConfig: <seechan sample="1" interval="0" watch="#channel #another"> */
+
+/* sample: only show the details of 1 in this many events, besides those on watched channels.
+ * interval: if set then a summary of all events is sent this often.
+ */
+
+enum SeeChanEvent
+{
+	SEECHAN_CREATE,
+	SEECHAN_JOIN,
+	SEECHAN_PART,
+	SEECHAN_KICK,
+	SEECHAN_MAX
+};
 
 class ModuleSeeChan : public Module
 {
+	/* The number of each type of event seen from local and remote users since the last summary. */
+	unsigned long counts[2][SEECHAN_MAX];
+	std::set<irc::string> watched;
+	unsigned int sample;
+	time_t interval;
+	time_t nextsummary;
+
+	bool ShowDetail(Channel* channel)
+	{
+		if (sample <= 1 || watched.find(channel->name.c_str()) != watched.end())
+			return true;
+		return (rand() % sample) == 0;
+	}
+
+	void Count(User* user, SeeChanEvent event)
+	{
+		counts[IS_LOCAL(user) ? 0 : 1][event]++;
+	}
+
+	void SendSummary(char snomask, unsigned long* count)
+	{
+		if (!count[SEECHAN_CREATE] && !count[SEECHAN_JOIN] && !count[SEECHAN_PART] && !count[SEECHAN_KICK])
+			return;
+
+		ServerInstance->SNO->WriteToSnoMask(snomask, "Channel activity in the last %lu seconds: %lu created, %lu joins, %lu parts, %lu kicks",
+			(unsigned long)interval, count[SEECHAN_CREATE], count[SEECHAN_JOIN], count[SEECHAN_PART], count[SEECHAN_KICK]);
+	}
+
  public:
 	ModuleSeeChan(InspIRCd* Me)
-		: Module(Me)
+		: Module(Me), sample(1), interval(0), nextsummary(0)
 	{
+		memset(counts, 0, sizeof(counts));
 		ServerInstance->SNO->EnableSnomask('j', "CHANNEL");
 		ServerInstance->SNO->EnableSnomask('J', "REMOTECHANNEL");
 
-		Implementation eventlist[] = { I_OnUserJoin, I_OnUserPart, I_OnUserKick };
-		ServerInstance->Modules->Attach(eventlist, this, 3);
+		OnRehash(NULL, "");
+		Implementation eventlist[] = { I_OnUserJoin, I_OnUserPart, I_OnUserKick, I_OnRehash, I_OnBackgroundTimer };
+		ServerInstance->Modules->Attach(eventlist, this, 5);
 	}
 	virtual void OnUserJoin(User* user, Channel* channel, bool sync, bool &silent);
 	virtual void OnUserPart(User* user, Channel* channel, std::string &partmessage, bool &silent);
 	virtual void OnUserKick(User* source, User* user, Channel* chan, const std::string &reason, bool &silent);
 
+	virtual void OnRehash(User* user, const std::string &param)
+	{
+		ConfigReader conf(ServerInstance);
+		int newsample = conf.ReadInteger("seechan", "sample", 0, true);
+		sample = newsample > 1 ? newsample : 1;
+		interval = ServerInstance->Duration(conf.ReadValue("seechan", "interval", 0).c_str());
+		nextsummary = ServerInstance->Time() + interval;
+
+		watched.clear();
+		irc::spacesepstream stream(conf.ReadValue("seechan", "watch", 0));
+		std::string channel;
+		while (stream.GetToken(channel))
+			watched.insert(channel.c_str());
+	}
+
+	virtual void OnBackgroundTimer(time_t curtime)
+	{
+		if (!interval || curtime < nextsummary)
+			return;
+
+		SendSummary('j', counts[0]);
+		SendSummary('J', counts[1]);
+		memset(counts, 0, sizeof(counts));
+		nextsummary = curtime + interval;
+	}
+
 	virtual ~ModuleSeeChan()
 	{
 		ServerInstance->SNO->DisableSnomask('j');
@@ -47,22 +117,31 @@ class ModuleSeeChan : public Module
 void ModuleSeeChan::OnUserJoin(User* user, Channel* channel, bool sync, bool &silent)
 {
 	silent = false;
-	if (channel->age == ServerInstance->Time())
-		ServerInstance->SNO->WriteToSnoMask(IS_LOCAL(user) ? 'j' : 'J',"%s!%s@%s has joined to %s",user->nick.c_str(), user->ident.c_str(), user->host.c_str(),channel->name.c_str());
-	else
+	const bool created = (channel->age == ServerInstance->Time());
+	Count(user, created ? SEECHAN_CREATE : SEECHAN_JOIN);
+	if (!ShowDetail(channel))
+		return;
+
+	if (created)
 		ServerInstance->SNO->WriteToSnoMask(IS_LOCAL(user) ? 'j' : 'J',"%s!%s@%s has created %s",user->nick.c_str(), user->ident.c_str(), user->host.c_str(),channel->name.c_str());
+	else
+		ServerInstance->SNO->WriteToSnoMask(IS_LOCAL(user) ? 'j' : 'J',"%s!%s@%s has joined to %s",user->nick.c_str(), user->ident.c_str(), user->host.c_str(),channel->name.c_str());
 }
 
 void ModuleSeeChan::OnUserPart(User* user, Channel* channel, std::string &partmessage, bool &silent)
 {
 	silent = false;
-	ServerInstance->SNO->WriteToSnoMask(IS_LOCAL(user) ? 'j' : 'J',"%s!%s@%s has parted from %s",user->nick.c_str(), user->ident.c_str(), user->host.c_str(),channel->name.c_str());
+	Count(user, SEECHAN_PART);
+	if (ShowDetail(channel))
+		ServerInstance->SNO->WriteToSnoMask(IS_LOCAL(user) ? 'j' : 'J',"%s!%s@%s has parted from %s",user->nick.c_str(), user->ident.c_str(), user->host.c_str(),channel->name.c_str());
 }
 
 void ModuleSeeChan::OnUserKick(User* source, User* user, Channel* channel, const std::string &reason, bool &silent)
 {
 	silent = false;
-	ServerInstance->SNO->WriteToSnoMask(IS_LOCAL(user) ? 'j' : 'J',"%s!%s@%s got kicked from %s",user->nick.c_str(), user->ident.c_str(), user->host.c_str(),channel->name.c_str());   
-}  
+	Count(user, SEECHAN_KICK);
+	if (ShowDetail(channel))
+		ServerInstance->SNO->WriteToSnoMask(IS_LOCAL(user) ? 'j' : 'J',"%s!%s@%s got kicked from %s",user->nick.c_str(), user->ident.c_str(), user->host.c_str(),channel->name.c_str());
+}
 
 MODULE_INIT(ModuleSeeChan)
@@ -13,19 +13,37 @@
 
 #include "inspircd.h"
 #include "m_sqlv2.h"
-#include "m_sqlutils.h"
 #include "m_hash.h"
 #include "commands/cmd_privmsg.h"
 
 /* $ModDesc: Allow/Deny connections based upon an arbitary SQL table with extended options. */
-/* $ModDep: m_sqlv2.h m_sqlutils.h m_hash.h */
+/* $ModDep: m_sqlv2.h m_hash.h */
 /* $ModDepends: core 1.2 */
 
 /* Original source from InspIRCd 1.2 modified by Bawitdaba on December 23rd 2008 */
 /* Derived from m_sqlauth.cpp rev 10622 by brain */
 
+/* The details of a user which can be bound into the auth query */
+enum QueryParam { QP_NICK, QP_PASS, QP_HOST, QP_IP, QP_MD5PASS, QP_SHA256PASS, QP_MAX };
+
+/* What the auth query returned for a set of details */
+struct AuthResult {
+	bool found;
+	std::string allowedident;
+	std::string allowedhost;
+	std::string vhost;
+	std::string title;
+	std::string umodes;
+	time_t expires;
+
+	AuthResult() : found(false), expires(0) { }
+};
+
 class ModuleSQLAuth : public Module {
-	Module* SQLutils;
+	typedef std::map<std::string, AuthResult> AuthCache;
+	typedef std::map<std::string, std::vector<std::string> > PendingQueries;
+	typedef std::map<unsigned long, std::string> QueryKeys;
+
 	Module* SQLprovider;
 	Module* m_customtitle;
 
@@ -41,16 +59,23 @@ class ModuleSQLAuth : public Module {
 	bool setaccount;
 	bool servicesident;
 
+	std::string querytemplate;
+	std::vector<QueryParam> queryparams;
+	bool queryneedshost;
+	time_t cachetime;
+
+	/* Results by the bound values of the query which produced them */
+	AuthCache authcache;
+	/* Users waiting on the query for a set of bound values */
+	PendingQueries pendingkeys;
+	/* The bound values of each query which is in progress */
+	QueryKeys queryids;
+
 public:
 	ModuleSQLAuth(InspIRCd* Me)
 	: Module(Me) {
-		ServerInstance->Modules->UseInterface("SQLutils");
 		ServerInstance->Modules->UseInterface("SQL");
 
-		SQLutils = ServerInstance->Modules->Find("m_sqlutils.so");
-		if (!SQLutils)
-			throw ModuleException("Can't find m_sqlutils.so. Please load m_sqlutils.so before m_sqlauth_extended.so.");
-
 		SQLprovider = ServerInstance->Modules->FindFeature("SQL");
 		if (!SQLprovider)
 			throw ModuleException("Can't find an SQL provider module. Please load one before attempting to load m_sqlauth_extended.so.");
@@ -63,14 +88,13 @@ public:
 		*/
 
 		OnRehash(NULL);
-		Implementation eventlist[] = { I_OnPostConnect, I_OnPreCommand, I_OnUserConnect, I_OnUserDisconnect, I_OnCheckReady, I_OnRequest, I_OnRehash, I_OnUserRegister };
-		ServerInstance->Modules->Attach(eventlist, this, 8);
+		Implementation eventlist[] = { I_OnPostConnect, I_OnPreCommand, I_OnUserConnect, I_OnUserDisconnect, I_OnCheckReady, I_OnRequest, I_OnRehash, I_OnUserRegister, I_OnBackgroundTimer };
+		ServerInstance->Modules->Attach(eventlist, this, 9);
 
 	}
 
 	virtual ~ModuleSQLAuth() {
 		ServerInstance->Modules->DoneWithInterface("SQL");
-		ServerInstance->Modules->DoneWithInterface("SQLutils");
 	}
 
 	/* Function for matching ident/hostmasks */
@@ -100,6 +124,11 @@ public:
 		ghosting		= Conf.ReadFlag("sqlauth_extended", "ghosting", 0);				/* Set to true to kill connected users with same nick as connecting user */		
 		setaccount		= Conf.ReadFlag("sqlauth_extended", "setaccount", 0);			/* Set account name for m_services_account */		
 		servicesident	= Conf.ReadFlag("sqlauth_extended", "servicesident", 0);		/* Auto identify to NickServ (Anope/Atheme) */		
+		cachetime		= ServerInstance->Duration(Conf.ReadValue("sqlauth_extended", "cachetime", "60", 0));	/* How long to remember the result for the same credentials, 0 to disable */
+
+		/* The query may have changed so anything cached for the old one is useless */
+		authcache.clear();
+		CompileQuery();
 
 	}
 
@@ -159,6 +188,14 @@ public:
 			}
 		}
 
+		/* The query only has to wait for the DNS lookup if it uses the hostname,
+		 * otherwise it runs alongside the lookups made during registration.
+		 */
+		if (queryneedshost && !user->dns_done) {
+			user->Extend("sqlauth_deferred");
+			return 0;
+		}
+
 		checkResult = CheckCredentials(user);
 
 		if (!checkResult) { return 1; }
@@ -177,51 +214,110 @@ public:
 		}
 	}
 
-	/* Auth Function, builds SQL query for connecting user */
-	bool CheckCredentials(User* user) {
-		std::string thisquery = freeformquery;
-		std::string safepass = user->password;
+	/* Turns the configured query into one with ? placeholders so the values are
+	 * bound by the SQL provider instead of being pasted into the query text.
+	 */
+	void CompileQuery() {
+		static const char* const names[] = { "$nick", "$pass", "$host", "$ip", "$md5pass", "$sha256pass" };
+
+		querytemplate.clear();
+		queryparams.clear();
+		queryneedshost = false;
+
+		std::string::size_type pos = 0;
+		while (pos < freeformquery.length()) {
+			std::string::size_type found = std::string::npos;
+			int param = 0;
+			for (int i = 0; i < QP_MAX; ++i) {
+				std::string::size_type x = freeformquery.find(names[i], pos);
+				if (x < found) {
+					found = x;
+					param = i;
+				}
+			}
 
-		/* Search and replace the escaped nick and escaped pass into the query */
-		SearchAndReplace(safepass, "\"", "");
-		std::string* wnick;
-		if (user->GetExt("wantsnick", wnick)) {
-			SearchAndReplace(thisquery, "$nick", *wnick);
-		} else {
-			SearchAndReplace(thisquery, "$nick", user->nick);
+			if (found == std::string::npos) {
+				querytemplate.append(freeformquery, pos, std::string::npos);
+				break;
+			}
+
+			querytemplate.append(freeformquery, pos, found - pos);
+			querytemplate.push_back('?');
+			queryparams.push_back(static_cast<QueryParam>(param));
+			if (param == QP_HOST)
+				queryneedshost = true;
+			pos = found + strlen(names[param]);
 		}
+	}
+
+	std::string HashPassword(const char* modname, User* user) {
+		Module* HashMod = ServerInstance->Modules->Find(modname);
+		if (!HashMod)
+			return "";
 
-		SearchAndReplace(thisquery, "$pass", safepass);
-		SearchAndReplace(thisquery, "$host", user->host);
-		SearchAndReplace(thisquery, "$ip", user->GetIPString());
-		
-		Module* HashMod = ServerInstance->Modules->Find("m_md5.so");
+		HashResetRequest(this, HashMod).Send();
+		return HashSumRequest(this, HashMod, user->password).Send();
+	}
+
+	/* Auth Function, binds the connecting user's details into the auth query */
+	bool CheckCredentials(User* user) {
+		SQLquery query(querytemplate);
+		std::string key;
 
-		if (HashMod) {
-			HashResetRequest(this, HashMod).Send();
-			SearchAndReplace(thisquery, "$md5pass", HashSumRequest(this, HashMod, user->password).Send());
+		std::string* wnick;
+		for (std::vector<QueryParam>::const_iterator i = queryparams.begin(); i != queryparams.end(); ++i) {
+			std::string value;
+			switch (*i) {
+				case QP_NICK:
+					value = user->GetExt("wantsnick", wnick) ? *wnick : user->nick;
+					break;
+				case QP_PASS:
+					value = user->password;
+					break;
+				case QP_HOST:
+					value = user->host;
+					break;
+				case QP_IP:
+					value = user->GetIPString();
+					break;
+				case QP_MD5PASS:
+					value = HashPassword("m_md5.so", user);
+					break;
+				case QP_SHA256PASS:
+					value = HashPassword("m_sha256.so", user);
+					break;
+				default:
+					break;
+			}
+			query % value;
+			key.append(value).push_back('\0');
 		}
 
-		HashMod = ServerInstance->Modules->Find("m_sha256.so");
+		/* Answer from the cache if someone with the same details was checked recently */
+		AuthCache::iterator cached = authcache.find(key);
+		if (cached != authcache.end()) {
+			if (cached->second.expires > ServerInstance->Time()) {
+				ApplyResult(user, cached->second);
+				return true;
+			}
+			authcache.erase(cached);
+		}
 
-		if (HashMod) {
-			HashResetRequest(this, HashMod).Send();
-			SearchAndReplace(thisquery, "$sha256pass", HashSumRequest(this, HashMod, user->password).Send());
+		/* Only one query per set of details is sent, later users wait for its result */
+		PendingQueries::iterator pending = pendingkeys.find(key);
+		if (pending != pendingkeys.end()) {
+			pending->second.push_back(user->uuid);
+			return true;
 		}
 
-		/* Build the query */
-		SQLrequest req = SQLrequest(this, SQLprovider, databaseid, SQLquery(thisquery));
+		SQLrequest req = SQLrequest(this, SQLprovider, databaseid, query);
 
 		if(req.Send()) {
-			/* When we get the query response from the service provider we will be given an ID to play with,
-			 * just an ID number which is unique to this query. We need a way of associating that ID with a User
-			 * so we insert it into a map mapping the IDs to users.
-			 * Thankfully m_sqlutils provides this, it will associate a ID with a user or channel, and if the user quits it removes the
-			 * association. This means that if the user quits during a query we will just get a failed lookup from m_sqlutils - telling
-			 * us to discard the query.
-		 	 */
-			AssociateUser(this, SQLutils, req.id, user).Send();
-
+			/* When the user quits during the query they can't be found by their UUID any
+			 * more and the result is just cached for whoever connects next.
+			 */
+			queryids[req.id] = key;
+			pendingkeys[key].push_back(user->uuid);
 			return true;
 		} else {
 			if (verbose) {
@@ -231,164 +327,169 @@ public:
 		}
 	}
 
+	/* Run Failure SQL Insert Query (For Logging) */
+	void RunFailureQuery(User* user, const std::string& reason) {
+		std::string repfquery = failurequery;
+		if (repfquery != "") {
+			std::string* wnick;
+			if (user->GetExt("wantsnick", wnick)) {
+				SearchAndReplace(repfquery, "$nick", *wnick);
+			} else {
+				SearchAndReplace(repfquery, "$nick", user->nick);
+			}
+
+			SearchAndReplace(repfquery, "$host", user->host);
+			SearchAndReplace(repfquery, "$ip", user->GetIPString());
+			SearchAndReplace(repfquery, "$reason", reason);
+
+			SQLrequest req = SQLrequest(this, SQLprovider, databaseid, SQLquery(repfquery));
+			req.Send();
+		}
+	}
+
+	/* Auths or kills a user based on a result from the database or the cache */
+	void ApplyResult(User* user, const AuthResult& result) {
+		std::string* wnick;
+
+		if (!result.found) {
+			if (verbose) {
+				/* No rows in result, this means there was no record matching the user */
+				ServerInstance->SNO->WriteToSnoMask('A', "Forbidden connection from %s!%s@%s (SQL query returned no matches)", user->nick.c_str(), user->ident.c_str(), user->host.c_str());
+			}
+
+			RunFailureQuery(user, killreason);
+
+			/* Kill user that entered invalid credentials */
+			ServerInstance->Users->QuitUser(user, killreason);
+
+			user->Extend("sqlauth_failed");
+			return;
+		}
+
+		/* Clean Custom User Metadata */
+		user->Shrink("sqlAllowedIdent");
+		user->Shrink("sqlAllowedHost");
+		user->Shrink("sqlvHost");
+		user->Shrink("sqlTitle");
+		user->Shrink("sqlumodes");
+
+		user->Extend("sqlAllowedIdent", new std::string(result.allowedident));
+		user->Extend("sqlAllowedHost", new std::string(result.allowedhost));
+		user->Extend("sqlvHost", new std::string(result.vhost));
+		user->Extend("sqlTitle", new std::string(result.title));
+		user->Extend("sqlumodes", new std::string(result.umodes));
+
+		/* Check Allowed Ident@Hostname from SQL */
+		if (result.allowedident != "" && result.allowedhost != "") {
+			char TheHost[MAXBUF];
+			char TheIP[MAXBUF];
+			char TheAllowedUHost[MAXBUF];
+
+			snprintf(TheHost,MAXBUF,"%s@%s",user->ident.c_str(), user->host.c_str());
+			snprintf(TheIP, MAXBUF,"%s@%s",user->ident.c_str(), user->GetIPString());
+			snprintf(TheAllowedUHost, MAXBUF, "%s@%s", result.allowedident.c_str(), result.allowedhost.c_str());
+
+			if (!OneOfMatches(TheHost,TheIP,TheAllowedUHost)) {
+				if (killreasonUHost == "") { killreasonUHost = "Your ident or hostmask did not match the one registered to this nickname. Allowed: $allowedident@$allowedhost"; }
+				std::string tmpKillReason = killreasonUHost;
+				SearchAndReplace(tmpKillReason, "$allowedident", result.allowedident);
+				SearchAndReplace(tmpKillReason, "$allowedhost", result.allowedhost);
+
+				RunFailureQuery(user, tmpKillReason);
+
+				ServerInstance->Users->QuitUser(user, tmpKillReason);
+
+				user->Extend("sqlauth_failed");
+				return;
+			}
+		}
+
+		/* We got a result, auth user */
+		user->Extend("sqlauthed");
+
+		/* possible ghosting? */
+		if (user->GetExt("wantsnick", wnick)) {
+			/* no need to check ghosting, this is done in OnPreCommand
+			 * and if ghosting is off, user wont have the Extend 
+			 */
+			User* InUse = ServerInstance->FindNickOnly(wnick->c_str());
+			if (InUse) {
+				/* change his nick to UUID so we can take it */
+				//InUse->ForceNickChange(InUse->uuid.c_str());
+				/* put user on cull list */
+				ServerInstance->Users->QuitUser(InUse, "Ghosted by connecting user with same nick.");
+			}
+			/* steal the nick ;) */
+			user->ForceNickChange(wnick->c_str());
+			user->Shrink("wantsnick");
+			delete wnick;
+		}
+
+		/* Set Account Name (for m_services_account +R/+M channels) */
+		if (setaccount) {
+			std::string* pAccount = new std::string(user->nick.c_str());
+
+			user->Extend("accountname",pAccount);
+		}
+
+		/* Run Success SQL Update Query */
+		std::string repsquery = successquery;
+		if (successquery != "") {
+			SearchAndReplace(repsquery, "$nick", user->nick);
+			SearchAndReplace(repsquery, "$host", user->host);
+			SearchAndReplace(repsquery, "$ip", user->GetIPString());
+
+			SQLrequest req = SQLrequest(this, SQLprovider, databaseid, SQLquery(repsquery));
+			req.Send();
+		}
+	}
+
 	/* SQL Request */
 	virtual const char* OnRequest(Request* request) {
 		if(strcmp(SQLRESID, request->GetId()) == 0) {
 			SQLresult* res = static_cast<SQLresult*>(request);
 
-			User* user = GetAssocUser(this, SQLutils, res->id).S().user;
-			UnAssociate(this, SQLutils, res->id).S();
+			QueryKeys::iterator qk = queryids.find(res->id);
+			if (qk == queryids.end())
+				return NULL;
+
+			const std::string key = qk->second;
+			queryids.erase(qk);
+
+			std::vector<std::string> waiting;
+			PendingQueries::iterator pending = pendingkeys.find(key);
+			if (pending != pendingkeys.end()) {
+				waiting.swap(pending->second);
+				pendingkeys.erase(pending);
+			}
+
+			AuthResult result;
+			if(res->error.Id() == SQL_NO_ERROR) {
+				/* Get Data from SQL (using freeform query. "query" in modules.conf) */
+				int rowcount = res->Rows();
+				result.found = (rowcount > 0);
+				for (int i = 0; i < rowcount; ++i) {
+					SQLfieldList& currow = res->GetRow();
+					result.allowedident = currow[1].d;
+					result.allowedhost = currow[2].d;
+					result.vhost = currow[3].d;
+					result.title = currow[4].d;
+					result.umodes = currow[5].d;
+				}
+
+				if (cachetime) {
+					result.expires = ServerInstance->Time() + cachetime;
+					authcache[key] = result;
+				}
+			}
+
+			for (std::vector<std::string>::const_iterator i = waiting.begin(); i != waiting.end(); ++i) {
+				User* user = ServerInstance->FindUUID(*i);
+				if (!user || user->quitting || user->registered == REG_ALL)
+					continue;
 
-			if(user) {
 				if(res->error.Id() == SQL_NO_ERROR) {
-					std::string* wnick;
-					bool result;
-
-					if(res->Rows()) {
-						int rowcount=res->Rows(),i;
-
-						/* Clean Custom User Metadata */
-						user->Shrink("sqlAllowedIdent");
-						user->Shrink("sqlAllowedHost");
-						user->Shrink("sqlvHost");
-						user->Shrink("sqlTitle");
-						user->Shrink("sqlumodes");
-
-						std::string sqlvHost;
-						std::string sqlTitle;
-						std::string sqlumodes;
-						std::string sqlAllowedIdent;
-						std::string sqlAllowedHost;
-
-						/* Get Data from SQL (using freeform query. "query" in modules.conf) */
-						for (i=0; i<rowcount; ++i) {
-							SQLfieldList& currow = res->GetRow();
-							sqlAllowedIdent = currow[1].d.c_str();
-							sqlAllowedHost = currow[2].d.c_str();
-							sqlvHost = currow[3].d.c_str();
-							sqlTitle = currow[4].d.c_str();
-							sqlumodes = currow[5].d.c_str();
-						}
-
-						std::string* pAllowedIdent = new std::string(sqlAllowedIdent);
-						std::string* pAllowedHost = new std::string(sqlAllowedHost);
-						std::string* pvHost = new std::string(sqlvHost);
-						std::string* pTitle = new std::string(sqlTitle);
-						std::string* pumodes = new std::string(sqlumodes);
-
-						user->Extend("sqlAllowedIdent",pAllowedIdent);
-						user->Extend("sqlAllowedHost",pAllowedHost);
-						user->Extend("sqlvHost",pvHost);
-						user->Extend("sqlTitle",pTitle);
-						user->Extend("sqlumodes",pumodes);
-
-						/* Check Allowed Ident@Hostname from SQL */
-						if (sqlAllowedIdent != "" && sqlAllowedHost != "") {
-							char TheHost[MAXBUF];
-							char TheIP[MAXBUF];
-							char TheAllowedUHost[MAXBUF];
-
-							snprintf(TheHost,MAXBUF,"%s@%s",user->ident.c_str(), user->host.c_str());
-							snprintf(TheIP, MAXBUF,"%s@%s",user->ident.c_str(), user->GetIPString());
-							snprintf(TheAllowedUHost, MAXBUF, "%s@%s", sqlAllowedIdent.c_str(), sqlAllowedHost.c_str());
-
-							if (!OneOfMatches(TheHost,TheIP,TheAllowedUHost)) {
-								if (killreasonUHost == "") { killreasonUHost = "Your ident or hostmask did not match the one registered to this nickname. Allowed: $allowedident@$allowedhost"; }
-								std::string tmpKillReason = killreasonUHost;
-								SearchAndReplace(tmpKillReason, "$allowedident", sqlAllowedIdent.c_str());
-								SearchAndReplace(tmpKillReason, "$allowedhost", sqlAllowedHost.c_str());
-
-								/* Run Failure SQL Insert Query (For Logging) */
-								std::string repfquery = failurequery;
-								if (repfquery != "") {
-									if (user->GetExt("wantsnick", wnick)) {
-										SearchAndReplace(repfquery, "$nick", *wnick);
-									} else {
-										SearchAndReplace(repfquery, "$nick", user->nick);
-									}
-
-									SearchAndReplace(repfquery, "$host", user->host);
-									SearchAndReplace(repfquery, "$ip", user->GetIPString());
-									SearchAndReplace(repfquery, "$reason", tmpKillReason.c_str());
-
-									SQLrequest req = SQLrequest(this, SQLprovider, databaseid, SQLquery(repfquery));
-									result = req.Send();
-								}
-
-								ServerInstance->Users->QuitUser(user, tmpKillReason);
-
-								user->Extend("sqlauth_failed");
-								return NULL;
-							}
-						}
-
-						/* We got a result, auth user */
-						user->Extend("sqlauthed");
-
-						/* possible ghosting? */
-						if (user->GetExt("wantsnick", wnick)) {
-							/* no need to check ghosting, this is done in OnPreCommand
-							 * and if ghosting is off, user wont have the Extend 
-							 */
-							User* InUse = ServerInstance->FindNickOnly(wnick->c_str());
-							if (InUse) {
-								/* change his nick to UUID so we can take it */
-								//InUse->ForceNickChange(InUse->uuid.c_str());
-								/* put user on cull list */
-								ServerInstance->Users->QuitUser(InUse, "Ghosted by connecting user with same nick.");
-							}
-							/* steal the nick ;) */
-							user->ForceNickChange(wnick->c_str());
-							user->Shrink("wantsnick");
-						}
-
-						/* Set Account Name (for m_services_account +R/+M channels) */
-						if (setaccount) {
-							std::string* pAccount = new std::string(user->nick.c_str());
-
-							user->Extend("accountname",pAccount);
-						}
-
-						/* Run Success SQL Update Query */
-						std::string repsquery = successquery;
-						if (successquery != "") {
-							SearchAndReplace(repsquery, "$nick", user->nick);
-							SearchAndReplace(repsquery, "$host", user->host);
-							SearchAndReplace(repsquery, "$ip", user->GetIPString());
-
-							SQLrequest req = SQLrequest(this, SQLprovider, databaseid, SQLquery(repsquery));
-							result = req.Send();
-						}
-
-					/* Returned No Rows */
-					} else {
-						if (verbose) {
-							/* No rows in result, this means there was no record matching the user */
-							ServerInstance->SNO->WriteToSnoMask('A', "Forbidden connection from %s!%s@%s (SQL query returned no matches)", user->nick.c_str(), user->ident.c_str(), user->host.c_str());
-						}
-
-						/* Run Failure SQL Insert Query (For Logging) */
-						std::string repfquery = failurequery;
-						if (repfquery != "") {
-							if (user->GetExt("wantsnick", wnick)) {
-								SearchAndReplace(repfquery, "$nick", *wnick);
-							} else {
-								SearchAndReplace(repfquery, "$nick", user->nick);
-							}
-
-							SearchAndReplace(repfquery, "$host", user->host);
-							SearchAndReplace(repfquery, "$ip", user->GetIPString());
-							SearchAndReplace(repfquery, "$reason", killreason.c_str());
-
-							SQLrequest req = SQLrequest(this, SQLprovider, databaseid, SQLquery(repfquery));
-							result = req.Send();
-						}
-
-						/* Kill user that entered invalid credentials */
-						ServerInstance->Users->QuitUser(user, killreason);
-
-						user->Extend("sqlauth_failed");
-					}
+					ApplyResult(user, result);
 				/* SQL Failure */
 				} else {
 					if (verbose) {
@@ -397,18 +498,26 @@ public:
 					
 					user->Extend("sqlauth_failed");
 				}
-			} else {
-				return NULL;
-			}
 
-			if (!user->GetExt("sqlauthed")) {
-				ServerInstance->Users->QuitUser(user, killreason);
+				if (!user->GetExt("sqlauthed")) {
+					ServerInstance->Users->QuitUser(user, killreason);
+				}
 			}
 			return SQLSUCCESS;
 		}
 		return NULL;
 	}
 
+	/* Drop cached results which have expired */
+	virtual void OnBackgroundTimer(time_t curtime) {
+		for (AuthCache::iterator i = authcache.begin(); i != authcache.end(); ) {
+			if (i->second.expires <= curtime)
+				authcache.erase(i++);
+			else
+				++i;
+		}
+	}
+
 	/* User has connected to the IRCd */
 	virtual void OnUserConnect(User* user) {
 		std::string sqlAllowedIdent;
@@ -512,6 +621,7 @@ public:
 	virtual void OnUserDisconnect(User* user) {
 		user->Shrink("sqlauthed");
 		user->Shrink("sqlauth_failed");
+		user->Shrink("sqlauth_deferred");
 		user->Shrink("sqlAllowedIdent");
 		user->Shrink("sqlAllowedHost");
 		user->Shrink("sqlvHost");
@@ -521,6 +631,11 @@ public:
 	}
 
 	virtual bool OnCheckReady(User* user) {
+		if (user->GetExt("sqlauth_deferred") && user->dns_done) {
+			user->Shrink("sqlauth_deferred");
+			if (!CheckCredentials(user))
+				ServerInstance->Users->QuitUser(user, killreason);
+		}
 		return user->GetExt("sqlauthed");
 	}
 
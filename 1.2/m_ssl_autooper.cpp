@@ -19,13 +19,33 @@
 /* $ModDesc: auto-opers any user if his SSL fingerprint matches with the fingerprint in an oper block */
 /* $ModDepends: core 1.2-1.3 */
 
+/** An oper block with a fingerprint, with its <type> already looked up */
+struct AutoOper
+{
+	std::string name;
+	std::string type;
+	std::vector<std::string> hosts;
+
+	/* Whether the <type> block was found, and its settings */
+	bool hastype;
+	bool validtype;
+	std::string typehost;
+	std::string typeclass;
+};
+
+/* Oper blocks by fingerprint in the order they are in the config */
+typedef nspace::hash_map<std::string, std::vector<AutoOper> > AutoOperMap;
+
 class ModuleSSLAutoOper : public Module
 {
+	AutoOperMap opers;
+
  public:
 	ModuleSSLAutoOper(InspIRCd* Me) : Module(Me)
 	{
-		Implementation eventlist[] = { I_OnPostConnect };
-		ServerInstance->Modules->Attach(eventlist, this, 1);
+		OnRehash(NULL, "");
+		Implementation eventlist[] = { I_OnPostConnect, I_OnRehash };
+		ServerInstance->Modules->Attach(eventlist, this, 2);
 	}
 
 	virtual ~ModuleSSLAutoOper()
@@ -48,13 +68,49 @@ class ModuleSSLAutoOper : public Module
 			ServerInstance->Modules->SetPriority(this, I_OnPostConnect, PRIORITY_AFTER, &sslmodule);
 	}
 
-	bool OneOfMatches(const char* host, const char* ip, const char* hostlist)
+	virtual void OnRehash(User* user, const std::string &param)
 	{
-		std::stringstream hl(hostlist);
-		std::string xhost;
-		while (hl >> xhost)
+		ConfigReader cf(ServerInstance);
+		opers.clear();
+
+		for (int i = 0; i < cf.Enumerate("oper"); i++)
 		{
-			if (InspIRCd::Match(host, xhost, ascii_case_insensitive_map) || InspIRCd::MatchCIDR(ip, xhost, ascii_case_insensitive_map))
+			std::string FingerPrint = cf.ReadValue("oper", "fingerprint", i);
+			if (FingerPrint.empty())
+				continue;
+
+			AutoOper oper;
+			oper.name = cf.ReadValue("oper", "name", i);
+			oper.type = cf.ReadValue("oper", "type", i);
+			oper.hastype = oper.validtype = false;
+
+			std::stringstream hl(cf.ReadValue("oper", "host", i));
+			std::string xhost;
+			while (hl >> xhost)
+				oper.hosts.push_back(xhost);
+
+			/* get the right oper type and class from the config */
+			for (int j = 0; j < cf.Enumerate("type"); j++)
+			{
+				if (oper.type != cf.ReadValue("type", "name", j))
+					continue;
+
+				oper.hastype = true;
+				oper.validtype = ServerInstance->IsNick(oper.type.c_str(), ServerInstance->Config->Limits.NickMax);
+				oper.typehost = cf.ReadValue("type", "host", j);
+				oper.typeclass = cf.ReadValue("type", "class", j);
+				break;
+			}
+
+			opers[FingerPrint].push_back(oper);
+		}
+	}
+
+	bool OneOfMatches(const std::string &host, const std::string &ip, const std::vector<std::string> &hostlist)
+	{
+		for (std::vector<std::string>::const_iterator xhost = hostlist.begin(); xhost != hostlist.end(); ++xhost)
+		{
+			if (InspIRCd::Match(host, *xhost, ascii_case_insensitive_map) || InspIRCd::MatchCIDR(ip, *xhost, ascii_case_insensitive_map))
 			{
 				return true;
 			}
@@ -64,13 +120,6 @@ class ModuleSSLAutoOper : public Module
 
 	virtual void OnPostConnect(User *user)
 	{
-		ConfigReader cf(ServerInstance);
-		std::string TheHost;
-		std::string TheIP;
-		std::string LoginName;
-		std::string OperType;
-		std::string HostName;
-		std::string FingerPrint;
 		ssl_cert* cert = NULL;
 
 		user->GetExt("ssl_cert",cert);
@@ -78,62 +127,40 @@ class ModuleSSLAutoOper : public Module
 		if (!cert)
 			return;
 
-		for (int i = 0; i < cf.Enumerate("oper"); i++)
-		{
+		AutoOperMap::const_iterator iter = opers.find(cert->GetFingerprint());
+		if (iter == opers.end())
+			return;
 
-			LoginName = cf.ReadValue("oper", "name", i);
-			OperType = cf.ReadValue("oper", "type", i);
-			HostName = cf.ReadValue("oper", "host", i);
-			FingerPrint = cf.ReadValue("oper", "fingerprint", i);
+		const std::string TheHost = user->ident + "@" + user->host;
+		const std::string TheIP = user->ident + "@" + user->GetIPString();
+		for (std::vector<AutoOper>::const_iterator oper = iter->second.begin(); oper != iter->second.end(); ++oper)
+		{
+			/* now check if the user is using an allowed hostname/IP */
+			if (!OneOfMatches(TheHost, TheIP, oper->hosts))
+			{
+				user->WriteNumeric(491, "%s :Invalid oper credentials, your host is not on your oper block!", user->nick.c_str());
+				return;
+			}
 
-			if (FingerPrint.empty())
+			/* an oper block without a valid type falls through to the next one */
+			if (!oper->hastype)
 				continue;
 
-			/* check if the fingerprint matches */
-			if (cert->GetFingerprint() == FingerPrint)
+			if (!oper->validtype)
+				return;
+
+			if (!oper->typehost.empty())
+				user->ChangeDisplayedHost(oper->typehost.c_str());
+			if (!oper->typeclass.empty())
 			{
-				/* now check if the user is using an allowed hostname/IP */
-				TheHost = user->ident + "@" + user->host;
-				TheIP = user->ident + "@" + user->GetIPString();
-				if (!OneOfMatches(TheHost.c_str(), TheIP.c_str(), HostName.c_str()))
-				{
-					user->WriteNumeric(491, "%s :Invalid oper credentials, your host is not on your oper block!", user->nick.c_str());
-					return;
-				}
-
-				/* get the right oper type and class from the config */
-				char TypeName[MAXBUF];
-				char ClassName[MAXBUF];
-
-				for (int j = 0; j < ServerInstance->Config->ConfValueEnum("type"); j++)
-				{
-					ServerInstance->Config->ConfValue("type", "name", j, TypeName, MAXBUF);
-					ServerInstance->Config->ConfValue("type", "class", j, ClassName, MAXBUF);
-
-					if (!OperType.compare(TypeName))
-					{
-						/* found this oper's opertype */
-						if (!ServerInstance->IsNick(TypeName, ServerInstance->Config->Limits.NickMax))
-							return;
-						char OperHost[MAXBUF];
-						ServerInstance->Config->ConfValue("type","host", j, OperHost, MAXBUF);
-						if (*OperHost)
-							user->ChangeDisplayedHost(OperHost);
-						if (*ClassName)
-						{
-							user->SetClass(ClassName);
-							user->CheckClass();
-						}
-						user->Oper(OperType, LoginName);
-						return;
-					}
-				} // for "type"
-			} // if (cert->GetFingerprint() == FingerPrint)
-		} // for (int i = 0; i < cf.Enumerate("oper"); i++)
-		return;
-	} // virtual void OnUserConnect(User *user)
+				user->SetClass(oper->typeclass);
+				user->CheckClass();
+			}
+			user->Oper(oper->type, oper->name);
+			return;
+		}
+	}
 
 };
 
 MODULE_INIT(ModuleSSLAutoOper)
-
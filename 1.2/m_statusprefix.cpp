@@ -20,19 +20,48 @@
 
 #define STATUS_VALUE 1
 
+/* Members of a channel who have +V, kept on the channel */
+typedef std::set<User*> StatusList;
+
+static const std::string statusext = "cm_status";
+
+/* Frees the +V list of a channel */
+static void ClearStatus(Channel* channel)
+{
+	StatusList* list;
+	if (channel->GetExt(statusext, list))
+	{
+		channel->Shrink(statusext);
+		delete list;
+	}
+}
+
+/* Forgets the +V of a member */
+static void ClearStatus(User* user, Channel* channel)
+{
+	StatusList* list;
+	if (channel->GetExt(statusext, list))
+		list->erase(user);
+}
+
+static bool HasStatus(User* user, Channel* channel)
+{
+	StatusList* list;
+	return channel->GetExt(statusext, list) && list->count(user);
+}
+
 /** Handles basic operation of +V channel mode
  */
 class StatusPrefixBase
 {
  private:
 	InspIRCd* MyInstance;
-	std::string extend;
 	std::string type;
 	int list;
 	int end;
  public:
-	StatusPrefixBase(InspIRCd* Instance, const std::string &ext, const std::string &mtype, int l, int e) :
-		MyInstance(Instance), extend(ext), type(mtype), list(l), end(e)
+	StatusPrefixBase(InspIRCd* Instance, const std::string &mtype, int l, int e) :
+		MyInstance(Instance), type(mtype), list(l), end(e)
 	{
 	}
 
@@ -47,8 +76,7 @@ class StatusPrefixBase
 			}
 			else
 			{
-				std::string item = extend+std::string(channel->name);
-				if (x->GetExt(item))
+				if (HasStatus(x, channel))
 				{
 					return std::make_pair(true, x->nick);
 				}
@@ -63,21 +91,21 @@ class StatusPrefixBase
 
 	void RemoveMode(Channel* channel, char mc, irc::modestacker* stack)
 	{
-		CUList* cl = channel->GetUsers();
-		std::string item = extend + std::string(channel->name);
 		std::vector<std::string> mode_junk;
 		mode_junk.push_back(channel->name);
 		irc::modestacker modestack(MyInstance, false);
 		std::deque<std::string> stackresult;
 
-		for (CUList::iterator i = cl->begin(); i != cl->end(); i++)
+		/* only the members with +V are walked */
+		StatusList* list;
+		if (channel->GetExt(statusext, list))
 		{
-			if (i->first->GetExt(item))
+			for (StatusList::iterator i = list->begin(); i != list->end(); i++)
 			{
 				if (stack)
-					stack->Push(mc, i->first->nick);
+					stack->Push(mc, (*i)->nick);
 				else
-					modestack.Push(mc, i->first->nick);
+					modestack.Push(mc, (*i)->nick);
 			}
 		}
 
@@ -105,22 +133,27 @@ class StatusPrefixBase
 
 	ModeAction HandleChange(User* source, User* theuser, bool adding, Channel* channel, std::string &parameter)
 	{
-		std::string item = extend+std::string(channel->name);
+		StatusList* list;
+		if (!channel->GetExt(statusext, list))
+		{
+			if (!adding)
+				return MODEACTION_DENY;
+			list = new StatusList;
+			channel->Extend(statusext, list);
+		}
 
 		if (adding)
 		{
-			if (!theuser->GetExt(item))
+			if (list->insert(theuser).second)
 			{
-				theuser->Extend(item);
 				parameter = theuser->nick;
 				return MODEACTION_ALLOW;
 			}
 		}
 		else
 		{
-			if (theuser->GetExt(item))
+			if (list->erase(theuser))
 			{
-				theuser->Shrink(item);
 				parameter = theuser->nick;
 				return MODEACTION_ALLOW;
 			}
@@ -136,7 +169,7 @@ class StatusPrefix : public ModeHandler, public StatusPrefixBase
  public:
 	StatusPrefix(InspIRCd* Instance, char my_prefix)
 		: ModeHandler(Instance, 'V', 1, 1, true, MODETYPE_CHANNEL, false, my_prefix, 0, TR_NICK),
-		  StatusPrefixBase(Instance,"cm_protect_","protected user", 388, 389) { }
+		  StatusPrefixBase(Instance,"protected user", 388, 389) { }
 
 	unsigned int GetPrefixRank()
 	{
@@ -166,8 +199,6 @@ class StatusPrefix : public ModeHandler, public StatusPrefixBase
 		if (!theuser)
 			return MODEACTION_DENY;
 
-		std::string founder = "cm_founder_"+std::string(channel->name);
-
 		if ((!adding))
 		{
 			return StatusPrefixBase::HandleChange(source, theuser, adding, channel, parameter);
@@ -229,20 +260,35 @@ class ModuleStatusPrefix : public Module
 			throw ModuleException("Could not add new mode!");
 		}
 
-		Implementation eventlist[] = { I_OnUserKick, I_OnUserPart };
-		ServerInstance->Modules->Attach(eventlist, this, 2);
+		Implementation eventlist[] = { I_OnUserKick, I_OnUserPart, I_OnUserQuit, I_OnChannelDelete, I_OnCleanup };
+		ServerInstance->Modules->Attach(eventlist, this, 5);
 	}
 
 	virtual void OnUserKick(User* source, User* user, Channel* chan, const std::string &reason, bool &silent)
 	{
-		// FIX: when someone gets kicked from a channel we must remove their Extensibles!
-		user->Shrink("cm_status_"+std::string(chan->name));
+		ClearStatus(user, chan);
 	}
 
 	virtual void OnUserPart(User* user, Channel* channel, std::string &partreason, bool &silent)
 	{
-		// FIX: when someone parts a channel we must remove their Extensibles!
-		user->Shrink("cm_status_"+std::string(channel->name));
+		ClearStatus(user, channel);
+	}
+
+	virtual void OnUserQuit(User* user, const std::string &message, const std::string &oper_message)
+	{
+		for (UCListIter f = user->chans.begin(); f != user->chans.end(); f++)
+			ClearStatus(user, f->first);
+	}
+
+	virtual void OnChannelDelete(Channel* chan)
+	{
+		ClearStatus(chan);
+	}
+
+	virtual void OnCleanup(int target_type, void* item)
+	{
+		if (target_type == TYPE_CHANNEL)
+			ClearStatus((Channel*)item);
 	}
 
 	void LoadSettings()
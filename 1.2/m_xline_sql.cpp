@@ -50,9 +50,19 @@ CREATE TABLE `xlines` (
 );
 
 
+Sync mode:
+
+If <xlinesql syncinterval> is set to a number of seconds then the lines
+which were set or deleted since the last sync are pulled from the database
+that often, so that servers sharing a database pick up each other's lines
+without reloading everything. The newest settime and deletetime seen so far
+are used as the high-water marks and are substituted for ? in syncquery and
+syncdeletequery. Both queries must return the columns in the same order as
+the table above.
+
  */
 
-enum XLSQLAction { XLSQL_ORDINARY, XLSQL_RENEW, XLSQL_SELECT };
+enum XLSQLAction { XLSQL_ORDINARY, XLSQL_RENEW, XLSQL_SELECT, XLSQL_SYNC, XLSQL_SYNCDELETE };
 
 class ModuleXLineSQL : public Module
 {
@@ -65,8 +75,21 @@ class ModuleXLineSQL : public Module
 	std::string deletequery;
 	std::string renewquery;
 	std::string selectquery;
+	std::string syncquery;
+	std::string syncdeletequery;
 	std::string databaseid;
 
+	/* seconds between syncs, 0 if disabled */
+	long syncinterval;
+	time_t nextsync;
+
+	/* high-water marks for syncing */
+	unsigned long lastsettime;
+	unsigned long lastdeletetime;
+
+	/* true while a sync query is outstanding so they don't pile up */
+	bool syncing;
+
 	std::map<unsigned long, XLSQLAction> active_queries;
 
 public:
@@ -78,9 +101,11 @@ public:
 		if (!SQLprovider)
 			throw ModuleException("Can't find an SQL provider module. Please load one before attempting to load m_xline_sql.");
 
-		Implementation eventlist[] = { I_OnRequest, I_OnRehash, I_OnAddLine, I_OnDelLine, I_OnExpireLine };
-		ServerInstance->Modules->Attach(eventlist, this, 5);
+		Implementation eventlist[] = { I_OnRequest, I_OnRehash, I_OnAddLine, I_OnDelLine, I_OnExpireLine, I_OnBackgroundTimer };
+		ServerInstance->Modules->Attach(eventlist, this, 6);
 		reading_db = false;
+		syncing = false;
+		nextsync = 0;
 
 		OnRehash(NULL, "");
 
@@ -106,6 +131,11 @@ public:
 									   "update        $table set   expired=1 where deleted=0 and settime+duration<=UNIX_TIMESTAMP()", 0, true);
 		selectquery   = Conf.ReadValue("xlinesql", "selectquery",
 									   "select * from $table where expired=0 and   deleted=0 and settime+duration> UNIX_TIMESTAMP()", 0, true);
+		syncquery     = Conf.ReadValue("xlinesql", "syncquery",
+									   "select * from $table where expired=0 and   deleted=0 and settime+duration> UNIX_TIMESTAMP() and settime>=?", 0, true);
+		syncdeletequery = Conf.ReadValue("xlinesql", "syncdeletequery",
+									   "select * from $table where deleted=1 and deletetime>=?", 0, true);
+		syncinterval  = Conf.ReadInteger("xlinesql", "syncinterval", 0, true);
 
 		std::string tablename = Conf.ReadValue("xlinesql", "table", "xlines", 0, false);
 
@@ -114,6 +144,8 @@ public:
 		SearchAndReplace(deletequery, std::string("$table"), tablename);
 		SearchAndReplace(renewquery,  std::string("$table"), tablename);
 		SearchAndReplace(selectquery, std::string("$table"), tablename);
+		SearchAndReplace(syncquery, std::string("$table"), tablename);
+		SearchAndReplace(syncdeletequery, std::string("$table"), tablename);
 
 		ReadDatabase();
 	}
@@ -123,17 +155,102 @@ public:
 		if (!renewquery.empty())
 			SendQuery(renewquery, XLSQL_RENEW);
 
-		reading_db = true;
+		/* the full load sets the high-water marks for the syncs after it */
+		lastsettime = 0;
+		lastdeletetime = ServerInstance->Time();
+		nextsync = ServerInstance->Time() + syncinterval;
 		SendQuery(selectquery, XLSQL_SELECT);
 	}
 
-	void SendQuery(const std::string &query, XLSQLAction querytype = XLSQL_ORDINARY)
+	virtual void OnBackgroundTimer(time_t curtime)
 	{
-		SQLrequest req = SQLrequest(this, SQLprovider, databaseid, SQLquery(query));
+		if (syncinterval <= 0 || syncing || curtime < nextsync)
+			return;
+
+		nextsync = curtime + syncinterval;
+		syncing = true;
+
+		SQLquery addquery(syncquery);
+		addquery % lastsettime;
+		SendQuery(addquery, XLSQL_SYNC);
+
+		SQLquery delquery(syncdeletequery);
+		delquery % lastdeletetime;
+		if (!SendQuery(delquery, XLSQL_SYNCDELETE))
+			syncing = false;
+	}
+
+	bool SendQuery(const SQLquery &query, XLSQLAction querytype)
+	{
+		SQLrequest req = SQLrequest(this, SQLprovider, databaseid, query);
 		if (req.Send())
 		{
 			active_queries[req.id] = querytype;
+			return true;
+		}
+		return false;
+	}
+
+	/* Adds the lines from a result in one go, applying them to users once at the end */
+	void AddLines(SQLresult* res)
+	{
+		unsigned long added = 0;
+		int rowcount = res->Rows(), i;
+		for (i = 0; i < rowcount; ++i)
+		{
+			SQLfieldList& currow = res->GetRow();
+			unsigned long settime = strtoul(currow[3].d.c_str(), NULL, 10);
+			if (settime > lastsettime)
+				lastsettime = settime;
+
+			//populate xlines
+			XLineFactory* xlf = ServerInstance->XLines->GetFactory(currow[0].d);
+
+			if (!xlf)
+			{
+				ServerInstance->SNO->WriteToSnoMask('x', "database: Unknown line type (%s).", currow[0].d.c_str());
+				continue;
+			}
+
+			XLine* xl = xlf->Generate(ServerInstance->Time(), atoi(currow[4].d.c_str()), currow[2].d.c_str(), currow[5].d.c_str(), currow[1].d.c_str());
+			xl->SetCreateTime(settime);
+
+			/* lines we already have come back from each sync */
+			if (ServerInstance->XLines->AddLine(xl, NULL))
+				added++;
+			else
+				delete xl;
 		}
+
+		if (added)
+		{
+			ServerInstance->XLines->ApplyLines();
+			ServerInstance->SNO->WriteToSnoMask('x', "database: Added %lu lines", added);
+		}
+	}
+
+	void DelLines(SQLresult* res)
+	{
+		unsigned long removed = 0;
+		int rowcount = res->Rows(), i;
+		for (i = 0; i < rowcount; ++i)
+		{
+			SQLfieldList& currow = res->GetRow();
+			unsigned long deletetime = strtoul(currow[10].d.c_str(), NULL, 10);
+			if (deletetime > lastdeletetime)
+				lastdeletetime = deletetime;
+
+			if (ServerInstance->XLines->DelLine(currow[1].d.c_str(), currow[0].d, NULL))
+				removed++;
+		}
+
+		if (removed)
+			ServerInstance->SNO->WriteToSnoMask('x', "database: Removed %lu lines", removed);
+	}
+
+	void SendQuery(const std::string &query, XLSQLAction querytype = XLSQL_ORDINARY)
+	{
+		SendQuery(SQLquery(query), querytype);
 	}
 
 	virtual const char* OnRequest(Request* request)
@@ -150,32 +267,16 @@ public:
 
 			if (n != active_queries.end())
 			{
-				if (n->second == XLSQL_SELECT)
+				/* don't write the lines we are reading back to the database */
+				reading_db = true;
+				if (n->second == XLSQL_SELECT || n->second == XLSQL_SYNC)
+					AddLines(res);
+				else if (n->second == XLSQL_SYNCDELETE)
 				{
-					int rowcount = res->Rows(), i;
-					for (i = 0; i < rowcount; ++i)
-					{
-						SQLfieldList& currow = res->GetRow();
-						//populate xlines
-						XLineFactory* xlf = ServerInstance->XLines->GetFactory(currow[0].d);
-
-						if (!xlf)
-						{
-							ServerInstance->SNO->WriteToSnoMask('x', "database: Unknown line type (%s).", currow[0].d.c_str());
-							continue;
-						}
-
-						XLine* xl = xlf->Generate(ServerInstance->Time(), atoi(currow[4].d.c_str()), currow[2].d.c_str(), currow[5].d.c_str(), currow[1].d.c_str());
-						xl->SetCreateTime(atoi(currow[3].d.c_str()));
-
-						if (ServerInstance->XLines->AddLine(xl, NULL))
-						{
-							ServerInstance->SNO->WriteToSnoMask('x', "database: Added a line of type %s", currow[0].d.c_str());
-						}
-
-					}
-					reading_db = false;
+					DelLines(res);
+					syncing = false;
 				}
+				reading_db = false;
 				active_queries.erase(n);
 			}
 
@@ -24,7 +24,10 @@
 class ModuleXMLSocket : public Module
 {
 	ConfigReader* Conf;
-	std::vector<std::string> listenports;
+	/* The "address:port" of each xmlsocket listener, plus the ports which
+	 * are bound on every address. */
+	std::set<std::string> listenports;
+	std::set<long> wildcardports;
 
  public:
 
@@ -36,15 +39,12 @@ class ModuleXMLSocket : public Module
 		ServerInstance->Modules->Attach(eventlist, this, 6);
 	}
 
-	bool isin(const std::string &host, int port, const std::vector<std::string> &portlist)
+	bool isin(const std::string &host, int port)
 	{
-		if (std::find(portlist.begin(), portlist.end(), "*:" + ConvToStr(port)) != portlist.end())
+		if (wildcardports.find(port) != wildcardports.end())
 			return true;
 
-		if (std::find(portlist.begin(), portlist.end(), ":" + ConvToStr(port)) != portlist.end())
-			return true;
-
-		return std::find(portlist.begin(), portlist.end(), host + ":" + ConvToStr(port)) != portlist.end();
+		return listenports.find(host + ":" + ConvToStr(port)) != listenports.end();
 	}
 
 	virtual void OnRehash(User* user, const std::string &param)
@@ -53,6 +53,7 @@ class ModuleXMLSocket : public Module
 		Conf = new ConfigReader(ServerInstance);
 
 		listenports.clear();
+		wildcardports.clear();
 
 		for (int i = 0; i < Conf->Enumerate("bind"); i++)
 		{
@@ -70,7 +71,9 @@ class ModuleXMLSocket : public Module
 				{
 					try
 					{
-						listenports.push_back(addr + ":" + ConvToStr(portno));
+						listenports.insert(addr + ":" + ConvToStr(portno));
+						if (addr.empty() || addr == "*")
+							wildcardports.insert(portno);
 						for (size_t j = 0; j < ServerInstance->Config->ports.size(); j++)
 							if ((ServerInstance->Config->ports[j]->GetPort() == portno) && (ServerInstance->Config->ports[j]->GetIP() == addr))
 								ServerInstance->Config->ports[j]->SetDescription("xml");
@@ -94,12 +97,9 @@ class ModuleXMLSocket : public Module
 	{
 		if (mod == this)
 		{
-			for(unsigned int i = 0; i < listenports.size(); i++)
-			{
-				for (size_t j = 0; j < ServerInstance->Config->ports.size(); j++)
-					if (listenports[i] == (ServerInstance->Config->ports[j]->GetIP()+":"+ConvToStr(ServerInstance->Config->ports[j]->GetPort())))
-						ServerInstance->Config->ports[j]->SetDescription("plaintext");
-			}
+			for (size_t j = 0; j < ServerInstance->Config->ports.size(); j++)
+				if (listenports.find(ServerInstance->Config->ports[j]->GetIP()+":"+ConvToStr(ServerInstance->Config->ports[j]->GetPort())) != listenports.end())
+					ServerInstance->Config->ports[j]->SetDescription("plaintext");
 		}
 	}
 
@@ -120,7 +120,7 @@ class ModuleXMLSocket : public Module
 
 	virtual void OnHookUserIO(User* user, const std::string &targetip)
 	{
-		if (!user->GetIOHook() && isin(targetip,user->GetPort(),listenports))
+		if (!user->GetIOHook() && isin(targetip,user->GetPort()))
 		{
 			/* Hook the user with our module */
 			user->AddIOHook(this);
@@ -147,9 +147,9 @@ class ModuleXMLSocket : public Module
 		 * we asked for, and we dont need to re-implement our own socket
 		 * buffering (See below)
 		 */
-		for (int n = 0; n < result; n++)
-			if (buffer[n] == 0)
-				buffer[n] = '\n';
+		char* end = buffer + result;
+		for (char* nul = buffer; (nul = (char*)memchr(nul, 0, end - nul)); )
+			*nul++ = '\n';
 
 		readresult = result;
 		return result;
@@ -162,22 +162,33 @@ class ModuleXMLSocket : public Module
 		if (user == NULL)
 			return -1;
 
-		/* We want to alter the buffer, so we have to make a copy */
-		char * tmpbuffer = new char[count + 1];
-		memcpy(tmpbuffer, buffer, count);
-
-		/* XXX: This will actually generate lines "looking\0\0like\0\0this"
-		 * rather than lines "looking\0like\0this". This shouldnt be a problem
-		 * to the client, but it saves us a TON of processing and the need
-		 * to re-implement socket buffering, as the data we are sending is
-		 * exactly the same length as the data we are receiving.
+		/* Each CRLF (or lone LF) becomes a single \0. The core always writes
+		 * whole lines, so a CR which is split from its LF by a partial write
+		 * only costs the client an empty line.
 		 */
-		for (int n = 0; n < count; n++)
-			if ((tmpbuffer[n] == '\r') || (tmpbuffer[n] == '\n'))
-				tmpbuffer[n] = 0;
+		std::string out;
+		out.reserve(count);
+
+		const char* pos = buffer;
+		const char* end = buffer + count;
+		while (pos < end)
+		{
+			const char* nl = (const char*)memchr(pos, '\n', end - pos);
+			const char* lineend = nl ? nl : end;
+			const char* textend = lineend;
+			if ((textend > pos) && (textend[-1] == '\r'))
+				textend--;
+
+			out.append(pos, textend - pos);
+			if ((nl) || (textend != lineend))
+				out.push_back(0);
+
+			if (!nl)
+				break;
+			pos = nl + 1;
+		}
 
-		user->AddWriteBuf(std::string(tmpbuffer,count));
-		delete [] tmpbuffer;
+		user->AddWriteBuf(out);
 
 		return 1;
 	}
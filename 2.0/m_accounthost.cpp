@@ -53,10 +53,14 @@ class ModuleAccountHost : public Module
 			return;
 
 		std::string hostname = hostprefix + accev->account + hostsuffix;
-		if (changereal && accev->user->registered != REG_ALL)
+		if (changereal && accev->user->registered != REG_ALL && accev->user->host != hostname)
+		{
 			accev->user->host = hostname;
+			accev->user->InvalidateCache();
+		}
+
+		// ChangeDisplayedHost does nothing if the host is unchanged, so a repeated login costs no broadcast.
 		accev->user->ChangeDisplayedHost(hostname.c_str());
-		accev->user->InvalidateCache();
 	}
 
 	void OnRehash(User* user)
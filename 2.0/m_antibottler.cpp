@@ -42,54 +42,21 @@ class ModuleAntiBottler : public Module
 
 	virtual ModResult OnPreCommand(std::string &command, std::vector<std::string> &parameters, LocalUser *user, bool validated, const std::string &original_line)
 	{
-		char data[MAXBUF];
-		strlcpy(data,original_line.c_str(),MAXBUF);
-		bool not_bottler = false;
-		if (!strncmp(data,"user ",5))
-		{
-			for (char* j = data; *j; j++)
-			{
-				if (*j == ':')
-					break;
+		// Bottlers send a lowercase USER with a numeric remote host and no quotes before the real name.
+		// This is only checked before validation so the parameters are only changed once.
+		if (validated || command != "USER" || parameters.size() < 4 || original_line.compare(0, 5, "user "))
+			return MOD_RES_PASSTHRU;
 
-				if (*j == '"')
-				{
-					not_bottler = true;
-				}
-			}
-			// Bug Fix (#14) -- FCS
-			if (!*data)
-				return MOD_RES_PASSTHRU;
+		const std::string::size_type quote = original_line.find_first_of("\":");
+		if (quote != std::string::npos && original_line[quote] == '"')
+			return MOD_RES_PASSTHRU;
 
-			strtok(data," ");
-			char *ident = strtok(NULL," ");
-			char *local = strtok(NULL," ");
-			char *remote = strtok(NULL," :");
-			char *gecos = strtok(NULL,"\r\n");
+		if (parameters[2].empty() || parameters[2].find_first_not_of("0123456789.") != std::string::npos)
+			return MOD_RES_PASSTHRU;
 
-			if (!ident || !local || !remote || !gecos)
-				return MOD_RES_PASSTHRU;
-
-			for (char* j = remote; *j; j++)
-			{
-				if (((*j < '0') || (*j > '9')) && (*j != '.'))
-				{
-					not_bottler = true;
-				}
-			}
-
-			if (!not_bottler)
-			{
-				std::string strgecos = std::string(gecos) + "[Possible bottler, ident: " + std::string(ident) + "]";
-				std::vector<std::string> modified;
-				modified.push_back("bottler");
-				modified.push_back(local);
-				modified.push_back(remote);
-				modified.push_back(strgecos);
-				ServerInstance->Parser->CallHandler("USER", modified, user);
-				return MOD_RES_DENY;
-			}
-		}
+		// The parameters are changed in place and the USER handler is left to use them.
+		parameters[3].append("[Possible bottler, ident: ").append(parameters[0]).append("]");
+		parameters[0] = "bottler";
 		return MOD_RES_PASSTHRU;
  	}
 };
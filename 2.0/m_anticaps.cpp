@@ -151,10 +151,36 @@ class ModuleAntiCaps : public Module
 {
  private:
 	SimpleExtItem<AntiCapsSettings> ext;
-	std::bitset<UCHAR_MAX> uppercase;
-	std::bitset<UCHAR_MAX> lowercase;
 	AntiCapsMode mode;
 
+	// The amount each character adds to the count of a message. The number of
+	// upper case characters is kept in the low 32 bits and the number of upper
+	// and lower case characters in the high 32 bits so that counting a message
+	// is a single addition per character.
+	uint64_t weights[UCHAR_MAX + 1];
+
+	void SetWeights(const std::string& chars, uint64_t weight)
+	{
+		for (std::string::const_iterator iter = chars.begin(); iter != chars.end(); ++iter)
+			weights[static_cast<unsigned char>(*iter)] = weight;
+	}
+
+	uint64_t CountCase(std::string::const_iterator begin, std::string::const_iterator end) const
+	{
+		// Four independent sums so the additions don't wait on each other.
+		uint64_t sums[4] = { 0, 0, 0, 0 };
+		for (; end - begin >= 4; begin += 4)
+		{
+			sums[0] += weights[static_cast<unsigned char>(begin[0])];
+			sums[1] += weights[static_cast<unsigned char>(begin[1])];
+			sums[2] += weights[static_cast<unsigned char>(begin[2])];
+			sums[3] += weights[static_cast<unsigned char>(begin[3])];
+		}
+		for (; begin != end; ++begin)
+			sums[0] += weights[static_cast<unsigned char>(*begin)];
+		return sums[0] + sums[1] + sums[2] + sums[3];
+	}
+
 	void CreateBan(Channel* channel, User* user, bool mute)
 	{
 		std::string banmask(mute ? "m:" : "");
@@ -193,15 +219,11 @@ class ModuleAntiCaps : public Module
 	{
 		ConfigTag* tag = ServerInstance->Config->ConfValue("anticaps");
 
-		uppercase.reset();
-		const std::string upper = tag->getString("uppercase", "ABCDEFGHIJKLMNOPQRSTUVWXYZ");
-		for (std::string::const_iterator iter = upper.begin(); iter != upper.end(); ++iter)
-			uppercase.set(static_cast<unsigned char>(*iter));
-
-		lowercase.reset();
-		const std::string lower = tag->getString("lowercase", "abcdefghijklmnopqrstuvwxyz");
-		for (std::string::const_iterator iter = lower.begin(); iter != lower.end(); ++iter)
-			lowercase.set(static_cast<unsigned char>(*iter));
+		// Lower case characters are applied first so a character in both lists
+		// is treated as upper case like it was before.
+		std::fill(weights, weights + UCHAR_MAX + 1, 0);
+		SetWeights(tag->getString("lowercase", "abcdefghijklmnopqrstuvwxyz"), static_cast<uint64_t>(1) << 32);
+		SetWeights(tag->getString("uppercase", "ABCDEFGHIJKLMNOPQRSTUVWXYZ"), (static_cast<uint64_t>(1) << 32) | 1);
 	}
 
 	ModResult OnUserPreMessage(User* user, void* dest, int target_type, std::string& text, char, CUList&)
@@ -249,21 +271,14 @@ class ModuleAntiCaps : public Module
 
 		// If the message is shorter than the minimum length then
 		// we don't need to do anything else.
-		size_t length = std::distance(text_begin, text_end);
-		if (length < config->minlen)
+		if (static_cast<size_t>(std::distance(text_begin, text_end)) < config->minlen)
 			return MOD_RES_PASSTHRU;
 
 		// Count the characters to see how many upper case and
-		// ignored (non upper or lower) characters there are.
-		size_t upper = 0;
-		for (std::string::const_iterator iter = text_begin; iter != text_end; ++iter)
-		{
-			unsigned char chr = static_cast<unsigned char>(*iter);
-			if (uppercase.test(chr))
-				upper += 1;
-			else if (!lowercase.test(chr))
-				length -= 1;
-		}
+		// how many letters (upper or lower case) there are.
+		const uint64_t counts = CountCase(text_begin, text_end);
+		const size_t upper = static_cast<uint32_t>(counts);
+		const size_t length = static_cast<size_t>(counts >> 32);
 
 		// If the message was entirely symbols then the message
 		// can't contain any upper case letters.
@@ -16,9 +16,13 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
-#include <fstream>
+#include <crypt.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "inspircd.h"
 #include "hash.h"
+#include "threadengine.h"
 
 /* $ModAuthor: Collabora Ltd */
 /* $ModAuthorMail: vincent@collabora.co.uk */
@@ -26,30 +30,238 @@
 /* $ModDesc: Allow/Deny connections based upon an apache auth file */
 /* $LinkerFlags: -lcrypt */
 
+class ModuleApacheAuth;
+
+struct HashedPassword {
+	std::string algorithm;
+	std::string salt;
+	std::string hash;
+	std::string hashed;
+};
+
+/** An open addressing hash table of logins, sized when the auth file is
+ * loaded so that it never needs to grow.
+ */
+class LoginTable
+{
+	struct Slot {
+		std::string login;
+		HashedPassword password;
+		bool used;
+
+		Slot() : used(false) { }
+	};
+
+	std::vector<Slot> slots;
+	size_t count;
+
+	static size_t Hash(const char* data, size_t len)
+	{
+		// FNV-1a
+		size_t hash = 2166136261U;
+		for (size_t i = 0; i < len; ++i)
+			hash = (hash ^ static_cast<unsigned char>(data[i])) * 16777619U;
+		return hash;
+	}
+
+	size_t FindSlot(const char* login, size_t len) const
+	{
+		const size_t mask = slots.size() - 1;
+		size_t pos = Hash(login, len) & mask;
+		while (slots[pos].used && (slots[pos].login.length() != len || slots[pos].login.compare(0, len, login, len)))
+			pos = (pos + 1) & mask;
+		return pos;
+	}
+
+ public:
+	LoginTable() : count(0) { }
+
+	// Prepares the table for up to the specified number of logins.
+	void Reserve(size_t logins)
+	{
+		size_t size = 16;
+		while (size < logins * 2)
+			size <<= 1;
+		slots.assign(size, Slot());
+		count = 0;
+	}
+
+	bool Contains(const char* login, size_t len) const
+	{
+		return !slots.empty() && slots[FindSlot(login, len)].used;
+	}
+
+	void Insert(const char* login, size_t len, const HashedPassword& password)
+	{
+		Slot& slot = slots[FindSlot(login, len)];
+		if (slot.used)
+			return;
+
+		slot.login.assign(login, len);
+		slot.password = password;
+		slot.used = true;
+		count++;
+	}
+
+	const HashedPassword* Find(const std::string& login) const
+	{
+		if (slots.empty())
+			return NULL;
+
+		const Slot& slot = slots[FindSlot(login.data(), login.length())];
+		return slot.used ? &slot.password : NULL;
+	}
+
+	void Clear()
+	{
+		std::vector<Slot>().swap(slots);
+		count = 0;
+	}
+
+	void Swap(LoginTable& other)
+	{
+		slots.swap(other.slots);
+		std::swap(count, other.count);
+	}
+
+	size_t Size() const { return count; }
+};
+
+// A password which is waiting to be checked by a worker thread.
+struct CryptJob
+{
+	std::string uuid;
+	std::string password;
+	std::string salt;
+	std::string expected;
+	std::string cachekey;
+	bool valid;
+};
+
+/** Runs crypt() away from the main thread as strong hashes can take tens
+ * of milliseconds per check.
+ */
+class CryptWorker : public SocketThread
+{
+	ModuleApacheAuth* mod;
+	std::deque<CryptJob> queue;
+	std::deque<CryptJob> finished;
+	bool started;
+
+ public:
+	CryptWorker(ModuleApacheAuth* Mod)
+		: mod(Mod)
+		, started(false)
+	{
+	}
+
+	~CryptWorker()
+	{
+		if (started)
+		{
+			this->LockQueue();
+			this->SetExitFlag();
+			this->UnlockQueueWakeup();
+			this->join();
+		}
+	}
+
+	void Start()
+	{
+		ServerInstance->Threads->Start(this);
+		started = true;
+	}
+
+	void Queue(const CryptJob& job)
+	{
+		this->LockQueue();
+		queue.push_back(job);
+		this->UnlockQueueWakeup();
+	}
+
+	void Run()
+	{
+		struct crypt_data* data = new struct crypt_data;
+		data->initialized = 0;
+
+		this->LockQueue();
+		while (!this->GetExitFlag())
+		{
+			if (queue.empty())
+			{
+				this->WaitForQueue();
+				continue;
+			}
+
+			CryptJob job = queue.front();
+			queue.pop_front();
+			this->UnlockQueue();
+
+			const char* hashed = crypt_r(job.password.c_str(), job.salt.c_str(), data);
+			job.valid = hashed && job.expected == hashed;
+
+			this->LockQueue();
+			finished.push_back(job);
+			this->NotifyParent();
+		}
+		this->UnlockQueue();
+		delete data;
+	}
+
+	void OnNotify();
+};
+
 class ModuleApacheAuth : public Module
 {
 	std::string authfile;
 	std::string killreason;
 	std::string allowpattern;
 	bool verbose;
-	struct HashedPassword {
-		std::string algorithm;
-		std::string salt;
-		std::string hash;
-		std::string hashed;
+	LoginTable logins;
+
+	// The auth file which was last loaded, used to skip reloading it when it hasn't changed.
+	std::string loadedfile;
+	struct stat loadedstat;
+
+	// Users whose password is being checked.
+	LocalIntExt pending;
+
+	// The threads which check passwords.
+	std::vector<CryptWorker*> workers;
+	size_t nextworker;
+
+	// Recent results keyed on the login, the stored hash and a digest of the password.
+	struct CachedResult
+	{
+		bool valid;
+		time_t expires;
 	};
-	std::map<std::string, HashedPassword> logins;
+	typedef std::map<std::string, CachedResult> ResultCache;
+	ResultCache cache;
+	unsigned long cachetime;
+	dynamic_reference<HashProvider> sha256;
 
  public:
 	ModuleApacheAuth()
+		: pending("apacheauth_pending", this)
+		, nextworker(0)
+		, cachetime(0)
+		, sha256(this, "hash/sha256")
+	{
+	}
+
+	~ModuleApacheAuth()
 	{
+		for (std::vector<CryptWorker*>::iterator iter = workers.begin(); iter != workers.end(); ++iter)
+			delete *iter;
 	}
 
 	void init()
 	{
 		OnRehash(NULL);
-		Implementation eventlist[] = { I_OnRehash, I_OnUserRegister };
-		ServerInstance->Modules->Attach(eventlist, this, 2);
+		ServerInstance->Modules->AddService(pending);
+		Implementation eventlist[] = { I_OnRehash, I_OnUserRegister, I_OnCheckReady, I_OnBackgroundTimer };
+		ServerInstance->Modules->Attach(eventlist, this, sizeof(eventlist)/sizeof(Implementation));
 	}
 
 	void OnRehash(User* user)
@@ -59,7 +271,23 @@ class ModuleApacheAuth : public Module
 		killreason = conf->getString("killreason");
 		allowpattern = conf->getString("allowpattern");
 		verbose = conf->getBool("verbose");
+		cachetime = ServerInstance->Duration(conf->getString("cachetime", "60"));
 		LoadAuthFile();
+
+		// The number of threads can only be changed by reloading the module.
+		if (workers.empty())
+		{
+			long threads = conf->getInt("threads", 2);
+			if (threads < 1 || threads > 32)
+				threads = 2;
+
+			for (long i = 0; i < threads; ++i)
+			{
+				CryptWorker* worker = new CryptWorker(this);
+				workers.push_back(worker);
+				worker->Start();
+			}
+		}
 	}
 
 	bool SplitRecord(const std::string &record, std::string &record_algorithm, std::string &record_salt, std::string &record_hash)
@@ -79,48 +307,90 @@ class ModuleApacheAuth : public Module
 
 	void LoadAuthFile()
 	{
-		int line=0;
-		std::ifstream f;
+		int fd = open(authfile.c_str(), O_RDONLY);
+		struct stat sb;
+		if (fd < 0 || fstat(fd, &sb) < 0) {
+			if (fd >= 0)
+				close(fd);
+			logins.Clear();
+			loadedfile.clear();
+			ServerInstance->SNO->WriteGlobalSno('a', "Auth file %s failed to open, no connections will be allowed", authfile.c_str());
+			return;
+		}
 
-		logins.clear();
-		ServerInstance->SNO->WriteGlobalSno('a', "Loading auth file %s",authfile.c_str());
-		f.open(authfile.c_str(), std::ifstream::in);
-		if (!f.good()) {
-			ServerInstance->SNO->WriteGlobalSno('a', "Auth file failed to open, no connections will be allowed");
+		// Skip the reload if the file is the same one that was loaded last time.
+		if (loadedfile == authfile && sb.st_dev == loadedstat.st_dev && sb.st_ino == loadedstat.st_ino
+			&& sb.st_mtime == loadedstat.st_mtime && sb.st_size == loadedstat.st_size) {
+			close(fd);
 			return;
 		}
-		std::string s;
-		while (std::getline(f, s)) {
-			++line;
-			size_t pos = s.find(':');
-			if (pos == std::string::npos) {
-				ServerInstance->SNO->WriteGlobalSno('a', "Syntax error at line %d", line);
-				continue;
+
+		ServerInstance->SNO->WriteGlobalSno('a', "Loading auth file %s", authfile.c_str());
+		LoginTable newlogins;
+		const char* data = NULL;
+		if (sb.st_size > 0) {
+			void* map = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+			if (map == MAP_FAILED) {
+				close(fd);
+				ServerInstance->SNO->WriteGlobalSno('a', "Auth file %s could not be read, keeping the previous logins", authfile.c_str());
+				return;
 			}
-			std::string login = s.substr(0, pos);
-			std::string hashed = s.substr(pos + 1);
-			if (verbose) {
-				ServerInstance->SNO->WriteGlobalSno('a', "Found login %s, hash %s", login.c_str(), hashed.c_str());
+			data = static_cast<const char*>(map);
+		}
+		close(fd);
+
+		const char* end = data + sb.st_size;
+		newlogins.Reserve(std::count(data, end, '\n') + 1);
+
+		unsigned int errors = 0, duplicates = 0, unsupported = 0;
+		for (const char* line = data; line < end; ) {
+			const char* eol = static_cast<const char*>(memchr(line, '\n', end - line));
+			if (!eol)
+				eol = end;
+
+			const char* colon = static_cast<const char*>(memchr(line, ':', eol - line));
+			if (!colon) {
+				if (eol > line)
+					errors++;
+				line = eol + 1;
+				continue;
 			}
-			if (logins.find(login) != logins.end()) {
-				ServerInstance->SNO->WriteGlobalSno ('a', "Warning: ignoring duplicate login: %s", login.c_str());
+
+			const size_t loginlen = colon - line;
+			if (verbose)
+				ServerInstance->Logs->Log("m_apacheauth", DEBUG, "Found login %s", std::string(line, loginlen).c_str());
+
+			if (newlogins.Contains(line, loginlen)) {
+				duplicates++;
 			}
 			else {
 				HashedPassword p;
-				p.hashed = hashed;
-				if (!SplitRecord(hashed, p.algorithm, p.salt, p.hash)) {
-					ServerInstance->SNO->WriteGlobalSno ('a', "Warning: ignoring malformed line: %s", hashed.c_str());
+				p.hashed.assign(colon + 1, eol);
+				if (!SplitRecord(p.hashed, p.algorithm, p.salt, p.hash)) {
+					errors++;
 				}
 				else if (p.algorithm != "1") { // MD5
-					ServerInstance->SNO->WriteGlobalSno ('a', "Warning: ignoring unsupported algorithm: %s", p.algorithm.c_str());
+					unsupported++;
 				}
 				else {
-					logins.insert(std::make_pair(login, p));
+					newlogins.Insert(line, loginlen, p);
 				}
 			}
+			line = eol + 1;
 		}
-		ServerInstance->SNO->WriteGlobalSno ('a', "Done C++ loading auth file, %u users", (unsigned)logins.size());
-		f.close();
+
+		if (data)
+			munmap(const_cast<char*>(data), sb.st_size);
+
+		if (errors || duplicates || unsupported)
+			ServerInstance->SNO->WriteGlobalSno('a', "Warning: ignored %u malformed lines, %u duplicate logins and %u unsupported algorithms",
+				errors, duplicates, unsupported);
+
+		// Only replace the logins once the whole file has been parsed.
+		logins.Swap(newlogins);
+		loadedfile = authfile;
+		loadedstat = sb;
+		ServerInstance->SNO->WriteGlobalSno ('a', "Done C++ loading auth file, %u users", (unsigned)logins.Size());
 	}
 
 	ModResult OnUserRegister(LocalUser* user)
@@ -133,26 +403,84 @@ class ModuleApacheAuth : public Module
 		if (!allowpattern.empty() && InspIRCd::Match(user->ident,allowpattern))
 			return MOD_RES_PASSTHRU;
 
-		std::map<std::string, HashedPassword>::const_iterator i = logins.find(user->ident);
-		if (i == logins.end()) {
+		const HashedPassword* i = logins.Find(user->ident);
+		if (!i) {
 			ServerInstance->SNO->WriteGlobalSno('a', "Denying connection from %s!%s@%s (login not found)",
 				user->nick.c_str(), user->ident.c_str(), user->host.c_str());
 			ServerInstance->Users->QuitUser(user, killreason);
 			return MOD_RES_PASSTHRU;
 		}
 
-		const HashedPassword &p = i->second;
-		std::string algorithm_and_salt = std::string("$") + p.algorithm + std::string("$") + p.salt;
-		std::string hashed = crypt(user->password.c_str(),algorithm_and_salt.c_str());
-		if (hashed != p.hashed) {
+		const HashedPassword &p = *i;
+		CryptJob job;
+		job.uuid = user->uuid;
+		job.password = user->password;
+		job.salt = std::string("$") + p.algorithm + std::string("$") + p.salt;
+		job.expected = p.hashed;
+		job.valid = false;
+
+		// Reconnecting users with the same password don't need to be checked again.
+		if (sha256 && cachetime)
+		{
+			job.cachekey = user->ident + '\0' + p.hashed + '\0' + sha256->sum(user->password);
+			ResultCache::const_iterator cached = cache.find(job.cachekey);
+			if (cached != cache.end() && cached->second.expires > ServerInstance->Time())
+			{
+				job.valid = cached->second.valid;
+				OnResult(user, job);
+				return MOD_RES_PASSTHRU;
+			}
+		}
+
+		pending.set(user, 1);
+		workers[nextworker++ % workers.size()]->Queue(job);
+		return MOD_RES_PASSTHRU;
+	}
+
+	void OnResult(LocalUser* user, const CryptJob& job)
+	{
+		if (!job.valid) {
 			ServerInstance->SNO->WriteGlobalSno('a', "Forbiding connection from %s!%s@%s (invalid password)",
 				user->nick.c_str(), user->ident.c_str(), user->host.c_str());
 			ServerInstance->Users->QuitUser(user, killreason);
-			return MOD_RES_PASSTHRU;
+			return;
 		}
 		ServerInstance->SNO->WriteGlobalSno('a', "Granting access to connection from %s!%s@%s",
 				user->nick.c_str(), user->ident.c_str(), user->host.c_str());
-		return MOD_RES_PASSTHRU;
+	}
+
+	// Called on the main thread when a worker has checked a password.
+	void OnCryptDone(const CryptJob& job)
+	{
+		if (!job.cachekey.empty())
+		{
+			CachedResult& result = cache[job.cachekey];
+			result.valid = job.valid;
+			result.expires = ServerInstance->Time() + cachetime;
+		}
+
+		LocalUser* user = IS_LOCAL(ServerInstance->FindUUID(job.uuid));
+		if (!user || user->quitting)
+			return;
+
+		pending.set(user, 0);
+		OnResult(user, job);
+	}
+
+	ModResult OnCheckReady(LocalUser* user)
+	{
+		return pending.get(user) ? MOD_RES_DENY : MOD_RES_PASSTHRU;
+	}
+
+	void OnBackgroundTimer(time_t now)
+	{
+		for (ResultCache::iterator iter = cache.begin(); iter != cache.end(); )
+		{
+			if (iter->second.expires <= now)
+				cache.erase(iter++);
+			else
+				++iter;
+		}
 	}
 
 	Version GetVersion()
@@ -161,5 +489,16 @@ class ModuleApacheAuth : public Module
 	}
 };
 
+void CryptWorker::OnNotify()
+{
+	std::deque<CryptJob> done;
+	this->LockQueue();
+	done.swap(finished);
+	this->UnlockQueue();
+
+	for (std::deque<CryptJob>::const_iterator iter = done.begin(); iter != done.end(); ++iter)
+		mod->OnCryptDone(*iter);
+}
+
 MODULE_INIT(ModuleApacheAuth)
 
@@ -20,7 +20,7 @@
 /* $ModAuthorMail: shutter@canternet.org */
 /* $ModDesc: Enables two factor authentification for oper blocks using authy */
 /* $ModDepends: core 2.0 */
-/* $ModConfig: <authy apikey="" ssl="" graceful="false"> */
+/* $ModConfig: <authy apikey="" ssl="" graceful="false" timeout="10" connections="4"> */
 
 /*
 	Note:
@@ -30,6 +30,10 @@
 
 	If graceful is set to true, the opers will still be allowed to log in, in case
 	of failure to communicate with Authy.com
+
+	Verifications are spread over a pool of up to <connections> keep-alive
+	connections to the API. If Authy has not answered within <timeout> seconds
+	the attempt is treated as a failure to communicate with Authy.com.
 */
 
 #include "inspircd.h"
@@ -50,148 +54,459 @@ class ResolveAPI : public Resolver
 };
 
 static bool auth_req_active = false;
-class AuthRequest : public BufferedSocket
+
+struct AuthData
 {
- public:
-	struct AuthData
-	{
-		const std::string uuid;
-		const std::string username;
-		const std::string password;
-		const std::string authy_id;
-		const std::string token;
-		AuthData(User* u, const std::string& unm, const std::string& pwd, const std::string& aid, const std::string& tok)
-			: uuid(u->uuid), username(unm), password(pwd), authy_id(aid), token(tok)
-		{
-		}
-	};
+	const std::string uuid;
+	const std::string username;
+	const std::string password;
+	const std::string authy_id;
+	const std::string token;
+	time_t deadline;
+	bool retried;
+	AuthData(User* u, const std::string& unm, const std::string& pwd, const std::string& aid, const std::string& tok, time_t dl)
+		: uuid(u->uuid), username(unm), password(pwd), authy_id(aid), token(tok), deadline(dl), retried(false)
+	{
+	}
+};
 
- private:
-	bool graceful_failure;
-	const std::string api_key;
-	AuthData AData;
-	std::string ip;
+class AuthyConnection;
+
+/** Keeps a small number of keep-alive connections to the Authy API open and
+ * spreads the pending verifications over them.
+ */
+class AuthyPool
+{
+	std::deque<AuthData*> queue;
+	std::vector<AuthyConnection*> conns;
+	bool dispatching;
 
-	void ForwardAuthRequest()
+	void Finish(AuthData* data, bool ok)
 	{
-		User* u = ServerInstance->FindUUID(AData.uuid);
+		User* u = ServerInstance->FindUUID(data->uuid);
 		LocalUser* user = (u ? IS_LOCAL(u) : NULL);
 		if (!user)
+		{
+			delete data;
 			return;
+		}
 
-		auth_req_active = true;
-		std::string line = "OPER " + AData.username + " :" + AData.password;
-		ServerInstance->Parser->ProcessBuffer(line, user);
-		auth_req_active = false;
+		if (ok)
+		{
+			auth_req_active = true;
+			std::string line = "OPER " + data->username + " :" + data->password;
+			ServerInstance->Parser->ProcessBuffer(line, user);
+			auth_req_active = false;
+		}
+		else
+		{
+			user->WriteNumeric(491, "%s :Invalid oper credentials", user->nick.c_str());
+			user->CommandFloodPenalty += 10000;
+		}
+		delete data;
 	}
 
-	void Failure()
+ public:
+	std::string ip;
+	std::string api_key;
+	bool graceful;
+	unsigned int timeout;
+	unsigned int maxconns;
+	dynamic_reference<ServiceProvider>& SSLProv;
+
+	AuthyPool(dynamic_reference<ServiceProvider>& prov) : dispatching(false), graceful(false), timeout(10), maxconns(4), SSLProv(prov)
 	{
-		User* u = ServerInstance->FindUUID(AData.uuid);
-		LocalUser* user = (u ? IS_LOCAL(u) : NULL);
-		if (!user)
-			return;
+	}
+
+	~AuthyPool();
 
-		user->WriteNumeric(491, "%s :Invalid oper credentials", user->nick.c_str());
-		user->CommandFloodPenalty += 10000;
+	void Submit(AuthData* data)
+	{
+		queue.push_back(data);
+		Dispatch();
+	}
+
+	void Retry(AuthData* data)
+	{
+		data->retried = true;
+		queue.push_front(data);
+	}
+
+	// Hands queued requests to idle connections, opening new ones up to the limit.
+	// Nothing is sent until the address of the API has been resolved.
+	void Dispatch();
+
+	void Remove(AuthyConnection* conn)
+	{
+		std::vector<AuthyConnection*>::iterator it = std::find(conns.begin(), conns.end(), conn);
+		if (it != conns.end())
+			conns.erase(it);
+	}
+
+	// Closes the idle connections so changes to the settings take effect.
+	void CloseIdle();
+
+	void OnResponse(AuthData* data, unsigned int code, const std::string& status)
+	{
+		// 200 always means the auth is OK as long as force=true
+		if (code == 200)
+			Finish(data, true);
+		else if (code == 401)
+			Finish(data, false);
+		else
+		{
+			ServerInstance->SNO->WriteToSnoMask('a', "\2WARNING\2: Got unknown response code %s from Authy on OPER attempt from %s - %s",
+				status.c_str(), data->username.c_str(), (graceful ? "pretending OTP OK" : "rejected OPER attempt"));
+			Finish(data, graceful);
+		}
+	}
+
+	void OnFailure(AuthData* data, const char* reason)
+	{
+		ServerInstance->SNO->WriteToSnoMask('a', "\2WARNING\2: %s to verify OPER attempt from %s - %s",
+			reason, data->username.c_str(), (graceful ? "pretending OTP OK" : "rejected OPER attempt"));
+		Finish(data, graceful);
+	}
+
+	// Fails the requests which have passed their deadline.
+	void Tick(time_t now);
+};
+
+class AuthyConnection : public BufferedSocket
+{
+	enum ParseState
+	{
+		PS_STATUS,
+		PS_HEADERS,
+		PS_BODY
+	};
+
+	AuthyPool& pool;
+	AuthData* current;
+	ParseState state;
+	std::string status;
+	unsigned int code;
+	size_t bodyleft;
+	bool keepalive;
+	bool connected;
+	bool dead;
+
+	void Complete()
+	{
+		AuthData* data = current;
+		current = NULL;
+		lastused = ServerInstance->Time();
+		if (keepalive)
+			reused = true;
+		else
+			Shutdown();
+
+		pool.OnResponse(data, code, status);
+		if (keepalive)
+			pool.Dispatch();
 	}
 
  public:
-	AuthRequest(bool grace, dynamic_reference<ServiceProvider>& prov, const std::string& ipa, const std::string& apk, const AuthData& ad) : BufferedSocket(-1), graceful_failure(grace), api_key(apk), AData(ad), ip(ipa)
+	time_t lastused;
+	bool reused;
+
+	AuthyConnection(AuthyPool& p, AuthData* data)
+		: BufferedSocket(-1), pool(p), current(data), state(PS_STATUS), code(0), bodyleft(0), keepalive(true)
+		, connected(false), dead(false), lastused(ServerInstance->Time()), reused(false)
+	{
+		if (pool.SSLProv)
+			AddIOHook(pool.SSLProv->creator);
+	}
+
+	// This may call OnError straight away so the pool must already know about us.
+	void Connect()
+	{
+		DoConnect(pool.ip, (pool.SSLProv ? 443 : 80), pool.timeout, "");
+	}
+
+	bool IsIdle() const
 	{
-		if (prov)
-			AddIOHook(prov->creator);
+		return connected && !current && !dead;
+	}
 
-		DoConnect(ip, (prov ? 443 : 80), 10, "");
+	AuthData* GetCurrent() const
+	{
+		return current;
+	}
+
+	void Send(AuthData* data)
+	{
+		current = data;
+		state = PS_STATUS;
+		bodyleft = 0;
+		keepalive = true;
+
+		const std::string req_url = "/protected/json/verify/" + data->token + "/" + data->authy_id + "?api_key=" + pool.api_key + "&force=true";
+		WriteData("GET " + req_url + " HTTP/1.1\r\nHost: api.authy.com\r\nConnection: keep-alive\r\n\r\n");
 	}
 
 	void OnConnected()
 	{
-		const std::string req_url = "/protected/json/verify/" + AData.token + "/" + AData.authy_id + "?api_key=" + api_key + "&force=true";
-		WriteData("GET " + req_url + " HTTP/1.1\r\nHost: api.authy.com" + "\r\n\r\n");
+		connected = true;
+		if (current)
+			Send(current);
+		else
+			pool.Dispatch();
 	}
 
 	void OnDataReady()
 	{
-		// We only need the response code
 		std::string line;
-		GetNextLine(line);
+		while (current && state != PS_BODY && GetNextLine(line))
+		{
+			if (!line.empty() && line[line.length() - 1] == '\r')
+				line.erase(line.length() - 1);
 
-		// 200 always means the auth is OK as long as force=true
-		if (line == "HTTP/1.1 200 OK\r")
-			ForwardAuthRequest();
-		else if (line == "HTTP/1.1 401 Unauthorized\r")
-			Failure();
-		else
+			if (state == PS_STATUS)
+			{
+				status = line;
+				std::string::size_type sp = line.find(' ');
+				code = (sp == std::string::npos ? 0 : atoi(line.c_str() + sp + 1));
+				keepalive = (line.compare(0, 8, "HTTP/1.1") == 0);
+				state = PS_HEADERS;
+			}
+			else if (line.empty())
+			{
+				state = PS_BODY;
+			}
+			else
+			{
+				std::string::size_type colon = line.find(':');
+				if (colon == std::string::npos)
+					continue;
+
+				const std::string name = line.substr(0, colon);
+				std::string value = line.substr(colon + 1);
+				value.erase(0, value.find_first_not_of(' '));
+				if (irc::equals(name, "Content-Length"))
+					bodyleft = atol(value.c_str());
+				else if (irc::equals(name, "Connection") && irc::equals(value, "close"))
+					keepalive = false;
+				else if (irc::equals(name, "Transfer-Encoding"))
+					keepalive = false; // We only want the status so don't bother decoding chunks.
+			}
+		}
+
+		if (!current || state != PS_BODY)
+			return;
+
+		// The body has to be skipped to find the start of the next response.
+		if (keepalive)
 		{
-			ServerInstance->SNO->WriteToSnoMask('a', "\2WARNING\2: Got unknown response code %s from Authy on OPER attempt from %s - %s",
-				line.c_str(), AData.username.c_str(), (graceful_failure ? "pretending OTP OK" : "rejected OPER attempt"));
-			if (graceful_failure)
-				ForwardAuthRequest();
+			size_t len = std::min(bodyleft, recvq.length());
+			recvq.erase(0, len);
+			bodyleft -= len;
+			if (bodyleft)
+				return;
+		}
+		Complete();
+	}
+
+	void OnError(BufferedSocketError e)
+	{
+		if (dead)
+			return;
+
+		AuthData* data = current;
+		current = NULL;
+		Shutdown();
+
+		if (data)
+		{
+			// A kept alive connection may have been closed by the other end in the meantime.
+			if (reused && !data->retried)
+				pool.Retry(data);
 			else
-				Failure();
+				pool.OnFailure(data, "Could not connect to Authy");
 		}
+		pool.Dispatch();
+	}
+
+	void Shutdown()
+	{
+		if (dead)
+			return;
+
+		dead = true;
+		pool.Remove(this);
 		Close();
 		ServerInstance->GlobalCulls.AddItem(this);
 	}
 
-	void OnError(BufferedSocketError e)
+	void TimedOut()
 	{
-		ServerInstance->SNO->WriteToSnoMask('a', "\2WARNING\2: Could not connect to Authy to verify OPER attemt from %s - %s",
-			AData.username.c_str(), (graceful_failure ? "pretending OTP OK" : "rejected OPER attempt"));
-		if (graceful_failure)
-			ForwardAuthRequest();
+		AuthData* data = current;
+		current = NULL;
+		Shutdown();
+		if (data)
+			pool.OnFailure(data, "Timed out waiting for Authy");
+	}
+};
+
+AuthyPool::~AuthyPool()
+{
+	while (!conns.empty())
+	{
+		AuthyConnection* conn = conns.back();
+		delete conn->GetCurrent();
+		conn->Shutdown();
+	}
+
+	for (std::deque<AuthData*>::iterator i = queue.begin(); i != queue.end(); ++i)
+		delete *i;
+}
+
+void AuthyPool::Dispatch()
+{
+	// A connection failing straight away calls back into here; the outer call
+	// carries on with the rest of the queue.
+	if (dispatching || ip.empty())
+		return;
+
+	dispatching = true;
+	while (!queue.empty())
+	{
+		AuthyConnection* idle = NULL;
+		for (std::vector<AuthyConnection*>::iterator i = conns.begin(); i != conns.end() && !idle; ++i)
+		{
+			if ((*i)->IsIdle())
+				idle = *i;
+		}
+
+		if (idle)
+		{
+			idle->Send(queue.front());
+			queue.pop_front();
+		}
+		else if (conns.size() < maxconns)
+		{
+			AuthData* data = queue.front();
+			queue.pop_front();
+			AuthyConnection* conn = new AuthyConnection(*this, data);
+			conns.push_back(conn);
+			conn->Connect();
+		}
 		else
-			Failure();
+			break;
+	}
+	dispatching = false;
+}
 
-		Close();
-		ServerInstance->GlobalCulls.AddItem(this);
+void AuthyPool::CloseIdle()
+{
+	std::vector<AuthyConnection*> idle;
+	for (std::vector<AuthyConnection*>::iterator i = conns.begin(); i != conns.end(); ++i)
+	{
+		if ((*i)->IsIdle())
+			idle.push_back(*i);
+	}
+
+	for (std::vector<AuthyConnection*>::iterator i = idle.begin(); i != idle.end(); ++i)
+		(*i)->Shutdown();
+}
+
+void AuthyPool::Tick(time_t now)
+{
+	// Copy the list as failing a request may close its connection.
+	std::vector<AuthyConnection*> list(conns);
+	for (std::vector<AuthyConnection*>::iterator i = list.begin(); i != list.end(); ++i)
+	{
+		AuthyConnection* conn = *i;
+		if (conn->GetCurrent() && conn->GetCurrent()->deadline <= now)
+			conn->TimedOut();
+		else if (conn->IsIdle() && conn->lastused + 60 <= now)
+			conn->Shutdown();
+	}
+
+	std::deque<AuthData*> expired;
+	for (std::deque<AuthData*>::iterator i = queue.begin(); i != queue.end(); )
+	{
+		if ((*i)->deadline <= now)
+		{
+			expired.push_back(*i);
+			i = queue.erase(i);
+		}
+		else
+			++i;
+	}
+
+	for (std::deque<AuthData*>::iterator i = expired.begin(); i != expired.end(); ++i)
+		OnFailure(*i, "Timed out waiting for a connection to Authy");
+
+	Dispatch();
+}
+
+class AuthyTimer : public Timer
+{
+	AuthyPool& pool;
+
+ public:
+	AuthyTimer(AuthyPool& p) : Timer(1, ServerInstance->Time(), true), pool(p)
+	{
+	}
+
+	void Tick(time_t now)
+	{
+		pool.Tick(now);
 	}
 };
 
 class ModuleAuthy : public Module
 {
-	std::string ip;
-	std::string api_key;
-	bool graceful;
 	dynamic_reference<ServiceProvider> SSLProv;
+	AuthyPool pool;
+	AuthyTimer* timer;
 
  public:
-	ModuleAuthy() : SSLProv(this, "ssl"), bghits(0)
+	ModuleAuthy() : SSLProv(this, "ssl"), pool(SSLProv), timer(NULL), bghits(0)
 	{
 	}
 
+	~ModuleAuthy()
+	{
+		if (timer)
+			ServerInstance->Timers->DelTimer(timer);
+	}
+
 	void init()
 	{
 		Implementation eventlist[] = { I_OnPreCommand, I_OnRehash, I_OnBackgroundTimer };
 		ServerInstance->Modules->Attach(eventlist, this, sizeof(eventlist) / sizeof(Implementation));
 		OnRehash(NULL);
+		ResolveAPIAddress();
+		timer = new AuthyTimer(pool);
+		ServerInstance->Timers->AddTimer(timer);
 	}
 
 	void OnRehash(User* user)
 	{
 		ConfigTag* tag = ServerInstance->Config->ConfValue("authy");
-		graceful = tag->getBool("graceful", false);
-		api_key = tag->getString("apikey");
+		pool.graceful = tag->getBool("graceful", false);
+		pool.api_key = tag->getString("apikey");
+		pool.timeout = std::max<int>(1, tag->getInt("timeout", 10));
+		pool.maxconns = std::max<int>(1, tag->getInt("connections", 4));
 
 		std::string ssl = tag->getString("ssl", "ssl");
 		SSLProv.SetProvider((!ssl.empty() && ssl != "ssl") ? "ssl/" + ssl : ssl);
 		if (!SSLProv)
 			ServerInstance->SNO->WriteToSnoMask('a', "\2WARNING\2: m_authy was told to use " + ssl
 				+ " for encryption, but the provider is not loaded. Falling back to plain text");
+
+		// New requests should use the new settings.
+		pool.CloseIdle();
 	}
 
-	// In case the location for the API changes
-	size_t bghits;
-	void OnBackgroundTimer(time_t curtime)
+	void ResolveAPIAddress()
 	{
-		if (bghits++ % 120)
-			return;
-
 		try
 		{
 			bool cached;
-			ResolveAPI* res = new ResolveAPI(this, ip, cached);
+			ResolveAPI* res = new ResolveAPI(this, pool.ip, cached);
 			ServerInstance->AddResolver(res, cached);
 		}
 		catch (...)
@@ -199,6 +514,16 @@ class ModuleAuthy : public Module
 		}
 	}
 
+	// In case the location for the API changes
+	size_t bghits;
+	void OnBackgroundTimer(time_t curtime)
+	{
+		if (++bghits % 120)
+			return;
+
+		ResolveAPIAddress();
+	}
+
 	ModResult OnPreCommand(std::string &command, std::vector<std::string> &parameters, LocalUser *user, bool validated, const std::string &original_line)
 	{
 		if (auth_req_active)
@@ -226,7 +551,7 @@ class ModuleAuthy : public Module
 			std::string otp = parameters[1].substr(pos + 1);
 			parameters[1].erase(pos);
 
-			new AuthRequest(graceful, SSLProv, ip, api_key, AuthRequest::AuthData(user, parameters[0], parameters[1], authyid, otp));
+			pool.Submit(new AuthData(user, parameters[0], parameters[1], authyid, otp, ServerInstance->Time() + pool.timeout));
 
 			return MOD_RES_DENY;
 		}
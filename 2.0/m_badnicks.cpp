@@ -17,12 +17,74 @@
 
 #include "inspircd.h"
 
+/** The badnicks of a connect class, split at rehash into names which can be
+ * looked up directly and the wildcard patterns which still have to be matched.
+ */
+struct BadNickList
+{
+	struct Glob
+	{
+		std::string pattern;
+		size_t minlength;
+		Glob(const std::string& p) : pattern(p), minlength(p.length() - std::count(p.begin(), p.end(), '*')) { }
+	};
+
+	std::set<irc::string> literals;
+	std::vector<Glob> globs;
+
+	BadNickList(const std::string& badnicks)
+	{
+		irc::spacesepstream StreamReader(badnicks);
+		std::string badnick;
+		while (StreamReader.GetToken(badnick))
+		{
+			if (badnick.find_first_of("*?") == std::string::npos)
+				literals.insert(badnick.c_str());
+			else
+				globs.push_back(Glob(badnick));
+		}
+	}
+
+	bool Matches(const std::string& nick) const
+	{
+		if (literals.find(nick.c_str()) != literals.end())
+			return true;
+
+		for (std::vector<Glob>::const_iterator i = globs.begin(); i != globs.end(); ++i)
+		{
+			// Every character other than * has to match one in the nick.
+			if (nick.length() >= i->minlength && InspIRCd::Match(nick, i->pattern))
+				return true;
+		}
+		return false;
+	}
+};
+
 class ModuleBadnicks : public Module
 {
+	typedef std::map<ConnectClass*, BadNickList> ClassLists;
+	ClassLists lists;
+
+	const BadNickList& GetList(ConnectClass* cls)
+	{
+		ClassLists::iterator iter = lists.find(cls);
+		if (iter == lists.end())
+			iter = lists.insert(std::make_pair(cls, BadNickList(cls->config->getString("badnicks")))).first;
+		return iter->second;
+	}
+
 public:
 	void init()
 	{
-		ServerInstance->Modules->Attach(I_OnUserPreNick, this);
+		Implementation eventlist[] = { I_OnUserPreNick, I_OnRehash };
+		ServerInstance->Modules->Attach(eventlist, this, sizeof(eventlist)/sizeof(Implementation));
+	}
+
+	void OnRehash(User*)
+	{
+		// Rehashing updates the settings of existing classes in place, so
+		// the lists are built again as they are used.
+		lists.clear();
 	}
 
 	ModResult OnUserPreNick(User* olduser, const std::string& newnick)
@@ -31,20 +93,10 @@ public:
 		if (!user)
 			return MOD_RES_PASSTHRU;
 
-		ConfigTag* tag = user->MyClass->config;
-		std::string badnicks = tag->getString("badnicks");
-		if (badnicks.empty())
-			return MOD_RES_PASSTHRU;
-
-		irc::spacesepstream StreamReader(badnicks);
-		std::string badnick;
-		while (StreamReader.GetToken(badnick))
+		if (GetList(user->MyClass).Matches(newnick))
 		{
-			if (InspIRCd::Match(newnick, badnick))
-			{
-				user->WriteNumeric(432, "%s %s :This nick is prohibited for your connect class", (user->registered & REG_NICK ? user->nick.c_str() : "*"), newnick.c_str());
-				return MOD_RES_DENY;
-			}
+			user->WriteNumeric(432, "%s %s :This nick is prohibited for your connect class", (user->registered & REG_NICK ? user->nick.c_str() : "*"), newnick.c_str());
+			return MOD_RES_DENY;
 		}
 		return MOD_RES_PASSTHRU;
 	}
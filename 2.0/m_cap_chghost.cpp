@@ -37,32 +37,38 @@ class ModuleCapChghost : public Module
 		std::map<User*, bool> exceptions;
 		FOREACH_MOD(I_OnBuildNeighborList, OnBuildNeighborList(user, chans, exceptions));
 
+		// Everyone decided on by the modules and the user itself are marked so
+		// that the channel pass below skips them without another lookup.
+		already_sent_t uniq_id = ++LocalUser::already_sent_id;
+		LocalUser* source = IS_LOCAL(user);
+		if (source)
+			source->already_sent = uniq_id;
+
 		// Send it to all local users who were explicitly marked as neighbours by modules and have the required ext
 		for (std::map<User*, bool>::const_iterator i = exceptions.begin(); i != exceptions.end(); ++i)
 		{
 			LocalUser* u = IS_LOCAL(i->first);
-			if ((u) && (i->second) && (ext.get(u)))
+			if (!u || u->already_sent == uniq_id)
+				continue;
+
+			u->already_sent = uniq_id;
+			if ((i->second) && (ext.get(u)))
 				u->Write(line);
 		}
 
 		// Now consider sending it to all other users who has at least a common channel with the user
-		std::set<User*> already_sent;
 		for (UCListIter i = chans.begin(); i != chans.end(); ++i)
 		{
 			const UserMembList* userlist = (*i)->GetUsers();
 			for (UserMembList::const_iterator m = userlist->begin(); m != userlist->end(); ++m)
 			{
-				/*
-				 * Send the line if the channel member in question meets all of the following criteria:
-				 * - local
-				 * - not the user who is doing the action (i.e. whose channels we're iterating)
-				 * - has the given extension
-				 * - not on the except list built by modules
-				 * - we haven't sent the line to the member yet
-				 *
-				 */
+				// Each local member is only considered once no matter how many channels they share with the user.
 				LocalUser* member = IS_LOCAL(m->first);
-				if ((member) && (member != user) && (ext.get(member)) && (exceptions.find(member) == exceptions.end()) && (already_sent.insert(member).second))
+				if (!member || member->already_sent == uniq_id)
+					continue;
+
+				member->already_sent = uniq_id;
+				if (ext.get(member))
 					member->Write(line);
 			}
 		}
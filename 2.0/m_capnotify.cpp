@@ -24,11 +24,72 @@
 #include "inspircd.h"
 #include "m_cap.h"
 
+/** Holds the cap-notify users who have not been told about a change yet so
+ * a large server sends the lines over a few seconds instead of all at once.
+ */
+class NotifyQueue : public Timer
+{
+ private:
+	struct PendingNotify
+	{
+		std::string uuid;
+		std::string add;
+		std::string del;
+		PendingNotify(LocalUser* u, const std::string& a, const std::string& d) : uuid(u->uuid), add(a), del(d) { }
+	};
+
+	// The most users which are sent to every second.
+	static const size_t batchsize = 5000;
+
+	std::deque<PendingNotify> pending;
+
+	void Send(size_t count)
+	{
+		const std::string prefix = ":" + ServerInstance->Config->ServerName + " CAP ";
+		for (; count && !pending.empty(); --count)
+		{
+			const PendingNotify& notify = pending.front();
+			LocalUser* user = IS_LOCAL(ServerInstance->FindUUID(notify.uuid));
+			if (user && !user->quitting)
+			{
+				if (!notify.add.empty())
+					user->Write(prefix + user->nick + notify.add);
+
+				if (!notify.del.empty())
+					user->Write(prefix + user->nick + notify.del);
+			}
+			pending.pop_front();
+		}
+	}
+
+ public:
+	NotifyQueue()
+		: Timer(1, ServerInstance->Time(), true)
+	{
+	}
+
+	void Add(LocalUser* user, const std::string& add, const std::string& del)
+	{
+		pending.push_back(PendingNotify(user, add, del));
+	}
+
+	void Flush()
+	{
+		Send(pending.size());
+	}
+
+	void Tick(time_t time)
+	{
+		Send(batchsize);
+	}
+};
+
 class ModuleCapNotify : public Module
 {
 	GenericCap cap;
 	bool inited;
 	std::vector<std::string> currentcaps;
+	NotifyQueue* queue;
 
 	void ListCaps(std::vector<std::string>& list)
 	{
@@ -40,19 +101,23 @@ class ModuleCapNotify : public Module
 
 	void SendAllWithCapNotify(const std::string& todel, const std::string& toadd)
 	{
+		if (toadd.empty() && todel.empty())
+			return;
+
+		// Only the nick differs between users so the rest of each line is built once.
+		const std::string add = toadd.empty() ? std::string() : " NEW :" + toadd;
+		const std::string del = todel.empty() ? std::string() : " DEL :" + todel;
+
 		const LocalUserList& locallist = ServerInstance->Users->local_users;
 		for (LocalUserList::const_iterator i = locallist.begin(); i != locallist.end(); ++i)
 		{
 			LocalUser* user = *i;
-			if (!cap.ext.get(user))
-				continue;
-
-			if (!toadd.empty())
-				user->WriteServ("CAP %s NEW :%s", user->nick.c_str(), toadd.c_str());
-
-			if (!todel.empty())
-				user->WriteServ("CAP %s DEL :%s", user->nick.c_str(), todel.c_str());
+			if (cap.ext.get(user))
+				queue->Add(user, add, del);
 		}
+
+		// The first batch goes out straight away.
+		queue->Tick(ServerInstance->Time());
 	}
 
 	static std::string SetDiff(const std::vector<std::string>& list1, const std::vector<std::string>& list2)
@@ -66,11 +131,21 @@ class ModuleCapNotify : public Module
 	ModuleCapNotify()
 		: cap(this, "cap-notify")
 		, inited(false)
+		, queue(NULL)
 	{
 	}
 
+	~ModuleCapNotify()
+	{
+		if (queue)
+			ServerInstance->Timers->DelTimer(queue);
+	}
+
 	void init()
 	{
+		queue = new NotifyQueue;
+		ServerInstance->Timers->AddTimer(queue);
+
 		Implementation eventlist[] = { I_OnEvent, I_On005Numeric };
 		ServerInstance->Modules->Attach(eventlist, this, sizeof(eventlist)/sizeof(Implementation));
 	}
@@ -82,6 +157,7 @@ class ModuleCapNotify : public Module
 		{
 			inited = false;
 			SendAllWithCapNotify(cap.cap, std::string());
+			queue->Flush();
 		}
 	}
 
@@ -30,11 +30,23 @@
 class CiphersuiteJoinMode : public ListModeBase
 {
  public:
+	/** What the list of a channel says about each ciphersuite ID: 0 = not checked yet, 1 = allowed, 2 = denied */
+	SimpleExtItem<std::vector<unsigned char> > verdicts;
+
 	CiphersuiteJoinMode(Module* Creator)
 		: ListModeBase(Creator, "ciphersuite", 'Z', "End of channel allowed SSL ciphersuite list", 961, 960, false, "ciphersuitelist")
+		, verdicts("ciphersuitejoin_verdicts", Creator)
 	{
 	}
 
+	ModeAction OnModeChange(User* source, User* dest, Channel* channel, std::string &parameter, bool adding)
+	{
+		ModeAction res = ListModeBase::OnModeChange(source, dest, channel, parameter, adding);
+		if (res == MODEACTION_ALLOW)
+			verdicts.unset(channel);
+		return res;
+	}
+
 	bool TellListTooLong(User* user, Channel* chan, std::string& param)
 	{
 		user->WriteNumeric(962, "%s %s %s :Channel ciphersuite whitelist is full", user->nick.c_str(), chan->name.c_str(), param.c_str());
@@ -61,6 +73,27 @@ class ModuleCiphersuiteJoin : public Module
 {
 	CiphersuiteJoinMode mode;
 
+	// There are only a few dozen ciphersuites so every one seen gets a small ID.
+	std::map<std::string, size_t> suiteids;
+
+	size_t GetSuiteID(const std::string& ciphersuite)
+	{
+		std::map<std::string, size_t>::iterator iter = suiteids.find(ciphersuite);
+		if (iter == suiteids.end())
+			iter = suiteids.insert(std::make_pair(ciphersuite, suiteids.size())).first;
+		return iter->second;
+	}
+
+	bool IsAllowed(modelist* list, const std::string& ciphersuite)
+	{
+		for (modelist::const_iterator i = list->begin(); i != list->end(); ++i)
+		{
+			if (InspIRCd::Match(ciphersuite, i->mask))
+				return true;
+		}
+		return false;
+	}
+
  public:
 	ModuleCiphersuiteJoin()
 		: mode(this)
@@ -70,6 +103,7 @@ class ModuleCiphersuiteJoin : public Module
 	void init()
 	{
 		ServerInstance->Modules->AddService(mode);
+		ServerInstance->Modules->AddService(mode.verdicts);
 		mode.DoImplements(this);
 		ServerInstance->Modules->Attach(I_OnUserPreJoin, this);
 	}
@@ -95,12 +129,23 @@ class ModuleCiphersuiteJoin : public Module
 			return MOD_RES_DENY;
 		}
 
-		for (modelist::const_iterator i = list->begin(); i != list->end(); ++i)
+		// The list is only matched once per ciphersuite until it changes.
+		std::vector<unsigned char>* verdict = mode.verdicts.get(chan);
+		if (!verdict)
 		{
-			if (InspIRCd::Match(*ciphersuite, i->mask))
-				return MOD_RES_PASSTHRU;
+			verdict = new std::vector<unsigned char>;
+			mode.verdicts.set(chan, verdict);
 		}
 
+		const size_t id = GetSuiteID(*ciphersuite);
+		if (id >= verdict->size())
+			verdict->resize(id + 1);
+		if (!(*verdict)[id])
+			(*verdict)[id] = IsAllowed(list, *ciphersuite) ? 1 : 2;
+
+		if ((*verdict)[id] == 1)
+			return MOD_RES_PASSTHRU;
+
 		user->WriteServ("489 %s %s :Cannot join channel because you are not using a whitelisted ciphersuite (+Z)", user->nick.c_str(), cname);
 		return MOD_RES_DENY;
 	}
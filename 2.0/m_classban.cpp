@@ -45,7 +45,10 @@ class ModuleClassBan : public Module
 	{
 		if ((mask.length() > 2) && (mask[0] == 'n') && (mask[1] == ':'))
 		{
-			if (InspIRCd::Match(user->GetClass()->GetName(), mask.substr(2)))
+			// Only local users have a connect class. Classes are matched by name
+			// each time as a removed class lingers until its last user is gone.
+			ConnectClass* cls = user->GetClass();
+			if (cls && InspIRCd::Match(cls->GetName().c_str(), mask.c_str() + 2))
 				return MOD_RES_DENY;
 		}
 		return MOD_RES_PASSTHRU;
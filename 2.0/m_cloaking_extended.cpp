@@ -31,6 +31,8 @@
 #include "inspircd.h"
 #include "hash.h"
 
+#include <list>
+
 enum CloakMode
 {
 	/** 2.0 cloak of "half" of the hostname plus the full IP hash */
@@ -63,6 +65,12 @@ struct CloakInfo
 	// The suffix for IP cloaks (e.g. .IP).
 	std::string suffix;
 
+	bool operator==(const CloakInfo& other) const
+	{
+		return mode == other.mode && domainparts == other.domainparts && key == other.key
+			&& prefix == other.prefix && suffix == other.suffix;
+	}
+
 	CloakInfo(CloakMode Mode, const std::string& Key, const std::string& Prefix, const std::string& Suffix, unsigned int DomainParts = 0)
 		: mode(Mode)
 		, domainparts(DomainParts)
@@ -75,6 +83,81 @@ struct CloakInfo
 
 typedef std::vector<std::string> CloakList;
 
+// The cloaks of a user as full nick!ident@cloak masks for ban matching.
+struct CloakMasks
+{
+	// The nick!ident@ the masks were built with.
+	std::string nickident;
+
+	// The masks in the same order as the CloakList.
+	std::vector<std::string> masks;
+};
+
+/** Remembers the cloaks generated for recently seen IP and host pairs so
+ * that users connecting from the same place don't have to be hashed again.
+ */
+class CloakCache
+{
+	typedef std::pair<std::string, CloakList> Entry;
+	typedef std::list<Entry> EntryList;
+	typedef std::map<std::string, EntryList::iterator> EntryMap;
+
+	// The most recently used entries are at the front.
+	EntryList entries;
+	EntryMap index;
+
+	// The cloak config the entries were generated with.
+	unsigned long generation;
+
+	static std::string MakeKey(unsigned long gen, const std::string& ip, const std::string& host)
+	{
+		return ConvToStr(gen) + ' ' + ip + ' ' + host;
+	}
+
+ public:
+	// The most entries kept.
+	static const size_t maxsize = 4096;
+
+	CloakCache()
+		: generation(0)
+	{
+	}
+
+	// Forgets all of the cached cloaks as the config changed.
+	void Invalidate()
+	{
+		generation++;
+		entries.clear();
+		index.clear();
+	}
+
+	const CloakList* Find(const std::string& ip, const std::string& host)
+	{
+		EntryMap::iterator iter = index.find(MakeKey(generation, ip, host));
+		if (iter == index.end())
+			return NULL;
+
+		entries.splice(entries.begin(), entries, iter->second);
+		return &iter->second->second;
+	}
+
+	void Add(const std::string& ip, const std::string& host, const CloakList& cloaks)
+	{
+		const std::string key = MakeKey(generation, ip, host);
+		if (index.find(key) != index.end())
+			return;
+
+		if (entries.size() >= maxsize)
+		{
+			index.erase(entries.back().first);
+			entries.pop_back();
+		}
+
+		entries.push_front(std::make_pair(key, cloaks));
+		index[key] = entries.begin();
+	}
+};
+
 /** Handles user mode +x
  */
 class CloakUser : public ModeHandler
@@ -82,6 +165,7 @@ class CloakUser : public ModeHandler
  public:
 	bool active;
 	SimpleExtItem<CloakList> ext;
+	SimpleExtItem<CloakMasks> maskext;
 	std::string debounce_uid;
 	time_t debounce_ts;
 	int debounce_count;
@@ -90,6 +174,7 @@ class CloakUser : public ModeHandler
 		: ModeHandler(source, "cloak", 'x', PARAM_NONE, MODETYPE_USER)
 		, active(false)
 		, ext("cloaked_host", source)
+		, maskext("cloaked_masks", source)
 		, debounce_ts(0)
 		, debounce_count(0)
 	{
@@ -179,28 +264,73 @@ class CommandCloak : public Command
 	CmdResult Handle(const std::vector<std::string>& parameters, User* user);
 };
 
+class ModuleCloaking;
+
+/** Holds the local users whose cloaks were generated with an old cloak
+ * configuration so they can be regenerated a batch at a time after a rehash.
+ */
+class RecloakQueue : public Timer
+{
+ private:
+	ModuleCloaking* mod;
+
+	// The most users which are recloaked every second.
+	static const size_t batchsize = 500;
+
+	std::deque<std::string> pending;
+
+ public:
+	RecloakQueue(ModuleCloaking* Creator)
+		: Timer(1, ServerInstance->Time(), true)
+		, mod(Creator)
+	{
+	}
+
+	void Reset()
+	{
+		pending.clear();
+		const LocalUserList& locallist = ServerInstance->Users->local_users;
+		for (LocalUserList::const_iterator i = locallist.begin(); i != locallist.end(); ++i)
+			pending.push_back((*i)->uuid);
+	}
+
+	void Tick(time_t time);
+};
+
 class ModuleCloaking : public Module
 {
  public:
 	CloakUser cu;
 	CommandCloak ck;
 	std::vector<CloakInfo> cloaks;
+	CloakCache cache;
 	dynamic_reference<HashProvider> Hash;
+	RecloakQueue* recloak;
 
 	ModuleCloaking()
 		: cu(this)
 		, ck(this)
 		, Hash(this, "hash/md5")
+		, recloak(NULL)
 	{
 	}
 
+	~ModuleCloaking()
+	{
+		if (recloak)
+			ServerInstance->Timers->DelTimer(recloak);
+	}
+
 	void init()
 	{
+		recloak = new RecloakQueue(this);
+		ServerInstance->Timers->AddTimer(recloak);
 		OnRehash(NULL);
 
 		ServerInstance->Modules->AddService(cu);
 		ServerInstance->Modules->AddService(ck);
 		ServerInstance->Modules->AddService(cu.ext);
+		ServerInstance->Modules->AddService(cu.maskext);
 
 		Implementation eventlist[] = { I_OnRehash, I_OnCheckBan, I_OnUserConnect, I_OnChangeHost };
 		ServerInstance->Modules->Attach(eventlist, this, sizeof(eventlist)/sizeof(Implementation));
@@ -352,27 +482,44 @@ class ModuleCloaking : public Module
 			return MOD_RES_PASSTHRU;
 
 		// Force the creation of cloaks if not already set.
-		OnUserConnect(lu);
+		CloakList* cloaklist = cu.ext.get(user);
+		if (!cloaklist)
+		{
+			OnUserConnect(lu);
+			cloaklist = cu.ext.get(user);
+		}
 
 		// If the user has no cloaks (i.e. UNIX socket) then we do nothing here.
-		CloakList* cloaklist = cu.ext.get(user);
 		if (!cloaklist || cloaklist->empty())
 			return MOD_RES_PASSTHRU;
 
 		// Check if they have a cloaked host but are not using it.
-		for (CloakList::const_iterator iter = cloaklist->begin(); iter != cloaklist->end(); ++iter)
+		const CloakMasks& cloakmasks = GetMasks(lu, *cloaklist);
+		for (size_t i = 0; i < cloaklist->size(); ++i)
 		{
-			const std::string& cloak = *iter;
-			if (cloak != user->dhost)
-			{
-				const std::string cloakMask = user->nick + "!" + user->ident + "@" + cloak;
-				if (InspIRCd::Match(cloakMask, mask))
-					return MOD_RES_DENY;
-			}
+			if ((*cloaklist)[i] != user->dhost && InspIRCd::Match(cloakmasks.masks[i], mask))
+				return MOD_RES_DENY;
 		}
 		return MOD_RES_PASSTHRU;
 	}
 
+	// Retrieves the masks for the cloaks of a user, rebuilding them if their nick or ident changed.
+	const CloakMasks& GetMasks(LocalUser* user, const CloakList& cloaklist)
+	{
+		CloakMasks* cloakmasks = cu.maskext.get(user);
+		if (cloakmasks && cloakmasks->masks.size() == cloaklist.size() && cloakmasks->nickident.length() == user->nick.length() + user->ident.length() + 2
+			&& !cloakmasks->nickident.compare(0, user->nick.length(), user->nick)
+			&& !cloakmasks->nickident.compare(user->nick.length() + 1, user->ident.length(), user->ident))
+			return *cloakmasks;
+
+		CloakMasks newmasks;
+		newmasks.nickident = user->nick + "!" + user->ident + "@";
+		for (CloakList::const_iterator iter = cloaklist.begin(); iter != cloaklist.end(); ++iter)
+			newmasks.masks.push_back(newmasks.nickident + *iter);
+		cu.maskext.set(user, newmasks);
+		return *cu.maskext.get(user);
+	}
+
 	void Prioritize()
 	{
 		/* Needs to be after m_banexception etc. */
@@ -455,6 +602,13 @@ class ModuleCloaking : public Module
 		}
 
 		// The cloak configuration was valid so we can apply it.
+		if (newcloaks != cloaks)
+		{
+			// Existing cloaks are regenerated in the background so the hashing
+			// doesn't all happen at once or on the ban checking path.
+			cache.Invalidate();
+			recloak->Reset();
+		}
 		cloaks.swap(newcloaks);
 	}
 
@@ -490,13 +644,51 @@ class ModuleCloaking : public Module
 		if (dest->client_sa.sa.sa_family != AF_INET && dest->client_sa.sa.sa_family != AF_INET6)
 			return;
 
+		cu.ext.set(dest, GetCloaks(dest->client_sa, dest->GetIPString(), dest->host));
+	}
+
+	void Recloak(LocalUser* user)
+	{
+		// Users without cloaks yet get them as normal when they are needed.
+		if (!cu.ext.get(user))
+			return;
+
+		cu.ext.set(user, GetCloaks(user->client_sa, user->GetIPString(), user->host));
+		cu.maskext.unset(user);
+	}
+
+	CloakList GetCloaks(const irc::sockets::sockaddrs& ip, const std::string& ipstr, const std::string& host)
+	{
+		// Cloaks can't be cached without an IP or while the hash provider is missing.
+		const bool cacheable = !ipstr.empty() && Hash;
+		if (cacheable)
+		{
+			const CloakList* cached = cache.Find(ipstr, host);
+			if (cached)
+				return *cached;
+		}
+
 		CloakList cloaklist;
 		for (std::vector<CloakInfo>::const_iterator iter = cloaks.begin(); iter != cloaks.end(); ++iter)
-			cloaklist.push_back(GenCloak(*iter, dest->client_sa, dest->GetIPString(), dest->host));
-		cu.ext.set(dest, cloaklist);
+			cloaklist.push_back(GenCloak(*iter, ip, ipstr, host));
+
+		if (cacheable)
+			cache.Add(ipstr, host, cloaklist);
+		return cloaklist;
 	}
 };
 
+void RecloakQueue::Tick(time_t time)
+{
+	for (size_t count = 0; count < batchsize && !pending.empty(); ++count)
+	{
+		LocalUser* user = IS_LOCAL(ServerInstance->FindUUID(pending.front()));
+		if (user && !user->quitting)
+			mod->Recloak(user);
+		pending.pop_front();
+	}
+}
+
 CmdResult CommandCloak::Handle(const std::vector<std::string>& parameters, User* user)
 {
 	ModuleCloaking* mod = (ModuleCloaking*)(Module*)creator;
@@ -506,11 +698,9 @@ CmdResult CommandCloak::Handle(const std::vector<std::string>& parameters, User*
 	const char* ipaddr = irc::sockets::aptosa(parameters[0], 0, sa) ? parameters[0].c_str() : "";
 
 	unsigned int id = 0;
-	for (std::vector<CloakInfo>::const_iterator iter = mod->cloaks.begin(); iter != mod->cloaks.end(); ++iter)
-	{
-		const std::string cloak = mod->GenCloak(*iter, sa, ipaddr, parameters[0]);
-		user->WriteServ("NOTICE %s :*** Cloak #%u for %s is %s", user->nick.c_str(), ++id, parameters[0].c_str(), cloak.c_str());
-	}
+	const CloakList cloaks = mod->GetCloaks(sa, ipaddr, parameters[0]);
+	for (CloakList::const_iterator iter = cloaks.begin(); iter != cloaks.end(); ++iter)
+		user->WriteServ("NOTICE %s :*** Cloak #%u for %s is %s", user->nick.c_str(), ++id, parameters[0].c_str(), iter->c_str());
 	return CMD_SUCCESS;
 }
 
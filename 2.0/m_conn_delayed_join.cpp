@@ -26,7 +26,7 @@
 /* $ModAuthor: Christoph "Sheogorath" Kern */
 /* $ModDesc: Replaces m_conn_join.so and forces users to join the specified channel(s) after a specified delay on connect */
 /* $ModDepends: core 2.0 */
-/* $ModConfig: <autojoin channel="#one,#two,#three" delay="30"> */
+/* $ModConfig: <autojoin channel="#one,#two,#three" delay="30" jitter="10"> */
 static void JoinChannels(LocalUser* u, const std::string& chanlist)
 {
 	irc::commasepstream chans(chanlist);
@@ -39,40 +39,79 @@ static void JoinChannels(LocalUser* u, const std::string& chanlist)
 	}
 }
  
-class JoinTimer : public Timer
+/** Holds the users who are waiting to be joined in one bucket per second
+ * so that a single timer serves every connecting user.
+ */
+class JoinQueue : public Timer
 {
  private:
-	LocalUser* const user;
-	std::string uuid;
-	const std::string channels;
- 
+	struct PendingJoin
+	{
+		std::string uuid;
+		std::string channels;
+		PendingJoin(LocalUser* u, const std::string& chans) : uuid(u->uuid), channels(chans) { }
+	};
+
+	typedef std::map<time_t, std::vector<PendingJoin> > BucketMap;
+	BucketMap buckets;
+
  public:
-	JoinTimer(LocalUser* u, const std::string& chans, unsigned int delay)
-		: Timer(delay, ServerInstance->Time(), false)
-		, user(u), channels(chans)
+	JoinQueue()
+		: Timer(1, ServerInstance->Time(), true)
 	{
-		uuid = user->uuid;
-		ServerInstance->Timers->AddTimer(this);
 	}
- 
+
+	void Add(LocalUser* user, const std::string& chans, unsigned int delay, unsigned int jitter)
+	{
+		// Spread the joins out so users who connected together don't all join at once.
+		time_t due = ServerInstance->Time() + delay;
+		if (jitter)
+			due += ServerInstance->GenRandomInt(jitter + 1);
+		buckets[due].push_back(PendingJoin(user, chans));
+	}
+
 	void Tick(time_t time)
 	{
-		if (ServerInstance->FindUUID(uuid) != user)
-			return;
- 
-		if (user->chans.empty())
-			JoinChannels(user, channels);
+		while (!buckets.empty() && buckets.begin()->first <= time)
+		{
+			std::vector<PendingJoin> due;
+			due.swap(buckets.begin()->second);
+			buckets.erase(buckets.begin());
+
+			for (std::vector<PendingJoin>::const_iterator i = due.begin(); i != due.end(); ++i)
+			{
+				LocalUser* user = IS_LOCAL(ServerInstance->FindUUID(i->uuid));
+				if (user && !user->quitting && user->chans.empty())
+					JoinChannels(user, i->channels);
+			}
+		}
 	}
 };
 
 class ModuleConnJoin : public Module
 {
+		JoinQueue* queue;
+
 	public:
+		ModuleConnJoin()
+			: queue(NULL)
+		{
+		}
+
+		~ModuleConnJoin()
+		{
+			if (queue)
+				ServerInstance->Timers->DelTimer(queue);
+		}
+
 		void init()
 		{
 			OnModuleLoad(NULL);
 			Implementation eventlist[] = { I_OnLoadModule, I_OnPostConnect };
 			ServerInstance->Modules->Attach(eventlist, this, sizeof(eventlist)/sizeof(Implementation));
+
+			queue = new JoinQueue;
+			ServerInstance->Timers->AddTimer(queue);
 		}
 
 		void Prioritize()
@@ -93,21 +132,23 @@ class ModuleConnJoin : public Module
 
 			std::string chanlist = localuser->GetClass()->config->getString("autojoin");
 			unsigned int chandelay = localuser->GetClass()->config->getInt("autojoindelay", 0);
+			unsigned int chanjitter = localuser->GetClass()->config->getInt("autojoinjitter", 0);
 			
 			if (chanlist.empty())
 			{
 				ConfigTag* tag = ServerInstance->Config->ConfValue("autojoin");
 				chanlist = tag->getString("channel");
 				chandelay = tag->getInt("delay", 0);
+				chanjitter = tag->getInt("jitter", 0);
 			}
 
 			if (chanlist.empty())
 				return;
  
-			if (!chandelay)
+			if (!chandelay && !chanjitter)
 				JoinChannels(localuser, chanlist);
 			else
-				new JoinTimer(localuser, chanlist, chandelay);
+				queue->Add(localuser, chanlist, chandelay, chanjitter);
 		}
 
 		void OnModuleLoad(Module* mod)
@@ -27,24 +27,55 @@
 
 #include "inspircd.h"
 
-static void InviteChannels(LocalUser* u, const std::string& chanlist) {
+typedef std::vector<std::string> ChannelList;
+
+static void ParseChannels(const std::string& chanlist, ChannelList& out)
+{
 	irc::commasepstream chans(chanlist);
 	std::string chan;
 
 	while (chans.GetToken(chan))
 	{
-		if (IS_LOCAL(u)) {
-			IS_LOCAL(u)->InviteTo(chan.c_str(), 0);
-			u->WriteServ("INVITE %s :%s", u->nick.c_str(), chan.c_str());
-		}
+		if (!chan.empty())
+			out.push_back(chan);
+	}
+}
+
+static void InviteChannels(LocalUser* u, const ChannelList& chans)
+{
+	const std::string prefix = ":" + ServerInstance->Config->ServerName + " INVITE " + u->nick + " :";
+	for (ChannelList::const_iterator chan = chans.begin(); chan != chans.end(); ++chan)
+	{
+		u->InviteTo(chan->c_str(), 0);
+		u->Write(prefix + *chan);
 	}
 }
 
 class ModuleConnInvite : public Module {
+	private:
+		// The channels from <autoinvite>, used for classes which have none of their own.
+		ChannelList defaultchans;
+
+		// The parsed autoinvite setting of each class, filled in as users connect.
+		typedef std::map<ConnectClass*, ChannelList> ClassChannels;
+		ClassChannels classchans;
+
+		const ChannelList& GetChannels(ConnectClass* cls)
+		{
+			ClassChannels::iterator iter = classchans.find(cls);
+			if (iter == classchans.end())
+			{
+				iter = classchans.insert(std::make_pair(cls, ChannelList())).first;
+				ParseChannels(cls->config->getString("autoinvite"), iter->second);
+			}
+			return iter->second.empty() ? defaultchans : iter->second;
+		}
+
 	public:
 		void init()
 		{
-			Implementation eventlist[] = { I_OnLoadModule, I_OnPostConnect };
+			OnRehash(NULL);
+			Implementation eventlist[] = { I_OnLoadModule, I_OnPostConnect, I_OnRehash };
 			ServerInstance->Modules->Attach(eventlist, this, sizeof(eventlist)/sizeof(Implementation));
 		}
 		void Prioritize()
@@ -55,22 +86,26 @@ class ModuleConnInvite : public Module {
 		{
 			return Version("Invites users to join the specified channel(s) on connect", VF_VENDOR);
 		}
+		void OnRehash(User*)
+		{
+			defaultchans.clear();
+			ParseChannels(ServerInstance->Config->ConfValue("autoinvite")->getString("channel"), defaultchans);
+
+			// Rehashing updates the settings of existing classes in place, so
+			// their lists are parsed again as they are used.
+			classchans.clear();
+		}
 		void OnPostConnect(User* user)
 		{
 			LocalUser* localuser = IS_LOCAL(user);
 			if (!localuser)
 				return;
-			std::string chanlist = localuser->GetClass()->config->getString("autoinvite");
 
-			if (chanlist.empty())
-			{
-				ConfigTag* tag = ServerInstance->Config->ConfValue("autoinvite");
-				chanlist = tag->getString("channel");
-			}
-			if (chanlist.empty())
+			const ChannelList& chans = GetChannels(localuser->GetClass());
+			if (chans.empty())
 				return;
 
-			InviteChannels(localuser, chanlist);
+			InviteChannels(localuser, chans);
 		}
 };
 
@@ -25,31 +25,145 @@
 /* $ModDesc: Incoming connection throttle */
 /* $ModDepends: core 2.0 */
 
-class Throttle
+/** The connection attempts from one IPv4 address or IPv6 /64. Entries are
+ * stored inline in an open addressing table keyed on the binary address so
+ * that accepting a connection does not allocate.
+ */
+struct Throttle
 {
- public:
+	unsigned char key[8];
+	bool used;
 	int con_count;
 	time_t last_attempt;
 
-	Throttle() : con_count(0), last_attempt(0) { }
+	Throttle() : used(false), con_count(0), last_attempt(0) { }
 };
 
-class ModuleConnThrottle : public Module
+class ThrottleTable
 {
-	typedef nspace::hash_map<std::string, Throttle*> throttle_hash;
+	std::vector<Throttle> slots;
+	size_t count;
 
-	throttle_hash throttles;
+	// The next slot to check for an expired entry.
+	size_t cursor;
 
-	int throttle_num;
-	int throttle_time;
+	static size_t Hash(const unsigned char* key)
+	{
+		// FNV-1a
+		size_t hash = 2166136261U;
+		for (size_t i = 0; i < 8; ++i)
+		{
+			hash ^= key[i];
+			hash *= 16777619U;
+		}
+		return hash;
+	}
+
+	size_t Mask() const
+	{
+		return slots.size() - 1;
+	}
+
+	void Grow()
+	{
+		std::vector<Throttle> old(slots.size() * 2);
+		old.swap(slots);
+		count = 0;
+		cursor = 0;
+
+		for (std::vector<Throttle>::const_iterator it = old.begin(); it != old.end(); ++it)
+		{
+			if (it->used)
+				*Find(it->key, true) = *it;
+		}
+	}
+
+	// Removes an entry, moving back any entries after it that would no longer be found.
+	void Erase(size_t pos)
+	{
+		slots[pos].used = false;
+		count--;
+
+		for (size_t next = (pos + 1) & Mask(); slots[next].used; next = (next + 1) & Mask())
+		{
+			const size_t home = Hash(slots[next].key) & Mask();
+			if (((next - home) & Mask()) < ((next - pos) & Mask()))
+				continue;
+
+			slots[pos] = slots[next];
+			slots[next].used = false;
+			pos = next;
+		}
+	}
 
  public:
+	ThrottleTable() : slots(1024), count(0), cursor(0) { }
+
+	static void MakeKey(const irc::sockets::sockaddrs* sa, unsigned char* key)
+	{
+		memset(key, 0, 8);
+		if (sa->sa.sa_family == AF_INET6)
+			memcpy(key, &sa->in6.sin6_addr, 8);
+		else
+			memcpy(key, &sa->in4.sin_addr, 4);
+	}
+
+	Throttle* Find(const unsigned char* key, bool create)
+	{
+		if (create && (count + 1) * 2 > slots.size())
+			Grow();
+
+		for (size_t pos = Hash(key) & Mask(); ; pos = (pos + 1) & Mask())
+		{
+			Throttle& throttle = slots[pos];
+			if (!throttle.used)
+			{
+				if (!create)
+					return NULL;
+
+				memcpy(throttle.key, key, 8);
+				throttle.used = true;
+				throttle.con_count = 0;
+				throttle.last_attempt = 0;
+				count++;
+				return &throttle;
+			}
+
+			if (!memcmp(throttle.key, key, 8))
+				return &throttle;
+		}
+	}
+
+	// Checks a few slots for expired entries.
+	void Expire(time_t cutoff, size_t checks)
+	{
+		for (; checks && count; --checks)
+		{
+			cursor = (cursor + 1) & Mask();
+			if (slots[cursor].used && slots[cursor].last_attempt <= cutoff)
+			{
+				Erase(cursor);
+
+				// Another entry may have been moved into this slot.
+				cursor = (cursor - 1) & Mask();
+			}
+		}
+	}
 
-	~ModuleConnThrottle()
+	size_t Size() const
 	{
-		for (throttle_hash::iterator it = throttles.begin(); it != throttles.end(); ++it)
-			delete it->second;
+		return slots.size();
 	}
+};
+
+class ModuleConnThrottle : public Module
+{
+	ThrottleTable throttles;
+
+	int throttle_num;
+	int throttle_time;
+
+ public:
 
 	Version GetVersion()
 	{
@@ -74,53 +188,43 @@ class ModuleConnThrottle : public Module
 
 	ModResult OnAcceptConnection(int fd, ListenSocket* sock, irc::sockets::sockaddrs* client, irc::sockets::sockaddrs* server)
 	{
-		if (ServerInstance->XLines->MatchesLine("E", client->addr()) != NULL)
-			return MOD_RES_PASSTHRU;
+		const time_t now = ServerInstance->Time();
+		throttles.Expire(now - throttle_time, 2);
 
-		Throttle*& throttle = throttles[client->addr()];
-		if (throttle != NULL && ServerInstance->Time() - throttle->last_attempt < throttle_time)
-		{
-			if (throttle->con_count >= throttle_num)
-			{
-				if (sock->bind_tag->getString("ssl").empty())
-				{
-					const char err[] = "ERROR :Trying to reconnect too fast.\r\n";
-					send(fd, err, sizeof(err) - 1, 0);
-				}
+		unsigned char key[8];
+		ThrottleTable::MakeKey(client, key);
 
-				return MOD_RES_DENY;
-			}
+		Throttle* throttle = throttles.Find(key, true);
+		if (now - throttle->last_attempt >= throttle_time)
+		{
+			throttle->con_count = 1;
+			throttle->last_attempt = now;
+			return MOD_RES_PASSTHRU;
+		}
 
+		if (throttle->con_count < throttle_num)
+		{
 			++throttle->con_count;
+			return MOD_RES_PASSTHRU;
 		}
-		else
-		{
-			if (throttle == NULL)
-				throttle = new Throttle();
 
-			throttle->con_count = 1;
-			throttle->last_attempt = ServerInstance->Time();
+		// Only users over the limit get this far so the E-line check is left until last.
+		if (ServerInstance->XLines->MatchesLine("E", client->addr()) != NULL)
+			return MOD_RES_PASSTHRU;
+
+		if (sock->bind_tag->getString("ssl").empty())
+		{
+			const char err[] = "ERROR :Trying to reconnect too fast.\r\n";
+			send(fd, err, sizeof(err) - 1, 0);
 		}
 
-		return MOD_RES_PASSTHRU;
+		return MOD_RES_DENY;
 	}
 
 	void OnGarbageCollect()
 	{
-		throttle_hash temp;
-
-		throttles.swap(temp);
-
-		for (throttle_hash::iterator it = temp.begin(); it != temp.end(); ++it)
-		{
-			const std::string &ip = it->first;
-			Throttle *t = it->second;
-
-			if (ServerInstance->Time() - t->last_attempt < throttle_time)
-			{
-				throttles[ip] = t;
-			}
-		}
+		// Catch up on any entries the accepts have not got to yet.
+		throttles.Expire(ServerInstance->Time() - throttle_time, throttles.Size());
 	}
 };
 
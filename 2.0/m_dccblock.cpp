@@ -76,14 +76,14 @@ class ModuleDCCBlock : public Module
 		if (!IS_LOCAL(user))
 			return MOD_RES_PASSTHRU;
 
-		if (strncmp(text.c_str(), "\1DCC ", 5) == 0)
-		{
-			if (target_type == TYPE_USER && !users)
-				return MOD_RES_PASSTHRU;
+		if (target_type == TYPE_USER && !users)
+			return MOD_RES_PASSTHRU;
 
-			if (target_type == TYPE_CHANNEL && !channels)
-				return MOD_RES_PASSTHRU;
+		if (target_type == TYPE_CHANNEL && !channels)
+			return MOD_RES_PASSTHRU;
 
+		if (text.compare(0, 5, "\1DCC ") == 0)
+		{
 			// This is a DCC request and we want to block it
 			user->WriteNumeric(998, "%s :DCC not allowed on this server.  No exceptions allowed.", user->nick.c_str());
 			return MOD_RES_DENY;
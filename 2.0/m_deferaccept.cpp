@@ -20,7 +20,11 @@
 /* $ModAuthorMail: shutter@canternet.org */
 /* $ModDesc: Enable TCP_DEFER_ACCEPT on sockets */
 /* $ModDepends: core 2.0 */
-/* $ModConfig: <bind defer="0"> */
+/* $ModConfig: <bind defer="0" fastopen="0"> */
+
+/* fastopen sets the length of the TCP Fast Open queue on the listener where
+ * the system supports it, 0 disables it.
+ */
 
 #include "inspircd.h"
 #include <netinet/tcp.h>
@@ -62,6 +66,13 @@ class ModuleDeferAccept : public Module
 			strcpy(afa.af_name, "dataready");
 			setsockopt(fd, SOL_SOCKET, SO_ACCEPTFILTER, (!timeout ? NULL : &afa), sizeof(afa));
 #endif
+
+#ifdef TCP_FASTOPEN
+			int queuelen = 0;
+			if (!removing)
+				queuelen = (*it)->bind_tag->getInt("fastopen", 0);
+			setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN, &queuelen, sizeof(queuelen));
+#endif
 		}
 	}
 
@@ -237,6 +237,51 @@ class ModuleExtBanRegex : public Module
 	dynamic_reference<RegexFactory> rxfactory;
 	RegexFactory* factory;
 
+	// Compiled patterns by mask, and the factory which compiled them.
+	typedef std::map<std::string, Regex*> RegexCache;
+	RegexCache regexes;
+	RegexFactory* cachefactory;
+
+	// The most compiled patterns which are kept at once.
+	static const size_t maxcached = 1000;
+
+	void ClearCache()
+	{
+		for (RegexCache::iterator i = regexes.begin(); i != regexes.end(); ++i)
+			delete i->second;
+		regexes.clear();
+	}
+
+	Regex* GetRegex(const std::string& pattern)
+	{
+		if (factory != cachefactory)
+		{
+			ClearCache();
+			cachefactory = factory;
+		}
+
+		RegexCache::const_iterator iter = regexes.find(pattern);
+		if (iter != regexes.end())
+			return iter->second;
+
+		if (regexes.size() >= maxcached)
+			ClearCache();
+
+		Regex* regex;
+		try
+		{
+			regex = factory->Create(pattern);
+		}
+		catch (ModuleException&)
+		{
+			// Set by a server using a different engine.
+			return NULL;
+		}
+
+		regexes[pattern] = regex;
+		return regex;
+	}
+
  public:
 	ModuleExtBanRegex()
 		: opersonly(true)
@@ -247,6 +292,7 @@ class ModuleExtBanRegex : public Module
 		, iewactive(false)
 		, initing(true)
 		, rxfactory(this, "regex")
+		, cachefactory(NULL)
 	{
 	}
 
@@ -266,6 +312,7 @@ class ModuleExtBanRegex : public Module
 
 	~ModuleExtBanRegex()
 	{
+		ClearCache();
 		ServerInstance->Modes->DelModeWatcher(&banwatcher);
 		if (ewactive)
 			ServerInstance->Modes->DelModeWatcher(&exceptionwatcher);
@@ -283,6 +330,15 @@ class ModuleExtBanRegex : public Module
 
 	void OnUnloadModule(Module* mod)
 	{
+		// The compiled patterns can't outlive the module which created them.
+		if (cachefactory && cachefactory->creator == mod)
+		{
+			ClearCache();
+			cachefactory = NULL;
+		}
+		if (factory && factory->creator == mod)
+			factory = NULL;
+
 		if (ewactive && mod->ModuleSourceFile == "m_banexception.so" && ServerInstance->Modes->DelModeWatcher(&exceptionwatcher))
 			ewactive = false;
 		if (iewactive && mod->ModuleSourceFile == "m_inviteexception.so" && ServerInstance->Modes->DelModeWatcher(&inviteexceptionwatcher))
@@ -334,9 +390,8 @@ class ModuleExtBanRegex : public Module
 		struct timeval pretv, posttv;
 		gettimeofday(&pretv, NULL);
 
-		Regex* regex = factory->Create(mask.substr(2));
-		bool matched = (regex->Matches(dhost) || regex->Matches(host) || regex->Matches(ip));
-		delete regex;
+		Regex* regex = GetRegex(mask.substr(2));
+		bool matched = (regex && (regex->Matches(dhost) || regex->Matches(host) || regex->Matches(ip)));
 
 		gettimeofday(&posttv, NULL);
 		float timediff = ((double)(posttv.tv_usec - pretv.tv_usec) / 1000000) + (double)(posttv.tv_sec - pretv.tv_sec);
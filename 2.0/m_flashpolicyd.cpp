@@ -44,10 +44,12 @@ class FlashPDSocket : public BufferedSocket
 {
  public:
 	time_t created;
+	bool flushing;
 
 	FlashPDSocket(int newfd)
 		: BufferedSocket(newfd)
 		, created(ServerInstance->Time())
+		, flushing(false)
 	{
 	}
 
@@ -63,9 +65,37 @@ class FlashPDSocket : public BufferedSocket
 
 	void OnDataReady()
 	{
-		if (recvq == expected_request)
-			WriteData(policy_reply);
-		AddToCull();
+		// Wait for the rest of a request which arrived in pieces.
+		if (recvq.length() < expected_request.length() && !expected_request.compare(0, recvq.length(), recvq))
+			return;
+
+		if (recvq != expected_request)
+		{
+			AddToCull();
+			return;
+		}
+
+		// The reply is sent straight from the shared buffer and nearly always
+		// fits in the socket buffer, only a short write needs to be queued.
+		int sent = ServerInstance->SE->Send(this, policy_reply.data(), policy_reply.length(), 0);
+		if (sent < 0)
+			sent = 0;
+
+		if (static_cast<size_t>(sent) >= policy_reply.length())
+		{
+			AddToCull();
+			return;
+		}
+
+		WriteData(policy_reply.substr(sent));
+		recvq.clear();
+		flushing = true;
+	}
+
+	// Lets the background timer close the socket once a queued write has gone.
+	bool Flushed()
+	{
+		return flushing && !getSendQSize();
 	}
 
 	void AddToCull()
@@ -97,7 +127,7 @@ class ModuleFlashPD : public Module
 		for (std::set<FlashPDSocket*>::const_iterator i = sockets.begin(); i != sockets.end(); ++i)
 		{
 			FlashPDSocket* sock = *i;
-			if ((sock->created + timeout < curtime) && (sock->created != 0))
+			if ((sock->created != 0) && ((sock->created + timeout < curtime) || sock->Flushed()))
 				sock->AddToCull();
 		}
 	}
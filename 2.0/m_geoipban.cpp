@@ -19,6 +19,7 @@
 
 #include "inspircd.h"
 #include <GeoIP.h>
+#include <bitset>
 
 #ifdef _WIN32
 # pragma comment(lib, "GeoIP.lib")
@@ -36,12 +37,86 @@ enum
 	RPL_WHOISCOUNTRY = 344
 };
 
+/** Country codes are two characters from A-Z and 0-9 (GeoIP uses codes like A1
+ * for proxies). This lets a G: mask be compiled into a bitset of the codes it
+ * matches. Anything else (e.g. "--" or "UNK") is matched against the mask as
+ * it was before.
+ */
+static const size_t CODE_UNKNOWN = 36 * 36;
+typedef std::bitset<CODE_UNKNOWN> CountrySet;
+
+static int CodeChar(char chr)
+{
+	if (chr >= 'A' && chr <= 'Z')
+		return chr - 'A';
+	if (chr >= '0' && chr <= '9')
+		return chr - '0' + 26;
+	return -1;
+}
+
+static size_t CodeToIndex(const std::string& cc)
+{
+	if (cc.length() != 2)
+		return CODE_UNKNOWN;
+
+	int first = CodeChar(cc[0]);
+	int second = CodeChar(cc[1]);
+	if (first < 0 || second < 0)
+		return CODE_UNKNOWN;
+
+	return first * 36 + second;
+}
+
+static std::string IndexToCode(size_t index)
+{
+	static const char* const chars = "ABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789";
+	std::string cc;
+	cc.push_back(chars[index / 36]);
+	cc.push_back(chars[index % 36]);
+	return cc;
+}
+
 class ModuleGeoIPBan : public Module
 {
 	LocalStringExt ext;
+	LocalIntExt codeext;
 	GeoIP* gi;
 	GeoIP* gi6;
-	
+
+	// The codes matched by each G: extban which has been checked.
+	typedef std::map<std::string, CountrySet> MaskCache;
+	MaskCache maskcache;
+	static const size_t maxcachedmasks = 1024;
+
+	const CountrySet& GetMask(const std::string& extban)
+	{
+		MaskCache::iterator it = maskcache.find(extban);
+		if (it != maskcache.end())
+			return it->second;
+
+		if (maskcache.size() >= maxcachedmasks)
+			maskcache.clear();
+
+		const std::string mask(extban, 2);
+		CountrySet& codes = maskcache[extban];
+		for (size_t index = 0; index < CODE_UNKNOWN; ++index)
+			codes[index] = InspIRCd::Match(IndexToCode(index), mask);
+		return codes;
+	}
+
+	// The index of a user's country code, looked up the first time it is needed.
+	size_t GetCode(User* user)
+	{
+		intptr_t code = codeext.get(user);
+		if (code)
+			return code - 1;
+
+		std::string* cc = ext.get(user);
+		if (!cc)
+			cc = SetExt(user);
+		return codeext.get(user) - 1;
+	}
+
 	std::string* SetExt(User* user)
 	{
 		const char* c = NULL;
@@ -62,11 +137,12 @@ class ModuleGeoIPBan : public Module
 
 		std::string* cc = new std::string(c);
 		ext.set(user, cc);
+		codeext.set(user, CodeToIndex(*cc) + 1);
 		return cc;
 	}
 
  public:
-	ModuleGeoIPBan() : ext("geoipban_cc", this), gi(NULL)
+	ModuleGeoIPBan() : ext("geoipban_cc", this), codeext("geoipban_code", this), gi(NULL)
 	{
 	}
 
@@ -79,6 +155,7 @@ class ModuleGeoIPBan : public Module
 		if (gi6 == NULL)
 			throw ModuleException("Unable to initialize geoip, are you missing GeoIPv6.dat?");
 		ServerInstance->Modules->AddService(ext);
+		ServerInstance->Modules->AddService(codeext);
 		Implementation eventlist[] = { I_OnCheckBan, I_On005Numeric, I_OnWhois };
 		ServerInstance->Modules->Attach(eventlist, this, sizeof(eventlist)/sizeof(Implementation));
 	}
@@ -92,11 +169,8 @@ class ModuleGeoIPBan : public Module
 	{
 		if ((mask.length() > 2) && (mask[0] == 'G') && (mask[1] == ':'))
 		{
-			std::string* cc = ext.get(user);
-			if (!cc)
-				cc = SetExt(user);
-
-			if (InspIRCd::Match(*cc, mask.substr(2)))
+			const size_t code = GetCode(user);
+			if (code == CODE_UNKNOWN ? InspIRCd::Match(*ext.get(user), mask.substr(2)) : GetMask(mask).test(code))
 				return MOD_RES_DENY;
 		}
 		return MOD_RES_PASSTHRU;
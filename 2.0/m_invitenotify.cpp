@@ -24,18 +24,47 @@
 #include "inspircd.h"
 #include "m_cap.h"
 
+/** The local members of a channel who have the invite-notify cap. */
+typedef std::set<User*> NotifyList;
+
 class ModuleInviteNotify : public Module
 {
 	GenericCap invite_notify;
+	SimpleExtItem<NotifyList> notifylist;
+
+	void AddNotify(User* user, Channel* chan)
+	{
+		NotifyList* list = notifylist.get(chan);
+		if (!list)
+		{
+			list = new NotifyList;
+			notifylist.set(chan, list);
+		}
+		list->insert(user);
+	}
+
+	void RemoveNotify(User* user, Channel* chan)
+	{
+		NotifyList* list = notifylist.get(chan);
+		if (!list)
+			return;
+
+		list->erase(user);
+		if (list->empty())
+			notifylist.unset(chan);
+	}
 
  public:
-	ModuleInviteNotify() : invite_notify(this, "invite-notify")
+	ModuleInviteNotify()
+		: invite_notify(this, "invite-notify")
+		, notifylist("invitenotify_list", this)
 	{
 	}
 
 	void init()
 	{
-		Implementation eventlist[] = { I_OnEvent, I_OnUserInvite };
+		ServerInstance->Modules->AddService(notifylist);
+		Implementation eventlist[] = { I_OnEvent, I_OnUserInvite, I_OnUserJoin, I_OnUserPart, I_OnUserKick, I_OnUserQuit };
 		ServerInstance->Modules->Attach(eventlist, this, sizeof(eventlist) / sizeof(Implementation));
 	}
 
@@ -46,20 +75,65 @@ class ModuleInviteNotify : public Module
 
 	void OnEvent(Event& ev)
 	{
+		if (ev.id != "cap_request")
+			return;
+
+		User* user = static_cast<CapEvent*>(&ev)->user;
+		const bool had = user && this->invite_notify.ext.get(user);
 		this->invite_notify.HandleEvent(ev);
+		if (!user || had == !!this->invite_notify.ext.get(user))
+			return;
+
+		// The cap was turned on or off so update every channel the user is in.
+		for (UCListIter i = user->chans.begin(); i != user->chans.end(); ++i)
+		{
+			if (had)
+				RemoveNotify(user, *i);
+			else
+				AddNotify(user, *i);
+		}
+	}
+
+	void OnUserJoin(Membership* memb, bool sync, bool created, CUList& except)
+	{
+		if (this->invite_notify.ext.get(memb->user))
+			AddNotify(memb->user, memb->chan);
+	}
+
+	void OnUserPart(Membership* memb, std::string& partmessage, CUList& except)
+	{
+		RemoveNotify(memb->user, memb->chan);
+	}
+
+	void OnUserKick(User* source, Membership* memb, const std::string& reason, CUList& except)
+	{
+		RemoveNotify(memb->user, memb->chan);
+	}
+
+	void OnUserQuit(User* user, const std::string& message, const std::string& oper_message)
+	{
+		if (!this->invite_notify.ext.get(user))
+			return;
+
+		for (UCListIter i = user->chans.begin(); i != user->chans.end(); ++i)
+			RemoveNotify(user, *i);
 	}
 
 	void OnUserInvite(User* source, User* dest, Channel* channel, time_t)
 	{
-		const UserMembList* cl = channel->GetUsers();
-		for (UserMembCIter it = cl->begin(); it != cl->end(); ++it)
+		NotifyList* list = notifylist.get(channel);
+		if (!list)
+			return;
+
+		const std::string line = "INVITE " + dest->nick + " :" + channel->name;
+		for (NotifyList::const_iterator it = list->begin(); it != list->end(); ++it)
 		{
-			User* u = it->first;
+			User* u = *it;
 
-			if (u == source || u == dest || !this->invite_notify.ext.get(u))
+			if (u == source || u == dest)
 				continue;
 
-			u->WriteFrom(source, "INVITE " + dest->nick + " :" + channel->name);
+			u->WriteFrom(source, line);
 		}
 	}
 };
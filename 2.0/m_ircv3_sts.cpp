@@ -27,7 +27,9 @@
 
 class STSCap
 {
-	std::string cap;
+	// The cap advertised to clients on plaintext and TLS connections.
+	std::string plaintextcap;
+	std::string securecap;
 
  public:
 	void HandleEvent(Event& ev)
@@ -36,17 +38,22 @@ class STSCap
 			return;
 
 		// Empty cap name means configuration is invalid
-		if (cap.empty())
+		if (plaintextcap.empty())
 			return;
 
 		CapEvent* data = static_cast<CapEvent*>(&ev);
-		if (data->type == CapEvent::CAPEVENT_LS)
-			data->wanted.push_back(cap);
+		if (data->type != CapEvent::CAPEVENT_LS)
+			return;
+
+		// Put the policy first so clients see it at the start of a multi-line CAP LS.
+		LocalUser* user = IS_LOCAL(data->user);
+		data->wanted.insert(data->wanted.begin(), (user && user->eh.GetIOHook()) ? securecap : plaintextcap);
 	}
 
-	void SetPolicy(const std::string& name, const std::string& newpolicystr)
+	void SetPolicy(const std::string& name, const std::string& plaintextpolicy, const std::string& securepolicy)
 	{
-		cap = name + "=" + newpolicystr;
+		plaintextcap = name + "=" + plaintextpolicy;
+		securecap = name + "=" + securepolicy;
 	}
 };
 
@@ -69,10 +76,17 @@ class STSPolicy
 		return ((duration == other.duration) && (port == other.port) && (preload == other.preload));
 	}
 
-	std::string GetString() const
+	// Plaintext clients only need to know where to upgrade to.
+	std::string GetPlaintextString() const
+	{
+		return "port=" + ConvToStr(port);
+	}
+
+	// The persistence of the policy is only trusted over TLS.
+	std::string GetSecureString() const
 	{
 		std::string newpolicystr = "duration=";
-		newpolicystr.append(ConvToStr(duration)).append(",port=").append(ConvToStr(port));
+		newpolicystr.append(ConvToStr(duration));
 		if (preload)
 			newpolicystr.append(",preload");
 		return newpolicystr;
@@ -92,6 +106,11 @@ class ModuleIRCv3STS : public Module
 		ServerInstance->Modules->Attach(eventlist, this, sizeof(eventlist) / sizeof(Implementation));
 	}
 
+	void Prioritize()
+	{
+		ServerInstance->Modules->SetPriority(this, I_OnEvent, PRIORITY_FIRST);
+	}
+
 	void OnRehash(User* user)
 	{
 		ConfigTag* tag = ServerInstance->Config->ConfValue("sts");
@@ -116,9 +135,11 @@ class ModuleIRCv3STS : public Module
 			return;
 
 		policy = newpolicy;
-		const std::string newpolicystr = policy.GetString();
-		ServerInstance->Logs->Log("m_ircv3_sts", DEFAULT, "STS: policy changed to \"%s\"", newpolicystr.c_str());
-		cap.SetPolicy("sts", newpolicystr);
+		const std::string plaintextpolicy = policy.GetPlaintextString();
+		const std::string securepolicy = policy.GetSecureString();
+		ServerInstance->Logs->Log("m_ircv3_sts", DEFAULT, "STS: policy changed to \"%s\" (plaintext) and \"%s\" (TLS)",
+			plaintextpolicy.c_str(), securepolicy.c_str());
+		cap.SetPolicy("sts", plaintextpolicy, securepolicy);
 	}
 
 	void OnEvent(Event& ev)
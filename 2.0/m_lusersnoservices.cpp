@@ -27,18 +27,35 @@ class ModuleLusersNoServices : public Module
 {
 	int clientsNoServices;
 
+	/* Set on the users who are included in clientsNoServices. The U-Line check is only done
+	 * once per user so nick changes and rehashes can't make the count drift on quit. */
+	LocalIntExt counted;
+
+	void AddUser(User *user)
+	{
+		if (ServerInstance->ULine(user->server) || ServerInstance->ULine(user->nick))
+			return;
+
+		this->counted.set(user, 1);
+		++this->clientsNoServices;
+	}
+
 public:
+	ModuleLusersNoServices() : clientsNoServices(0), counted("lusersnoservices_counted", this)
+	{
+	}
+
 	void init()
 	{
+		ServerInstance->Modules->AddService(this->counted);
 		Implementation implementations[] = { I_OnNumeric, I_OnPostConnect, I_OnUserQuit };
 		ServerInstance->Modules->Attach(implementations, this, sizeof(implementations) / sizeof(implementations[0]));
 
 		/* Calculate how many clients are not psuedo-clients introduced by the Services package */
-		this->clientsNoServices = 0;
 		user_hash::const_iterator curr = ServerInstance->Users->clientlist->begin(), end = ServerInstance->Users->clientlist->end();
 		for (; curr != end; ++curr)
-			if (!ServerInstance->ULine(curr->second->server) && !ServerInstance->ULine(curr->second->nick))
-				++this->clientsNoServices;
+			if (curr->second->registered == REG_ALL)
+				this->AddUser(curr->second);
 	}
 
 	Version GetVersion()
@@ -55,14 +72,17 @@ public:
 
 	void OnPostConnect(User *user)
 	{
-		if (!ServerInstance->ULine(user->server) && !ServerInstance->ULine(user->nick))
-			++this->clientsNoServices;
+		if (!this->counted.get(user))
+			this->AddUser(user);
 	}
 
 	void OnUserQuit(User *user, const std::string &, const std::string &)
 	{
-		if (!ServerInstance->ULine(user->server) && !ServerInstance->ULine(user->nick))
+		if (this->counted.get(user))
+		{
+			this->counted.set(user, 0);
 			--this->clientsNoServices;
+		}
 	}
 };
 
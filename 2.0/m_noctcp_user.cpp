@@ -55,7 +55,14 @@ public:
 		if (!IS_LOCAL(user))
 			return MOD_RES_PASSTHRU;
 
-		if ((text.empty()) || (text[0] != '\001') || (!strncmp(text.c_str(), "\1ACTION ", 8)) || (text == "\1ACTION\1") || (text == "\1ACTION"))
+		if ((text.empty()) || (text[0] != '\001'))
+			return MOD_RES_PASSTHRU;
+
+		// The verb ends at the first space or the closing \1, ACTION is always allowed.
+		size_t verbend = text.find_first_of(" \1", 1);
+		if (verbend == std::string::npos)
+			verbend = text.length();
+		if (text.compare(1, verbend - 1, "ACTION") == 0)
 			return MOD_RES_PASSTHRU;
 
 		switch (target_type)
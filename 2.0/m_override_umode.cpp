@@ -52,28 +52,25 @@ snoonexpire="no">
 
 static unsigned int activetime; // seconds after the mode expires
 
-struct ActiveOper
-{
-	std::string uuid;
-	time_t expiretime;
-
-	ActiveOper(LocalUser* user)
-		: uuid(user->uuid)
-		, expiretime(ServerInstance->Time() + activetime)
-	{
-	}
-};
-
-typedef std::vector<ActiveOper> ActiveOperList;
-static ActiveOperList activeopers; // List of opers with the mode set who need expire checking
+/** Opers with the mode set who need expire checking, ordered by the time
+ * their mode expires. An entry is only acted on if it still matches the
+ * expiry time stored on the oper, so unsetting the mode doesn't need to
+ * search for it here.
+ */
+typedef std::multimap<time_t, std::string> ExpiryQueue;
+static ExpiryQueue expiries;
 static bool snoonset;
 static bool snoonunset;
 
 class OverrideMode : public ModeHandler
 {
  public:
+	// The time at which the mode expires on a local oper.
+	LocalIntExt expiry;
+
 	OverrideMode(Module* mod, unsigned char modechar)
 		: ModeHandler(mod, "override", modechar, PARAM_NONE, MODETYPE_USER)
+		, expiry("override_expiry", mod)
 	{
 		oper = true;
 	}
@@ -104,20 +101,16 @@ class OverrideMode : public ModeHandler
 			if (adding)
 			{
 				if (activetime > 0)
-					activeopers.push_back(ActiveOper(localuser));
+				{
+					const time_t expiretime = ServerInstance->Time() + activetime;
+					expiry.set(localuser, expiretime);
+					expiries.insert(std::make_pair(expiretime, localuser->uuid));
+				}
 			}
 			else
 			{
-				// Remove this oper from the list
-				for (ActiveOperList::iterator i = activeopers.begin(); i != activeopers.end(); ++i)
-				{
-					ActiveOper& item = *i;
-					if (item.uuid == dest->uuid)
-					{
-						activeopers.erase(i);
-						break;
-					}
-				}
+				// Any queued expiry for this oper is now stale
+				expiry.unset(localuser);
 			}
 		}
 
@@ -146,6 +139,7 @@ class ModuleOverrideUserMode : public Module
 		Implementation eventlist[] = { I_OnLoadModule, I_OnUnloadModule, I_OnBackgroundTimer, I_OnRehash, I_OnPreMode, I_OnUserPreJoin, I_OnUserPreKick, I_OnPreTopicChange };
 		ServerInstance->Modules->Attach(eventlist, this, sizeof(eventlist)/sizeof(Implementation));
 		ServerInstance->Modules->AddService(overridemode);
+		ServerInstance->Modules->AddService(overridemode.expiry);
 		OnRehash(NULL);
 		overridemod = ServerInstance->Modules->Find("m_override.so");
 	}
@@ -232,30 +226,30 @@ class ModuleOverrideUserMode : public Module
 
 	void OnBackgroundTimer(time_t curtime)
 	{
-		for (ActiveOperList::iterator i = activeopers.begin(); i != activeopers.end(); )
+		while (!expiries.empty() && expiries.begin()->first < curtime)
 		{
-			ActiveOper& item = *i;
-			if (item.expiretime < curtime)
-			{
-				User* const user = ServerInstance->FindUUID(item.uuid);
-				i = activeopers.erase(i);
-				if ((!user) || (user->quitting))
-					continue; // User has quit
-
-				if (!expiremsg.empty())
-					user->WriteServ("NOTICE %s :%s", user->nick.c_str(), expiremsg.c_str());
-
-				if (snoonexpire)
-					ServerInstance->SNO->WriteGlobalSno('v', "Override has expired on oper %s", user->nick.c_str());
-
-				// Remove the mode
-				std::vector<std::string> modeparams;
-				modeparams.push_back(user->nick);
-				modeparams.push_back(std::string("-") + overridemode.GetModeChar());
-				ServerInstance->SendGlobalMode(modeparams, ServerInstance->FakeClient);
-			}
-			else
-				++i;
+			const time_t expiretime = expiries.begin()->first;
+			User* const user = ServerInstance->FindUUID(expiries.begin()->second);
+			expiries.erase(expiries.begin());
+			if ((!user) || (user->quitting))
+				continue; // User has quit
+
+			// Skip entries from a mode change which has since been undone
+			if (overridemode.expiry.get(user) != expiretime)
+				continue;
+			overridemode.expiry.unset(user);
+
+			if (!expiremsg.empty())
+				user->WriteServ("NOTICE %s :%s", user->nick.c_str(), expiremsg.c_str());
+
+			if (snoonexpire)
+				ServerInstance->SNO->WriteGlobalSno('v', "Override has expired on oper %s", user->nick.c_str());
+
+			// Remove the mode
+			std::vector<std::string> modeparams;
+			modeparams.push_back(user->nick);
+			modeparams.push_back(std::string("-") + overridemode.GetModeChar());
+			ServerInstance->SendGlobalMode(modeparams, ServerInstance->FakeClient);
 		}
 	}
 
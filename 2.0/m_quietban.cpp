@@ -35,14 +35,69 @@
 class QuietBan : public ListModeBase
 {
 	public:
-		QuietBan(Module* Creator) : ListModeBase(Creator, "quietban", 'q', "End of Channel Quiet List", 728, 729, true) { }
+		/* Cached verdict on each membership: 0 = unknown, 1 = can speak, 2 = muted */
+		LocalIntExt verdict;
 
+		QuietBan(Module* Creator) : ListModeBase(Creator, "quietban", 'q', "End of Channel Quiet List", 728, 729, true)
+			, verdict("quietban_verdict", Creator) { }
+
+		/** Forgets the verdicts of everyone in a channel */
+		void Invalidate(Channel* chan)
+		{
+			const UserMembList* members = chan->GetUsers();
+			for (UserMembCIter i = members->begin(); i != members->end(); ++i)
+				verdict.unset(i->second);
+		}
+
+		/** Forgets the verdicts of a user in every channel they are in */
+		void Invalidate(User* user)
+		{
+			for (UCListIter i = user->chans.begin(); i != user->chans.end(); ++i)
+			{
+				Membership* memb = (*i)->GetUser(user);
+				if (memb)
+					verdict.unset(memb);
+			}
+		}
+
+		ModeAction OnModeChange(User* source, User* dest, Channel* channel, std::string &parameter, bool adding)
+		{
+			ModeAction res = ListModeBase::OnModeChange(source, dest, channel, parameter, adding);
+			if (res == MODEACTION_ALLOW)
+				Invalidate(channel);
+			return res;
+		}
 };
 
 class ModuleQuietBan : public Module
 {
 	QuietBan qb;
 
+	bool IsMuted(User* user, Channel* chan)
+	{
+		/* Get the list of +q's */
+		modelist *list = qb.extItem.get(chan);
+
+		/* No list, continue. */
+		if (!list)
+			return false;
+
+		/* Copied from m_banredirect.cpp */
+		std::string ipmask(user->nick);
+		ipmask.append(1, '!').append(user->MakeHostIP());
+		const std::string& fullhost = user->GetFullHost();
+		const std::string& fullrealhost = user->GetFullRealHost();
+
+		/* If this matches, then they match a +q, & don't allow them to speak. */
+		for (modelist::iterator it = list->begin(); it != list->end(); it++)
+			if (InspIRCd::Match(fullhost, it->mask) ||
+				InspIRCd::Match(fullrealhost, it->mask) ||
+				InspIRCd::MatchCIDR(ipmask, it->mask))
+				return true;
+
+		return false;
+	}
+
 	public:
 		ModuleQuietBan() : qb(this)
 		{
@@ -54,12 +109,13 @@ class ModuleQuietBan : public Module
 				throw ModuleException("Cannot load with: m_muteban.so or m_chanprotect.so.");
 
 			ServerInstance->Modules->AddService(qb);
+			ServerInstance->Modules->AddService(qb.verdict);
 
 			/* Populate Implements list with the events for a List Mode */
 			qb.DoImplements(this);
 
-			Implementation list[] = { I_OnUserPreNotice, I_OnUserPreMessage };
-			ServerInstance->Modules->Attach(list, this, 2);
+			Implementation list[] = { I_OnUserPreNotice, I_OnUserPreMessage, I_OnUserPostNick, I_OnChangeHost, I_OnChangeIdent, I_OnSetUserIP };
+			ServerInstance->Modules->Attach(list, this, sizeof(list)/sizeof(Implementation));
 		}
 
 		ModResult OnUserPreMessage(User* user, void* dest, int target_type, std::string &text, char status, CUList &exempt_list)
@@ -72,32 +128,50 @@ class ModuleQuietBan : public Module
 				if (chan->GetPrefixValue(user) >= VOICE_VALUE)
 					return MOD_RES_PASSTHRU;
 
-				/* Get the list of +q's */
-				modelist *list = qb.extItem.get(chan);
-
-				/* No list, continue. */
-				if (!list)
-					return MOD_RES_PASSTHRU;
-
-				/* Copied from m_banredirect.cpp */
-				std::string ipmask(user->nick);
-				ipmask.append(1, '!').append(user->MakeHostIP());
-
-				/* If this matches, then they match a +q, & don't allow them to speak. */
-				for (modelist::iterator it = list->begin(); it != list->end(); it++)
-					if (InspIRCd::Match(user->GetFullHost(), it->mask) ||
-						InspIRCd::Match(user->GetFullRealHost(), it->mask) ||
-						InspIRCd::MatchCIDR(ipmask, it->mask))
-					{
-						/* lol 404 */
-						user->WriteNumeric(404, "%s %s :Cannot send to channel (You are muted (+q))", user->nick.c_str(), chan->name.c_str());
-						return MOD_RES_DENY;
-					}
+				/* Non-members are checked every time as there is nowhere to keep the verdict. */
+				Membership* memb = chan->GetUser(user);
+				bool muted;
+				if (!memb)
+					muted = IsMuted(user, chan);
+				else if (qb.verdict.get(memb))
+					muted = (qb.verdict.get(memb) == 2);
+				else
+				{
+					muted = IsMuted(user, chan);
+					qb.verdict.set(memb, muted ? 2 : 1);
+				}
+
+				if (muted)
+				{
+					/* lol 404 */
+					user->WriteNumeric(404, "%s %s :Cannot send to channel (You are muted (+q))", user->nick.c_str(), chan->name.c_str());
+					return MOD_RES_DENY;
+				}
 			}
 
 			return MOD_RES_PASSTHRU;
 		}
 
+		void OnUserPostNick(User* user, const std::string& oldnick)
+		{
+			qb.Invalidate(user);
+		}
+
+		void OnChangeHost(User* user, const std::string& newhost)
+		{
+			qb.Invalidate(user);
+		}
+
+		void OnChangeIdent(User* user, const std::string& newident)
+		{
+			qb.Invalidate(user);
+		}
+
+		void OnSetUserIP(LocalUser* user)
+		{
+			qb.Invalidate(user);
+		}
+
 		ModResult OnUserPreNotice(User* user, void* dest, int target_type, std::string &text, char status, CUList &exempt_list)
 		{
 			return OnUserPreMessage(user, dest, target_type, text, status, exempt_list);
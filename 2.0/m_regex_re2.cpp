@@ -36,6 +36,7 @@
 /* $ModDesc: Regex Provider Module for RE2. */
 /* $ModDepends: core 2.0 */
 /* $LinkerFlags: -lre2 */
+/* $ModConfig: <regex_re2 maxmem="8M" maxprogramsize="0" literal="no" longestmatch="no"> */
 
 class RE2Exception : public ModuleException
 {
@@ -50,12 +51,18 @@ class RE2Regex : public Regex
 	RE2 regexcl;
 
  public:
-	RE2Regex(const std::string& rx) : Regex(rx), regexcl(rx, RE2::Quiet)
+	RE2Regex(const std::string& rx, const RE2::Options& options, int maxprogramsize) : Regex(rx), regexcl(rx, options)
 	{
 		if (!regexcl.ok())
 		{
 			throw RE2Exception(rx, regexcl.error());
 		}
+
+		// The program size is RE2's measure of how expensive a pattern is.
+		if (maxprogramsize && regexcl.ProgramSize() > maxprogramsize)
+		{
+			throw RE2Exception(rx, "pattern is too complex (" + ConvToStr(regexcl.ProgramSize()) + " > " + ConvToStr(maxprogramsize) + ")");
+		}
 	}
 
 	bool Matches(const std::string& text)
@@ -67,11 +74,14 @@ class RE2Regex : public Regex
 class RE2Factory : public RegexFactory
 {
  public:
-	RE2Factory(Module* m) : RegexFactory(m, "regex/re2") { }
+	RE2::Options options;
+	int maxprogramsize;
+
+	RE2Factory(Module* m) : RegexFactory(m, "regex/re2"), options(RE2::Quiet), maxprogramsize(0) { }
 
 	Regex* Create(const std::string& expr)
 	{
-		return new RE2Regex(expr);
+		return new RE2Regex(expr, options, maxprogramsize);
 	}
 };
 
@@ -85,6 +95,23 @@ class ModuleRegexRE2 : public Module
 		ServerInstance->Modules->AddService(ref);
 	}
 
+	void init()
+	{
+		OnRehash(NULL);
+		ServerInstance->Modules->Attach(I_OnRehash, this);
+	}
+
+	void OnRehash(User* user)
+	{
+		ConfigTag* tag = ServerInstance->Config->ConfValue("regex_re2");
+
+		// The memory RE2 may use for a compiled pattern including its DFA cache.
+		ref.options.set_max_mem(std::max<long>(1 << 20, tag->getInt("maxmem", 8 << 20)));
+		ref.options.set_literal(tag->getBool("literal"));
+		ref.options.set_longest_match(tag->getBool("longestmatch"));
+		ref.maxprogramsize = std::max<long>(0, tag->getInt("maxprogramsize", 0));
+	}
+
 	Version GetVersion()
 	{
 		return Version("Regex Provider Module for RE2");
@@ -43,31 +43,39 @@ class ModuleReplayMessage : public Module
 		if (!standardCap.ext.get(user) && !vendorCap.ext.get(user))
 			return;
 
-		std::string target;
+		// Build the echoed line in one go instead of formatting it through a printf style buffer.
+		const std::string& prefix = user->GetFullHost();
+		std::string line;
+		line.reserve(prefix.length() + strlen(cmd) + text.length() + 64);
+		line.push_back(':');
+		line.append(prefix).push_back(' ');
+		line.append(cmd).push_back(' ');
+
 		if (target_type == TYPE_USER)
 		{
 			User* destuser = (User*) dest;
 			if (destuser == user)
 				return;
 
-			target = destuser->nick;
+			line.append(destuser->nick);
 		}
 		else if (target_type == TYPE_CHANNEL)
 		{
 			Channel* chan = (Channel*) dest;
 			if (status)
-				target.push_back(status);
-			target.append(chan->name);
+				line.push_back(status);
+			line.append(chan->name);
 		}
 		else if (target_type == TYPE_SERVER)
 		{
 			const char* destserver = (const char*) dest;
-			target.append(destserver);
+			line.append(destserver);
 		}
 		else
 			return;
 
-		user->WriteFrom(user, "%s %s :%s", cmd, target.c_str(), text.c_str());
+		line.append(" :").append(text);
+		user->Write(line);
 	}
 
  public:
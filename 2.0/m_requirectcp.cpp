@@ -79,7 +79,10 @@ class ModuleRequireCTCP : public Module
 	{
 		if (command == "NOTICE" && !validated && parameters.size() > 1 && ext.get(user))
 		{
-			if (parameters[1].size() > 1 && parameters[1][0] == 0x1 && parameters[1].compare(1, ctcp.length(), ctcp) == 0)
+			const std::string& text = parameters[1];
+			// The reply must be for the verb itself rather than one it is a prefix of.
+			if (text.size() > 1 && text[0] == 0x1 && text.compare(1, ctcp.length(), ctcp) == 0
+				&& (ctcp.empty() || text.size() == ctcp.length() + 1 || text[ctcp.length() + 1] == ' ' || text[ctcp.length() + 1] == 0x1))
 			{
 				ext.set(user, 0);
 				if (!accepted.empty())
@@ -22,23 +22,124 @@
 /* $ModDepends: core 2.0 */
 /* $ModConfig: <saslservercheck reason="SASL is currently unavailable."> */
 
+/* While the target is unavailable the sasl capability is left out of CAP LS.
+ * With m_capnotify loaded, clients are sent CAP DEL and CAP NEW when it goes and comes back.
+ */
+
 #include "inspircd.h"
 #include "account.h"
+#include "m_cap.h"
 
+class ModuleSaslServerCheck;
+
+/** Checks the target every few seconds so the sasl capability follows it even
+ * when nobody is sending AUTHENTICATE.
+ */
+class SaslCheckTimer : public Timer
+{
+	ModuleSaslServerCheck* parent;
+
+ public:
+	SaslCheckTimer(ModuleSaslServerCheck* Parent)
+		: Timer(5, ServerInstance->Time(), true)
+		, parent(Parent)
+	{
+	}
+
+	void Tick(time_t);
+};
 
 class ModuleSaslServerCheck : public Module
 {
 	std::string reason;
 	std::string target;
 
+	// Whether the target was linked when the server list was last checked.
+	bool reachable;
+	time_t lastcheck;
+
+	// Whether the sasl capability is currently being advertised.
+	bool advertised;
+	SaslCheckTimer* timer;
+
+	bool IsReachable()
+	{
+		// A SASL login sends several AUTHENTICATE lines so only look once a second.
+		if (lastcheck == ServerInstance->Time())
+			return reachable;
+
+		lastcheck = ServerInstance->Time();
+		ProtoServerList servers;
+		ServerInstance->PI->GetServerList(servers);
+
+		// No server list can mean that there is no linking module loaded.
+		reachable = servers.empty();
+		for (ProtoServerList::const_iterator i = servers.begin(); i != servers.end() && !reachable; ++i)
+			reachable = (i->servername == target);
+
+		if (reachable != advertised)
+		{
+			// Rebuilding the 005 makes m_capnotify list the caps again and send the difference.
+			advertised = reachable;
+			ServerInstance->Config->Update005();
+		}
+		return reachable;
+	}
+
  public:
+	ModuleSaslServerCheck()
+		: reachable(false)
+		, lastcheck(0)
+		, advertised(true)
+		, timer(NULL)
+	{
+	}
+
+	~ModuleSaslServerCheck()
+	{
+		if (timer)
+			ServerInstance->Timers->DelTimer(timer);
+	}
+
 	void init()
 	{
 		OnRehash(NULL);
-		Implementation eventlist[] = { I_OnRehash, I_OnPreCommand };
+		timer = new SaslCheckTimer(this);
+		ServerInstance->Timers->AddTimer(timer);
+
+		Implementation eventlist[] = { I_OnRehash, I_OnPreCommand, I_OnEvent };
 		ServerInstance->Modules->Attach(eventlist, this, sizeof(eventlist)/sizeof(Implementation));
 	}
 
+	void Prioritize()
+	{
+		// The sasl capability has to be listed by m_sasl before it can be taken out again.
+		ServerInstance->Modules->SetPriority(this, I_OnEvent, PRIORITY_AFTER, ServerInstance->Modules->Find("m_sasl.so"));
+	}
+
+	void Check()
+	{
+		IsReachable();
+	}
+
+	void OnEvent(Event& ev)
+	{
+		if (ev.id != "cap_request" || advertised)
+			return;
+
+		CapEvent* data = static_cast<CapEvent*>(&ev);
+		if (data->type != CapEvent::CAPEVENT_LS)
+			return;
+
+		for (std::vector<std::string>::iterator i = data->wanted.begin(); i != data->wanted.end(); )
+		{
+			if (*i == "sasl" || i->compare(0, 5, "sasl=") == 0)
+				i = data->wanted.erase(i);
+			else
+				++i;
+		}
+	}
+
 	void OnRehash(User*)
 	{
 		reason = ServerInstance->Config->ConfValue("saslservercheck")->getString("reason", "SASL is currently unavailable.");
@@ -46,6 +147,9 @@ class ModuleSaslServerCheck : public Module
 
 		if (target.empty() || target == "*")
 			throw ModuleException("This module is useless without setting the <sasl target=\"services.mynetwork.com\"> value");
+
+		// The target may have changed.
+		lastcheck = 0;
 	}
 
 	ModResult OnPreCommand(std::string& command, std::vector<std::string>&, LocalUser* user, bool validated, const std::string&)
@@ -53,17 +157,9 @@ class ModuleSaslServerCheck : public Module
 		if (!validated || command != "AUTHENTICATE" || (target.empty() || target == "*"))
 			return MOD_RES_PASSTHRU;
 
-		ProtoServerList servers;
-		ServerInstance->PI->GetServerList(servers);
-		if (servers.empty())
+		if (IsReachable())
 			return MOD_RES_PASSTHRU;
 
-		for (ProtoServerList::const_iterator i = servers.begin(); i != servers.end(); ++i)
-		{
-			if (i->servername == target)
-				return MOD_RES_PASSTHRU;
-		}
-
 		// Target server not found, return SASL Fail and deny the command
 		user->WriteNumeric(904, "%s :SASL authentication failed: %s", user->nick.c_str(), reason.c_str());
 		return MOD_RES_DENY;
@@ -76,4 +172,9 @@ class ModuleSaslServerCheck : public Module
 	}
 };
 
+void SaslCheckTimer::Tick(time_t)
+{
+	parent->Check();
+}
+
 MODULE_INIT(ModuleSaslServerCheck)
@@ -41,6 +41,17 @@ A million repetitions of "a"
 #include "inspircd.h"
 #include "hash.h"
 
+#if (defined __x86_64__ || defined __i386__) && (defined __GNUC__ || defined __clang__)
+# define SHA1_HAS_SHANI
+# include <cpuid.h>
+# include <immintrin.h>
+#elif defined __aarch64__ && defined __ARM_FEATURE_CRYPTO && defined __linux__
+# define SHA1_HAS_ARMV8
+# include <arm_neon.h>
+# include <asm/hwcap.h>
+# include <sys/auxv.h>
+#endif
+
 union CHAR64LONG16
 {
 	unsigned char c[64];
@@ -73,26 +84,21 @@ static const uint32_t sha1_iv[5] =
 	0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0
 };
 
-class SHA1Context
+static void TransformScalar(uint32_t state[5], const unsigned char* data, size_t blocks)
 {
-	uint32_t state[5];
-	uint32_t count[2];
-	unsigned char buffer[64];
-	unsigned char digest[20];
-
-	void Transform(const unsigned char buf[64])
+	for (; blocks--; data += 64)
 	{
 		uint32_t a, b, c, d, e;
 
 		CHAR64LONG16 block;
-		memcpy(block.c, buf, 64);
+		memcpy(block.c, data, 64);
 
 		/* Copy context->state[] to working vars */
-		a = this->state[0];
-		b = this->state[1];
-		c = this->state[2];
-		d = this->state[3];
-		e = this->state[4];
+		a = state[0];
+		b = state[1];
+		c = state[2];
+		d = state[3];
+		e = state[4];
 
 		/* 4 rounds of 20 operations each. Loop unrolled. */
 		R0(block, a, b, c, d, e, 0); R0(block, e, a, b, c, d, 1); R0(block, d, e, a, b, c, 2); R0(block, c, d, e, a, b, 3);
@@ -116,14 +122,397 @@ class SHA1Context
 		R4(block, d, e, a, b, c, 72); R4(block, c, d, e, a, b, 73); R4(block, b, c, d, e, a, 74); R4(block, a, b, c, d, e, 75);
 		R4(block, e, a, b, c, d, 76); R4(block, d, e, a, b, c, 77); R4(block, c, d, e, a, b, 78); R4(block, b, c, d, e, a, 79);
 		/* Add the working vars back into context.state[] */
-		this->state[0] += a;
-		this->state[1] += b;
-		this->state[2] += c;
-		this->state[3] += d;
-		this->state[4] += e;
+		state[0] += a;
+		state[1] += b;
+		state[2] += c;
+		state[3] += d;
+		state[4] += e;
 		/* Wipe variables */
 		a = b = c = d = e = 0;
 	}
+}
+
+#if defined SHA1_HAS_SHANI
+/* Based on the public domain SHA-NI code by Sean Gulley and Jeffrey Walton. */
+__attribute__((target("sha,sse4.1")))
+static void TransformSHANI(uint32_t state[5], const unsigned char* data, size_t blocks)
+{
+	const __m128i MASK = _mm_set_epi64x(0x0001020304050607ULL, 0x08090A0B0C0D0E0FULL);
+	__m128i ABCD = _mm_shuffle_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(state)), 0x1B);
+	__m128i E0 = _mm_set_epi32(state[4], 0, 0, 0);
+	__m128i E1, MSG0, MSG1, MSG2, MSG3;
+
+	for (; blocks--; data += 64)
+	{
+		const __m128i ABCD_SAVE = ABCD;
+		const __m128i E0_SAVE = E0;
+
+		/* Rounds 0-3 */
+		MSG0 = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(data + 0)), MASK);
+		E0 = _mm_add_epi32(E0, MSG0);
+		E1 = ABCD;
+		ABCD = _mm_sha1rnds4_epu32(ABCD, E0, 0);
+
+		/* Rounds 4-7 */
+		MSG1 = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(data + 16)), MASK);
+		E1 = _mm_sha1nexte_epu32(E1, MSG1);
+		E0 = ABCD;
+		ABCD = _mm_sha1rnds4_epu32(ABCD, E1, 0);
+		MSG0 = _mm_sha1msg1_epu32(MSG0, MSG1);
+
+		/* Rounds 8-11 */
+		MSG2 = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(data + 32)), MASK);
+		E0 = _mm_sha1nexte_epu32(E0, MSG2);
+		E1 = ABCD;
+		ABCD = _mm_sha1rnds4_epu32(ABCD, E0, 0);
+		MSG1 = _mm_sha1msg1_epu32(MSG1, MSG2);
+		MSG0 = _mm_xor_si128(MSG0, MSG2);
+
+		/* Rounds 12-15 */
+		MSG3 = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(data + 48)), MASK);
+		E1 = _mm_sha1nexte_epu32(E1, MSG3);
+		E0 = ABCD;
+		MSG0 = _mm_sha1msg2_epu32(MSG0, MSG3);
+		ABCD = _mm_sha1rnds4_epu32(ABCD, E1, 0);
+		MSG2 = _mm_sha1msg1_epu32(MSG2, MSG3);
+		MSG1 = _mm_xor_si128(MSG1, MSG3);
+
+		/* Rounds 16-19 */
+		E0 = _mm_sha1nexte_epu32(E0, MSG0);
+		E1 = ABCD;
+		MSG1 = _mm_sha1msg2_epu32(MSG1, MSG0);
+		ABCD = _mm_sha1rnds4_epu32(ABCD, E0, 0);
+		MSG3 = _mm_sha1msg1_epu32(MSG3, MSG0);
+		MSG2 = _mm_xor_si128(MSG2, MSG0);
+
+		/* Rounds 20-23 */
+		E1 = _mm_sha1nexte_epu32(E1, MSG1);
+		E0 = ABCD;
+		MSG2 = _mm_sha1msg2_epu32(MSG2, MSG1);
+		ABCD = _mm_sha1rnds4_epu32(ABCD, E1, 1);
+		MSG0 = _mm_sha1msg1_epu32(MSG0, MSG1);
+		MSG3 = _mm_xor_si128(MSG3, MSG1);
+
+		/* Rounds 24-27 */
+		E0 = _mm_sha1nexte_epu32(E0, MSG2);
+		E1 = ABCD;
+		MSG3 = _mm_sha1msg2_epu32(MSG3, MSG2);
+		ABCD = _mm_sha1rnds4_epu32(ABCD, E0, 1);
+		MSG1 = _mm_sha1msg1_epu32(MSG1, MSG2);
+		MSG0 = _mm_xor_si128(MSG0, MSG2);
+
+		/* Rounds 28-31 */
+		E1 = _mm_sha1nexte_epu32(E1, MSG3);
+		E0 = ABCD;
+		MSG0 = _mm_sha1msg2_epu32(MSG0, MSG3);
+		ABCD = _mm_sha1rnds4_epu32(ABCD, E1, 1);
+		MSG2 = _mm_sha1msg1_epu32(MSG2, MSG3);
+		MSG1 = _mm_xor_si128(MSG1, MSG3);
+
+		/* Rounds 32-35 */
+		E0 = _mm_sha1nexte_epu32(E0, MSG0);
+		E1 = ABCD;
+		MSG1 = _mm_sha1msg2_epu32(MSG1, MSG0);
+		ABCD = _mm_sha1rnds4_epu32(ABCD, E0, 1);
+		MSG3 = _mm_sha1msg1_epu32(MSG3, MSG0);
+		MSG2 = _mm_xor_si128(MSG2, MSG0);
+
+		/* Rounds 36-39 */
+		E1 = _mm_sha1nexte_epu32(E1, MSG1);
+		E0 = ABCD;
+		MSG2 = _mm_sha1msg2_epu32(MSG2, MSG1);
+		ABCD = _mm_sha1rnds4_epu32(ABCD, E1, 1);
+		MSG0 = _mm_sha1msg1_epu32(MSG0, MSG1);
+		MSG3 = _mm_xor_si128(MSG3, MSG1);
+
+		/* Rounds 40-43 */
+		E0 = _mm_sha1nexte_epu32(E0, MSG2);
+		E1 = ABCD;
+		MSG3 = _mm_sha1msg2_epu32(MSG3, MSG2);
+		ABCD = _mm_sha1rnds4_epu32(ABCD, E0, 2);
+		MSG1 = _mm_sha1msg1_epu32(MSG1, MSG2);
+		MSG0 = _mm_xor_si128(MSG0, MSG2);
+
+		/* Rounds 44-47 */
+		E1 = _mm_sha1nexte_epu32(E1, MSG3);
+		E0 = ABCD;
+		MSG0 = _mm_sha1msg2_epu32(MSG0, MSG3);
+		ABCD = _mm_sha1rnds4_epu32(ABCD, E1, 2);
+		MSG2 = _mm_sha1msg1_epu32(MSG2, MSG3);
+		MSG1 = _mm_xor_si128(MSG1, MSG3);
+
+		/* Rounds 48-51 */
+		E0 = _mm_sha1nexte_epu32(E0, MSG0);
+		E1 = ABCD;
+		MSG1 = _mm_sha1msg2_epu32(MSG1, MSG0);
+		ABCD = _mm_sha1rnds4_epu32(ABCD, E0, 2);
+		MSG3 = _mm_sha1msg1_epu32(MSG3, MSG0);
+		MSG2 = _mm_xor_si128(MSG2, MSG0);
+
+		/* Rounds 52-55 */
+		E1 = _mm_sha1nexte_epu32(E1, MSG1);
+		E0 = ABCD;
+		MSG2 = _mm_sha1msg2_epu32(MSG2, MSG1);
+		ABCD = _mm_sha1rnds4_epu32(ABCD, E1, 2);
+		MSG0 = _mm_sha1msg1_epu32(MSG0, MSG1);
+		MSG3 = _mm_xor_si128(MSG3, MSG1);
+
+		/* Rounds 56-59 */
+		E0 = _mm_sha1nexte_epu32(E0, MSG2);
+		E1 = ABCD;
+		MSG3 = _mm_sha1msg2_epu32(MSG3, MSG2);
+		ABCD = _mm_sha1rnds4_epu32(ABCD, E0, 2);
+		MSG1 = _mm_sha1msg1_epu32(MSG1, MSG2);
+		MSG0 = _mm_xor_si128(MSG0, MSG2);
+
+		/* Rounds 60-63 */
+		E1 = _mm_sha1nexte_epu32(E1, MSG3);
+		E0 = ABCD;
+		MSG0 = _mm_sha1msg2_epu32(MSG0, MSG3);
+		ABCD = _mm_sha1rnds4_epu32(ABCD, E1, 3);
+		MSG2 = _mm_sha1msg1_epu32(MSG2, MSG3);
+		MSG1 = _mm_xor_si128(MSG1, MSG3);
+
+		/* Rounds 64-67 */
+		E0 = _mm_sha1nexte_epu32(E0, MSG0);
+		E1 = ABCD;
+		MSG1 = _mm_sha1msg2_epu32(MSG1, MSG0);
+		ABCD = _mm_sha1rnds4_epu32(ABCD, E0, 3);
+		MSG3 = _mm_sha1msg1_epu32(MSG3, MSG0);
+		MSG2 = _mm_xor_si128(MSG2, MSG0);
+
+		/* Rounds 68-71 */
+		E1 = _mm_sha1nexte_epu32(E1, MSG1);
+		E0 = ABCD;
+		MSG2 = _mm_sha1msg2_epu32(MSG2, MSG1);
+		ABCD = _mm_sha1rnds4_epu32(ABCD, E1, 3);
+		MSG3 = _mm_xor_si128(MSG3, MSG1);
+
+		/* Rounds 72-75 */
+		E0 = _mm_sha1nexte_epu32(E0, MSG2);
+		E1 = ABCD;
+		MSG3 = _mm_sha1msg2_epu32(MSG3, MSG2);
+		ABCD = _mm_sha1rnds4_epu32(ABCD, E0, 3);
+
+		/* Rounds 76-79 */
+		E1 = _mm_sha1nexte_epu32(E1, MSG3);
+		E0 = ABCD;
+		ABCD = _mm_sha1rnds4_epu32(ABCD, E1, 3);
+		/* Add the working vars back into the state */
+		E0 = _mm_sha1nexte_epu32(E0, E0_SAVE);
+		ABCD = _mm_add_epi32(ABCD, ABCD_SAVE);
+	}
+
+	_mm_storeu_si128(reinterpret_cast<__m128i*>(state), _mm_shuffle_epi32(ABCD, 0x1B));
+	state[4] = _mm_extract_epi32(E0, 3);
+}
+
+static bool HasSHANI()
+{
+	unsigned int eax, ebx, ecx, edx;
+	if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx) || !(ecx & bit_SSE4_1))
+		return false;
+	if (__get_cpuid_max(0, NULL) < 7)
+		return false;
+	__cpuid_count(7, 0, eax, ebx, ecx, edx);
+	return ebx & (1 << 29);
+}
+#endif
+
+#if defined SHA1_HAS_ARMV8
+/* Based on the public domain ARMv8 SHA code by Jeffrey Walton. */
+static void TransformARMv8(uint32_t state[5], const unsigned char* data, size_t blocks)
+{
+	uint32x4_t ABCD = vld1q_u32(state);
+	uint32_t E0 = state[4];
+	uint32_t E1;
+	uint32x4_t TMP0, TMP1, MSG0, MSG1, MSG2, MSG3;
+
+	for (; blocks--; data += 64)
+	{
+		const uint32x4_t ABCD_SAVE = ABCD;
+		const uint32_t E0_SAVE = E0;
+
+		MSG0 = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(data)));
+		MSG1 = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(data + 16)));
+		MSG2 = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(data + 32)));
+		MSG3 = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(data + 48)));
+		TMP0 = vaddq_u32(MSG0, vdupq_n_u32(0x5A827999));
+		TMP1 = vaddq_u32(MSG1, vdupq_n_u32(0x5A827999));
+
+		/* Rounds 0-3 */
+		E1 = vsha1h_u32(vgetq_lane_u32(ABCD, 0));
+		ABCD = vsha1cq_u32(ABCD, E0, TMP0);
+		TMP0 = vaddq_u32(MSG2, vdupq_n_u32(0x5A827999));
+		MSG0 = vsha1su0q_u32(MSG0, MSG1, MSG2);
+
+		/* Rounds 4-7 */
+		E0 = vsha1h_u32(vgetq_lane_u32(ABCD, 0));
+		ABCD = vsha1cq_u32(ABCD, E1, TMP1);
+		TMP1 = vaddq_u32(MSG3, vdupq_n_u32(0x5A827999));
+		MSG0 = vsha1su1q_u32(MSG0, MSG3);
+		MSG1 = vsha1su0q_u32(MSG1, MSG2, MSG3);
+
+		/* Rounds 8-11 */
+		E1 = vsha1h_u32(vgetq_lane_u32(ABCD, 0));
+		ABCD = vsha1cq_u32(ABCD, E0, TMP0);
+		TMP0 = vaddq_u32(MSG0, vdupq_n_u32(0x5A827999));
+		MSG1 = vsha1su1q_u32(MSG1, MSG0);
+		MSG2 = vsha1su0q_u32(MSG2, MSG3, MSG0);
+
+		/* Rounds 12-15 */
+		E0 = vsha1h_u32(vgetq_lane_u32(ABCD, 0));
+		ABCD = vsha1cq_u32(ABCD, E1, TMP1);
+		TMP1 = vaddq_u32(MSG1, vdupq_n_u32(0x6ED9EBA1));
+		MSG2 = vsha1su1q_u32(MSG2, MSG1);
+		MSG3 = vsha1su0q_u32(MSG3, MSG0, MSG1);
+
+		/* Rounds 16-19 */
+		E1 = vsha1h_u32(vgetq_lane_u32(ABCD, 0));
+		ABCD = vsha1cq_u32(ABCD, E0, TMP0);
+		TMP0 = vaddq_u32(MSG2, vdupq_n_u32(0x6ED9EBA1));
+		MSG3 = vsha1su1q_u32(MSG3, MSG2);
+		MSG0 = vsha1su0q_u32(MSG0, MSG1, MSG2);
+
+		/* Rounds 20-23 */
+		E0 = vsha1h_u32(vgetq_lane_u32(ABCD, 0));
+		ABCD = vsha1pq_u32(ABCD, E1, TMP1);
+		TMP1 = vaddq_u32(MSG3, vdupq_n_u32(0x6ED9EBA1));
+		MSG0 = vsha1su1q_u32(MSG0, MSG3);
+		MSG1 = vsha1su0q_u32(MSG1, MSG2, MSG3);
+
+		/* Rounds 24-27 */
+		E1 = vsha1h_u32(vgetq_lane_u32(ABCD, 0));
+		ABCD = vsha1pq_u32(ABCD, E0, TMP0);
+		TMP0 = vaddq_u32(MSG0, vdupq_n_u32(0x6ED9EBA1));
+		MSG1 = vsha1su1q_u32(MSG1, MSG0);
+		MSG2 = vsha1su0q_u32(MSG2, MSG3, MSG0);
+
+		/* Rounds 28-31 */
+		E0 = vsha1h_u32(vgetq_lane_u32(ABCD, 0));
+		ABCD = vsha1pq_u32(ABCD, E1, TMP1);
+		TMP1 = vaddq_u32(MSG1, vdupq_n_u32(0x6ED9EBA1));
+		MSG2 = vsha1su1q_u32(MSG2, MSG1);
+		MSG3 = vsha1su0q_u32(MSG3, MSG0, MSG1);
+
+		/* Rounds 32-35 */
+		E1 = vsha1h_u32(vgetq_lane_u32(ABCD, 0));
+		ABCD = vsha1pq_u32(ABCD, E0, TMP0);
+		TMP0 = vaddq_u32(MSG2, vdupq_n_u32(0x8F1BBCDC));
+		MSG3 = vsha1su1q_u32(MSG3, MSG2);
+		MSG0 = vsha1su0q_u32(MSG0, MSG1, MSG2);
+
+		/* Rounds 36-39 */
+		E0 = vsha1h_u32(vgetq_lane_u32(ABCD, 0));
+		ABCD = vsha1pq_u32(ABCD, E1, TMP1);
+		TMP1 = vaddq_u32(MSG3, vdupq_n_u32(0x8F1BBCDC));
+		MSG0 = vsha1su1q_u32(MSG0, MSG3);
+		MSG1 = vsha1su0q_u32(MSG1, MSG2, MSG3);
+
+		/* Rounds 40-43 */
+		E1 = vsha1h_u32(vgetq_lane_u32(ABCD, 0));
+		ABCD = vsha1mq_u32(ABCD, E0, TMP0);
+		TMP0 = vaddq_u32(MSG0, vdupq_n_u32(0x8F1BBCDC));
+		MSG1 = vsha1su1q_u32(MSG1, MSG0);
+		MSG2 = vsha1su0q_u32(MSG2, MSG3, MSG0);
+
+		/* Rounds 44-47 */
+		E0 = vsha1h_u32(vgetq_lane_u32(ABCD, 0));
+		ABCD = vsha1mq_u32(ABCD, E1, TMP1);
+		TMP1 = vaddq_u32(MSG1, vdupq_n_u32(0x8F1BBCDC));
+		MSG2 = vsha1su1q_u32(MSG2, MSG1);
+		MSG3 = vsha1su0q_u32(MSG3, MSG0, MSG1);
+
+		/* Rounds 48-51 */
+		E1 = vsha1h_u32(vgetq_lane_u32(ABCD, 0));
+		ABCD = vsha1mq_u32(ABCD, E0, TMP0);
+		TMP0 = vaddq_u32(MSG2, vdupq_n_u32(0x8F1BBCDC));
+		MSG3 = vsha1su1q_u32(MSG3, MSG2);
+		MSG0 = vsha1su0q_u32(MSG0, MSG1, MSG2);
+
+		/* Rounds 52-55 */
+		E0 = vsha1h_u32(vgetq_lane_u32(ABCD, 0));
+		ABCD = vsha1mq_u32(ABCD, E1, TMP1);
+		TMP1 = vaddq_u32(MSG3, vdupq_n_u32(0xCA62C1D6));
+		MSG0 = vsha1su1q_u32(MSG0, MSG3);
+		MSG1 = vsha1su0q_u32(MSG1, MSG2, MSG3);
+
+		/* Rounds 56-59 */
+		E1 = vsha1h_u32(vgetq_lane_u32(ABCD, 0));
+		ABCD = vsha1mq_u32(ABCD, E0, TMP0);
+		TMP0 = vaddq_u32(MSG0, vdupq_n_u32(0xCA62C1D6));
+		MSG1 = vsha1su1q_u32(MSG1, MSG0);
+		MSG2 = vsha1su0q_u32(MSG2, MSG3, MSG0);
+
+		/* Rounds 60-63 */
+		E0 = vsha1h_u32(vgetq_lane_u32(ABCD, 0));
+		ABCD = vsha1pq_u32(ABCD, E1, TMP1);
+		TMP1 = vaddq_u32(MSG1, vdupq_n_u32(0xCA62C1D6));
+		MSG2 = vsha1su1q_u32(MSG2, MSG1);
+		MSG3 = vsha1su0q_u32(MSG3, MSG0, MSG1);
+
+		/* Rounds 64-67 */
+		E1 = vsha1h_u32(vgetq_lane_u32(ABCD, 0));
+		ABCD = vsha1pq_u32(ABCD, E0, TMP0);
+		TMP0 = vaddq_u32(MSG2, vdupq_n_u32(0xCA62C1D6));
+		MSG3 = vsha1su1q_u32(MSG3, MSG2);
+
+		/* Rounds 68-71 */
+		E0 = vsha1h_u32(vgetq_lane_u32(ABCD, 0));
+		ABCD = vsha1pq_u32(ABCD, E1, TMP1);
+		TMP1 = vaddq_u32(MSG3, vdupq_n_u32(0xCA62C1D6));
+
+		/* Rounds 72-75 */
+		E1 = vsha1h_u32(vgetq_lane_u32(ABCD, 0));
+		ABCD = vsha1pq_u32(ABCD, E0, TMP0);
+
+		/* Rounds 76-79 */
+		E0 = vsha1h_u32(vgetq_lane_u32(ABCD, 0));
+		ABCD = vsha1pq_u32(ABCD, E1, TMP1);
+		/* Add the working vars back into the state */
+		E0 += E0_SAVE;
+		ABCD = vaddq_u32(ABCD_SAVE, ABCD);
+	}
+
+	vst1q_u32(state, ABCD);
+	state[4] = E0;
+}
+#endif
+
+/* The fastest transform supported by this CPU. */
+static void (*sha1_transform)(uint32_t state[5], const unsigned char* data, size_t blocks) = TransformScalar;
+
+static const char* SelectTransform()
+{
+#if defined SHA1_HAS_SHANI
+	if (HasSHANI())
+	{
+		sha1_transform = TransformSHANI;
+		return "SHA-NI";
+	}
+#endif
+#if defined SHA1_HAS_ARMV8
+	if (getauxval(AT_HWCAP) & HWCAP_SHA1)
+	{
+		sha1_transform = TransformARMv8;
+		return "ARMv8";
+	}
+#endif
+	sha1_transform = TransformScalar;
+	return "scalar";
+}
+
+class SHA1Context
+{
+	uint32_t state[5];
+	uint32_t count[2];
+	unsigned char buffer[64];
+	unsigned char digest[20];
+
+	void Transform(const unsigned char buf[64])
+	{
+		sha1_transform(this->state, buf, 1);
+	}
 
  public:
 	SHA1Context()
@@ -148,8 +537,12 @@ class SHA1Context
 		{
 			memcpy(&this->buffer[j], data, (i = 64 - j));
 			this->Transform(this->buffer);
-			for (; i + 63 < len; i += 64)
-				this->Transform(&data[i]);
+			if (i + 63 < len)
+			{
+				const size_t blocks = (len - i) / 64;
+				sha1_transform(this->state, &data[i], blocks);
+				i += blocks * 64;
+			}
 			j = 0;
 		}
 		else
@@ -214,6 +607,7 @@ class ModuleSHA1 : public Module
  public:
 	ModuleSHA1() : sha(this)
 	{
+		ServerInstance->Logs->Log("m_sha1", DEBUG, "Using the %s SHA-1 transform", SelectTransform());
 		ServerInstance->Modules->AddService(sha);
 	}
 
@@ -51,14 +51,38 @@ class CommandShowFile : public Command
 		SF_NUMERIC
 	};
 
+	/** A line of the response, the recipient's nick goes between the two halves */
+	struct Line
+	{
+		std::string prefix;
+		std::string suffix;
+
+		Line(const std::string& pre, const std::string& suf)
+			: prefix(pre), suffix(suf)
+		{
+		}
+	};
+
 	std::string introtext;
 	std::string endtext;
 	unsigned int intronumeric;
 	unsigned int textnumeric;
 	unsigned int endnumeric;
-	file_cache contents;
+	std::vector<Line> lines;
 	Method method;
 
+	void AddLine(const std::string& command, const std::string& text)
+	{
+		lines.push_back(Line(":" + ServerInstance->Config->ServerName + " " + command + " ", " :" + text));
+	}
+
+	static std::string Numeric(unsigned int numeric)
+	{
+		char buf[4];
+		snprintf(buf, sizeof(buf), "%03u", numeric);
+		return buf;
+	}
+
  public:
 	CommandShowFile(Module* Creator, const std::string& cmdname)
 		: Command(Creator, cmdname)
@@ -67,21 +91,12 @@ class CommandShowFile : public Command
 
 	CmdResult Handle(const std::vector<std::string>& parameters, User* user)
 	{
-		if (method == SF_NUMERIC)
+		for (std::vector<Line>::const_iterator i = lines.begin(); i != lines.end(); ++i)
 		{
-			if (!introtext.empty())
-				user->WriteNumeric(intronumeric, "%s :%s", user->nick.c_str(), introtext.c_str());
-
-			for (file_cache::const_iterator i = contents.begin(); i != contents.end(); ++i)
-				user->WriteNumeric(textnumeric, "%s :- %s", user->nick.c_str(), i->c_str());
-
-			user->WriteNumeric(endnumeric, "%s :%s", user->nick.c_str(), endtext.c_str());
-		}
-		else
-		{
-			const std::string msgcmd = (method == SF_MSG ? "PRIVMSG" : "NOTICE");
-			for (file_cache::const_iterator i = contents.begin(); i != contents.end(); ++i)
-				user->WriteServ("%s %s :%s", msgcmd.c_str(), user->nick.c_str(), i->c_str());
+			std::string line;
+			line.reserve(i->prefix.length() + user->nick.length() + i->suffix.length());
+			line.append(i->prefix).append(user->nick).append(i->suffix);
+			user->Write(line);
 		}
 		return CMD_SUCCESS;
 	}
@@ -110,8 +125,28 @@ class CommandShowFile : public Command
 		else if (smethod == "notice")
 			method = SF_NOTICE;
 
-		contents = filecontents;
+		file_cache contents = filecontents;
 		InspIRCd::ProcessColors(contents);
+
+		// Render the response once, only the nick is filled in per request.
+		lines.clear();
+		if (method == SF_NUMERIC)
+		{
+			if (!introtext.empty())
+				AddLine(Numeric(intronumeric), introtext);
+
+			const std::string numeric = Numeric(textnumeric);
+			for (file_cache::const_iterator i = contents.begin(); i != contents.end(); ++i)
+				AddLine(numeric, "- " + *i);
+
+			AddLine(Numeric(endnumeric), endtext);
+		}
+		else
+		{
+			const std::string msgcmd = (method == SF_MSG ? "PRIVMSG" : "NOTICE");
+			for (file_cache::const_iterator i = contents.begin(); i != contents.end(); ++i)
+				AddLine(msgcmd, *i);
+		}
 	}
 };
 
@@ -34,6 +34,15 @@ class ModuleSSLStatsGnuTLS : public Module
 {
 	StringExtItem ext;
 
+	// The number of sessions and how many of them were resumed, by local port.
+	struct PortStats
+	{
+		unsigned long sessions;
+		unsigned long resumed;
+		PortStats() : sessions(0), resumed(0) { }
+	};
+	std::map<int, PortStats> portstats;
+
 	static const char* UnknownIfNULL(const char* str)
 	{
 		return str ? str : "UNKNOWN";
@@ -75,7 +84,13 @@ class ModuleSSLStatsGnuTLS : public Module
 		SSLRawSessionRequest req(user->eh.GetFd(), this, mod);
 		if (req.data)
 		{
-			std::string ciphersuite = BuildString(reinterpret_cast<gnutls_session_t>(req.data));
+			gnutls_session_t sess = reinterpret_cast<gnutls_session_t>(req.data);
+			PortStats& ps = portstats[user->GetServerPort()];
+			ps.sessions++;
+			if (gnutls_session_is_resumed(sess))
+				ps.resumed++;
+
+			std::string ciphersuite = BuildString(sess);
 			ext.set(user, ciphersuite);
 			ServerInstance->SNO->WriteToSnoMask('z', "Connecting user %s is using ciphersuite %s", user->GetFullRealHost().c_str(), ciphersuite.c_str());
 		}
@@ -117,6 +132,13 @@ class ModuleSSLStatsGnuTLS : public Module
 		for (std::map<std::string, unsigned int>::const_iterator i = counts.begin(); i != counts.end(); ++i)
 			user->SendText("%s%s %u", line.c_str(), i->first.c_str(), i->second);
 
+		for (std::map<int, PortStats>::const_iterator i = portstats.begin(); i != portstats.end(); ++i)
+		{
+			const PortStats& ps = i->second;
+			user->SendText("%sPort %d: %lu session(s), %lu resumed (%lu%%)", line.c_str(), i->first, ps.sessions, ps.resumed,
+				ps.sessions ? (ps.resumed * 100) / ps.sessions : 0);
+		}
+
 		user->SendText("%sEnd of list - %u user(s) total", line.c_str(), total);
 		return MOD_RES_DENY;
 	}
@@ -183,11 +183,21 @@ class ModuleStun : public Module
 	StunFactory f;
 	bool affectopers;
 
+	/* The STUN verdict for each user, stored as (generation << 1) | stunned.
+	 * The generation changes whenever a STUN line is added or removed so
+	 * that old verdicts are recomputed the next time they are needed.
+	 */
+	LocalIntExt stunned;
+	intptr_t generation;
+
+	/* When the next timed STUN line expires, or 0 if there are none. */
+	time_t nextexpiry;
+
 	std::string deaf_bypasschars;
 	std::string deaf_bypasschars_uline;
 
  public:
-	ModuleStun() : cmd(this)
+	ModuleStun() : cmd(this), stunned("stunned", this), generation(1), nextexpiry(0)
 	{
 	}
 
@@ -195,8 +205,10 @@ class ModuleStun : public Module
 	{
 		ServerInstance->XLines->RegisterFactory(&f);
 		ServerInstance->Modules->AddService(cmd);
+		ServerInstance->Modules->AddService(stunned);
 
-		Implementation eventlist[] = { I_OnStats, I_OnUserPreMessage, I_OnUserPreNotice, I_OnRehash };
+		Implementation eventlist[] = { I_OnStats, I_OnUserPreMessage, I_OnUserPreNotice, I_OnRehash,
+			I_OnAddLine, I_OnDelLine, I_OnExpireLine, I_OnUserPostNick, I_OnChangeHost, I_OnChangeIdent, I_OnSetUserIP };
 		ServerInstance->Modules->Attach(eventlist, this, sizeof(eventlist)/sizeof(Implementation));
 		OnRehash(NULL);
 	}
@@ -226,6 +238,77 @@ class ModuleStun : public Module
 		return MOD_RES_DENY;
 	}
 
+	bool IsStunned(User* u)
+	{
+		/* Expired lines are only removed when the lines are looked at */
+		if (nextexpiry && ServerInstance->Time() > nextexpiry)
+		{
+			nextexpiry = 0;
+			XLineLookup* lines = ServerInstance->XLines->GetAll("STUN");
+			if (lines)
+			{
+				for (LookupIter i = lines->begin(); i != lines->end(); ++i)
+				{
+					XLine* line = i->second;
+					if (line->duration && (!nextexpiry || line->expiry < nextexpiry))
+						nextexpiry = line->expiry;
+				}
+			}
+		}
+
+		intptr_t verdict = stunned.get(u);
+		if ((verdict >> 1) != generation)
+		{
+			verdict = (generation << 1) | (ServerInstance->XLines->MatchesLine("STUN", u) ? 1 : 0);
+			stunned.set(u, verdict);
+		}
+		return verdict & 1;
+	}
+
+	virtual void OnAddLine(User*, XLine* line)
+	{
+		if (line->type != "STUN")
+			return;
+
+		generation++;
+		if (line->duration && (!nextexpiry || line->expiry < nextexpiry))
+			nextexpiry = line->expiry;
+	}
+
+	virtual void OnDelLine(User*, XLine* line)
+	{
+		if (line->type == "STUN")
+			generation++;
+	}
+
+	virtual void OnExpireLine(XLine* line)
+	{
+		OnDelLine(NULL, line);
+	}
+
+	/* Host and ident changes are announced before they happen so just forget
+	 * the old verdict and work it out again when it is next needed.
+	 */
+	virtual void OnUserPostNick(User* user, const std::string&)
+	{
+		stunned.set(user, 0);
+	}
+
+	virtual void OnChangeHost(User* user, const std::string&)
+	{
+		stunned.set(user, 0);
+	}
+
+	virtual void OnChangeIdent(User* user, const std::string&)
+	{
+		stunned.set(user, 0);
+	}
+
+	virtual void OnSetUserIP(LocalUser* user)
+	{
+		stunned.set(user, 0);
+	}
+
 	virtual void OnRehash(User* user)
 	{
 		ConfigTag* tag = ServerInstance->Config->ConfValue("stun");
@@ -297,7 +380,7 @@ class ModuleStun : public Module
 		for (UserMembCIter i = ulist->begin(); i != ulist->end(); i++)
 		{
 			/* Not stunned, don't touch. */
-			if (!ServerInstance->XLines->MatchesLine("STUN", i->first))
+			if (!IsStunned(i->first))
 				continue;
 
 			/* Don't do anything if the user is an operator and affectopers isn't set */
@@ -41,36 +41,133 @@ namespace
 
 typedef void Target;
 
+/* A most recently used list of targets kept in a ring buffer which is only
+ * allocated when the user is first seen or the configured size changes. A
+ * small bloom filter lets most lookups for a missing target skip the scan.
+ */
+class TargetRing
+{
+	std::vector<Target *> slots;
+	size_t head;
+	size_t count;
+	uint64_t filter;
+
+	static uint64_t Bit(Target *target)
+	{
+		uintptr_t v = reinterpret_cast<uintptr_t>(target);
+		return static_cast<uint64_t>(1) << (((v >> 4) ^ (v >> 10) ^ (v >> 16)) & 63);
+	}
+
+	Target *&At(size_t pos)
+	{
+		return slots[(head + pos) % slots.size()];
+	}
+
+	void RebuildFilter()
+	{
+		filter = 0;
+		for (size_t i = 0; i < count; ++i)
+			filter |= Bit(At(i));
+	}
+
+ public:
+	static const size_t npos = static_cast<size_t>(-1);
+
+	TargetRing() : head(0), count(0), filter(0)
+	{
+	}
+
+	size_t size() const
+	{
+		return count;
+	}
+
+	/* resizes the ring, keeping the most recent targets */
+	void Reserve(size_t capacity)
+	{
+		if (slots.size() == capacity)
+			return;
+
+		std::vector<Target *> newslots(capacity);
+		count = std::min(count, capacity);
+		for (size_t i = 0; i < count; ++i)
+			newslots[i] = At(i);
+
+		slots.swap(newslots);
+		head = 0;
+		RebuildFilter();
+	}
+
+	size_t Find(Target *target)
+	{
+		if (!(filter & Bit(target)))
+			return npos;
+
+		for (size_t i = 0; i < count; ++i)
+			if (At(i) == target)
+				return i;
+
+		return npos;
+	}
+
+	void MoveToFront(size_t pos)
+	{
+		Target *target = At(pos);
+		for (; pos > 0; --pos)
+			At(pos) = At(pos - 1);
+		At(0) = target;
+	}
+
+	/* there must be space for the target */
+	void PushFront(Target *target)
+	{
+		head = (head + slots.size() - 1) % slots.size();
+		slots[head] = target;
+		count++;
+		filter |= Bit(target);
+	}
+
+	void PopBack(size_t num)
+	{
+		count -= std::min(num, count);
+		RebuildFilter();
+	}
+};
+
 class TGInfo
 {
 	time_t last;
 
-	std::deque<Target *> targets;
-	std::deque<Target *> reply_targets;
+	TargetRing targets;
+	TargetRing reply_targets;
 
  public:
 	TGInfo() : last(0)
 	{
+		targets.Reserve(TGCHANGE_NUM);
+		reply_targets.Reserve(TGCHANGE_REPLY);
 	}
 
 	bool AddTarget(Target *target)
 	{
+		/* pick up any changes to the sizes */
+		targets.Reserve(TGCHANGE_NUM);
+		reply_targets.Reserve(TGCHANGE_REPLY);
+
 		/* already exists? */
-		std::deque<Target *>::iterator it = std::find(targets.begin(), targets.end(), target);
-		if (it != targets.end())
+		size_t pos = targets.Find(target);
+		if (pos != TargetRing::npos)
 		{
 			/* yes. move it to the beginning */
-			targets.erase(it);
-			targets.push_front(target);
+			targets.MoveToFront(pos);
 			return true;
 		}
 
 		/* or as a reply target? */
-		it = std::find(reply_targets.begin(), reply_targets.end(), target);
-		if (it != reply_targets.end())
+		pos = reply_targets.Find(target);
+		if (pos != TargetRing::npos)
 		{
-			reply_targets.erase(it);
-			reply_targets.push_front(target);
+			reply_targets.MoveToFront(pos);
 			return true;
 		}
 
@@ -79,14 +176,7 @@ class TGInfo
 		if (t > 0)
 		{
 			/* clear one target per minute */
-
-			size_t sz = targets.size();
-			if (static_cast<size_t>(t) > sz)
-				sz = 0;
-			else
-				sz -= t;
-
-			targets.resize(sz);
+			targets.PopBack(t);
 
 			last = ServerInstance->Time();
 		}
@@ -98,22 +188,30 @@ class TGInfo
 		}
 
 		/* add new target */
-		targets.push_front(target);
+		targets.PushFront(target);
 
 		return true;
 	}
 
 	void AddReply(User *target)
 	{
-		std::deque<Target *>::iterator it = std::find(reply_targets.begin(), reply_targets.end(), target);
-		if (it != reply_targets.end())
+		reply_targets.Reserve(TGCHANGE_REPLY);
+		if (!TGCHANGE_REPLY)
+			return;
+
+		size_t pos = reply_targets.Find(target);
+		if (pos != TargetRing::npos)
+		{
 			/* already exists, move to front */
-			reply_targets.erase(it);
-		else if (reply_targets.size() >= TGCHANGE_REPLY)
-			/* list growing too large? */
-			reply_targets.pop_back();
+			reply_targets.MoveToFront(pos);
+			return;
+		}
+
+		/* list growing too large? */
+		if (reply_targets.size() >= TGCHANGE_REPLY)
+			reply_targets.PopBack(1);
 
-		reply_targets.push_front(target);
+		reply_targets.PushFront(target);
 	}
 };
 
@@ -49,8 +49,8 @@ struct WhoData
 	// The text to match against.
 	std::string matchtext;
 
-	// The WHO/WHOX responses we will send to the source.
-	std::vector<std::string> results;
+	// The number of WHO/WHOX responses we have sent to the source.
+	size_t results;
 
 	// Whether the source requested a WHOX response.
 	bool whox;
@@ -61,8 +61,38 @@ struct WhoData
 	// A user specified label for the WHOX response.
 	std::string whox_querytype;
 
+	// The flag which decides what the matchtext is matched against or 0 for the default fields.
+	unsigned char match_field;
+
+	// The WHOX fields to include in the order they are sent.
+	std::string whox_layout;
+
+	// Whether the source has the users/auspex privilege.
+	bool source_has_users_auspex;
+
+	// Whether the source can see which server users are on.
+	bool source_can_see_server;
+
+	// Whether the real server name or the hidden one is shown to the source.
+	bool show_real_server_name;
+
+	// The start of every line we send to the source.
+	std::string line_prefix;
+
+	// The earliest connection time matched by the t flag.
+	time_t signon_after;
+
+	// The ports matched by the p flag.
+	std::set<long> ports;
+
 	WhoData(const std::vector<std::string>& parameters)
-		: whox(false)
+		: results(0)
+		, whox(false)
+		, match_field(0)
+		, source_has_users_auspex(false)
+		, source_can_see_server(false)
+		, show_real_server_name(false)
+		, signon_after(0)
 	{
 		// Find the matchtext and swap the 0 for a * so we can use InspIRCd::Match on it.
 		matchtext = parameters.size() > 2 ? parameters[2] : parameters[0];
@@ -100,6 +130,217 @@ struct WhoData
 				current_bitset->set(chr);
 			}
 		}
+
+		// Only the first of these flags is used for matching.
+		for (const char* field = "Aahimnprstu"; *field; ++field)
+		{
+			if (flags[static_cast<unsigned char>(*field)])
+			{
+				match_field = *field;
+				break;
+			}
+		}
+
+		if (match_field == 't')
+			signon_after = ServerInstance->Time() - ServerInstance->Duration(matchtext);
+
+		if (match_field == 'p')
+		{
+			irc::portparser portrange(matchtext, false);
+			long port;
+			while ((port = portrange.GetToken()))
+				ports.insert(port);
+		}
+
+		if (whox)
+		{
+			for (const char* field = "tcuihsnfdlaor"; *field; ++field)
+			{
+				if (whox_fields[static_cast<unsigned char>(*field)])
+					whox_layout.push_back(*field);
+			}
+
+			if (whox_querytype.empty() || whox_querytype.length() > 3)
+				whox_querytype = "0";
+		}
+	}
+
+	/** Works out everything which only depends on the source of the query. */
+	void Prepare(LocalUser* source)
+	{
+		source_has_users_auspex = source->HasPrivPermission("users/auspex");
+		source_can_see_server = ServerInstance->Config->HideWhoisServer.empty() || source_has_users_auspex;
+		show_real_server_name = ServerInstance->Config->HideWhoisServer.empty() || (source->HasPrivPermission("servers/auspex") && flags['x']);
+		line_prefix = ConvToStr(whox ? RPL_WHOSPCRPL : RPL_WHOREPLY) + " " + source->nick;
+	}
+
+	/** Retrieves the server name of a user as seen by the source. */
+	const std::string& GetServer(User* user) const
+	{
+		return show_real_server_name ? user->server : ServerInstance->Config->HideWhoisServer;
+	}
+};
+
+/** Keeps track of which users are logged into each account and connected to
+ * each server so WHO queries on those fields don't have to scan every user.
+ */
+class WhoIndex
+{
+ public:
+	typedef std::map<irc::string, std::set<User*> > IndexMap;
+
+ private:
+	// The account each indexed user is in the account index under.
+	std::map<User*, irc::string> useraccounts;
+
+	static void Remove(IndexMap& index, const irc::string& key, User* user)
+	{
+		IndexMap::iterator iter = index.find(key);
+		if (iter == index.end())
+			return;
+
+		iter->second.erase(user);
+		if (iter->second.empty())
+			index.erase(iter);
+	}
+
+ public:
+	IndexMap accounts;
+	IndexMap servers;
+
+	void SetAccount(User* user, const std::string& account)
+	{
+		std::map<User*, irc::string>::iterator iter = useraccounts.find(user);
+		if (iter != useraccounts.end())
+		{
+			Remove(accounts, iter->second, user);
+			useraccounts.erase(iter);
+		}
+
+		if (account.empty())
+			return;
+
+		const irc::string key(account.c_str());
+		accounts[key].insert(user);
+		useraccounts[user] = key;
+	}
+
+	void AddUser(User* user)
+	{
+		servers[user->server.c_str()].insert(user);
+	}
+
+	void RemoveUser(User* user)
+	{
+		SetAccount(user, "");
+		Remove(servers, user->server.c_str(), user);
+	}
+
+	/** Finds the users indexed under keys which match a mask. */
+	static void Find(const IndexMap& index, const std::string& mask, std::vector<User*>& users)
+	{
+		if (mask.find_first_of("*?") == std::string::npos)
+		{
+			IndexMap::const_iterator iter = index.find(mask.c_str());
+			if (iter != index.end())
+				users.insert(users.end(), iter->second.begin(), iter->second.end());
+			return;
+		}
+
+		for (IndexMap::const_iterator iter = index.begin(); iter != index.end(); ++iter)
+		{
+			if (InspIRCd::Match(iter->first.c_str(), mask.c_str()))
+				users.insert(users.end(), iter->second.begin(), iter->second.end());
+		}
+	}
+};
+
+/** Holds the channel WHO replies sent recently so clients which poll the same
+ * query can be sent a copy instead of having every line rebuilt.
+ */
+class WhoCache
+{
+ public:
+	struct Line
+	{
+		// The user the line is about.
+		User* user;
+
+		// The line without the numeric and source nick or empty if it has
+		// to be rebuilt because it was built for the user it is about.
+		std::string text;
+
+		Line(User* u, const std::string& t) : user(u), text(t) { }
+	};
+	typedef std::vector<Line> LineList;
+
+	// How long replies are kept for in seconds.
+	static const time_t ttl = 5;
+
+ private:
+	struct Reply
+	{
+		time_t expires;
+		LineList lines;
+	};
+	typedef std::map<std::string, Reply> ReplyMap;
+	typedef std::map<Channel*, ReplyMap> ChannelMap;
+
+	ChannelMap channels;
+
+ public:
+	const LineList* Find(Channel* chan, const std::string& key)
+	{
+		ChannelMap::iterator citer = channels.find(chan);
+		if (citer == channels.end())
+			return NULL;
+
+		ReplyMap::iterator riter = citer->second.find(key);
+		if (riter == citer->second.end() || riter->second.expires < ServerInstance->Time())
+			return NULL;
+
+		return &riter->second.lines;
+	}
+
+	void Add(Channel* chan, const std::string& key, LineList& lines)
+	{
+		Reply& reply = channels[chan][key];
+		reply.expires = ServerInstance->Time() + ttl;
+		reply.lines.swap(lines);
+	}
+
+	void Invalidate(Channel* chan)
+	{
+		channels.erase(chan);
+	}
+
+	void Invalidate(User* user)
+	{
+		if (channels.empty())
+			return;
+
+		for (UserChanList::iterator iter = user->chans.begin(); iter != user->chans.end(); ++iter)
+			Invalidate(*iter);
+	}
+
+	void Expire()
+	{
+		for (ChannelMap::iterator citer = channels.begin(); citer != channels.end(); )
+		{
+			ReplyMap& replies = citer->second;
+			for (ReplyMap::iterator riter = replies.begin(); riter != replies.end(); )
+			{
+				if (riter->second.expires < ServerInstance->Time())
+					replies.erase(riter++);
+				else
+					++riter;
+			}
+
+			if (replies.empty())
+				channels.erase(citer++);
+			else
+				++citer;
+		}
 	}
 };
 
@@ -154,6 +395,9 @@ class CommandWho : public SplitCommand
 	void WhoUsers(LocalUser* source, const std::vector<std::string>& parameters, const T& users, WhoData& data);
 
  public:
+	WhoIndex index;
+	WhoCache cache;
+
 	CommandWho(Module* parent)
 		: SplitCommand(parent, "WHO", 1, 3)
 	{
@@ -162,30 +406,28 @@ class CommandWho : public SplitCommand
 	}
 
 	/** Sends a WHO reply to a user. */
-	void SendWhoLine(LocalUser* user, const std::vector<std::string>& parameters, Channel* chan, User* u, WhoData& data);
+	void SendWhoLine(LocalUser* user, const std::vector<std::string>& parameters, Channel* chan, User* u, WhoData& data, WhoCache::LineList* record = NULL);
 
 	CmdResult HandleLocal(const std::vector<std::string>& parameters, LocalUser* user);
 };
 
 template<> User* CommandWho::GetUser(std::list<User*>::const_iterator& t) { return *t; }
 template<> User* CommandWho::GetUser(user_hash::const_iterator& t) { return t->second; }
+template<> User* CommandWho::GetUser(std::vector<User*>::const_iterator& t) { return *t; }
 
 bool CommandWho::MatchChannel(LocalUser* source, Membership* memb, WhoData& data)
 {
-	bool source_has_users_auspex = source->HasPrivPermission("users/auspex");
-	bool source_can_see_server = ServerInstance->Config->HideWhoisServer.empty() || source_has_users_auspex;
-
 	// The source only wants remote users. This user is eligible if:
 	//   (1) The source can't see server information.
 	//   (2) The source is not local to the current server.
 	LocalUser* lu = IS_LOCAL(memb->user);
-	if (data.flags['f'] && source_can_see_server && lu)
+	if (data.flags['f'] && data.source_can_see_server && lu)
 		return false;
 
 	// The source only wants local users. This user is eligible if:
 	//   (1) The source can't see server information.
 	//   (2) The source is local to the current server.
-	if (data.flags['l'] && source_can_see_server && !lu)
+	if (data.flags['l'] && data.source_can_see_server && !lu)
 		return false;
 
 	// Only show operators if the oper flag has been specified.
@@ -202,52 +444,52 @@ bool CommandWho::MatchUser(LocalUser* source, User* user, WhoData& data)
 	if (user->registered != REG_ALL)
 		return false;
 
-	bool source_has_users_auspex = source->HasPrivPermission("users/auspex");
-	bool source_can_see_target = source == user || source_has_users_auspex;
-	bool source_can_see_server = ServerInstance->Config->HideWhoisServer.empty() || source_has_users_auspex;
+	bool source_can_see_target = source == user || data.source_has_users_auspex;
 
 	// The source only wants remote users. This user is eligible if:
 	//   (1) The source can't see server information.
 	//   (2) The source is not local to the current server.
 	LocalUser* lu = IS_LOCAL(user);
-	if (data.flags['f'] && source_can_see_server && lu)
+	if (data.flags['f'] && data.source_can_see_server && lu)
 		return false;
 
 	// The source only wants local users. This user is eligible if:
 	//   (1) The source can't see server information.
 	//   (2) The source is local to the current server.
-	if (data.flags['l'] && source_can_see_server && !lu)
+	if (data.flags['l'] && data.source_can_see_server && !lu)
 		return false;
 
-	// The source wants to match against users' away messages.
-	bool match = false;
-	if (data.flags['A'])
-		match = IS_AWAY(user) && InspIRCd::Match(user->awaymsg, data.matchtext, ascii_case_insensitive_map);
-
-	// The source wants to match against users' account names.
-	else if (data.flags['a'])
+	switch (data.match_field)
 	{
-		const AccountExtItem* accountext = GetAccountExtItem();
-		const std::string* account = accountext ? accountext->get(user) : NULL;
-		match = account && InspIRCd::Match(*account, data.matchtext);
-	}
+		// The source wants to match against users' away messages.
+		case 'A':
+			return IS_AWAY(user) && InspIRCd::Match(user->awaymsg, data.matchtext, ascii_case_insensitive_map);
 
-	// The source wants to match against users' hostnames.
-	else if (data.flags['h'])
-	{
-		const std::string host = source_can_see_target && data.flags['x'] ? user->host : user->dhost;
-		match = InspIRCd::Match(host, data.matchtext, ascii_case_insensitive_map);
-	}
+		// The source wants to match against users' account names.
+		case 'a':
+		{
+			const AccountExtItem* accountext = GetAccountExtItem();
+			const std::string* account = accountext ? accountext->get(user) : NULL;
+			return account && InspIRCd::Match(*account, data.matchtext);
+		}
+
+		// The source wants to match against users' hostnames.
+		case 'h':
+		{
+			const std::string& host = source_can_see_target && data.flags['x'] ? user->host : user->dhost;
+			return InspIRCd::Match(host, data.matchtext, ascii_case_insensitive_map);
+		}
 
-	// The source wants to match against users' IP addresses.
-	else if (data.flags['i'])
-		match = source_can_see_target && InspIRCd::MatchCIDR(user->GetIPString(), data.matchtext, ascii_case_insensitive_map);
+		// The source wants to match against users' IP addresses.
+		case 'i':
+			return source_can_see_target && InspIRCd::MatchCIDR(user->GetIPString(), data.matchtext, ascii_case_insensitive_map);
 
-	// The source wants to match against users' modes.
-	else if (data.flags['m'])
-	{
-		if (source_can_see_target)
+		// The source wants to match against users' modes.
+		case 'm':
 		{
+			if (!source_can_see_target)
+				return false;
+
 			bool set = true;
 			for (std::string::const_iterator iter = data.matchtext.begin(); iter != data.matchtext.end(); ++iter)
 			{
@@ -274,75 +516,39 @@ bool CommandWho::MatchUser(LocalUser* source, User* user, WhoData& data)
 			// All of the modes matched.
 			return true;
 		}
-	}
 
-	// The source wants to match against users' nicks.
-	else if (data.flags['n'])
-		match = InspIRCd::Match(user->nick, data.matchtext);
+		// The source wants to match against users' nicks.
+		case 'n':
+			return InspIRCd::Match(user->nick, data.matchtext);
 
-	// The source wants to match against users' connection ports.
-	else if (data.flags['p'])
-	{
-		if (source_can_see_target && lu)
-		{
-			irc::portparser portrange(data.matchtext, false);
-			long port;
-			while ((port = portrange.GetToken()))
-			{
-				if (port == lu->GetServerPort())
-				{
-					match = true;
-					break;
-				}
-			}
-		}
-	}
+		// The source wants to match against users' connection ports.
+		case 'p':
+			return source_can_see_target && lu && data.ports.count(lu->GetServerPort());
 
-	// The source wants to match against users' real names.
-	else if (data.flags['r'])
-		match = InspIRCd::Match(user->fullname, data.matchtext, ascii_case_insensitive_map);
+		// The source wants to match against users' real names.
+		case 'r':
+			return InspIRCd::Match(user->fullname, data.matchtext, ascii_case_insensitive_map);
 
-	else if (data.flags['s'])
-	{
-		bool show_real_server_name = ServerInstance->Config->HideWhoisServer.empty() || (source->HasPrivPermission("servers/auspex") && data.flags['x']);
-		const std::string server = show_real_server_name ? user->server : ServerInstance->Config->HideWhoisServer;
-		match = InspIRCd::Match(server, data.matchtext, ascii_case_insensitive_map);
-	}
+		// The source wants to match against users' servers.
+		case 's':
+			return InspIRCd::Match(data.GetServer(user), data.matchtext, ascii_case_insensitive_map);
 
-	// The source wants to match against users' connection times.
-	else if (data.flags['t'])
-	{
-		time_t seconds = ServerInstance->Time() - ServerInstance->Duration(data.matchtext);
-		if (user->signon >= seconds)
-			match = true;
-	}
+		// The source wants to match against users' connection times.
+		case 't':
+			return user->signon >= data.signon_after;
 
-	// The source wants to match against users' idents.
-	else if (data.flags['u'])
-		match = InspIRCd::Match(user->ident, data.matchtext, ascii_case_insensitive_map);
+		// The source wants to match against users' idents.
+		case 'u':
+			return InspIRCd::Match(user->ident, data.matchtext, ascii_case_insensitive_map);
+	}
 
 	// The <name> passed to WHO is matched against users' host, server,
 	// real name and nickname if the channel <name> cannot be found.
-	else
-	{
-		const std::string host = source_can_see_target && data.flags['x'] ? user->host : user->dhost;
-		match = InspIRCd::Match(host, data.matchtext, ascii_case_insensitive_map);
-
-		if (!match)
-		{
-			bool show_real_server_name = ServerInstance->Config->HideWhoisServer.empty() || (source->HasPrivPermission("servers/auspex") && data.flags['x']);
-			const std::string server = show_real_server_name ? user->server : ServerInstance->Config->HideWhoisServer;
-			match = InspIRCd::Match(server, data.matchtext, ascii_case_insensitive_map);
-		}
-
-		if (!match)
-			match = InspIRCd::Match(user->fullname, data.matchtext, ascii_case_insensitive_map);
-
-		if (!match)
-			match = InspIRCd::Match(user->nick, data.matchtext);
-	}
-
-	return match;
+	const std::string& host = source_can_see_target && data.flags['x'] ? user->host : user->dhost;
+	return InspIRCd::Match(host, data.matchtext, ascii_case_insensitive_map)
+		|| InspIRCd::Match(data.GetServer(user), data.matchtext, ascii_case_insensitive_map)
+		|| InspIRCd::Match(user->fullname, data.matchtext, ascii_case_insensitive_map)
+		|| InspIRCd::Match(user->nick, data.matchtext);
 }
 
 void CommandWho::WhoChannel(LocalUser* source, const std::vector<std::string>& parameters, Channel* chan, WhoData& data)
@@ -351,34 +557,68 @@ void CommandWho::WhoChannel(LocalUser* source, const std::vector<std::string>& p
 		return;
 
 	bool inside = chan->HasUser(source);
+
+	// The idle time changes every second so replies which include it are never cached.
+	const bool cacheable = !data.whox_fields['l'];
+	std::string key;
+	if (cacheable)
+	{
+		// Everything other than the flags that changes the reply is down to who the source is.
+		key = parameters.size() > 1 ? parameters[1] : "";
+		key.append(1, ' ').append(1, inside ? 'I' : '-').append(1, data.source_has_users_auspex ? 'A' : '-')
+			.append(1, data.source_can_see_server ? 'S' : '-').append(1, data.show_real_server_name ? 'R' : '-');
+
+		const WhoCache::LineList* lines = cache.Find(chan, key);
+		if (lines)
+		{
+			// Sending can make the source quit which empties the cache so check that first.
+			for (size_t i = 0; !source->quitting && i < lines->size(); ++i)
+			{
+				const WhoCache::Line& line = (*lines)[i];
+				if (line.text.empty() || line.user == source)
+					SendWhoLine(source, parameters, chan, line.user, data);
+				else
+				{
+					source->WriteServ(data.line_prefix + line.text);
+					data.results++;
+				}
+			}
+			return;
+		}
+	}
+
+	WhoCache::LineList record;
 	const UserMembList* users = chan->GetUsers();
-	for (UserMembList::const_iterator iter = users->begin(); iter != users->end(); ++iter)
+	for (UserMembList::const_iterator iter = users->begin(); iter != users->end() && !source->quitting; ++iter)
 	{
 		User* user = iter->first;
 		Membership* memb = iter->second;
 
 		// Only show invisible users if the source is in the channel or has the users/auspex priv.
-		if (!inside && user->IsModeSet('i') && !source->HasPrivPermission("users/auspex"))
+		if (!inside && user->IsModeSet('i') && !data.source_has_users_auspex)
 			continue;
 
 		// Skip the user if it doesn't match the query.
 		if (!MatchChannel(source, memb, data))
 			continue;
 
-		SendWhoLine(source, parameters, memb->chan, user, data);
+		SendWhoLine(source, parameters, memb->chan, user, data, cacheable ? &record : NULL);
 	}
+
+	if (cacheable && !source->quitting)
+		cache.Add(chan, key, record);
 }
 
 template<typename T>
 void CommandWho::WhoUsers(LocalUser* source, const std::vector<std::string>& parameters, const T& users, WhoData& data)
 {
-	for (typename T::const_iterator iter = users.begin(); iter != users.end(); ++iter)
+	for (typename T::const_iterator iter = users.begin(); iter != users.end() && !source->quitting; ++iter)
 	{
 		User* user = GetUser(iter);
 
 		// Only show users in response to a fuzzy WHO if we can see them normally.
 		bool can_see_normally = user == source || source->SharesChannelWith(user) || !user->IsModeSet('i');
-		if (data.fuzzy_match && !can_see_normally && !source->HasPrivPermission("users/auspex"))
+		if (data.fuzzy_match && !can_see_normally && !data.source_has_users_auspex)
 			continue;
 
 		// Skip the user if it doesn't match the query.
@@ -389,99 +629,113 @@ void CommandWho::WhoUsers(LocalUser* source, const std::vector<std::string>& par
 	}
 }
 
-void CommandWho::SendWhoLine(LocalUser* source, const std::vector<std::string>& parameters, Channel* chan, User* user, WhoData& data)
+/** Builds the flags field of a WHO reply. */
+static void AppendFlags(std::string& wholine, Channel* chan, User* user)
+{
+	// Away state.
+	wholine.append(IS_AWAY(user) ? " G" : " H");
+
+	// Operator status.
+	if (IS_OPER(user))
+		wholine.push_back('*');
+
+	// Membership prefix.
+	if (chan)
+	{
+		const char* prefix = chan->GetPrefixChar(user);
+		if (prefix)
+			wholine.append(prefix);
+	}
+}
+
+void CommandWho::SendWhoLine(LocalUser* source, const std::vector<std::string>& parameters, Channel* chan, User* user, WhoData& data, WhoCache::LineList* record)
 {
 	if (!chan)
 		chan = GetFirstVisibleChannel(source, user);
 
-	bool source_can_see_target = source == user || source->HasPrivPermission("users/auspex");
-	std::string wholine(ConvToStr(data.whox ? RPL_WHOSPCRPL : RPL_WHOREPLY));
-	wholine.append(" ").append(source->nick);
+	bool source_can_see_target = source == user || data.source_has_users_auspex;
+	std::string wholine(data.line_prefix);
 	if (data.whox)
 	{
 		// The source used WHOX so we send a fancy customised response.
+		for (std::string::const_iterator field = data.whox_layout.begin(); field != data.whox_layout.end(); ++field)
+		{
+			switch (*field)
+			{
+				// Include the query type in the reply.
+				case 't':
+					wholine.append(" ").append(data.whox_querytype);
+					break;
 
-		// Include the query type in the reply.
-		if (data.whox_fields['t'])
-			wholine.append(" ").append(data.whox_querytype.empty() || data.whox_querytype.length() > 3 ? "0" : data.whox_querytype);
-
-		// Include the first channel name.
-		if (data.whox_fields['c'])
-			wholine.append(" ").append(chan ? chan->name : "*");
-
-		// Include the user's ident.
-		if (data.whox_fields['u'])
-			wholine.append(" ").append(user->ident);
+				// Include the first channel name.
+				case 'c':
+					wholine.append(" ").append(chan ? chan->name : "*");
+					break;
 
-		// Include the user's IP address.
-		if (data.whox_fields['i'])
-			wholine.append(" ").append(source_can_see_target ? user->GetIPString() : "255.255.255.255");
+				// Include the user's ident.
+				case 'u':
+					wholine.append(" ").append(user->ident);
+					break;
 
-		// Include the user's hostname.
-		if (data.whox_fields['h'])
-			wholine.append(" ").append(source_can_see_target && data.flags['x'] ? user->host : user->dhost);
+				// Include the user's IP address.
+				case 'i':
+					wholine.append(" ").append(source_can_see_target ? user->GetIPString() : "255.255.255.255");
+					break;
 
-		// Include the server name.
-		if (data.whox_fields['s'])
-		{
-			if (ServerInstance->Config->HideWhoisServer.empty() || (source->HasPrivPermission("servers/auspex") && data.flags['x']))
-				wholine.append(" ").append(user->server);
-			else
-				wholine.append(" ").append(ServerInstance->Config->HideWhoisServer);
-		}
+				// Include the user's hostname.
+				case 'h':
+					wholine.append(" ").append(source_can_see_target && data.flags['x'] ? user->host : user->dhost);
+					break;
 
-		// Include the user's nickname.
-		if (data.whox_fields['n'])
-			wholine.append(" ").append(user->nick);
+				// Include the server name.
+				case 's':
+					wholine.append(" ").append(data.GetServer(user));
+					break;
 
-		// Include the user's flags.
-		if (data.whox_fields['f'])
-		{
-			// Away state.
-			std::string flags(IS_AWAY(user) ? "G" : "H");
+				// Include the user's nickname.
+				case 'n':
+					wholine.append(" ").append(user->nick);
+					break;
 
-			// Operator status.
-			if (IS_OPER(user))
-				flags.push_back('*');
+				// Include the user's flags.
+				case 'f':
+					AppendFlags(wholine, chan, user);
+					break;
 
-			// Membership prefix.
-			if (chan)
-			{
-				const char* prefix = chan->GetPrefixChar(user);
-				if (prefix)
-					flags.append(prefix);
-			}
+				// Include the number of hops between the users.
+				case 'd':
+					wholine.append(" 0");
+					break;
 
-			wholine.append(" ").append(flags);
-		}
+				// Include the user's idle time.
+				case 'l':
+				{
+					LocalUser* lu = IS_LOCAL(user);
+					unsigned long idle = lu ? ServerInstance->Time() - lu->idle_lastmsg : 0;
+					wholine.append(" ").append(ConvToStr(idle));
+					break;
+				}
 
-		// Include the number of hops between the users.
-		if (data.whox_fields['d'])
-			wholine.append(" ").append("0");
+				// Include the user's account name.
+				case 'a':
+				{
+					const AccountExtItem* accountext = GetAccountExtItem();
+					const std::string* account = accountext ? accountext->get(user) : NULL;
+					wholine.append(" ").append(account ? *account : "0");
+					break;
+				}
 
-		// Include the user's idle time.
-		if (data.whox_fields['l'])
-		{
-			LocalUser* lu = IS_LOCAL(user);
-			unsigned long idle = lu ? ServerInstance->Time() - lu->idle_lastmsg : 0;
-			wholine.append(" ").append(ConvToStr(idle));
-		}
+				// Include the user's operator rank level.
+				case 'o':
+					wholine.append(" ").append(chan ? ConvToStr(chan->GetPrefixValue(user)) : "0");
+					break;
 
-		// Include the user's account name.
-		if (data.whox_fields['a'])
-		{
-			const AccountExtItem* accountext = GetAccountExtItem();
-			const std::string* account = accountext ? accountext->get(user) : NULL;
-			wholine.append(" ").append(account ? *account : "0");
+				// Include the user's real name.
+				case 'r':
+					wholine.append(" :").append(user->fullname);
+					break;
+			}
 		}
-
-		// Include the user's operator rank level.
-		if (data.whox_fields['o'])
-			wholine.append(" ").append(chan ? ConvToStr(chan->GetPrefixValue(user)) : "0");
-
-		// Include the user's real name.
-		if (data.whox_fields['r'])
-			wholine.append(" :").append(user->fullname);
 	}
 	else
 	{
@@ -497,46 +751,35 @@ void CommandWho::SendWhoLine(LocalUser* source, const std::vector<std::string>&
 		wholine.append(" ").append(source_can_see_target && data.flags['x'] ? user->host : user->dhost);
 
 		// Include the server name.
-		if (ServerInstance->Config->HideWhoisServer.empty() || (source->HasPrivPermission("servers/auspex") && data.flags['x']))
-			wholine.append(" ").append(user->server);
-		else
-			wholine.append(" ").append(ServerInstance->Config->HideWhoisServer);
+		wholine.append(" ").append(data.GetServer(user));
 
 		// Include the user's nick.
 		wholine.append(" ").append(user->nick);
 
 		// Include the user's flags.
-		{
-			// Away state.
-			std::string flags(IS_AWAY(user) ? "G" : "H");
-
-			// Operator status.
-			if (IS_OPER(user))
-				flags.push_back('*');
-
-			// Membership prefix.
-			if (chan)
-			{
-				const char* prefix = chan->GetPrefixChar(user);
-				if (prefix)
-					flags.append(prefix);
-			}
-
-			wholine.append(" ").append(flags);
-		}
+		AppendFlags(wholine, chan, user);
 
 		// Include the number of hops between the users and the user's real name.
 		wholine.append(" ").append(":0 ").append(user->fullname);
 	}
 
 	FOREACH_MOD(I_OnSendWhoLine, OnSendWhoLine(user, parameters, user, wholine));
-	if (!wholine.empty())
-		data.results.push_back(wholine);
+	if (wholine.empty())
+		return;
+
+	// The line about the source shows more than other users can see.
+	if (record)
+		record->push_back(WhoCache::Line(user, user == source ? "" : wholine.substr(data.line_prefix.length())));
+
+	// Send the line straight away so large replies are never held in memory.
+	source->WriteServ(wholine);
+	data.results++;
 }
 
 CmdResult CommandWho::HandleLocal(const std::vector<std::string>& parameters, LocalUser* user)
 {
 	WhoData data(parameters);
+	data.Prepare(user);
 
 	// Is the source running a WHO on a channel?
 	Channel* chan = ServerInstance->FindChan(data.matchtext);
@@ -547,17 +790,22 @@ CmdResult CommandWho::HandleLocal(const std::vector<std::string>& parameters, Lo
 	else if (data.flags['o'])
 		WhoUsers(user, parameters, ServerInstance->Users->all_opers, data);
 
+	// If we are matching against accounts or visible server names we can use the index.
+	else if (data.match_field == 'a' || (data.match_field == 's' && data.show_real_server_name))
+	{
+		std::vector<User*> users;
+		WhoIndex::Find(data.match_field == 'a' ? index.accounts : index.servers, data.matchtext, users);
+		WhoUsers(user, parameters, users, data);
+	}
+
 	// Otherwise we have to use the global user list.
 	else
 		WhoUsers(user, parameters, *ServerInstance->Users->clientlist, data);
 
-	// Send the results to the source.
-	for (std::vector<std::string>::const_iterator n = data.results.begin(); n != data.results.end(); ++n)
-		user->WriteServ(*n);
 	user->WriteNumeric(RPL_ENDOFWHO, "%s %s :End of /WHO list.", user->nick.c_str(), (data.matchtext.empty() ? "*" : data.matchtext.c_str()));
 
 	// Penalize the source a bit for large queries with one unit of penalty per 200 results.
-	user->CommandFloodPenalty += data.results.size() * 5;
+	user->CommandFloodPenalty += data.results * 5;
 	return CMD_SUCCESS;
 }
 
@@ -576,8 +824,116 @@ class ModuleWhoX : public Module
 
 	void init()
 	{
-		Implementation eventlist[] = { I_On005Numeric, I_OnNumeric, I_OnPreCommand };
+		Implementation eventlist[] = { I_On005Numeric, I_OnNumeric, I_OnPreCommand, I_OnEvent, I_OnPostConnect, I_OnUserQuit, I_OnUserDisconnect,
+			I_OnUserJoin, I_OnUserPart, I_OnUserKick, I_OnUserPostNick, I_OnSetAway, I_OnChangeHost, I_OnChangeIdent, I_OnChangeName,
+			I_OnMode, I_OnPostOper, I_OnChannelDelete, I_OnBackgroundTimer };
 		ServerInstance->Modules->Attach(eventlist, this, sizeof(eventlist)/sizeof(Implementation));
+
+		// Index the users who were already connected when we were loaded.
+		const AccountExtItem* accountext = GetAccountExtItem();
+		for (user_hash::const_iterator iter = ServerInstance->Users->clientlist->begin(); iter != ServerInstance->Users->clientlist->end(); ++iter)
+		{
+			User* user = iter->second;
+			if (user->registered == REG_ALL)
+				cmd.index.AddUser(user);
+
+			const std::string* account = accountext ? accountext->get(user) : NULL;
+			if (account)
+				cmd.index.SetAccount(user, *account);
+		}
+	}
+
+	void OnEvent(Event& event)
+	{
+		if (event.id != "account_login")
+			return;
+
+		// Logouts have an empty account name which removes the user from the index.
+		AccountEvent* accev = (AccountEvent*)&event;
+		cmd.index.SetAccount(accev->user, accev->account);
+		cmd.cache.Invalidate(accev->user);
+	}
+
+	void OnPostConnect(User* user)
+	{
+		cmd.index.AddUser(user);
+	}
+
+	void OnUserQuit(User* user, const std::string& message, const std::string& oper_message)
+	{
+		cmd.index.RemoveUser(user);
+		cmd.cache.Invalidate(user);
+	}
+
+	void OnUserDisconnect(LocalUser* user)
+	{
+		// Users who never finished registering don't get OnUserQuit.
+		cmd.index.RemoveUser(user);
+	}
+
+	void OnUserJoin(Membership* memb, bool sync, bool created, CUList& except)
+	{
+		cmd.cache.Invalidate(memb->chan);
+	}
+
+	void OnUserPart(Membership* memb, std::string& partmessage, CUList& except)
+	{
+		cmd.cache.Invalidate(memb->chan);
+	}
+
+	void OnUserKick(User* source, Membership* memb, const std::string& reason, CUList& except)
+	{
+		cmd.cache.Invalidate(memb->chan);
+	}
+
+	void OnUserPostNick(User* user, const std::string& oldnick)
+	{
+		cmd.cache.Invalidate(user);
+	}
+
+	ModResult OnSetAway(User* user, const std::string& awaymsg)
+	{
+		cmd.cache.Invalidate(user);
+		return MOD_RES_PASSTHRU;
+	}
+
+	void OnChangeHost(User* user, const std::string& newhost)
+	{
+		cmd.cache.Invalidate(user);
+	}
+
+	void OnChangeIdent(User* user, const std::string& newident)
+	{
+		cmd.cache.Invalidate(user);
+	}
+
+	void OnChangeName(User* user, const std::string& gecos)
+	{
+		cmd.cache.Invalidate(user);
+	}
+
+	void OnMode(User* user, void* dest, int target_type, const std::vector<std::string>& text, const std::vector<TranslateType>& translate)
+	{
+		// Prefix modes change the flags and user modes change who is shown.
+		if (target_type == TYPE_CHANNEL)
+			cmd.cache.Invalidate(static_cast<Channel*>(dest));
+		else if (target_type == TYPE_USER)
+			cmd.cache.Invalidate(static_cast<User*>(dest));
+	}
+
+	void OnPostOper(User* user, const std::string& opername, const std::string& opertype)
+	{
+		cmd.cache.Invalidate(user);
+	}
+
+	void OnChannelDelete(Channel* chan)
+	{
+		cmd.cache.Invalidate(chan);
+	}
+
+	void OnBackgroundTimer(time_t curtime)
+	{
+		cmd.cache.Expire();
 	}
 
 	void On005Numeric(std::string& output)
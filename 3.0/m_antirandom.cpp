@@ -42,10 +42,18 @@
         This module uses a scoring system that will react based
          on the threshold set above. If the threshold is set too low many
          clients will be tagged a bot.
+        /STATS r shows how long scoring takes, how scores are spread, how
+         many connections each threshold would reject and how many rejected
+         IPs connected successfully within ten minutes, which are likely
+         false positives.
+        /ANTIRANDOM <nick> <ident> :<real name> shows the score of a sample
+         without it connecting, so a corpus can be scored by a client script
+         when tuning the threshold.
  */
 
 #include "inspircd.h"
 #include "xline.h"
+#include "modules/stats.h"
 
 /// $ModDesc: A module to prevent against bots using random patterns.
 /// $ModAuthor: lnx85
@@ -59,18 +67,170 @@
 
 enum AntirandomExemptType { NICK, IDENT, HOST, FULLNAME };
 
-class AntirandomExempt
+// Hashes and compares strings using the same case mapping as the exemptions are matched with.
+struct AntirandomExemptHash
 {
-public:
-	AntirandomExemptType type;
-	std::string pattern;
+	size_t operator()(const std::string& str) const
+	{
+		size_t hash = 0;
+		for (std::string::const_iterator i = str.begin(); i != str.end(); ++i)
+			hash = 5 * hash + ascii_case_insensitive_map[static_cast<unsigned char>(*i)];
+		return hash;
+	}
+
+	bool operator()(const std::string& lhs, const std::string& rhs) const
+	{
+		if (lhs.length() != rhs.length())
+			return false;
+
+		for (size_t i = 0; i < lhs.length(); ++i)
+		{
+			if (ascii_case_insensitive_map[static_cast<unsigned char>(lhs[i])] != ascii_case_insensitive_map[static_cast<unsigned char>(rhs[i])])
+				return false;
+		}
+		return true;
+	}
+};
+
+// The exemptions split up by type when the config is read so that only the
+// patterns with wildcards have to be matched one at a time.
+class AntirandomExemptList
+{
+ private:
+	typedef TR1NS::unordered_set<std::string, AntirandomExemptHash, AntirandomExemptHash> LiteralSet;
+
+	typedef std::map<irc::sockets::cidr_mask, std::string> RangeMap;
+
+	// The address family and prefix length of the ranges in use.
+	typedef std::set<std::pair<unsigned char, unsigned char> > LengthSet;
+
+	struct TypeExempts
+	{
+		LiteralSet literals;
+		RangeMap ranges;
+		LengthSet lengths;
+		std::vector<std::string> globs;
+	};
+
+	TypeExempts types[FULLNAME + 1];
+
+	// Parses an IP/bits pattern, which can only match through MatchCIDR.
+	static bool GetRange(const std::string& pattern, irc::sockets::cidr_mask& range)
+	{
+		const std::string::size_type slash = pattern.find('/');
+		if (slash == std::string::npos || pattern.find_first_of("*?") != std::string::npos)
+			return false;
+
+		irc::sockets::sockaddrs sa;
+		const std::string bits(pattern, slash + 1);
+		if (!irc::sockets::aptosa(pattern.substr(0, slash), 0, sa) || bits.empty() || bits.length() > 3
+			|| bits.find_first_not_of("0123456789") != std::string::npos)
+			return false;
+
+		const unsigned int length = ConvToNum<unsigned int>(bits);
+		if (length > (sa.family() == AF_INET6 ? 128U : 32U))
+			return false;
+
+		range = irc::sockets::cidr_mask(sa, length);
+		return true;
+	}
+
+	static const std::string* FindRange(const TypeExempts& exempts, User* user)
+	{
+		for (LengthSet::const_iterator iter = exempts.lengths.begin(); iter != exempts.lengths.end(); ++iter)
+		{
+			if (iter->first != user->client_sa.family())
+				continue;
+
+			RangeMap::const_iterator range = exempts.ranges.find(irc::sockets::cidr_mask(user->client_sa, iter->second));
+			if (range != exempts.ranges.end())
+				return &range->second;
+		}
+		return NULL;
+	}
+
+	static const std::string* FindLiteral(const LiteralSet& literals, const std::string& str)
+	{
+		LiteralSet::const_iterator iter = literals.find(str);
+		return iter != literals.end() ? &*iter : NULL;
+	}
+
+	static const std::string* FindIn(const TypeExempts& exempts, const std::string& str)
+	{
+		const std::string* pattern = FindLiteral(exempts.literals, str);
+		if (pattern)
+			return pattern;
+
+		for (std::vector<std::string>::const_iterator iter = exempts.globs.begin(); iter != exempts.globs.end(); ++iter)
+		{
+			if (InspIRCd::Match(str, *iter, ascii_case_insensitive_map))
+				return &*iter;
+		}
+		return NULL;
+	}
+
+ public:
+	void Clear()
+	{
+		for (size_t i = 0; i <= FULLNAME; ++i)
+		{
+			types[i].literals.clear();
+			types[i].ranges.clear();
+			types[i].lengths.clear();
+			types[i].globs.clear();
+		}
+	}
 
-	AntirandomExempt(AntirandomExemptType t, const std::string &p)
-	: type(t), pattern(p)
+	void Add(AntirandomExemptType type, const std::string& pattern)
 	{
+		irc::sockets::cidr_mask range;
+		if (pattern.find_first_of(type == HOST ? "*?/" : "*?") == std::string::npos)
+			types[type].literals.insert(pattern);
+		else if (type == HOST && GetRange(pattern, range))
+		{
+			types[type].ranges.insert(std::make_pair(range, pattern));
+			types[type].lengths.insert(std::make_pair(range.type, range.length));
+		}
+		else
+			types[type].globs.push_back(pattern);
+	}
+
+	// Returns the pattern that exempts the user or NULL if none do.
+	const std::string* Find(AntirandomExemptType type, User* user) const
+	{
+		const TypeExempts& exempts = types[type];
+		switch (type)
+		{
+			case NICK:
+				return FindIn(exempts, user->nick);
+
+			case IDENT:
+				return FindIn(exempts, user->ident);
+
+			case HOST:
+			{
+				const std::string* pattern = FindLiteral(exempts.literals, user->GetRealHost());
+				if (!pattern)
+					pattern = FindLiteral(exempts.literals, user->GetIPString());
+				if (!pattern)
+					pattern = FindRange(exempts, user);
+				if (pattern)
+					return pattern;
+
+				for (std::vector<std::string>::const_iterator iter = exempts.globs.begin(); iter != exempts.globs.end(); ++iter)
+				{
+					if (InspIRCd::Match(user->GetRealHost(), *iter, ascii_case_insensitive_map) || InspIRCd::MatchCIDR(user->GetIPString(), *iter, ascii_case_insensitive_map))
+						return &*iter;
+				}
+				return NULL;
+			}
+
+			case FULLNAME:
+				return FindIn(exempts, user->GetRealName());
+		}
+		return NULL;
 	}
 };
-typedef std::vector<AntirandomExempt> AntirandomExemptList;
 
 static const char *triples_txt[] = {
 	"aj", "fqtvxz",
@@ -515,20 +675,94 @@ static const char *triples_txt[] = {
 	NULL, NULL
 };
 
-static std::map<std::string, std::string> init_map(const char **a)
+namespace
 {
-	std::map<std::string, std::string> m;
-	for (const char **ci = a; *ci; ci += 2)
+	enum CharClass
 	{
-		m.insert(std::pair<std::string, std::string>(ci[0], ci[1]));
-	}
-	return m;
+		CC_DIGIT = 1,
+		CC_CONSONANT = 2,
+		CC_VOWEL = 4
+	};
+
+	// Built once when the module is loaded so that scoring a string is a single
+	// pass over it without any allocations or string searches.
+	class ScoreTables
+	{
+	 private:
+		// The character classes of each byte.
+		unsigned char classes[UCHAR_MAX + 1];
+
+		// A bitmask of the third letters of the triples which start with each pair of letters.
+		uint32_t triples[26][26];
+
+		static bool IsLetter(char c)
+		{
+			return static_cast<unsigned char>(c - 'a') < 26;
+		}
+
+		void SetClass(const char* chars, CharClass cc)
+		{
+			for (; *chars; ++chars)
+				classes[static_cast<unsigned char>(*chars)] |= cc;
+		}
+
+	 public:
+		ScoreTables()
+		{
+			memset(classes, 0, sizeof(classes));
+			SetClass("0123456789", CC_DIGIT);
+			SetClass("bcdfghjklmnpqrstvwxz", CC_CONSONANT);
+			SetClass("aeiou", CC_VOWEL);
+
+			memset(triples, 0, sizeof(triples));
+			for (const char** ci = triples_txt; *ci; ci += 2)
+			{
+				for (const char* third = ci[1]; *third; ++third)
+					triples[ci[0][0] - 'a'][ci[0][1] - 'a'] |= 1U << (*third - 'a');
+			}
+		}
+
+		unsigned char GetClass(char c) const
+		{
+			return classes[static_cast<unsigned char>(c)];
+		}
+
+		bool IsTriple(char first, char second, char third) const
+		{
+			if (!IsLetter(first) || !IsLetter(second) || !IsLetter(third))
+				return false;
+
+			return triples[first - 'a'][second - 'a'] & (1U << (third - 'a'));
+		}
+	};
+
+	const ScoreTables tables;
 }
 
-const static std::map<std::string, std::string> triples_map = init_map(triples_txt);
+class ModuleAntiRandom;
 
-class ModuleAntiRandom : public Module
+/** Handle /ANTIRANDOM
+ */
+class CommandAntiRandom : public Command
 {
+	ModuleAntiRandom& parent;
+
+ public:
+	CommandAntiRandom(Module* Creator, ModuleAntiRandom& Parent)
+		: Command(Creator, "ANTIRANDOM", 3, 3)
+		, parent(Parent)
+	{
+		flags_needed = 'o';
+		syntax = "<nick> <ident> :<real name>";
+	}
+
+	CmdResult Handle(User* user, const Params& parameters) CXX11_OVERRIDE;
+};
+
+class ModuleAntiRandom : public Module, public Stats::EventListener
+{
+	friend class CommandAntiRandom;
+
  private:
 	bool ShowFailedConnects;
 	bool DebugMode;
@@ -537,7 +771,77 @@ class ModuleAntiRandom : public Module
 	unsigned int BanDuration;
 	std::string BanReason;
 	AntirandomExemptList Exempts;
+	CommandAntiRandom cmd;
+
+	// The number of connections which have been scored and how long it took in nanoseconds.
+	unsigned long ScoredConnections;
+	unsigned long long ScoringTime;
+
+	// The number of connections which got each score. The last entry also holds
+	// every higher score.
+	std::vector<unsigned long> ScoreCounts;
+
+	// The same for the nick, ident and real name parts of the score.
+	std::vector<unsigned long> NickScoreCounts;
+	std::vector<unsigned long> IdentScoreCounts;
+	std::vector<unsigned long> RealNameScoreCounts;
+
+	// The number of connections which were exempt or went over the threshold.
+	unsigned long ExemptConnections;
+	unsigned long RejectedConnections;
+
+	// When each recently rejected IP was rejected. A rejected IP which then gets
+	// through with another nick, ident or real name soon after was most likely a
+	// person and is counted as a false positive.
+	typedef std::map<std::string, time_t> RejectMap;
+	RejectMap RecentRejects;
+	unsigned long FalsePositives;
+	static const time_t FalsePositiveWindow = 600;
+	static const size_t MaxRecentRejects = 10000;
+
+	void PruneRejects()
+	{
+		const time_t cutoff = ServerInstance->Time() - FalsePositiveWindow;
+		for (RejectMap::iterator i = RecentRejects.begin(); i != RecentRejects.end(); )
+		{
+			if (i->second < cutoff)
+				RecentRejects.erase(i++);
+			else
+				++i;
+		}
+
+		if (RecentRejects.size() >= MaxRecentRejects)
+			RecentRejects.clear();
+	}
+
+	static unsigned long long GetNanoseconds()
+	{
+		struct timespec ts;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		return static_cast<unsigned long long>(ts.tv_sec) * 1000000000ULL + ts.tv_nsec;
+	}
+
+	static void CountScore(std::vector<unsigned long>& counts, int score)
+	{
+		counts[std::min<size_t>(std::max(score, 0), counts.size() - 1)]++;
+	}
+
  public:
+	ModuleAntiRandom()
+		: Stats::EventListener(this)
+		, cmd(this, *this)
+		, ScoredConnections(0)
+		, ScoringTime(0)
+		, ScoreCounts(102)
+		, NickScoreCounts(102)
+		, IdentScoreCounts(102)
+		, RealNameScoreCounts(102)
+		, ExemptConnections(0)
+		, RejectedConnections(0)
+		, FalsePositives(0)
+	{
+	}
+
 	Version GetVersion() CXX11_OVERRIDE
 	{
 		return Version("A module to prevent against bots using random patterns",VF_NONE);
@@ -558,8 +862,8 @@ class ModuleAntiRandom : public Module
 		/* Fast digit/consonant/vowel checks... */
 		for (size_t i = 0; i < original_str.length(); i++)
 		{
-			const char &c = original_str[i];
-			if ((c >= '0') && (c <= '9'))
+			const unsigned char cc = tables.GetClass(original_str[i]);
+			if (cc & CC_DIGIT)
 			{
 				digits++;
 			}
@@ -571,7 +875,7 @@ class ModuleAntiRandom : public Module
 			}
 
 			/* Check consonants */
-			if (strchr("bcdfghjklmnpqrstvwxz", c))
+			if (cc & CC_CONSONANT)
 			{
 				consonants++;
 			}
@@ -583,7 +887,7 @@ class ModuleAntiRandom : public Module
 			}
 
 			/* Check vowels */
-			if (strchr("aeiou", c))
+			if (cc & CC_VOWEL)
 			{
 				vowels++;
 			}
@@ -630,14 +934,13 @@ class ModuleAntiRandom : public Module
 		{
 			for (size_t i = 0; i < (original_str.length() - 2); i++)
 			{
-				std::map<std::string, std::string>::const_iterator trip = triples_map.find(original_str.substr(i, 2));
-				// Check whether the current and next characters are the first half of a triple, if so, check for the 3rd character in the second half
-				if (trip != triples_map.end() && trip->second.find_first_of(original_str[i + 2]) != std::string::npos)
+				// Check whether the current and next two characters form a triple.
+				if (tables.IsTriple(original_str[i], original_str[i + 1], original_str[i + 2]))
 				{
 					score++;
 					if (this->DebugMode)
-						ServerInstance->SNO->WriteGlobalSno('a', "m_antirandom: %s:MATCH triple (%s:%c/%c/%c)",
-															original_str.c_str(), trip->second.c_str(), original_str[i], original_str[i + 1], original_str[i + 2]);
+						ServerInstance->SNO->WriteGlobalSno('a', "m_antirandom: %s:MATCH triple (%c/%c/%c)",
+															original_str.c_str(), original_str[i], original_str[i + 1], original_str[i + 2]);
 				}
 			}
 		}
@@ -647,19 +950,25 @@ class ModuleAntiRandom : public Module
 	unsigned int GetUserScore(User *user)
 	{
 		int nscore, uscore, gscore, score;
-		struct timeval tv_alpha, tv_beta;
 
-		gettimeofday(&tv_alpha, NULL);
+		const unsigned long long alpha = GetNanoseconds();
 
 		nscore = GetStringScore(user->nick);
 		uscore = GetStringScore(user->ident);
 		gscore = GetStringScore(user->GetRealName());
 		score = nscore + uscore + gscore;
 
-		gettimeofday(&tv_beta, NULL);
+		const unsigned long long beta = GetNanoseconds();
+		const unsigned long long elapsed = (beta > alpha ? beta - alpha : 0);
 		if (this->DebugMode)
-			ServerInstance->SNO->WriteGlobalSno('a', "m_antirandom Timing: %ld microseconds",
-				((tv_beta.tv_sec - tv_alpha.tv_sec) * 1000000) + (tv_beta.tv_usec - tv_alpha.tv_usec));
+			ServerInstance->SNO->WriteGlobalSno('a', "m_antirandom Timing: %llu nanoseconds", elapsed);
+
+		ScoredConnections++;
+		ScoringTime += elapsed;
+		CountScore(ScoreCounts, score);
+		CountScore(NickScoreCounts, nscore);
+		CountScore(IdentScoreCounts, uscore);
+		CountScore(RealNameScoreCounts, gscore);
 
 		if (this->DebugMode)
 			ServerInstance->SNO->WriteGlobalSno('a', "m_antirandom Got score: %d/%d/%d = %d", nscore, uscore, gscore, score);
@@ -668,50 +977,15 @@ class ModuleAntiRandom : public Module
 
 	bool IsAntirandomExempt(User *user)
 	{
-		for (AntirandomExemptList::iterator iter = Exempts.begin(); iter != Exempts.end(); iter++)
+		static const char* const typenames[] = { "NICK", "IDENT", "HOST", "FULLNAME" };
+		for (int type = NICK; type <= FULLNAME; ++type)
 		{
-			switch (iter->type)
+			const std::string* pattern = Exempts.Find(static_cast<AntirandomExemptType>(type), user);
+			if (pattern)
 			{
-				case NICK:
-				{
-					if (InspIRCd::Match(user->nick, iter->pattern, ascii_case_insensitive_map))
-					{
-						if (this->DebugMode)
-							ServerInstance->SNO->WriteGlobalSno('a', "m_antirandom exempt: NICK (%s)", iter->pattern.c_str());
-						return true;
-					}
-					break;
-				}
-				case IDENT:
-				{
-					if (InspIRCd::Match(user->ident, iter->pattern, ascii_case_insensitive_map))
-					{
-						if (this->DebugMode)
-							ServerInstance->SNO->WriteGlobalSno('a', "m_antirandom exempt: IDENT (%s)", iter->pattern.c_str());
-						return true;
-					}
-					break;
-				}
-				case HOST:
-				{
-					if (InspIRCd::Match(user->GetRealHost(), iter->pattern, ascii_case_insensitive_map) || InspIRCd::MatchCIDR(user->GetIPString().c_str(), iter->pattern, ascii_case_insensitive_map))
-					{
-						if (this->DebugMode)
-							ServerInstance->SNO->WriteGlobalSno('a', "m_antirandom exempt: HOST (%s)", iter->pattern.c_str());
-						return true;
-					}
-					break;
-				}
-				case FULLNAME:
-				{
-					if (InspIRCd::Match(user->GetRealName(), iter->pattern, ascii_case_insensitive_map))
-					{
-						if (this->DebugMode)
-							ServerInstance->SNO->WriteGlobalSno('a', "m_antirandom exempt: FULLNAME (%s)", iter->pattern.c_str());
-						return true;
-					}
-					break;
-				}
+				if (this->DebugMode)
+					ServerInstance->SNO->WriteGlobalSno('a', "m_antirandom exempt: %s (%s)", typenames[type], pattern->c_str());
+				return true;
 			}
 		}
 		return false;
@@ -721,6 +995,7 @@ class ModuleAntiRandom : public Module
 	{
 		if (IsAntirandomExempt(user))
 		{
+			ExemptConnections++;
 			return MOD_RES_PASSTHRU;
 		}
 
@@ -728,6 +1003,9 @@ class ModuleAntiRandom : public Module
 
 		if (score > this->Threshold)
 		{
+			RejectedConnections++;
+			PruneRejects();
+			RecentRejects[user->GetIPString()] = ServerInstance->Time();
 			std::string method = "allowed because no action was set";
 
 			switch (this->BanAction)
@@ -768,6 +1046,55 @@ class ModuleAntiRandom : public Module
 			}
 			return MOD_RES_DENY;
 		}
+
+		RejectMap::iterator reject = RecentRejects.find(user->GetIPString());
+		if (reject != RecentRejects.end())
+		{
+			if (reject->second + FalsePositiveWindow >= ServerInstance->Time())
+				FalsePositives++;
+			RecentRejects.erase(reject);
+		}
+		return MOD_RES_PASSTHRU;
+	}
+
+	ModResult OnStats(Stats::Context& stats) CXX11_OVERRIDE
+	{
+		if (stats.GetSymbol() != 'r')
+			return MOD_RES_PASSTHRU;
+
+		unsigned long long nanoseconds = ScoredConnections ? ScoringTime / ScoredConnections : 0;
+		stats.AddRow(249, InspIRCd::Format("Scored %lu connections in %llu microseconds (%llu nanoseconds per connection)",
+			ScoredConnections, ScoringTime / 1000, nanoseconds));
+		stats.AddRow(249, InspIRCd::Format("Exempted %lu connections and rejected %lu connections, %lu of them likely false positives",
+			ExemptConnections, RejectedConnections, FalsePositives));
+
+		for (size_t score = 0; score < ScoreCounts.size(); ++score)
+		{
+			if (!ScoreCounts[score] && !NickScoreCounts[score] && !IdentScoreCounts[score] && !RealNameScoreCounts[score])
+				continue;
+
+			stats.AddRow(249, InspIRCd::Format("Score %lu%s: %lu total, %lu nick, %lu ident, %lu real name",
+				static_cast<unsigned long>(score), score == ScoreCounts.size() - 1 ? "+" : "", ScoreCounts[score],
+				NickScoreCounts[score], IdentScoreCounts[score], RealNameScoreCounts[score]));
+		}
+
+		// A connection is rejected when its score is above the threshold so the
+		// connections with at least a given score are those that would have been
+		// rejected with a threshold one lower.
+		unsigned long rejected = 0;
+		for (size_t score = ScoreCounts.size() - 1; score > 1; --score)
+		{
+			rejected += ScoreCounts[score];
+			if (!ScoreCounts[score])
+				continue;
+
+			unsigned long percent = (rejected * 100) / ScoredConnections;
+			stats.AddRow(249, InspIRCd::Format("Threshold %lu would reject %lu connections (%lu%%)%s",
+				static_cast<unsigned long>(score - 1), rejected, percent,
+				score - 1 == Threshold ? " (current threshold)" : ""));
+		}
+
+		// Let other modules add their own rows to STATS r.
 		return MOD_RES_PASSTHRU;
 	}
 
@@ -797,7 +1124,7 @@ class ModuleAntiRandom : public Module
 		this->BanDuration = conftag->getDuration("banduration", 86400, 1);
 		this->BanReason = conftag->getString("banreason", "You look like a bot. Change your nick/ident/gecos and try reconnecting.", 1);
 
-		Exempts.clear();
+		Exempts.Clear();
 
 		ConfigTagList exempts_list = ServerInstance->Config->ConfTags("antirandomexempt");
 		for (ConfigIter i = exempts_list.first; i != exempts_list.second; ++i)
@@ -825,7 +1152,7 @@ class ModuleAntiRandom : public Module
 					continue;
 				}
 
-				Exempts.push_back(AntirandomExempt(exemptType, pattern));
+				Exempts.Add(exemptType, pattern);
 				if (this->DebugMode)
 					ServerInstance->SNO->WriteGlobalSno('a', "m_antirandom: Added exempt: %s (%s)", type.c_str(), pattern.c_str());
 			}
@@ -840,6 +1167,16 @@ class ModuleAntiRandom : public Module
 
 };
 
+CmdResult CommandAntiRandom::Handle(User* user, const Params& parameters)
+{
+	const unsigned int nscore = parent.GetStringScore(parameters[0]);
+	const unsigned int uscore = parent.GetStringScore(parameters[1]);
+	const unsigned int gscore = parent.GetStringScore(parameters[2]);
+	const unsigned int score = nscore + uscore + gscore;
+	user->WriteNotice(InspIRCd::Format("*** Antirandom score: %u (%u nick, %u ident, %u real name), %s", score, nscore, uscore,
+		gscore, score > parent.Threshold ? "would be rejected" : "would be allowed"));
+	return CMD_SUCCESS;
+}
 
 MODULE_INIT(ModuleAntiRandom)
 
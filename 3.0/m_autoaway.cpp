@@ -26,6 +26,8 @@
 #include "inspircd.h"
 #include "modules/away.h"
 
+#include <queue>
+
 enum
 {
 	// From RFC 1459.
@@ -33,6 +35,12 @@ enum
 	RPL_NOWAWAY = 306
 };
 
+// A local user and the idle_lastmsg they had when they were queued.
+typedef std::pair<time_t, std::string> IdleEntry;
+
+// Local users who are not away ordered by when they last spoke.
+typedef std::priority_queue<IdleEntry, std::vector<IdleEntry>, std::greater<IdleEntry> > IdleQueue;
+
 class ModuleAutoAway
 	: public Module
 	, public Timer
@@ -40,7 +48,10 @@ class ModuleAutoAway
 {
  private:
 	LocalIntExt autoaway;
+	LocalIntExt queued;
 	Away::EventProvider awayevprov;
+	IdleQueue idlequeue;
+	bool queuebuilt;
 	unsigned long idleperiod;
 	std::string message;
 	bool setting;
@@ -50,7 +61,9 @@ class ModuleAutoAway
 		: Timer(0, true)
 		, Away::EventListener(this)
 		, autoaway("autoaway", ExtensionItem::EXT_CHANNEL, this)
+		, queued("autoaway-queued", ExtensionItem::EXT_USER, this)
 		, awayevprov(this)
+		, queuebuilt(false)
 		, setting(false)
 	{
 	}
@@ -63,20 +76,54 @@ class ModuleAutoAway
 		message = tag->getString("message", "Idle");
 	}
 
+	// Queues a user unless they are already queued.
+	void Queue(LocalUser* user)
+	{
+		if (!queuebuilt || queued.get(user))
+			return;
+
+		queued.set(user, user->idle_lastmsg);
+		idlequeue.push(std::make_pair(user->idle_lastmsg, user->uuid));
+	}
+
 	bool Tick(time_t) CXX11_OVERRIDE
 	{
 		ServerInstance->Logs->Log(MODNAME, LOG_DEBUG, "Checking for idle users ...");
+		if (!queuebuilt)
+		{
+			queuebuilt = true;
+			const UserManager::LocalList& users = ServerInstance->Users.GetLocalUsers();
+			for (UserManager::LocalList::const_iterator iter = users.begin(); iter != users.end(); ++iter)
+			{
+				if ((*iter)->registered == REG_ALL)
+					Queue(*iter);
+			}
+		}
+
 		setting = true;
 		time_t idlethreshold = ServerInstance->Time() - idleperiod;
-		const UserManager::LocalList& users = ServerInstance->Users.GetLocalUsers();
-		for (UserManager::LocalList::const_iterator iter = users.begin(); iter != users.end(); ++iter)
+		while (!idlequeue.empty() && idlequeue.top().first <= idlethreshold)
 		{
-			LocalUser* user = *iter;
+			const IdleEntry top = idlequeue.top();
+			idlequeue.pop();
 
-			// Skip users who are already away or who are not idle.
-			if (user->IsAway() || user->idle_lastmsg > idlethreshold)
+			// Skip users who have gone or entries which were replaced.
+			LocalUser* user = IS_LOCAL(ServerInstance->FindUUID(top.second));
+			if (!user || user->quitting || static_cast<time_t>(queued.get(user)) != top.first)
 				continue;
 
+			// Users who are already away are queued again when they come back.
+			queued.set(user, 0);
+			if (user->IsAway())
+				continue;
+
+			// The user has spoken since they were queued, put them back in the right place.
+			if (user->idle_lastmsg != top.first)
+			{
+				Queue(user);
+				continue;
+			}
+
 			autoaway.set(user, 1);
 			user->awaytime = ServerInstance->Time();
 			user->awaymsg.assign(message, 0, ServerInstance->Config->Limits.MaxAway);
@@ -87,6 +134,13 @@ class ModuleAutoAway
 		return true;
 	}
 
+	void OnPostConnect(User* user) CXX11_OVERRIDE
+	{
+		LocalUser* luser = IS_LOCAL(user);
+		if (luser)
+			Queue(luser);
+	}
+
 	void OnUserAway(User* user) CXX11_OVERRIDE
 	{
 		// If the user is changing their away status then unmark them.
@@ -97,8 +151,12 @@ class ModuleAutoAway
 	void OnUserBack(User* user) CXX11_OVERRIDE
 	{
 		// If the user is unsetting their away status then unmark them.
-		if (IS_LOCAL(user))
-			autoaway.set(user, 0);
+		LocalUser* luser = IS_LOCAL(user);
+		if (luser)
+		{
+			autoaway.set(luser, 0);
+			Queue(luser);
+		}
 	}
 
 	void OnUserPostMessage(User* user, const MessageTarget& target, const MessageDetails& details) CXX11_OVERRIDE
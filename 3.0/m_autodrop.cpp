@@ -28,7 +28,8 @@
 class ModuleAutoDrop : public Module
 {
  private:
-	std::vector<std::string> Commands;
+	// Command names are uppercased by the core before OnPreCommand is called.
+	TR1NS::unordered_set<std::string> Commands;
 
  public:
 	void Prioritize() CXX11_OVERRIDE
@@ -38,7 +39,7 @@ class ModuleAutoDrop : public Module
 
 	void ReadConfig(ConfigStatus&) CXX11_OVERRIDE
 	{
-		Commands.clear();
+		TR1NS::unordered_set<std::string> newcommands;
 
 		ConfigTag* tag = ServerInstance->Config->ConfValue("autodrop");
 		std::string commandList = tag->getString("commands", "CONNECT DELETE GET HEAD OPTIONS PATCH POST PUT TRACE");
@@ -47,13 +48,15 @@ class ModuleAutoDrop : public Module
 		std::string token;
 		while (stream.GetToken(token))
 		{
-			Commands.push_back(token);
+			std::transform(token.begin(), token.end(), token.begin(), ::toupper);
+			newcommands.insert(token);
 		}
+		Commands.swap(newcommands);
 	}
 
 	ModResult OnPreCommand(std::string& command, Command::Params&, LocalUser* user, bool) CXX11_OVERRIDE
 	{
-		if (user->registered == REG_ALL || std::find(Commands.begin(), Commands.end(), command) == Commands.end())
+		if (user->registered == REG_ALL || !Commands.count(command))
 			return MOD_RES_PASSTHRU;
 
 		user->eh.SetError("Dropped by " MODNAME);
@@ -18,40 +18,165 @@
 
 /// $ModAuthor: Sadie Powell
 /// $ModAuthorMail: sadie@witchery.services
-/// $ModConfig: <autokick message="Banned">
+/// $ModConfig: <autokick message="Banned" maxkicks="100">
 /// $ModDepends: core 3
 /// $ModDesc: Automatically kicks people who match a banned mask.
 
+/* Users matching a new ban are kicked at a rate of at most <autokick maxkicks>
+ * per second so that a wide ban on a large channel does not stall the server.
+ */
+
 
 #include "inspircd.h"
 
-class ModeWatcherBan : public ModeWatcher
+// A ban mask which has been split up front so it can be matched against many
+// users without being parsed again. This mirrors Channel::CheckBan.
+struct ParsedBan
+{
+	std::string mask;
+	bool extban;
+	std::string nickident;
+	std::string host;
+
+	ParsedBan(const std::string& banmask)
+		: mask(banmask)
+	{
+		std::string::size_type at = mask.find('@');
+		extban = ((mask.length() <= 2) || (mask[1] == ':') || (at == std::string::npos));
+		if (extban)
+			return;
+
+		nickident.assign(mask, 0, at);
+		host.assign(mask, at + 1, std::string::npos);
+	}
+
+	bool Matches(User* user, Channel* chan) const
+	{
+		ModResult result;
+		FIRST_MOD_RESULT(OnCheckBan, result, (user, chan, mask));
+		if (result != MOD_RES_PASSTHRU)
+			return (result == MOD_RES_DENY);
+
+		if (extban || !InspIRCd::Match(user->nick + "!" + user->ident, nickident))
+			return false;
+
+		if (InspIRCd::Match(user->GetRealHost(), host) || InspIRCd::Match(user->GetDisplayedHost(), host))
+			return true;
+
+		return InspIRCd::MatchCIDR(user->GetIPString(), host);
+	}
+};
+
+// The local members of a channel which still have to be checked against a new ban.
+struct Sweep
 {
+	// The channel being swept or NULL if the sweep has been cancelled.
+	Channel* chan;
+	ParsedBan ban;
+	unsigned int rank;
+	std::vector<std::string> users;
+	size_t next;
+
+	Sweep(Channel* c, const std::string& mask, unsigned int r)
+		: chan(c)
+		, ban(mask)
+		, rank(r)
+		, next(0)
+	{
+	}
+};
+
+class ModeWatcherBan
+	: public ModeWatcher
+	, public Timer
+{
+ private:
+	std::deque<Sweep> sweeps;
+
+	// The number of kicks left this second.
+	unsigned long budget;
+
+	// Kicks matching users from the front sweep until it is done or the budget runs out.
+	bool Process(Sweep& sweep)
+	{
+		while (sweep.chan && sweep.next < sweep.users.size())
+		{
+			if (!budget)
+				return false;
+
+			LocalUser* user = IS_LOCAL(ServerInstance->FindUUID(sweep.users[sweep.next++]));
+			if (!user || !sweep.chan->HasUser(user))
+				continue;
+
+			if (sweep.rank > sweep.chan->GetPrefixValue(user) && sweep.ban.Matches(user, sweep.chan))
+			{
+				sweep.chan->KickUser(ServerInstance->FakeClient, user, Reason);
+				budget--;
+			}
+		}
+		return true;
+	}
+
+	// Kicking the last user deletes the channel so sweeps are cancelled in place
+	// rather than being removed while they might be being processed.
+	void Cancel(Channel* channel, const std::string* mask)
+	{
+		for (std::deque<Sweep>::iterator iter = sweeps.begin(); iter != sweeps.end(); ++iter)
+		{
+			if (iter->chan == channel && (!mask || iter->ban.mask == *mask))
+				iter->chan = NULL;
+		}
+	}
+
+	void ProcessAll()
+	{
+		while (!sweeps.empty() && Process(sweeps.front()))
+			sweeps.pop_front();
+	}
+
  public:
 	std::string Reason;
+	unsigned long MaxKicks;
 
-	ModeWatcherBan(Module* Creator) : ModeWatcher(Creator, "ban", MODETYPE_CHANNEL) { }
+	ModeWatcherBan(Module* Creator)
+		: ModeWatcher(Creator, "ban", MODETYPE_CHANNEL)
+		, Timer(1, true)
+		, budget(0)
+		, MaxKicks(100)
+	{
+	}
 
 	void AfterMode(User* source, User*, Channel* channel, const std::string& parameter, bool adding) CXX11_OVERRIDE
 	{
-		if (adding)
+		if (!adding)
 		{
-			unsigned int rank = channel->GetPrefixValue(source);
+			// Stop kicking for a ban as soon as it is removed.
+			Cancel(channel, &parameter);
+			return;
+		}
 
-			const Channel::MemberMap& users = channel->GetUsers();
-			Channel::MemberMap::const_iterator iter = users.begin();
+		sweeps.push_back(Sweep(channel, parameter, channel->GetPrefixValue(source)));
+		Sweep& sweep = sweeps.back();
 
-			while (iter != users.end())
-			{
-				// KickUser invalidates the iterator so copy and increment it here.
-				Channel::MemberMap::const_iterator it = iter++;
-				if (IS_LOCAL(it->first) && rank > channel->GetPrefixValue(it->first) && channel->CheckBan(it->first, parameter))
-				{
-					channel->KickUser(ServerInstance->FakeClient, it->first, Reason.c_str());
-				}
-			}
+		const Channel::MemberMap& users = channel->GetUsers();
+		for (Channel::MemberMap::const_iterator iter = users.begin(); iter != users.end(); ++iter)
+		{
+			if (IS_LOCAL(iter->first))
+				sweep.users.push_back(iter->first->uuid);
 		}
 	}
+
+	void Cancel(Channel* channel)
+	{
+		Cancel(channel, NULL);
+	}
+
+	bool Tick(time_t) CXX11_OVERRIDE
+	{
+		budget = MaxKicks;
+		ProcessAll();
+		return true;
+	}
 };
 
 class ModuleAutoKick : public Module
@@ -62,10 +187,21 @@ class ModuleAutoKick : public Module
  public:
 	ModuleAutoKick() : mw(this) { }
 
+	void init() CXX11_OVERRIDE
+	{
+		ServerInstance->Timers.AddTimer(&mw);
+	}
+
 	void ReadConfig(ConfigStatus&) CXX11_OVERRIDE
 	{
 		ConfigTag* tag = ServerInstance->Config->ConfValue("autokick");
 		mw.Reason = tag->getString("message", "Banned");
+		mw.MaxKicks = tag->getUInt("maxkicks", 100, 1);
+	}
+
+	void OnChannelDelete(Channel* chan) CXX11_OVERRIDE
+	{
+		mw.Cancel(chan);
 	}
 
 	Version GetVersion() CXX11_OVERRIDE
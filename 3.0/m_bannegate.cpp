@@ -26,7 +26,32 @@
 
 class ModuleBanNegate : public Module
 {
+ private:
+	// The inner masks of negated bans keyed by the negated mask. This only
+	// saves copying the inner mask on every check so it can't go stale; it
+	// is simply emptied once it holds maxcache masks.
+	typedef TR1NS::unordered_map<std::string, std::string> InnerMaskMap;
+	InnerMaskMap innermasks;
+	static const size_t maxcache = 4096;
+
+	// Inner masks are passed by reference so the cache can only be emptied
+	// when no check is using one of them.
+	unsigned int depth;
+
+	bool CheckInner(User* source, Channel* chan, const std::string& inner)
+	{
+		depth++;
+		bool matched = chan->CheckBan(source, inner);
+		depth--;
+		return matched;
+	}
+
  public:
+	ModuleBanNegate()
+		: depth(0)
+	{
+	}
+
 	void Prioritize() CXX11_OVERRIDE
 	{
 		ServerInstance->Modules->SetPriority(this, I_OnCheckBan, PRIORITY_FIRST);
@@ -36,7 +61,21 @@ class ModuleBanNegate : public Module
 	{
 		// If our matching mask begins with the negate character, but does not have multiple in a row (to avoid nested loops)
 		if (mask.length() > 2 && mask[0] == '~' && mask[1] != '~')
-			return (chan->CheckBan(source, mask.substr(1)) ? MOD_RES_ALLOW : MOD_RES_DENY);
+		{
+			// The inner mask can be an extban so it still has to go through CheckBan.
+			InnerMaskMap::const_iterator iter = innermasks.find(mask);
+			if (iter == innermasks.end())
+			{
+				if (!depth && innermasks.size() >= maxcache)
+					innermasks.clear();
+
+				if (innermasks.size() >= maxcache)
+					return (chan->CheckBan(source, mask.substr(1)) ? MOD_RES_ALLOW : MOD_RES_DENY);
+
+				iter = innermasks.insert(std::make_pair(mask, mask.substr(1))).first;
+			}
+			return (CheckInner(source, chan, iter->second) ? MOD_RES_ALLOW : MOD_RES_DENY);
+		}
 
 		return MOD_RES_PASSTHRU;
 	}
@@ -26,12 +26,22 @@
 #include "inspircd.h"
 #include "modules/exemption.h"
 
+// The nicks of the members of a channel, folded for case insensitive lookups.
+typedef TR1NS::unordered_set<std::string, irc::insensitive, irc::StrHashComp> NickSet;
+
 class ModuleBlockHighlight : public Module
 {
 	SimpleChannelModeHandler mode;
 	ChanModeReference noextmsgmode;
 	CheckExemption::EventProvider exemptionprov;
 
+	// Built for a +V channel when it is first needed and then kept up to date
+	// as members join, leave and change nick.
+	SimpleExtItem<NickSet> nicks;
+
+	// Reused for each token to avoid allocating.
+	std::string token;
+
 	bool ignoreextmsg;
 	unsigned int minlen;
 	unsigned int minusers;
@@ -43,7 +53,62 @@ public:
 		: mode(this, "blockhighlight", 'V')
 		, noextmsgmode(this, "noextmsg")
 		, exemptionprov(this)
+		, nicks("blockhighlight-nicks", ExtensionItem::EXT_CHANNEL, this)
+	{
+	}
+
+	NickSet* GetNicks(Channel* chan)
+	{
+		NickSet* nickset = nicks.get(chan);
+		if (nickset)
+			return nickset;
+
+		nickset = new NickSet;
+		const Channel::MemberMap& users = chan->GetUsers();
+		for (Channel::MemberMap::const_iterator i = users.begin(); i != users.end(); ++i)
+			nickset->insert(i->first->nick);
+		nicks.set(chan, nickset);
+		return nickset;
+	}
+
+	void RemoveNick(Channel* chan, const std::string& nick)
+	{
+		NickSet* nickset = nicks.get(chan);
+		if (nickset)
+			nickset->erase(nick);
+	}
+
+	unsigned int CountHighlights(const std::string& message, const NickSet& nickset)
+	{
+		// Split on spaces the same way as irc::spacesepstream does.
+		unsigned int count = 0;
+		std::string::size_type start = 0;
+		while (start < message.length())
+		{
+			std::string::size_type end = message.find(' ', start);
+			if (end == std::string::npos)
+				end = message.length();
+
+			std::string::size_type length = end - start;
+
+			// Chop off trailing :
+			if ((length > 1) && (message[end - 1] == ':'))
+				length--;
+
+			if (length)
+			{
+				token.assign(message, start, length);
+				if (nickset.count(token) && ++count >= minusers)
+					break;
+			}
+			start = end + 1;
+		}
+		return count;
+	}
+
+	static bool IsControl(char chr)
 	{
+		return static_cast<unsigned char>(chr) < 32;
 	}
 
 	void ReadConfig(ConfigStatus&) CXX11_OVERRIDE
@@ -85,35 +150,63 @@ public:
 		if (!chan->IsModeSet(noextmsgmode) && !chan->HasUser(user) && ignoreextmsg)
 			return MOD_RES_PASSTHRU;
 
-		std::string message(details.text);
-		if (stripcolor)
+		// Only copy the message if it has formatting codes that need stripping.
+		const NickSet& nickset = *GetNicks(chan);
+		unsigned int count;
+		if (stripcolor && std::find_if(details.text.begin(), details.text.end(), IsControl) != details.text.end())
+		{
+			std::string message(details.text);
 			InspIRCd::StripColor(message);
+			count = CountHighlights(message, nickset);
+		}
+		else
+		{
+			count = CountHighlights(details.text, nickset);
+		}
 
-		irc::spacesepstream ss(message);
-		unsigned int count = 0;
-		for (std::string token; ss.GetToken(token); )
+		if (count >= minusers)
 		{
-			// Chop off trailing :
-			if ((token.length() > 1) && (token[token.length()-1] == ':'))
-				token.erase(token.length()-1);
+			ServerInstance->Users->QuitUser(user, reason);
+			return MOD_RES_DENY;
+		}
 
-			User* const highlighted = ServerInstance->FindNickOnly(token);
-			if (!highlighted)
-				continue;
+		return MOD_RES_PASSTHRU;
+	}
+
+	void OnUserJoin(Membership* memb, bool, bool, CUList&) CXX11_OVERRIDE
+	{
+		NickSet* nickset = nicks.get(memb->chan);
+		if (nickset)
+			nickset->insert(memb->user->nick);
+	}
+
+	void OnUserPart(Membership* memb, std::string&, CUList&) CXX11_OVERRIDE
+	{
+		RemoveNick(memb->chan, memb->user->nick);
+	}
+
+	void OnUserKick(User*, Membership* memb, const std::string&, CUList&) CXX11_OVERRIDE
+	{
+		RemoveNick(memb->chan, memb->user->nick);
+	}
+
+	void OnUserQuit(User* user, const std::string&, const std::string&) CXX11_OVERRIDE
+	{
+		for (User::ChanList::iterator i = user->chans.begin(); i != user->chans.end(); ++i)
+			RemoveNick((*i)->chan, user->nick);
+	}
 
-			if (!chan->HasUser(highlighted))
+	void OnUserPostNick(User* user, const std::string& oldnick) CXX11_OVERRIDE
+	{
+		for (User::ChanList::iterator i = user->chans.begin(); i != user->chans.end(); ++i)
+		{
+			NickSet* nickset = nicks.get((*i)->chan);
+			if (!nickset)
 				continue;
 
-			// Highlighted someone
-			count++;
-			if (count >= minusers)
-			{
-				ServerInstance->Users->QuitUser(user, reason);
-				return MOD_RES_DENY;
-			}
+			nickset->erase(oldnick);
+			nickset->insert(user->nick);
 		}
-
-		return MOD_RES_PASSTHRU;
 	}
 
 	Version GetVersion() CXX11_OVERRIDE
@@ -36,8 +36,9 @@ Get a list of bans and exceptions that match you (or the given user)
 on the specified channel.
 ">
 
-<helpop key="checkbans" title="/CHECKBANS <channel>" value="
+<helpop key="checkbans" title="/CHECKBANS <channel> [-summary]" value="
 Get a list of bans and exceptions that match current users on the channel.
+With -summary only the number of users matching each entry is shown.
 ">
 
  */
@@ -69,39 +70,161 @@ bool CanCheck(Channel* chan, User* user, ChanModeReference& ban)
 	return true;
 }
 
-void CheckLists(User* source, Channel* chan, User* user, ChanModeReference& ban, ChanModeReference& exc)
+// Adds extra fakelag to a local user for a check which matched many users
+// against many entries so that large channels can't be audited back to back.
+void AddCheckPenalty(User* user, size_t checks)
 {
-	ListModeBase::ModeList* list;
-	ListModeBase::ModeList::const_iterator iter;
+	LocalUser* lu = IS_LOCAL(user);
+	if (lu && !lu->HasPrivPermission("users/flood/no-fakelag"))
+		lu->CommandFloodPenalty += checks / 100;
+}
 
-	ListModeBase* banlm = ban->IsListModeBase();
-	list = banlm ? banlm->GetList(chan) : NULL;
-	if (list)
+// Matches users against a ban or exception list which is parsed once up front
+// rather than every time a user is checked against one of its entries. This
+// mirrors Channel::CheckBan with the users being streamed through it.
+class ListMatcher
+{
+ public:
+	struct Entry
 	{
-		for (iter = list->begin(); iter != list->end(); ++iter)
-		{
-			if (!chan->CheckBan(user, iter->mask))
-				continue;
+		// The mask being matched.
+		std::string mask;
 
-			source->WriteNumeric(RPL_BANMATCH, chan->name, InspIRCd::Format("Ban %s matches %s (set by %s on %s)",
-				iter->mask.c_str(), user->nick.c_str(), iter->setter.c_str(),
-				ServerInstance->TimeString(iter->time, "%Y-%m-%d %H:%M:%S UTC", true).c_str()));
-		}
+		// The list entry the mask is from or NULL if it is not from a list.
+		const ListModeBase::ListItem* item;
+
+		// Whether the mask is an extban and can only be matched by modules.
+		bool extban;
+
+		// The nick!ident and host parts of the mask.
+		std::string nickident;
+		std::string host;
+
+		// The number of users that have matched this entry.
+		unsigned long hits;
+	};
+	typedef std::vector<Entry> EntryList;
+
+ private:
+	Channel* const chan;
+	EntryList entries;
+	User* user;
+	std::string nickident;
+
+ public:
+	ListMatcher(Channel* c)
+		: chan(c)
+		, user(NULL)
+	{
 	}
 
-	ListModeBase* exclm = exc ? exc->IsListModeBase() : NULL;
-	list = exclm ? exclm->GetList(chan) : NULL;
-	if (list)
+	ListMatcher(Channel* c, ChanModeReference& mode)
+		: chan(c)
+		, user(NULL)
 	{
-		for (iter = list->begin(); iter != list->end(); ++iter)
-		{
-			if (!chan->CheckBan(user, iter->mask))
-				continue;
+		ListModeBase* lm = mode ? mode->IsListModeBase() : NULL;
+		const ListModeBase::ModeList* list = lm ? lm->GetList(chan) : NULL;
+		if (!list)
+			return;
+
+		entries.reserve(list->size());
+		for (ListModeBase::ModeList::const_iterator iter = list->begin(); iter != list->end(); ++iter)
+			Add(iter->mask, &*iter);
+	}
 
-			source->WriteNumeric(RPL_EXCEPTIONMATCH, chan->name, InspIRCd::Format("Exception %s matches %s (set by %s on %s)",
-				iter->mask.c_str(), user->nick.c_str(), iter->setter.c_str(),
-				ServerInstance->TimeString(iter->time, "%Y-%m-%d %H:%M:%S UTC", true).c_str()));
-		}
+	void Add(const std::string& mask, const ListModeBase::ListItem* item = NULL)
+	{
+		entries.push_back(Entry());
+		Entry& entry = entries.back();
+		entry.mask = mask;
+		entry.item = item;
+		entry.hits = 0;
+
+		// Anything that isn't n!u@h can only be matched by the OnCheckBan hooks.
+		std::string::size_type at = mask.find('@');
+		entry.extban = ((mask.length() <= 2) || (mask[1] == ':') || (at == std::string::npos));
+		if (entry.extban)
+			return;
+
+		entry.nickident.assign(mask, 0, at);
+		entry.host.assign(mask, at + 1, std::string::npos);
+	}
+
+	EntryList& GetEntries()
+	{
+		return entries;
+	}
+
+	void SetUser(User* u)
+	{
+		user = u;
+		nickident = user->nick + "!" + user->ident;
+	}
+
+	bool Matches(Entry& entry)
+	{
+		ModResult result;
+		FIRST_MOD_RESULT(OnCheckBan, result, (user, chan, entry.mask));
+
+		bool matched;
+		if (result != MOD_RES_PASSTHRU)
+			matched = (result == MOD_RES_DENY);
+		else if (entry.extban || !InspIRCd::Match(nickident, entry.nickident))
+			matched = false;
+		else if (InspIRCd::Match(user->GetRealHost(), entry.host) || InspIRCd::Match(user->GetDisplayedHost(), entry.host))
+			matched = true;
+		else
+			matched = InspIRCd::MatchCIDR(user->GetIPString(), entry.host);
+
+		if (matched)
+			entry.hits++;
+		return matched;
+	}
+};
+
+void CheckList(User* source, Channel* chan, User* user, ListMatcher& matcher, unsigned int numeric, const char* type)
+{
+	matcher.SetUser(user);
+
+	ListMatcher::EntryList& entries = matcher.GetEntries();
+	for (ListMatcher::EntryList::iterator iter = entries.begin(); iter != entries.end(); ++iter)
+	{
+		if (!matcher.Matches(*iter))
+			continue;
+
+		source->WriteNumeric(numeric, chan->name, InspIRCd::Format("%s %s matches %s (set by %s on %s)",
+			type, iter->mask.c_str(), user->nick.c_str(), iter->item->setter.c_str(),
+			ServerInstance->TimeString(iter->item->time, "%Y-%m-%d %H:%M:%S UTC", true).c_str()));
+	}
+}
+
+void CheckLists(User* source, Channel* chan, User* user, ListMatcher& bans, ListMatcher& excs)
+{
+	CheckList(source, chan, user, bans, RPL_BANMATCH, "Ban");
+	CheckList(source, chan, user, excs, RPL_EXCEPTIONMATCH, "Exception");
+}
+
+void CountList(User* source, Channel* chan, ListMatcher& matcher, unsigned int numeric, const char* type)
+{
+	const Channel::MemberMap& users = chan->GetUsers();
+	for (Channel::MemberMap::const_iterator u = users.begin(); u != users.end(); ++u)
+	{
+		matcher.SetUser(u->first);
+
+		ListMatcher::EntryList& entries = matcher.GetEntries();
+		for (ListMatcher::EntryList::iterator iter = entries.begin(); iter != entries.end(); ++iter)
+			matcher.Matches(*iter);
+	}
+
+	const ListMatcher::EntryList& entries = matcher.GetEntries();
+	for (ListMatcher::EntryList::const_iterator iter = entries.begin(); iter != entries.end(); ++iter)
+	{
+		if (!iter->hits)
+			continue;
+
+		source->WriteNumeric(numeric, chan->name, InspIRCd::Format("%s %s matches %lu of %lu users (set by %s on %s)",
+			type, iter->mask.c_str(), iter->hits, users.size(), iter->item->setter.c_str(),
+			ServerInstance->TimeString(iter->item->time, "%Y-%m-%d %H:%M:%S UTC", true).c_str()));
 	}
 }
 } // namespace
@@ -113,11 +236,11 @@ class CommandCheckBans : public Command
 
  public:
 	CommandCheckBans(Module* Creator, ChanModeReference& _ban, ChanModeReference& _exc)
-		: Command(Creator, "CHECKBANS", 1, 1)
+		: Command(Creator, "CHECKBANS", 1, 2)
 		, ban(_ban)
 		, exc(_exc)
 	{
-		this->syntax = "<channel>";
+		this->syntax = "<channel> [-summary]";
 		this->Penalty = 6;
 	}
 
@@ -134,10 +257,24 @@ class CommandCheckBans : public Command
 		if (!CanCheck(chan, user, ban))
 			return CMD_FAILURE;
 
-		// Loop through all users of the channel, checking for matches to bans and exceptions (if available)
-		const Channel::MemberMap& users = chan->GetUsers();
-		for (Channel::MemberMap::const_iterator u = users.begin(); u != users.end(); ++u)
-			CheckLists(user, chan, u->first, ban, exc);
+		// Parse the bans and exceptions (if available) once for all users
+		ListMatcher bans(chan, ban);
+		ListMatcher excs(chan, exc);
+		AddCheckPenalty(user, chan->GetUsers().size() * (bans.GetEntries().size() + excs.GetEntries().size()));
+
+		if (parameters.size() > 1 && irc::equals(parameters[1], "-summary"))
+		{
+			// Only show how many users match each entry
+			CountList(user, chan, bans, RPL_BANMATCH, "Ban");
+			CountList(user, chan, excs, RPL_EXCEPTIONMATCH, "Exception");
+		}
+		else
+		{
+			// Loop through all users of the channel, checking for matches to bans and exceptions
+			const Channel::MemberMap& users = chan->GetUsers();
+			for (Channel::MemberMap::const_iterator u = users.begin(); u != users.end(); ++u)
+				CheckLists(user, chan, u->first, bans, excs);
+		}
 
 		user->WriteNumeric(RPL_ENDLIST, chan->name, "End of check bans list");
 		return CMD_SUCCESS;
@@ -170,11 +307,17 @@ class CommandTestBan : public Command
 		if (!CanCheck(chan, user, ban))
 			return CMD_FAILURE;
 
+		ListMatcher matcher(chan);
+		matcher.Add(parameters[1]);
+		ListMatcher::Entry& entry = matcher.GetEntries().front();
+		AddCheckPenalty(user, chan->GetUsers().size());
+
 		unsigned int matched = 0;
 		const Channel::MemberMap& users = chan->GetUsers();
 		for (Channel::MemberMap::const_iterator u = users.begin(); u != users.end(); ++u)
 		{
-			if (chan->CheckBan(u->first, parameters[1]))
+			matcher.SetUser(u->first);
+			if (matcher.Matches(entry))
 			{
 				user->WriteNumeric(RPL_BANMATCH, chan->name, InspIRCd::Format("Mask %s matches %s",
 					parameters[1].c_str(), u->first->nick.c_str()));
@@ -240,7 +383,9 @@ class CommandWhyBan : public Command
 		}
 
 		// Check for matching bans and exceptions (if available)
-		CheckLists(user, chan, u, ban, exc);
+		ListMatcher bans(chan, ban);
+		ListMatcher excs(chan, exc);
+		CheckLists(user, chan, u, bans, excs);
 
 		user->WriteNumeric(RPL_ENDLIST, chan->name, u->nick, "End of why ban list");
 		return CMD_SUCCESS;
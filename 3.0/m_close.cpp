@@ -22,59 +22,255 @@
 /// $ModDepends: core 3
 /// $ModDesc: Provides the ability to close unregistered connections.
 
+/* CLOSE [-port=<port>] [-age=<duration>] [-ip=<ip or CIDR range>]
+ * Closes the unregistered connections which match all of the given filters
+ * and reports how many were closed on each listener. Large numbers of
+ * connections are closed a chunk per second instead of all at once.
+ */
+
 
 #include "inspircd.h"
 
-class CommandClose : public Command
+// The filters a CLOSE was given.
+struct CloseFilter
 {
- public:
-	CommandClose(Module* Creator)
-		: Command(Creator,"CLOSE")
+	int port;
+	unsigned long age;
+	bool hasrange;
+	irc::sockets::cidr_mask range;
+
+	CloseFilter()
+		: port(0)
+		, age(0)
+		, hasrange(false)
 	{
-		flags_needed = 'o';
 	}
 
-	CmdResult Handle(User* src, const Params& parameters) CXX11_OVERRIDE
+	bool Matches(LocalUser* user) const
 	{
-		std::map<std::string,int> closed;
+		if (user->registered == REG_ALL || user->quitting)
+			return false;
 
-		const UserManager::LocalList& list = ServerInstance->Users.GetLocalUsers();
-		for (UserManager::LocalList::const_iterator u = list.begin(); u != list.end(); )
-		{
-			// Quitting the user removes it from the list
-			LocalUser* user = *u;
-			++u;
-			if (user->registered != REG_ALL)
-			{
-				ServerInstance->Users->QuitUser(user, "Closing all unknown connections per request");
-				std::string key = ConvToStr(user->GetIPString())+"."+ConvToStr(user->server_sa.port());
-				closed[key]++;
-			}
-		}
+		if (port && user->server_sa.port() != port)
+			return false;
+
+		if (age && static_cast<unsigned long>(ServerInstance->Time() - user->signon) < age)
+			return false;
+
+		if (hasrange && !range.match(user->client_sa))
+			return false;
+
+		return true;
+	}
+};
+
+typedef std::map<std::string, unsigned int> CloseCounts;
+
+/** Closes the connections matched by a CLOSE a chunk at a time so that a
+ * registration flood doesn't stall the server while it is being cleaned up.
+ */
+class CloseJobs : public Timer
+{
+	struct Job
+	{
+		std::string uuid;
+		CloseFilter filter;
+		std::vector<std::string> targets;
+		size_t next;
+		CloseCounts closed;
+	};
 
-		int total = 0;
-		for (std::map<std::string,int>::iterator ci = closed.begin(); ci != closed.end(); ci++)
+	std::deque<Job> jobs;
+
+	static void Close(LocalUser* user, CloseCounts& closed)
+	{
+		closed[user->server_sa.str()]++;
+		ServerInstance->Users->QuitUser(user, "Closing all unknown connections per request");
+	}
+
+ public:
+	// The most connections closed per second and in one go before they are closed in the background.
+	static const size_t chunksize = 1000;
+
+	CloseJobs()
+		: Timer(1, true)
+	{
+	}
+
+	static void Report(User* src, const CloseCounts& closed)
+	{
+		unsigned int total = 0;
+		for (CloseCounts::const_iterator ci = closed.begin(); ci != closed.end(); ++ci)
 		{
 			src->WriteNotice("*** Closed " + ConvToStr(ci->second) + " unknown " + (ci->second == 1 ? "connection" : "connections") +
-				" from [" + ci->first + "]");
+				" on [" + ci->first + "]");
 			total += ci->second;
 		}
 		if (total)
 			src->WriteNotice("*** " + ConvToStr(total) + " unknown " + (total == 1 ? "connection" : "connections") + " closed");
 		else
 			src->WriteNotice("*** No unknown connections found");
+	}
 
+	void Start(User* src, const CloseFilter& filter)
+	{
+		std::vector<std::string> targets;
+		CloseCounts closed;
+
+		// Quitting the user removes it from the list so only remember who to close here.
+		const UserManager::LocalList& list = ServerInstance->Users.GetLocalUsers();
+		for (UserManager::LocalList::const_iterator u = list.begin(); u != list.end(); ++u)
+		{
+			if (filter.Matches(*u))
+				targets.push_back((*u)->uuid);
+		}
+
+		if (targets.size() <= chunksize)
+		{
+			for (std::vector<std::string>::const_iterator i = targets.begin(); i != targets.end(); ++i)
+				Close(IS_LOCAL(ServerInstance->FindUUID(*i)), closed);
+			Report(src, closed);
+			return;
+		}
+
+		src->WriteNotice("*** Closing " + ConvToStr(targets.size()) + " unknown connections in the background, " +
+			ConvToStr(chunksize) + " per second");
+
+		jobs.push_back(Job());
+		Job& job = jobs.back();
+		job.uuid = src->uuid;
+		job.filter = filter;
+		job.targets.swap(targets);
+		job.next = 0;
+	}
+
+	bool Tick(time_t) CXX11_OVERRIDE
+	{
+		size_t budget = chunksize;
+		while (!jobs.empty() && budget)
+		{
+			Job& job = jobs.front();
+			for (; job.next < job.targets.size() && budget; ++job.next, --budget)
+			{
+				// The connection may have registered or gone since the CLOSE.
+				LocalUser* user = IS_LOCAL(ServerInstance->FindUUID(job.targets[job.next]));
+				if (user && job.filter.Matches(user))
+					Close(user, job.closed);
+			}
+
+			if (job.next < job.targets.size())
+				break;
+
+			User* src = ServerInstance->FindUUID(job.uuid);
+			if (src)
+				Report(src, job.closed);
+			jobs.pop_front();
+		}
+		return true;
+	}
+};
+
+class CommandClose : public Command
+{
+	CloseJobs& jobs;
+
+	static bool ParseFilter(User* src, const Params& parameters, CloseFilter& filter)
+	{
+		for (Params::const_iterator i = parameters.begin(); i != parameters.end(); ++i)
+		{
+			const std::string& param = *i;
+			std::string::size_type eq = param.find('=');
+			if (param.empty() || param[0] != '-' || eq == std::string::npos)
+			{
+				src->WriteNotice("*** Incorrect argument syntax \"" + param + "\"");
+				return false;
+			}
+
+			const std::string name(param, 1, eq - 1);
+			const std::string value(param, eq + 1);
+			if (irc::equals(name, "port"))
+			{
+				filter.port = ConvToNum<int>(value);
+				if (filter.port <= 0 || filter.port > 65535)
+				{
+					src->WriteNotice("*** Invalid port \"" + value + "\"");
+					return false;
+				}
+			}
+			else if (irc::equals(name, "age"))
+			{
+				if (!InspIRCd::Duration(value, filter.age))
+				{
+					src->WriteNotice("*** Invalid age \"" + value + "\"");
+					return false;
+				}
+			}
+			else if (irc::equals(name, "ip"))
+			{
+				// cidr_mask does not check what it is given so do that here.
+				const std::string::size_type slash = value.find('/');
+				const std::string bits = (slash == std::string::npos ? "" : value.substr(slash + 1));
+				irc::sockets::sockaddrs sa;
+				if (!irc::sockets::aptosa(value.substr(0, slash), 0, sa) ||
+					(slash != std::string::npos && (bits.empty() || bits.length() > 3 || bits.find_first_not_of("0123456789") != std::string::npos)))
+				{
+					src->WriteNotice("*** Invalid IP address or range \"" + value + "\"");
+					return false;
+				}
+
+				const unsigned int maxbits = (sa.family() == AF_INET6 ? 128 : 32);
+				const unsigned int range = (bits.empty() ? maxbits : ConvToNum<unsigned int>(bits));
+				if (range > maxbits)
+				{
+					src->WriteNotice("*** Invalid IP address or range \"" + value + "\"");
+					return false;
+				}
+
+				filter.range = irc::sockets::cidr_mask(sa, range);
+				filter.hasrange = true;
+			}
+			else
+			{
+				src->WriteNotice("*** Unknown filter \"" + name + "\"");
+				return false;
+			}
+		}
+		return true;
+	}
+
+ public:
+	CommandClose(Module* Creator, CloseJobs& Jobs)
+		: Command(Creator,"CLOSE")
+		, jobs(Jobs)
+	{
+		flags_needed = 'o';
+		syntax = "[-port=<port>] [-age=<duration>] [-ip=<ip or CIDR range>]";
+	}
+
+	CmdResult Handle(User* src, const Params& parameters) CXX11_OVERRIDE
+	{
+		CloseFilter filter;
+		if (!ParseFilter(src, parameters, filter))
+			return CMD_FAILURE;
+
+		jobs.Start(src, filter);
 		return CMD_SUCCESS;
 	}
 };
 
 class ModuleClose : public Module
 {
+	CloseJobs jobs;
 	CommandClose cmd;
  public:
 	ModuleClose()
-		: cmd(this)
+		: cmd(this, jobs)
+	{
+	}
+
+	void init() CXX11_OVERRIDE
 	{
+		ServerInstance->Timers.AddTimer(&jobs);
 	}
 
 	Version GetVersion() CXX11_OVERRIDE
@@ -31,7 +31,39 @@
 
 class ModuleConnAccounts : public Module
 {
+	typedef TR1NS::unordered_set<std::string, irc::insensitive, irc::StrHashComp> AccountSet;
+
+	struct ClassAccounts
+	{
+		// Whether this class is limited to the accounts below.
+		bool enabled;
+		AccountSet accounts;
+	};
+
+	// The parsed account list of each connect class, read once per rehash.
+	typedef insp::flat_map<ConnectClass*, ClassAccounts> AccountTable;
+	AccountTable classes;
+
+	const ClassAccounts& GetAccounts(ConnectClass* klass)
+	{
+		AccountTable::iterator iter = classes.find(klass);
+		if (iter != classes.end())
+			return iter->second;
+
+		ClassAccounts& entry = classes[klass];
+		irc::spacesepstream ss(klass->config->getString("accounts"));
+		for (std::string token; ss.GetToken(token); )
+			entry.accounts.insert(token);
+		entry.enabled = !entry.accounts.empty() && klass->config->getBool("requireaccount");
+		return entry;
+	}
+
  public:
+	void ReadConfig(ConfigStatus& status) CXX11_OVERRIDE
+	{
+		classes.clear();
+	}
+
 	void Prioritize() CXX11_OVERRIDE
 	{
 		// Go after services_account, it will deny non-authed clients
@@ -41,8 +73,8 @@ class ModuleConnAccounts : public Module
 
 	ModResult OnSetConnectClass(LocalUser* user, ConnectClass* connclass) CXX11_OVERRIDE
 	{
-		const std::string accounts = connclass->config->getString("accounts");
-		if (accounts.empty() || !connclass->config->getBool("requireaccount"))
+		const ClassAccounts& entry = GetAccounts(connclass);
+		if (!entry.enabled)
 			return MOD_RES_PASSTHRU;
 
 		const AccountExtItem* accountext = GetAccountExtItem();
@@ -50,14 +82,7 @@ class ModuleConnAccounts : public Module
 		if (!account)
 			return MOD_RES_DENY;
 
-		irc::spacesepstream ss(accounts);
-		for (std::string token; ss.GetToken(token); )
-		{
-			if (irc::equals(*account, token))
-				return MOD_RES_PASSTHRU;
-		}
-
-		return MOD_RES_DENY;
+		return entry.accounts.count(*account) ? MOD_RES_PASSTHRU : MOD_RES_DENY;
 	}
 
 	Version GetVersion() CXX11_OVERRIDE
@@ -29,16 +29,45 @@ class ModuleConnBanner : public Module
 {
 	std::string text;
 
+	// Built once per config so every connecting user shares its serialisation.
+	ClientProtocol::Messages::Privmsg* banner;
+
+	void ResetBanner()
+	{
+		delete banner;
+		banner = text.empty() ? NULL : new ClientProtocol::Messages::Privmsg(ServerInstance->FakeClient, "*", "*** " + text, MSG_NOTICE);
+	}
+
  public:
+	ModuleConnBanner()
+		: banner(NULL)
+	{
+	}
+
+	~ModuleConnBanner()
+	{
+		delete banner;
+	}
+
 	void ReadConfig(ConfigStatus&) CXX11_OVERRIDE
 	{
 		text = ServerInstance->Config->ConfValue("connbanner")->getString("text");
+		ResetBanner();
+	}
+
+	void OnUnloadModule(Module*) CXX11_OVERRIDE
+	{
+		// The cached serialisations are keyed on serializers which might be going away.
+		ResetBanner();
 	}
 
 	void OnUserPostInit(LocalUser* user) CXX11_OVERRIDE
 	{
-		if (!text.empty())
-			user->WriteNotice("*** " + text);
+		if (!banner)
+			return;
+
+		ClientProtocol::Event bannerevent(ServerInstance->GetRFCEvents().privmsg, *banner);
+		user->Send(bannerevent);
 	}
 
 	Version GetVersion() CXX11_OVERRIDE
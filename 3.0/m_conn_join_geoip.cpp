@@ -46,7 +46,27 @@ class ModuleConnJoinGeoIP : public Module
 		for (ConfigIter i = tags.first; i != tags.second; ++i)
 		{
 			ConfigTag* tag = i->second;
-			chans.insert(std::make_pair(tag->getString("country"), tag->getString("chan")));
+			const std::string country = tag->getString("country");
+			const std::string channame = tag->getString("chan");
+
+			// Check the channel names once here rather than for every connecting user.
+			if (!ServerInstance->IsChannel(channame))
+				continue;
+
+			// Skip channels listed more than once for the same country.
+			bool duplicate = false;
+			std::pair<CountryChans::const_iterator, CountryChans::const_iterator> itp = chans.equal_range(country);
+			for (CountryChans::const_iterator j = itp.first; j != itp.second; ++j)
+			{
+				if (irc::equals(j->second, channame))
+				{
+					duplicate = true;
+					break;
+				}
+			}
+
+			if (!duplicate)
+				chans.insert(std::make_pair(country, channame));
 		}
 	}
 
@@ -56,16 +76,17 @@ class ModuleConnJoinGeoIP : public Module
 		if (!localuser)
 			return;
 
+		std::pair<CountryChans::const_iterator, CountryChans::const_iterator> itp;
 		Geolocation::Location* location = geoapi ? geoapi->GetLocation(localuser) : NULL;
-		const std::string code = location ? location->GetCode() : "XX";
+		itp = chans.equal_range(location ? location->GetCode() : "XX");
+		if (itp.first == itp.second)
+			return;
 
-		std::pair<CountryChans::const_iterator, CountryChans::const_iterator> itp = chans.equal_range(code);
+		// The JOIN, NAMES and topic lines of every join are queued on the user's
+		// send queue and written out together once the event loop comes back to
+		// the socket so the joins are already done as a single batch of writes.
 		for (CountryChans::const_iterator i = itp.first; i != itp.second; ++i)
-		{
-			const std::string& channame = i->second;
-			if (ServerInstance->IsChannel(channame))
-				Channel::JoinUser(localuser, channame);
-		}
+			Channel::JoinUser(localuser, i->second);
 	}
 
 	Version GetVersion() CXX11_OVERRIDE
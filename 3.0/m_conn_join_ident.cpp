@@ -27,20 +27,53 @@
 
 class ModuleConnJoinIdent : public Module
 {
-	typedef std::vector<std::pair<std::string, std::string> > IdentChanList;
-	IdentChanList chans;
+	typedef std::vector<std::string> ChanList;
+	typedef TR1NS::unordered_map<std::string, ChanList, irc::insensitive, irc::StrHashComp> LiteralMap;
+	typedef std::vector<std::pair<std::string, ChanList> > GlobList;
+
+	// Channels for idents without wildcards, and for those with them.
+	LiteralMap literals;
+	GlobList globs;
+
+	static void JoinChans(LocalUser* user, const ChanList& channels)
+	{
+		for (ChanList::const_iterator i = channels.begin(); i != channels.end(); ++i)
+			Channel::JoinUser(user, *i);
+	}
 
  public:
 	void ReadConfig(ConfigStatus&) CXX11_OVERRIDE
 	{
-		chans.clear();
+		LiteralMap newliterals;
+		GlobList newglobs;
 
 		ConfigTagList tags = ServerInstance->Config->ConfTags("autojoinident");
 		for (ConfigIter i = tags.first; i != tags.second; ++i)
 		{
 			ConfigTag* tag = i->second;
-			chans.push_back(std::make_pair(tag->getString("ident"), tag->getString("chan")));
+
+			const std::string channame = tag->getString("chan");
+			if (!ServerInstance->IsChannel(channame))
+				continue;
+
+			const std::string ident = tag->getString("ident");
+			if (ident.find_first_of("*?") == std::string::npos)
+			{
+				newliterals[ident].push_back(channame);
+				continue;
+			}
+
+			// Idents which share a glob share its entry.
+			GlobList::iterator glob = newglobs.begin();
+			while (glob != newglobs.end() && glob->first != ident)
+				++glob;
+			if (glob == newglobs.end())
+				glob = newglobs.insert(newglobs.end(), std::make_pair(ident, ChanList()));
+			glob->second.push_back(channame);
 		}
+
+		std::swap(literals, newliterals);
+		std::swap(globs, newglobs);
 	}
 
 	void OnPostConnect(User* user) CXX11_OVERRIDE
@@ -49,14 +82,14 @@ class ModuleConnJoinIdent : public Module
 		if (!localuser)
 			return;
 
-		for (IdentChanList::const_iterator i = chans.begin(); i != chans.end(); ++i)
-		{
-			if (!InspIRCd::Match(localuser->ident, i->first))
-				continue;
+		LiteralMap::const_iterator literal = literals.find(localuser->ident);
+		if (literal != literals.end())
+			JoinChans(localuser, literal->second);
 
-			const std::string& channame = i->second;
-			if (ServerInstance->IsChannel(channame))
-				Channel::JoinUser(localuser, channame);
+		for (GlobList::const_iterator i = globs.begin(); i != globs.end(); ++i)
+		{
+			if (InspIRCd::Match(localuser->ident, i->first))
+				JoinChans(localuser, i->second);
 		}
 	}
 
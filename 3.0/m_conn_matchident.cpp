@@ -25,8 +25,60 @@
 
 #include "inspircd.h"
 
+// The idents a connect class matches, read once per rehash.
+struct ClassPolicy
+{
+	// Idents without wildcards so most users can be matched with one lookup.
+	TR1NS::unordered_set<std::string, irc::insensitive, irc::StrHashComp> literals;
+
+	// Idents with wildcards which have to be globbed.
+	std::vector<std::string> globs;
+
+	ClassPolicy(ConnectClass* klass)
+	{
+		irc::spacesepstream ss(klass->config->getString("matchident"));
+		for (std::string token; ss.GetToken(token); )
+		{
+			if (token.find_first_of("*?") == std::string::npos)
+				literals.insert(token);
+			else
+				globs.push_back(token);
+		}
+	}
+
+	bool Empty() const
+	{
+		return literals.empty() && globs.empty();
+	}
+
+	bool Matches(const std::string& ident) const
+	{
+		if (literals.count(ident))
+			return true;
+
+		for (std::vector<std::string>::const_iterator iter = globs.begin(); iter != globs.end(); ++iter)
+		{
+			if (InspIRCd::Match(ident, *iter))
+				return true;
+		}
+		return false;
+	}
+};
+
 class ModuleConnMatchIdent : public Module
 {
+ private:
+	typedef insp::flat_map<ConnectClass*, ClassPolicy> PolicyTable;
+	PolicyTable policies;
+
+	const ClassPolicy& GetPolicy(ConnectClass* klass)
+	{
+		PolicyTable::const_iterator iter = policies.find(klass);
+		if (iter == policies.end())
+			iter = policies.insert(std::make_pair(klass, ClassPolicy(klass))).first;
+		return iter->second;
+	}
+
  public:
 	void Prioritize() CXX11_OVERRIDE
 	{
@@ -35,19 +87,20 @@ class ModuleConnMatchIdent : public Module
 		ServerInstance->Modules->SetPriority(this, I_OnSetConnectClass, PRIORITY_AFTER, requireident);
 	}
 
+	void ReadConfig(ConfigStatus&) CXX11_OVERRIDE
+	{
+		policies.clear();
+		const ServerConfig::ClassVector& classes = ServerInstance->Config->Classes;
+		for (ServerConfig::ClassVector::const_iterator iter = classes.begin(); iter != classes.end(); ++iter)
+			GetPolicy(*iter);
+	}
+
 	ModResult OnSetConnectClass(LocalUser* user, ConnectClass* connclass) CXX11_OVERRIDE
 	{
-		const std::string matchident = connclass->config->getString("matchident");
-		if (matchident.empty())
+		const ClassPolicy& policy = GetPolicy(connclass);
+		if (policy.Empty() || policy.Matches(user->ident))
 			return MOD_RES_PASSTHRU;
 
-		irc::spacesepstream ss(matchident);
-		for (std::string token; ss.GetToken(token); )
-		{
-			if (InspIRCd::Match(user->ident, token))
-				return MOD_RES_PASSTHRU;
-		}
-
 		return MOD_RES_DENY;
 	}
 
@@ -78,6 +78,8 @@
 #include "inspircd.h"
 #include "xline.h"
 
+#include <queue>
+
 // ExtItem per User, tracking CAP request and CTCP replies
 struct UserData
 {
@@ -85,6 +87,7 @@ struct UserData
 	bool ctcpreply;
 	bool expectctcp;
 	bool expectversion;
+	bool held;
 	bool selfquit;
 	bool sentcap;
 	bool zapped;
@@ -96,6 +99,7 @@ struct UserData
 		, ctcpreply(false)
 		, expectctcp(false)
 		, expectversion(false)
+		, held(true)
 		, selfquit(false)
 		, sentcap(false)
 		, zapped(false)
@@ -122,11 +126,199 @@ struct BanMissing
 	std::string reason;
 };
 
-class ModuleConnRequire : public Module
+// Matches a string against many glob masks at once. An Aho-Corasick automaton
+// over the longest literal part of each mask finds the masks which could
+// match and only those are then checked with InspIRCd::Match.
+class MaskMatcher
 {
+	struct Node
+	{
+		std::vector<std::pair<unsigned char, size_t> > children;
+		size_t fail;
+
+		// The masks whose literal ends here or at any node on the fail chain.
+		std::vector<size_t> masks;
+
+		Node() : fail(0) { }
+	};
+
+	std::vector<Node> nodes;
+	std::vector<std::string> masks;
+
+	// Masks without any literal part which always have to be checked.
+	std::vector<size_t> always;
+
+	// Reused between calls to Match to avoid allocating.
+	std::vector<size_t> candidates;
+
+	static unsigned char Fold(char chr)
+	{
+		return national_case_insensitive_map[static_cast<unsigned char>(chr)];
+	}
+
+	size_t GetChild(size_t node, unsigned char chr) const
+	{
+		const std::vector<std::pair<unsigned char, size_t> >& children = nodes[node].children;
+		for (std::vector<std::pair<unsigned char, size_t> >::const_iterator it = children.begin(); it != children.end(); ++it)
+		{
+			if (it->first == chr)
+				return it->second;
+		}
+		return 0;
+	}
+
+	static std::string GetLongestLiteral(const std::string& mask)
+	{
+		std::string::size_type beststart = 0, bestlength = 0, start = 0;
+		while (start < mask.length())
+		{
+			std::string::size_type end = mask.find_first_of("*?", start);
+			if (end == std::string::npos)
+				end = mask.length();
+
+			if (end - start > bestlength)
+			{
+				beststart = start;
+				bestlength = end - start;
+			}
+			start = end + 1;
+		}
+		return mask.substr(beststart, bestlength);
+	}
+
+ public:
+	static const size_t npos = static_cast<size_t>(-1);
+
+	MaskMatcher() : nodes(1) { }
+
+	void Clear()
+	{
+		nodes.assign(1, Node());
+		masks.clear();
+		always.clear();
+	}
+
+	// Masks are matched in the order they are added in.
+	void Add(const std::string& mask)
+	{
+		const size_t index = masks.size();
+		masks.push_back(mask);
+
+		const std::string literal = GetLongestLiteral(mask);
+		if (literal.empty())
+		{
+			always.push_back(index);
+			return;
+		}
+
+		size_t node = 0;
+		for (std::string::const_iterator it = literal.begin(); it != literal.end(); ++it)
+		{
+			const unsigned char chr = Fold(*it);
+			size_t child = GetChild(node, chr);
+			if (!child)
+			{
+				child = nodes.size();
+				nodes.push_back(Node());
+				nodes[node].children.push_back(std::make_pair(chr, child));
+			}
+			node = child;
+		}
+		nodes[node].masks.push_back(index);
+	}
+
+	// Sets up the fail links once all of the masks have been added.
+	void Build()
+	{
+		std::vector<size_t> queue(1, 0);
+		for (size_t pos = 0; pos < queue.size(); ++pos)
+		{
+			const size_t node = queue[pos];
+			for (size_t i = 0; i < nodes[node].children.size(); ++i)
+			{
+				const unsigned char chr = nodes[node].children[i].first;
+				const size_t child = nodes[node].children[i].second;
+				queue.push_back(child);
+				if (!node)
+					continue;
+
+				size_t fail = nodes[node].fail;
+				while (fail && !GetChild(fail, chr))
+					fail = nodes[fail].fail;
+				nodes[child].fail = GetChild(fail, chr);
+
+				const std::vector<size_t>& inherited = nodes[nodes[child].fail].masks;
+				nodes[child].masks.insert(nodes[child].masks.end(), inherited.begin(), inherited.end());
+			}
+		}
+	}
+
+	// Returns the index of the first mask which matches or npos if none do.
+	size_t Match(const std::string& str)
+	{
+		candidates.assign(always.begin(), always.end());
+
+		size_t node = 0;
+		for (std::string::const_iterator it = str.begin(); it != str.end(); ++it)
+		{
+			const unsigned char chr = Fold(*it);
+			while (node && !GetChild(node, chr))
+				node = nodes[node].fail;
+
+			node = GetChild(node, chr);
+			candidates.insert(candidates.end(), nodes[node].masks.begin(), nodes[node].masks.end());
+		}
+
+		std::sort(candidates.begin(), candidates.end());
+		candidates.erase(std::unique(candidates.begin(), candidates.end()), candidates.end());
+		for (std::vector<size_t>::const_iterator it = candidates.begin(); it != candidates.end(); ++it)
+		{
+			if (InspIRCd::Match(str, masks[*it]))
+				return *it;
+		}
+		return npos;
+	}
+};
+
+// The requirements of a connect class, read once per rehash.
+struct ClassPolicy
+{
+	bool requirecap;
+	bool requirectcp;
+	bool requireversion;
+
+	ClassPolicy(ConnectClass* klass)
+		: requirecap(klass->config->getBool("requirecap"))
+		, requirectcp(klass->config->getBool("requirectcp"))
+		, requireversion(klass->config->getBool("requireversion"))
+	{
+	}
+};
+
+class ModuleConnRequire
+	: public Module
+	, public Timer
+{
+	typedef insp::flat_map<ConnectClass*, ClassPolicy> PolicyTable;
+	PolicyTable policies;
+
+	const ClassPolicy& GetPolicy(ConnectClass* klass)
+	{
+		PolicyTable::const_iterator iter = policies.find(klass);
+		if (iter == policies.end())
+			iter = policies.insert(std::make_pair(klass, ClassPolicy(klass))).first;
+		return iter->second;
+	}
+
+	// When each held user has to be let through even if their replies have not arrived.
+	typedef std::pair<time_t, std::string> Deadline;
+	typedef std::priority_queue<Deadline, std::vector<Deadline>, std::greater<Deadline> > DeadlineQueue;
+
 	SimpleExtItem<UserData> userdata;
+	DeadlineQueue deadlines;
 
 	std::vector<BadVersion> badversions;
+	MaskMatcher badversionmatcher;
 	std::vector<BanMissing> banmissings;
 
 	bool dualversion;
@@ -175,9 +367,24 @@ class ModuleConnRequire : public Module
 			delete x;
 	}
 
+	bool IsWaiting(const UserData* ud) const
+	{
+		return (!disableversion && ud->firstversionreply.empty()) ||
+			(dualversion && ud->secondversionreply.empty()) ||
+			(!ctcpstring.empty() && !ud->ctcpreply);
+	}
+
+	// Only called when a reply arrives so that OnCheckReady doesn't have to work this out every time.
+	void UpdateHeld(UserData* ud)
+	{
+		if (ud->held)
+			ud->held = IsWaiting(ud);
+	}
+
  public:
 	ModuleConnRequire ()
-		: userdata("userdata", ExtensionItem::EXT_USER, this)
+		: Timer(1, true)
+		, userdata("userdata", ExtensionItem::EXT_USER, this)
 		, wrapper('\001')
 		, ctcpversion("VERSION")
 		, len_part(ctcpversion.length() + 2)
@@ -191,6 +398,7 @@ class ModuleConnRequire : public Module
 			throw ModuleException("You have m_requirectcp loaded! This module will not work correctly alongside that.");
 
 		ServerInstance->SNO->EnableSnomask('u', "CONN_REQUIRE");
+		ServerInstance->Timers.AddTimer(this);
 	}
 
 	void Prioritize() CXX11_OVERRIDE
@@ -235,6 +443,7 @@ class ModuleConnRequire : public Module
 
 		// Rebuild the badversions vector
 		badversions.clear();
+		badversionmatcher.Clear();
 		ConfigTagList tags = ServerInstance->Config->ConfTags("badversion");
 		for (ConfigIter i = tags.first; i != tags.second; ++i)
 		{
@@ -254,7 +463,9 @@ class ModuleConnRequire : public Module
 			bv.duration = itag->getDuration("duration", 60*60*24*7);
 			bv.reason = itag->getString("reason", "Upgrade your client!");
 			badversions.push_back(bv);
+			badversionmatcher.Add(mask);
 		}
+		badversionmatcher.Build();
 
 		// Rebuild the banmissings vector
 		banmissings.clear();
@@ -271,25 +482,33 @@ class ModuleConnRequire : public Module
 			bm.reason = itag->getString("reason", "Fix your client!");
 			banmissings.push_back(bm);
 		}
+
+		policies.clear();
+		const ServerConfig::ClassVector& classes = ServerInstance->Config->Classes;
+		for (ServerConfig::ClassVector::const_iterator iter = classes.begin(); iter != classes.end(); ++iter)
+			GetPolicy(*iter);
 	}
 
-	ModResult OnCheckReady(LocalUser* user) CXX11_OVERRIDE
+	bool Tick(time_t now) CXX11_OVERRIDE
 	{
 		// Allow user to be held here for up to 'timeout' seconds
-		if (user->signon + timeout <= ServerInstance->Time())
-			return MOD_RES_PASSTHRU;
+		while (!deadlines.empty() && deadlines.top().first <= now)
+		{
+			LocalUser* user = IS_LOCAL(ServerInstance->FindUUID(deadlines.top().second));
+			deadlines.pop();
 
-		UserData* ud = userdata.get(user);
-		if (!ud)
-			return MOD_RES_PASSTHRU;
+			UserData* ud = user ? userdata.get(user) : NULL;
+			if (ud)
+				ud->held = false;
+		}
+		return true;
+	}
 
+	ModResult OnCheckReady(LocalUser* user) CXX11_OVERRIDE
+	{
 		// Hold while waiting for replies
-		if ((!disableversion && ud->firstversionreply.empty()) ||
-		   (dualversion && ud->secondversionreply.empty()) ||
-		   (!ctcpstring.empty() && !ud->ctcpreply))
-			return MOD_RES_DENY;
-
-		return MOD_RES_PASSTHRU;
+		UserData* ud = userdata.get(user);
+		return (ud && ud->held) ? MOD_RES_DENY : MOD_RES_PASSTHRU;
 	}
 
 	ModResult OnPreCommand(std::string& command, CommandBase::Params& parameters, LocalUser* user, bool validated) CXX11_OVERRIDE
@@ -332,12 +551,10 @@ class ModuleConnRequire : public Module
 				return MOD_RES_DENY;
 
 			// Check for a match to a configured <badversion>
-			for (std::vector<BadVersion>::const_iterator it = badversions.begin(); it != badversions.end(); ++it)
+			const size_t badversion = badversionmatcher.Match(rplversion);
+			if (badversion != MaskMatcher::npos)
 			{
-				const BadVersion& bv = *it;
-				if (!InspIRCd::Match(rplversion, bv.mask))
-					continue;
-
+				const BadVersion& bv = badversions[badversion];
 				if (bv.ban)
 					SetZLine(user, bv.duration, bv.reason, "badversion");
 
@@ -380,6 +597,7 @@ class ModuleConnRequire : public Module
 				ServerInstance->Users->QuitUser(user, dualreason);
 			}
 
+			UpdateHeld(ud);
 			return MOD_RES_DENY;
 		}
 		// Configurable CTCP string reply that we are expecting
@@ -387,6 +605,7 @@ class ModuleConnRequire : public Module
 		{
 			ud->expectctcp = false;
 			ud->ctcpreply = true;
+			UpdateHeld(ud);
 
 			return MOD_RES_DENY;
 		}
@@ -417,9 +636,10 @@ class ModuleConnRequire : public Module
 			return MOD_RES_PASSTHRU;
 
 		// Check class requirements against our UserData
-		if ((!cc->config->getBool("requirecap") || ud->sentcap) &&
-		   (disableversion || !cc->config->getBool("requireversion") || !ud->firstversionreply.empty()) &&
-		   (ctcpstring.empty() || !cc->config->getBool("requirectcp") || ud->ctcpreply))
+		const ClassPolicy& policy = GetPolicy(cc);
+		if ((!policy.requirecap || ud->sentcap) &&
+		   (disableversion || !policy.requireversion || !ud->firstversionreply.empty()) &&
+		   (ctcpstring.empty() || !policy.requirectcp || ud->ctcpreply))
 			return MOD_RES_PASSTHRU;
 
 		ud->ccblocked = true;
@@ -431,6 +651,8 @@ class ModuleConnRequire : public Module
 		// Initialize their UserData and send the CTCP request(s)
 		UserData* ud = new UserData;
 		userdata.set(user, ud);
+		deadlines.push(std::make_pair(user->signon + timeout, user->uuid));
+		UpdateHeld(ud);
 
 		if (!disableversion)
 		{
@@ -32,6 +32,18 @@ class ModuleVhostOnConnect : public Module
 {
 	std::bitset<UCHAR_MAX> hostmap;
 
+	// The vhost template of each connect class, read once per rehash.
+	typedef insp::flat_map<ConnectClass*, std::string> VhostTable;
+	VhostTable vhosts;
+
+	const std::string& GetVhost(ConnectClass* klass)
+	{
+		VhostTable::const_iterator iter = vhosts.find(klass);
+		if (iter == vhosts.end())
+			iter = vhosts.insert(std::make_pair(klass, klass->config->getString("vhost"))).first;
+		return iter->second;
+	}
+
 	const std::string GetAccount(LocalUser* user)
 	{
 		std::string result;
@@ -60,18 +72,23 @@ class ModuleVhostOnConnect : public Module
 		hostmap.reset();
 		for (std::string::iterator n = hmap.begin(); n != hmap.end(); n++)
 			hostmap.set(static_cast<unsigned char>(*n));
+
+		vhosts.clear();
+		const ServerConfig::ClassVector& classes = ServerInstance->Config->Classes;
+		for (ServerConfig::ClassVector::const_iterator iter = classes.begin(); iter != classes.end(); ++iter)
+			GetVhost(*iter);
 	}
 
 	void OnUserConnect(LocalUser* user) CXX11_OVERRIDE
 	{
-		ConfigTag* tag = user->MyClass->config;
-		std::string vhost = tag->getString("vhost");
+		const std::string& vhosttemplate = GetVhost(user->MyClass);
+		if (vhosttemplate.empty())
+			return;
+
+		std::string vhost = vhosttemplate;
 		std::string replace;
 		size_t pos;
 
-		if (vhost.empty())
-			return;
-
 		std::string ident = user->ident;
 		if (ident[0] == '~')
 			ident.erase(0, 1);
@@ -19,40 +19,191 @@
 /// $ModAuthor: Sadie Powell
 /// $ModAuthorMail: sadie@witchery.services
 /// $ModConfig: <penalty name="INVITE" value="60">
+/// $ModConfig: <penalty name="WHO" value="1" loadvalue="10">
+/// $ModConfig: <penaltyload start="50" full="90" hysteresis="10">
 /// $ModDepends: core 3
 /// $ModDesc: Allows the customisation of penalty levels.
 
 
 #include "inspircd.h"
 
-class ModuleCustomPenalty : public Module
+#ifndef _WIN32
+# include <sys/resource.h>
+#endif
+
+struct Penalty
+{
+	// The name of the command.
+	std::string name;
+
+	// The penalty when the server is idle.
+	unsigned int value;
+
+	// The penalty when the server is at or above <penaltyload:full>.
+	unsigned int loadvalue;
+};
+
+class ModuleCustomPenalty;
+
+/** Measures how busy the server is once a second and turns it into a load
+ * level between 0 (below <penaltyload:start>) and 1 (at <penaltyload:full>).
+ */
+class LoadMonitor : public Timer
 {
  private:
-	void SetPenalties()
+	ModuleCustomPenalty* mod;
+
+	// The CPU time and wall time at the last tick in microseconds.
+	long long lastcpu;
+	long long lastwall;
+
+	// The smoothed CPU usage as a percentage.
+	double usage;
+
+	static long long GetCPUTime()
 	{
-		ConfigTagList tags = ServerInstance->Config->ConfTags("penalty");
-		for (ConfigIter i = tags.first; i != tags.second; ++i)
+#ifndef _WIN32
+		rusage ru;
+		if (getrusage(RUSAGE_SELF, &ru) == 0)
 		{
-			ConfigTag* tag = i->second;
+			return (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000LL
+				+ ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+		}
+#endif
+		return 0;
+	}
+
+	double GetLevel(double cpu) const
+	{
+		if (full <= start)
+			return cpu >= full ? 1 : 0;
+		return std::min(1.0, std::max(0.0, (cpu - start) / (full - start)));
+	}
+
+ public:
+	// The thresholds from <penaltyload> as percentages.
+	double start;
+	double full;
+	double hysteresis;
+
+	// The current load level.
+	double level;
+
+	LoadMonitor(ModuleCustomPenalty* Creator)
+		: Timer(1, true)
+		, mod(Creator)
+		, lastcpu(GetCPUTime())
+		, lastwall(ServerInstance->Time_ns() / 1000)
+		, usage(0)
+		, start(50)
+		, full(90)
+		, hysteresis(10)
+		, level(0)
+	{
+	}
+
+	// Returns true if the load level changed.
+	bool Update()
+	{
+		const long long cpu = GetCPUTime();
+		const long long wall = ServerInstance->Time_ns() / 1000;
+		if (wall <= lastwall)
+			return false;
 
-			std::string name = tag->getString("name");
-			unsigned int penalty = tag->getUInt("value", 1, 1);
+		const double sample = 100.0 * (cpu - lastcpu) / (wall - lastwall);
+		lastcpu = cpu;
+		lastwall = wall;
+		usage = (usage + sample) / 2;
+
+		// The level rises as soon as usage does, but only falls once usage has
+		// dropped by the hysteresis margin, so penalties don't flap.
+		const double oldlevel = level;
+		if (GetLevel(usage) > level)
+			level = GetLevel(usage);
+		else if (GetLevel(usage + hysteresis) < level)
+			level = GetLevel(usage + hysteresis);
+		return level != oldlevel;
+	}
+
+	bool Tick(time_t) CXX11_OVERRIDE;
+};
 
-			Command* command = ServerInstance->Parser.GetHandler(name);
+class ModuleCustomPenalty : public Module
+{
+ private:
+	std::vector<Penalty> penalties;
+	LoadMonitor monitor;
+
+	// Whether any penalty changes with the load.
+	bool scaled;
+
+ public:
+	void SetPenalties()
+	{
+		for (std::vector<Penalty>::const_iterator i = penalties.begin(); i != penalties.end(); ++i)
+		{
+			Command* command = ServerInstance->Parser.GetHandler(i->name);
 			if (!command)
 			{
-				ServerInstance->Logs->Log(MODNAME, LOG_DEFAULT, "Warning: unable to find command: " + name);
+				ServerInstance->Logs->Log(MODNAME, LOG_DEFAULT, "Warning: unable to find command: " + i->name);
 				continue;
 			}
 
-			ServerInstance->Logs->Log(MODNAME, LOG_DEBUG, "Setting the penalty for %s to %d", name.c_str(), penalty);
+			const double range = static_cast<double>(i->loadvalue) - i->value;
+			const unsigned int penalty = i->value + static_cast<int>(range * monitor.level + 0.5);
+			if (command->Penalty == penalty)
+				continue;
+
+			ServerInstance->Logs->Log(MODNAME, LOG_DEBUG, "Setting the penalty for %s to %d", i->name.c_str(), penalty);
 			command->Penalty = penalty;
 		}
 	}
 
- public:
+	void CheckLoad()
+	{
+		if (scaled && monitor.Update())
+			SetPenalties();
+	}
+
+	ModuleCustomPenalty()
+		: monitor(this)
+		, scaled(false)
+	{
+	}
+
+	void init() CXX11_OVERRIDE
+	{
+		ServerInstance->Timers.AddTimer(&monitor);
+	}
+
 	void ReadConfig(ConfigStatus& status) CXX11_OVERRIDE
 	{
+		std::vector<Penalty> newpenalties;
+		bool newscaled = false;
+
+		ConfigTagList tags = ServerInstance->Config->ConfTags("penalty");
+		for (ConfigIter i = tags.first; i != tags.second; ++i)
+		{
+			ConfigTag* tag = i->second;
+
+			Penalty penalty;
+			penalty.name = tag->getString("name");
+			penalty.value = tag->getUInt("value", 1, 1);
+			penalty.loadvalue = tag->getUInt("loadvalue", penalty.value, 1);
+			if (penalty.loadvalue != penalty.value)
+				newscaled = true;
+			newpenalties.push_back(penalty);
+		}
+
+		ConfigTag* tag = ServerInstance->Config->ConfValue("penaltyload");
+		monitor.start = tag->getFloat("start", 50, 0, 100);
+		monitor.full = tag->getFloat("full", 90, 0, 100);
+		monitor.hysteresis = tag->getFloat("hysteresis", 10, 0, 100);
+		if (!newscaled)
+			monitor.level = 0;
+
+		penalties.swap(newpenalties);
+		scaled = newscaled;
 		SetPenalties();
 	}
 
@@ -67,4 +218,10 @@ class ModuleCustomPenalty : public Module
 	}
 };
 
+bool LoadMonitor::Tick(time_t)
+{
+	mod->CheckLoad();
+	return true;
+}
+
 MODULE_INIT(ModuleCustomPenalty)
@@ -27,11 +27,29 @@
 #include "modules/ctctags.h"
 #include "modules/ircv3.h"
 #include "modules/who.h"
+#include "modules/whois.h"
 
 typedef insp::flat_map<std::string, std::string, irc::insensitive_swo> CustomTagMap;
 typedef insp::flat_map<std::string, size_t, irc::insensitive_swo> SpecialMessageMap;
 
-class CustomTagsExtItem : public SimpleExtItem<CustomTagMap>
+struct CustomTagList
+{
+	// The tags as they were received from services.
+	CustomTagMap tags;
+
+	// The tags with the vendor prefix which are added to messages.
+	ClientProtocol::TagMap qualified;
+
+	// The vendor generation the qualified tags were built for.
+	unsigned int generation;
+
+	CustomTagList()
+		: generation(0)
+	{
+	}
+};
+
+class CustomTagsExtItem : public SimpleExtItem<CustomTagList>
 {
  private:
 	dynamic_reference_nocheck<Cap::Capability> ctctagref;
@@ -41,7 +59,7 @@ class CustomTagsExtItem : public SimpleExtItem<CustomTagMap>
 	bool broadcastchanges;
 
 	CustomTagsExtItem(Module* Creator)
-		: SimpleExtItem<CustomTagMap>("custom-tags", ExtensionItem::EXT_USER, Creator)
+		: SimpleExtItem<CustomTagList>("custom-tags", ExtensionItem::EXT_USER, Creator)
 		, ctctagref(Creator, "cap/message-tags")
 		, tagmsgprov(Creator, "TAGMSG")
 	{
@@ -53,7 +71,7 @@ class CustomTagsExtItem : public SimpleExtItem<CustomTagMap>
 		if (!user)
 			return;
 
-		CustomTagMap* list = new CustomTagMap();
+		CustomTagList* list = new CustomTagList();
 		irc::spacesepstream ts(value);
 		while (!ts.StreamEnd())
 		{
@@ -67,15 +85,20 @@ class CustomTagsExtItem : public SimpleExtItem<CustomTagMap>
 				return;
 			}
 
-			list->insert(std::make_pair(tagname, tagvalue));
+			list->tags.insert(std::make_pair(tagname, tagvalue));
 		}
 
-		if (!list->empty())
+		if (!list->tags.empty())
 		{
 			set(user, list);
 			if (!broadcastchanges || !ctctagref)
 				return;
 
+			// A user without channels has no neighbours to tell. This also
+			// covers users from a burst, whose tags go out with their joins.
+			if (user->chans.empty())
+				return;
+
 			ClientProtocol::TagMap tags;
 			CTCTags::TagMessage tagmsg(user, "*", tags);
 			ClientProtocol::Event tagev(tagmsgprov, tagmsg);
@@ -90,7 +113,7 @@ class CustomTagsExtItem : public SimpleExtItem<CustomTagMap>
 
 	std::string ToNetwork(const Extensible* container, void* item) const CXX11_OVERRIDE
 	{
-		CustomTagMap* list = static_cast<CustomTagMap*>(item);
+		CustomTagMap* list = &static_cast<CustomTagList*>(item)->tags;
 		std::string buf;
 		for (CustomTagMap::const_iterator iter = list->begin(); iter != list->end(); ++iter)
 		{
@@ -116,6 +139,10 @@ class CustomTags : public ClientProtocol::MessageTagProvider
 		if (iter == specialmsgs.end())
 			return NULL; // Not a special message.
 
+		// WHO and WHOIS replies are about the user we were given by the line hooks.
+		if (subject)
+			return subject;
+
 		size_t nick_index = iter->second;
 		if (irc::equals(msg.GetCommand(), "354"))
 		{
@@ -136,32 +163,61 @@ class CustomTags : public ClientProtocol::MessageTagProvider
 	CustomTagsExtItem ext;
 	SpecialMessageMap specialmsgs;
 	std::string vendor;
+	unsigned int generation;
 	int whox_index;
 
+	// The user the WHO or WHOIS reply which is being sent is about.
+	User* subject;
+
 	CustomTags(Module* mod)
 		: ClientProtocol::MessageTagProvider(mod)
 		, ctctagcap(mod, "message-tags")
 		, ext(mod)
+		, generation(1)
 		, whox_index(-1)
+		, subject(NULL)
 	{
 	}
 
+	void SetVendor(const std::string& newvendor)
+	{
+		if (newvendor == vendor)
+			return;
+
+		// Invalidates the qualified tags of every user.
+		vendor = newvendor;
+		generation++;
+	}
+
 	void OnPopulateTags(ClientProtocol::Message& msg) CXX11_OVERRIDE
 	{
 		User* user = msg.GetSourceUser();
 		if (!user || IS_SERVER(user))
 		{
+			if (subject && (irc::equals(msg.GetCommand(), "315") || irc::equals(msg.GetCommand(), "318")))
+			{
+				// RPL_ENDOFWHO and RPL_ENDOFWHOIS finish the reply the subject was for.
+				subject = NULL;
+				return;
+			}
+
 			user = UserFromMsg(msg);
 			if (!user)
 				return; // No such user.
 		}
 
-		CustomTagMap* tags = ext.get(user);
-		if (!tags)
+		CustomTagList* list = ext.get(user);
+		if (!list)
 			return;
 
-		for (CustomTagMap::const_iterator iter = tags->begin(); iter != tags->end(); ++iter)
-			msg.AddTag(vendor + "/" + iter->first, this, iter->second);
+		if (list->generation != generation)
+		{
+			list->qualified.clear();
+			for (CustomTagMap::const_iterator iter = list->tags.begin(); iter != list->tags.end(); ++iter)
+				list->qualified.insert(std::make_pair(vendor + "/" + iter->first, ClientProtocol::MessageTagData(this, iter->second)));
+			list->generation = generation;
+		}
+		msg.AddTags(list->qualified);
 	}
 
 	bool ShouldSendTag(LocalUser* user, const ClientProtocol::MessageTagData& tagdata) CXX11_OVERRIDE
@@ -173,6 +229,7 @@ class CustomTags : public ClientProtocol::MessageTagProvider
 class ModuleCustomTags
 	: public Module
 	, public Who::EventListener
+	, public Whois::LineEventListener
 {
  private:
 	CustomTags ctags;
@@ -180,6 +237,7 @@ class ModuleCustomTags
  public:
 	ModuleCustomTags()
 		: Who::EventListener(this)
+		, Whois::LineEventListener(this)
 		, ctags(this)
 	{
 	}
@@ -188,6 +246,13 @@ class ModuleCustomTags
 	{
 		size_t nick_index;
 		ctags.whox_index = request.GetFieldIndex('n', nick_index) ? nick_index : -1;
+		ctags.subject = user;
+		return MOD_RES_PASSTHRU;
+	}
+
+	ModResult OnWhoisLine(Whois::Context& whois, Numeric::Numeric& numeric) CXX11_OVERRIDE
+	{
+		ctags.subject = whois.GetTarget();
 		return MOD_RES_PASSTHRU;
 	}
 
@@ -209,7 +274,7 @@ class ModuleCustomTags
 
 		ConfigTag* tag = ServerInstance->Config->ConfValue("customtags");
 		ctags.ext.broadcastchanges = tag->getBool("broadcastchanges");
-		ctags.vendor = tag->getString("vendor", ServerInstance->Config->ServerName, 1);
+		ctags.SetVendor(tag->getString("vendor", ServerInstance->Config->ServerName, 1));
 	}
 
 	Version GetVersion() CXX11_OVERRIDE
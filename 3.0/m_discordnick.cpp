@@ -41,15 +41,179 @@ namespace
 			if (!isdigit(nick[pos]))
 				return false;
 
-		return origisnick(nick.substr(0, hashpos - 1));
+		// Reuse the same buffer so validating a nick doesn't allocate.
+		static std::string base;
+		base.assign(nick, 0, hashpos);
+		return origisnick(base);
+	}
+
+	// Splits a nick into its base and tag.
+	bool SplitNick(const std::string& nick, std::string& base, unsigned long& tag)
+	{
+		size_t hashpos = nick.find('#');
+		if (hashpos == std::string::npos || hashpos + 1 == nick.length())
+			return false;
+
+		base.assign(nick, 0, hashpos);
+		tag = ConvToNum<unsigned long>(nick.substr(hashpos + 1));
+		return true;
 	}
 }
 
+/** The tags which are in use with a base nick. Most base nicks are only used
+ * by one user so the bitmap is only allocated once a second tag is taken.
+ */
+class TagSet
+{
+ public:
+	static const unsigned long maxtags = 10000;
+
+ private:
+	static const size_t words = (maxtags + 63) / 64;
+
+	size_t count;
+	unsigned long only;
+	std::vector<uint64_t> bits;
+
+ public:
+	TagSet()
+		: count(0)
+		, only(0)
+	{
+	}
+
+	bool Empty() const
+	{
+		return !count;
+	}
+
+	bool Test(unsigned long tag) const
+	{
+		if (bits.empty())
+			return count && only == tag;
+		return (bits[tag / 64] >> (tag % 64)) & 1;
+	}
+
+	void Set(unsigned long tag)
+	{
+		if (Test(tag))
+			return;
+
+		if (bits.empty())
+		{
+			if (!count)
+			{
+				only = tag;
+				count = 1;
+				return;
+			}
+
+			bits.resize(words);
+			bits[only / 64] |= uint64_t(1) << (only % 64);
+		}
+
+		bits[tag / 64] |= uint64_t(1) << (tag % 64);
+		count++;
+	}
+
+	void Clear(unsigned long tag)
+	{
+		if (!Test(tag))
+			return;
+
+		if (!bits.empty())
+			bits[tag / 64] &= ~(uint64_t(1) << (tag % 64));
+		count--;
+	}
+
+	// Finds a tag which is not in use, returns false if there are none.
+	bool FindFree(unsigned long& tag) const
+	{
+		if (count >= maxtags)
+			return false;
+
+		if (bits.empty())
+		{
+			tag = (count && only == 0) ? 1 : 0;
+			return true;
+		}
+
+		for (size_t word = 0; word < words; ++word)
+		{
+			if (bits[word] == ~uint64_t(0))
+				continue;
+
+			for (unsigned long bit = 0; bit < 64; ++bit)
+			{
+				if (!((bits[word] >> bit) & 1))
+				{
+					tag = word * 64 + bit;
+					return tag < maxtags;
+				}
+			}
+		}
+		return false;
+	}
+};
+
 class ModuleDiscordNick : public Module
 {
  private:
+	typedef TR1NS::unordered_map<std::string, TagSet, irc::insensitive, irc::StrHashComp> TagMap;
+
 	LocalIntExt ext;
 
+	// The tags in use by the users on the network by base nick.
+	TagMap tags;
+
+	void Claim(const std::string& nick)
+	{
+		std::string base;
+		unsigned long tag;
+		if (SplitNick(nick, base, tag) && tag < TagSet::maxtags)
+			tags[base].Set(tag);
+	}
+
+	void Release(const std::string& nick)
+	{
+		std::string base;
+		unsigned long tag;
+		if (!SplitNick(nick, base, tag))
+			return;
+
+		TagMap::iterator iter = tags.find(base);
+		if (iter == tags.end())
+			return;
+
+		iter->second.Clear(tag);
+		if (iter->second.Empty())
+			tags.erase(iter);
+	}
+
+	// Picks the tag for a user who wants to use a base nick.
+	unsigned long GetTag(LocalUser* user, const std::string& base)
+	{
+		unsigned long tag = ext.get(user);
+		TagMap::const_iterator iter = tags.find(base);
+		if (iter == tags.end() || !iter->second.Test(tag))
+			return tag;
+
+		// The user may just be changing the case of their own nick.
+		std::string curbase;
+		unsigned long curtag;
+		if (SplitNick(user->nick, curbase, curtag) && curtag == tag && irc::equals(curbase, base))
+			return tag;
+
+		// If every tag is taken the nick change fails as a collision.
+		unsigned long freetag;
+		if (iter->second.FindFree(freetag))
+		{
+			tag = freetag;
+			ext.set(user, tag);
+		}
+		return tag;
+	}
+
  public:
 	ModuleDiscordNick()
 		: ext("nicktag", ExtensionItem::EXT_USER, this)
@@ -63,16 +227,46 @@ class ModuleDiscordNick : public Module
 		ServerInstance->IsNick = origisnick;
 	}
 
+	void init() CXX11_OVERRIDE
+	{
+		const user_hash& users = ServerInstance->Users.GetUsers();
+		for (user_hash::const_iterator iter = users.begin(); iter != users.end(); ++iter)
+		{
+			if (iter->second->registered == REG_ALL)
+				Claim(iter->second->nick);
+		}
+	}
+
 	ModResult OnPreCommand(std::string& command, CommandBase::Params& parameters, LocalUser* user, bool validated) CXX11_OVERRIDE
 	{
 		if (validated && command == "NICK" && parameters[0] != "0")
-			parameters[0].append(InspIRCd::Format("#%04ld", ext.get(user)));
+			parameters[0].append(InspIRCd::Format("#%04lu", GetTag(user, parameters[0])));
 		return MOD_RES_PASSTHRU;
 	}
 
 	void OnUserPostInit(LocalUser* user) CXX11_OVERRIDE
 	{
-		ext.set(user, ServerInstance->GenRandomInt(9999));
+		ext.set(user, ServerInstance->GenRandomInt(TagSet::maxtags));
+	}
+
+	void OnPostConnect(User* user) CXX11_OVERRIDE
+	{
+		Claim(user->nick);
+	}
+
+	void OnUserPostNick(User* user, const std::string& oldnick) CXX11_OVERRIDE
+	{
+		if (user->registered != REG_ALL)
+			return;
+
+		Release(oldnick);
+		Claim(user->nick);
+	}
+
+	void OnUserQuit(User* user, const std::string&, const std::string&) CXX11_OVERRIDE
+	{
+		if (user->registered == REG_ALL)
+			Release(user->nick);
 	}
 
 	Version GetVersion() CXX11_OVERRIDE
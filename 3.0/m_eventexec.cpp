@@ -19,12 +19,20 @@
 /// $ModAuthor: Sadie Powell
 /// $ModAuthorMail: sadie@witchery.services
 /// $ModConfig: <eventexec event="startup|shutdown|rehash|link|unlink" command="command to execute goes here">
+/// $ModConfig: <eventexecpool threads="2" queuesize="100">
 /// $ModDesc: Executes commands when a specified event occurs.
 /// $ModDepends: core 3
 
 
 #include "inspircd.h"
 #include "modules/server.h"
+#include "threadengine.h"
+
+#ifndef _WIN32
+# include <spawn.h>
+# include <sys/wait.h>
+extern char** environ;
+#endif
 
 enum EventType
 {
@@ -35,98 +43,297 @@ enum EventType
 	ET_SERVER_UNLINK
 };
 
-class CoreExport CommandThread : public Thread
+enum TemplateVar
+{
+	TV_ERROR,
+	TV_ID,
+	TV_NAME,
+	TV_REASON,
+	TV_USER,
+	TV_MAX
+};
+
+// The values of the template vars for an event, indexed by TemplateVar.
+typedef std::vector<std::string> TemplateValues;
+
+// Part of a command which is either literal text or a template var.
+struct CommandSegment
+{
+	std::string text;
+	TemplateVar var;
+
+	CommandSegment(const std::string& Text)
+		: text(Text)
+		, var(TV_MAX)
+	{
+	}
+
+	CommandSegment(TemplateVar Var)
+		: var(Var)
+	{
+	}
+};
+
+// A command split into segments when the config is read.
+typedef std::vector<CommandSegment> CommandTemplate;
+
+// Finds a template var which is valid for the specified event.
+static bool FindVariable(EventType event, const std::string& name, TemplateVar& var)
+{
+	if (stdalgo::string::equalsci(name, "error"))
+		var = TV_ERROR;
+	else if (stdalgo::string::equalsci(name, "id"))
+		var = TV_ID;
+	else if (stdalgo::string::equalsci(name, "name"))
+		var = TV_NAME;
+	else if (stdalgo::string::equalsci(name, "reason"))
+		var = TV_REASON;
+	else if (stdalgo::string::equalsci(name, "user"))
+		var = TV_USER;
+	else
+		return false;
+
+	switch (event)
+	{
+		case ET_SHUTDOWN:
+			return var == TV_REASON;
+		case ET_REHASH:
+			return var == TV_USER;
+		case ET_SERVER_LINK:
+			return var == TV_ID || var == TV_NAME;
+		case ET_SERVER_UNLINK:
+			return var == TV_ERROR || var == TV_ID || var == TV_NAME;
+		default:
+			return false;
+	}
+}
+
+static CommandTemplate ParseCommand(EventType event, const std::string& command)
+{
+	CommandTemplate segments;
+	size_t literal_start = 0;
+	size_t variable_start = std::string::npos;
+	for (size_t cmdpos = 0; cmdpos < command.length(); ++cmdpos)
+	{
+		if (command[cmdpos] != '%')
+			continue;
+
+		if (variable_start == std::string::npos)
+		{
+			// We've found the start of a variable.
+			variable_start = cmdpos;
+			continue;
+		}
+
+		if ((cmdpos - variable_start) < 2)
+		{
+			// Ignore empty variables (i.e. %%).
+			variable_start = std::string::npos;
+			continue;
+		}
+
+		// Extract the variable and leave it as literal text if it doesn't exist.
+		const std::string variable = command.substr(variable_start + 1, cmdpos - variable_start - 1);
+		TemplateVar var;
+		if (!FindVariable(event, variable, var))
+		{
+			ServerInstance->Logs->Log(MODNAME, LOG_DEBUG, "%s is not a valid variable for this event!", variable.c_str());
+			variable_start = std::string::npos;
+			continue;
+		}
+
+		if (variable_start > literal_start)
+			segments.push_back(CommandSegment(command.substr(literal_start, variable_start - literal_start)));
+		segments.push_back(CommandSegment(var));
+		literal_start = cmdpos + 1;
+		variable_start = std::string::npos;
+	}
+
+	if (literal_start < command.length())
+		segments.push_back(CommandSegment(command.substr(literal_start)));
+	return segments;
+}
+
+// The commands to execute for one event.
+typedef std::vector<std::string> CommandList;
+
+// Executes a command. Commands which don't need a shell are spawned directly.
+static void ExecuteCommand(const std::string& command)
+{
+#ifndef _WIN32
+	if (command.find_first_of("|&;<>()$`\\\"'*?[]#~=%{}!\n") == std::string::npos)
+	{
+		std::vector<std::string> args;
+		irc::spacesepstream argstream(command);
+		for (std::string arg; argstream.GetToken(arg); )
+			args.push_back(arg);
+
+		if (args.empty())
+			return;
+
+		std::vector<char*> argv;
+		for (std::vector<std::string>::iterator iter = args.begin(); iter != args.end(); ++iter)
+			argv.push_back(&(*iter)[0]);
+		argv.push_back(NULL);
+
+		pid_t pid;
+		if (posix_spawnp(&pid, argv[0], NULL, NULL, &argv[0], environ) == 0)
+		{
+			int status;
+			while (waitpid(pid, &status, 0) < 0 && errno == EINTR) { }
+		}
+		return;
+	}
+#endif
+	system(command.c_str());
+}
+
+class CommandWorker : public SocketThread
 {
  private:
-	std::vector<std::string> commands;
+	// The events which are waiting to be executed.
+	std::deque<CommandList> queue;
+
+	// Whether the thread has been started.
+	bool started;
 
  public:
-	CommandThread(const std::vector<std::string>& cmds)
-		: commands(cmds)
+	CommandWorker()
+		: started(false)
+	{
+	}
+
+	~CommandWorker()
 	{
+		// Any commands which are already queued are run before the thread exits.
+		if (started)
+		{
+			this->LockQueue();
+			this->SetExitFlag();
+			this->UnlockQueueWakeup();
+			this->join();
+		}
+	}
+
+	void Start()
+	{
+		ServerInstance->Threads.Start(this);
+		started = true;
+	}
+
+	// Queues the commands for an event unless the queue already has limit events in it.
+	bool Queue(const CommandList& commands, size_t limit)
+	{
+		this->LockQueue();
+		if (queue.size() >= limit)
+		{
+			this->UnlockQueue();
+			return false;
+		}
+
+		queue.push_back(commands);
+		this->UnlockQueueWakeup();
+		return true;
 	}
 
-	virtual ~CommandThread()
+	size_t QueueSize()
 	{
-		// Shuts the compiler up.
+		this->LockQueue();
+		size_t size = queue.size();
+		this->UnlockQueue();
+		return size;
 	}
 
 	void Run() CXX11_OVERRIDE
 	{
-		for (std::vector<std::string>::const_iterator iter = commands.begin(); iter != commands.end(); ++iter)
-			system(iter->c_str());
+		this->LockQueue();
+		for (;;)
+		{
+			if (queue.empty())
+			{
+				if (this->GetExitFlag())
+					break;
+
+				this->WaitForQueue();
+				continue;
+			}
+
+			CommandList commands;
+			commands.swap(queue.front());
+			queue.pop_front();
+			this->UnlockQueue();
+
+			for (CommandList::const_iterator iter = commands.begin(); iter != commands.end(); ++iter)
+				ExecuteCommand(*iter);
+
+			this->LockQueue();
+		}
+		this->UnlockQueue();
+	}
 
-		ServerInstance->Threads.Stop(this);
-		delete this;
+	void OnNotify() CXX11_OVERRIDE
+	{
 	}
 };
 
-
 class ModuleEventExec
 	: public Module
 	, public ServerProtocol::LinkEventListener
 {
  private:
 	// Maps event types to the associated commands.
-	typedef insp::flat_multimap<EventType, std::string> EventMap;
-
-	// Maps template vars to the associated values.
-	typedef insp::flat_map<std::string, std::string, irc::insensitive_swo> TemplateMap;
+	typedef insp::flat_multimap<EventType, CommandTemplate> EventMap;
 
 	// The events which are currently registered.
 	EventMap events;
 
-	// Executes the events 
-	void ExecuteEvents(EventType type, const TemplateMap& map)
+	// The threads which execute commands.
+	std::vector<CommandWorker*> workers;
+
+	// The maximum number of events which can be waiting on each thread.
+	size_t queuesize;
+
+	// The number of events which have been dropped because the queue was full.
+	unsigned long dropped;
+
+	void QueueCommands(const CommandList& commands)
 	{
-		std::vector<std::string> commands;
-		std::pair<EventMap::iterator, EventMap::iterator> iters = events.equal_range(type);
-		for (EventMap::iterator eiter = iters.first; eiter != iters.second; ++eiter)
+		// Give the event to the thread with the least work.
+		CommandWorker* worker = NULL;
+		size_t worksize = 0;
+		for (std::vector<CommandWorker*>::const_iterator iter = workers.begin(); iter != workers.end(); ++iter)
 		{
-			std::string command = eiter->second;
-			ServerInstance->Logs->Log(MODNAME, LOG_DEBUG, "Formatting command: %s", command.c_str());
-
-			size_t variable_start = std::string::npos;
-			for (size_t cmdpos = 0; cmdpos < command.length(); ++cmdpos)
+			size_t size = (*iter)->QueueSize();
+			if (!worker || size < worksize)
 			{
-				if (command[cmdpos] != '%')
-					continue;
-
-				if (variable_start == std::string::npos)
-				{
-					// We've found the start of a variable.
-					variable_start = cmdpos;
-					continue;
-				}
-
-				if ((cmdpos - variable_start) < 2)
-				{
-					// Ignore empty variables (i.e. %%).
-					variable_start = std::string::npos;
-					continue;
-				}
-
-				// Extract the variable and replace it if it exists.
-				const std::string variable = command.substr(variable_start + 1, cmdpos - variable_start - 1);
-				TemplateMap::const_iterator titer = map.find(variable);
-				if (titer == map.end())
-				{
-					ServerInstance->Logs->Log(MODNAME, LOG_DEBUG, "%s is not a valid variable for this event!", variable.c_str());
-					variable_start = std::string::npos;
-					continue;
-				}
-
-				ServerInstance->Logs->Log(MODNAME, LOG_DEBUG, "Replacing '%s' variable with '%s'", variable.c_str(), titer->second.c_str());
-				command.replace(variable_start, cmdpos - variable_start + 1, titer->second);
-				cmdpos = variable_start + titer->second.length();
+				worker = *iter;
+				worksize = size;
 			}
+		}
+
+		if (worker && worker->Queue(commands, queuesize))
+			return;
+
+		dropped++;
+		ServerInstance->Logs->Log(MODNAME, LOG_DEFAULT, "Dropped %lu commands as the queue is full (%lu events dropped in total)",
+			commands.size(), dropped);
+	}
 
-			ServerInstance->Logs->Log(MODNAME, LOG_DEBUG, "Scheduling command for execution: %s", command.c_str());
+	// Executes the events 
+	void ExecuteEvents(EventType type, const TemplateValues& values = TemplateValues(TV_MAX))
+	{
+		CommandList commands;
+		std::pair<EventMap::iterator, EventMap::iterator> iters = events.equal_range(type);
+		for (EventMap::iterator eiter = iters.first; eiter != iters.second; ++eiter)
+		{
+			std::string command;
+			for (CommandTemplate::const_iterator siter = eiter->second.begin(); siter != eiter->second.end(); ++siter)
+				command.append(siter->var == TV_MAX ? siter->text : values[siter->var]);
 			commands.push_back(command);
 		}
 
-		// The thread will delete itself when done.
-		ServerInstance->Threads.Start(new CommandThread(commands));
+		if (!commands.empty())
+			QueueCommands(commands);
 	}
 
  public:
@@ -134,7 +341,14 @@ class ModuleEventExec
 
 	ModuleEventExec()
 		: ServerProtocol::LinkEventListener(this)
+		, queuesize(0)
+		, dropped(0)
+	{
+	}
+
+	~ModuleEventExec()
 	{
+		stdalgo::delete_all(workers);
 	}
 
 	void ReadConfig(ConfigStatus& status) CXX11_OVERRIDE
@@ -170,44 +384,59 @@ class ModuleEventExec
 			if (command.empty())
 				throw ModuleException("<eventexec:command> is a required field, at " + tag->getTagLocation());
 
-			newevents.insert(std::make_pair(event, command));
+			newevents.insert(std::make_pair(event, ParseCommand(event, command)));
 		}
 		std::swap(newevents, events);
 
+		ConfigTag* pooltag = ServerInstance->Config->ConfValue("eventexecpool");
+		queuesize = pooltag->getUInt("queuesize", 100, 1);
+
+		// The number of threads can only be changed by reloading the module.
+		if (workers.empty())
+		{
+			const unsigned long threads = pooltag->getUInt("threads", 2, 1, 64);
+			for (unsigned long i = 0; i < threads; ++i)
+			{
+				CommandWorker* worker = new CommandWorker();
+				workers.push_back(worker);
+				worker->Start();
+			}
+		}
+
 		if (status.initial)
 		{
-			ExecuteEvents(ET_STARTUP, TemplateMap());
+			ExecuteEvents(ET_STARTUP);
 		}
 		else
 		{
-			TemplateMap map;
-			map["user"] = status.srcuser ? status.srcuser->GetFullRealHost() : ServerInstance->Config->ServerName;
-			ExecuteEvents(ET_REHASH, map);
+			TemplateValues values(TV_MAX);
+			values[TV_USER] = status.srcuser ? status.srcuser->GetFullRealHost() : ServerInstance->Config->ServerName;
+			ExecuteEvents(ET_REHASH, values);
 		}
 	}
 
 	void OnShutdown(const std::string& reason) CXX11_OVERRIDE
 	{
-		TemplateMap map;
-		map["reason"] = reason;
-		ExecuteEvents(ET_SHUTDOWN, map);
+		TemplateValues values(TV_MAX);
+		values[TV_REASON] = reason;
+		ExecuteEvents(ET_SHUTDOWN, values);
 	}
 
 	void OnServerLink(const Server* server) CXX11_OVERRIDE
 	{
-		TemplateMap map;
-		map["id"] = server->GetId();
-		map["name"] = server->GetName();
-		ExecuteEvents(ET_SERVER_LINK, map);
+		TemplateValues values(TV_MAX);
+		values[TV_ID] = server->GetId();
+		values[TV_NAME] = server->GetName();
+		ExecuteEvents(ET_SERVER_LINK, values);
 	}
 
 	void OnServerSplit(const Server* server, bool error) CXX11_OVERRIDE
 	{
-		TemplateMap map;
-		map["error"] = error ? "yes" : "no";
-		map["id"] = server->GetId();
-		map["name"] = server->GetName();
-		ExecuteEvents(ET_SERVER_UNLINK, map);
+		TemplateValues values(TV_MAX);
+		values[TV_ERROR] = error ? "yes" : "no";
+		values[TV_ID] = server->GetId();
+		values[TV_NAME] = server->GetName();
+		ExecuteEvents(ET_SERVER_UNLINK, values);
 	}
 
 	Version GetVersion() CXX11_OVERRIDE
@@ -18,6 +18,7 @@
 
 /// $ModAuthor: genius3000
 /// $ModAuthorMail: genius3000@g3k.solutions
+/// $ModConfig: <extbanbanlist cache="no" maxdepth="3">
 /// $ModDepends: core 3
 /// $ModDesc: Provides extban 'b' - Ban list from another channel
 
@@ -28,19 +29,110 @@
                requires the extbanbanlist contrib module).
  */
 
+/* References to other channels are followed through the ban lists of those
+ * channels up to <extbanbanlist maxdepth> levels deep, so #a can ban b:#b
+ * which in turn bans b:#c. In a cycle each channel is only checked once.
+ * When TESTBAN matches a user through this extban the chain of channels
+ * and the ban that matched are shown.
+ */
+
+/* With <extbanbanlist cache="yes"> whether a user matches the ban list of
+ * another channel is cached on the user until the ban list of any channel in
+ * the chain changes or the nick, ident, host, real name, IP or account of the
+ * user changes. Bans in the other channel which depend on anything else (e.g.
+ * oper status or channel membership) may be seen as stale until then, so this
+ * is off by default.
+ */
+
 
 #include "inspircd.h"
 #include "listmode.h"
+#include "modules/account.h"
+
+namespace
+{
+enum
+{
+	// From m_checkbans.
+	RPL_BANMATCH = 540
+};
+
+// The ban list epochs of the channels a verdict was made from, by channel name.
+typedef std::vector<std::pair<std::string, intptr_t> > EpochList;
+
+// A cached verdict of a user against the ban list of another channel.
+struct CachedVerdict
+{
+	// The channels that were checked for the verdict.
+	EpochList depends;
+
+	// Whether the user matched any entry in the ban lists.
+	bool banned;
+};
+
+typedef std::map<Channel*, CachedVerdict> VerdictMap;
+
+// The state of resolving one b: extban, including any that are nested in it.
+struct Resolution
+{
+	// The user being checked.
+	User* const user;
+
+	// The channels currently being checked, outermost first.
+	std::vector<Channel*> chain;
+
+	// The channels that have been checked with their ban list epochs.
+	EpochList depends;
+
+	// The verdicts of the channels that have already been checked.
+	std::map<Channel*, bool> seen;
+
+	// Whether a b: extban referenced a channel that does not exist. Creating
+	// that channel would change the verdict so it can't be cached.
+	bool unresolved;
+
+	// The chain of channels and the ban that matched the user, if any.
+	std::string match;
+
+	Resolution(User* u)
+		: user(u)
+		, unresolved(false)
+	{
+	}
+};
+} // namespace
 
 class ExtbanBanlist : public ModeWatcher
 {
 	ChanModeReference& banmode;
 
+	// Every change to the ban list of a channel moves it to a new epoch. As
+	// epochs are never reused a recycled channel pointer can't match stale
+	// verdicts.
+	LocalIntExt epochs;
+	intptr_t lastepoch;
+
  public:
 	ExtbanBanlist(Module* parent, ChanModeReference& moderef)
 		: ModeWatcher(parent, "ban", MODETYPE_CHANNEL)
 		, banmode(moderef)
+		, epochs("extbanbanlist-epoch", ExtensionItem::EXT_CHANNEL, parent)
+		, lastepoch(0)
+	{
+	}
+
+	intptr_t GetEpoch(Channel* chan)
+	{
+		intptr_t epoch = epochs.get(chan);
+		if (!epoch)
+			epoch = epochs.set(chan, ++lastepoch);
+		return epoch;
+	}
+
+	void AfterMode(User*, User*, Channel* channel, const std::string&, bool) CXX11_OVERRIDE
 	{
+		if (channel)
+			epochs.set(channel, ++lastepoch);
 	}
 
 	bool BeforeMode(User* source, User*, Channel* channel, std::string& param, bool adding) CXX11_OVERRIDE
@@ -77,46 +169,225 @@ class ExtbanBanlist : public ModeWatcher
 	}
 };
 
-class ModuleExtbanBanlist : public Module
+class ModuleExtbanBanlist
+	: public Module
+	, public AccountEventListener
 {
 	ChanModeReference banmode;
 	ExtbanBanlist eb;
-	bool checking;
+	SimpleExtItem<VerdictMap> verdicts;
+	Resolution* resolving;
+	LocalUser* reportto;
+	unsigned long maxdepth;
+	bool usecache;
+
+	bool Resolve(Resolution& res, Channel* chan)
+	{
+		std::map<Channel*, bool>::const_iterator seen = res.seen.find(chan);
+		if (seen != res.seen.end())
+			return seen->second;
+
+		// Stop at the depth limit and at any channel which is already being checked.
+		if (res.chain.size() >= maxdepth || std::find(res.chain.begin(), res.chain.end(), chan) != res.chain.end())
+			return false;
+
+		res.chain.push_back(chan);
+		res.depends.push_back(std::make_pair(chan->name, eb.GetEpoch(chan)));
+
+		bool banned = false;
+		ListModeBase* banlm = banmode->IsListModeBase();
+		const ListModeBase::ModeList* bans = banlm ? banlm->GetList(chan) : NULL;
+		if (bans)
+		{
+			for (ListModeBase::ModeList::const_iterator i = bans->begin(); i != bans->end(); ++i)
+			{
+				if (!chan->CheckBan(res.user, i->mask))
+					continue;
+
+				// A nested match is recorded before the bans that lead to it.
+				if (reportto && res.match.empty())
+				{
+					for (std::vector<Channel*>::const_iterator c = res.chain.begin(); c != res.chain.end(); ++c)
+						res.match.append((*c)->name).append(" -> ");
+					res.match.erase(res.match.length() - 4);
+					res.match.append(" (").append(i->mask).push_back(')');
+				}
+
+				banned = true;
+				break;
+			}
+		}
+
+		res.chain.pop_back();
+		res.seen[chan] = banned;
+		return banned;
+	}
+
+	const CachedVerdict* GetCached(User* user, Channel* chan)
+	{
+		VerdictMap* vm = verdicts.get(user);
+		if (!vm)
+			return NULL;
+
+		VerdictMap::const_iterator it = vm->find(chan);
+		if (it == vm->end())
+			return NULL;
+
+		const EpochList& depends = it->second.depends;
+		for (EpochList::const_iterator i = depends.begin(); i != depends.end(); ++i)
+		{
+			Channel* c = ServerInstance->FindChan(i->first);
+			if (!c || eb.GetEpoch(c) != i->second)
+				return NULL;
+		}
+		return &it->second;
+	}
+
+	void SetCached(User* user, Channel* chan, const Resolution& res, bool banned)
+	{
+		VerdictMap* vm = verdicts.get(user);
+		if (!vm)
+		{
+			vm = new VerdictMap;
+			verdicts.set(user, vm);
+		}
+
+		CachedVerdict& verdict = (*vm)[chan];
+		verdict.depends = res.depends;
+		verdict.banned = banned;
+	}
 
  public:
 	ModuleExtbanBanlist()
-		: banmode(this, "ban")
+		: AccountEventListener(this)
+		, banmode(this, "ban")
 		, eb(this, banmode)
-		, checking(false)
+		, verdicts("extbanbanlist-verdicts", ExtensionItem::EXT_USER, this)
+		, resolving(NULL)
+		, reportto(NULL)
+		, maxdepth(3)
+		, usecache(false)
+	{
+	}
+
+	void Prioritize() CXX11_OVERRIDE
 	{
+		// Only start reporting once no other module can block the command.
+		ServerInstance->Modules->SetPriority(this, I_OnPreCommand, PRIORITY_LAST);
+	}
+
+	void ReadConfig(ConfigStatus&) CXX11_OVERRIDE
+	{
+		ConfigTag* tag = ServerInstance->Config->ConfValue("extbanbanlist");
+		unsigned long newmaxdepth = tag->getUInt("maxdepth", 3, 1, 10);
+		usecache = tag->getBool("cache");
+
+		// Verdicts made with a different depth limit are no longer valid.
+		if (newmaxdepth != maxdepth || !usecache)
+		{
+			const user_hash& users = ServerInstance->Users.GetUsers();
+			for (user_hash::const_iterator u = users.begin(); u != users.end(); ++u)
+				verdicts.unset(u->second);
+		}
+		maxdepth = newmaxdepth;
 	}
 
 	ModResult OnCheckBan(User* user, Channel* c, const std::string& mask) CXX11_OVERRIDE
 	{
-		if (!checking && (mask.length() > 2) && (mask[0] == 'b') && (mask[1] == ':'))
+		if ((mask.length() < 3) || (mask[0] != 'b') || (mask[1] != ':'))
+			return MOD_RES_PASSTHRU;
+
+		Channel* chan = ServerInstance->FindChan(mask.substr(2));
+
+		// Nested in a b: extban which is already being resolved.
+		if (resolving && resolving->user == user)
 		{
-			Channel* chan = ServerInstance->FindChan(mask.substr(2));
 			if (!chan)
+			{
+				resolving->unresolved = true;
 				return MOD_RES_PASSTHRU;
+			}
+			return Resolve(*resolving, chan) ? MOD_RES_DENY : MOD_RES_PASSTHRU;
+		}
 
-			ListModeBase* banlm = banmode->IsListModeBase();
-			const ListModeBase::ModeList* bans = banlm ? banlm->GetList(chan) : NULL;
-			if (!bans)
-				return MOD_RES_PASSTHRU;
+		if (!chan)
+			return MOD_RES_PASSTHRU;
 
-			for (ListModeBase::ModeList::const_iterator i = bans->begin(); i != bans->end(); ++i)
-			{
-				checking = true;
-				bool hit = chan->CheckBan(user, i->mask);
-				checking = false;
+		// Unregistered users can still change host so are never cached.
+		const bool cacheable = usecache && !reportto && user->registered == REG_ALL;
+		if (cacheable)
+		{
+			const CachedVerdict* verdict = GetCached(user, chan);
+			if (verdict)
+				return verdict->banned ? MOD_RES_DENY : MOD_RES_PASSTHRU;
+		}
 
-				if (hit)
-					return MOD_RES_DENY;
-			}
+		Resolution* previous = resolving;
+		Resolution res(user);
+		resolving = &res;
+		bool banned = Resolve(res, chan);
+		resolving = previous;
+
+		if (cacheable && !res.unresolved)
+			SetCached(user, chan, res, banned);
+
+		if (reportto && !res.match.empty())
+		{
+			reportto->WriteNumeric(RPL_BANMATCH, c->name, InspIRCd::Format("Mask %s matches %s through %s",
+				mask.c_str(), user->nick.c_str(), res.match.c_str()));
 		}
+
+		return banned ? MOD_RES_DENY : MOD_RES_PASSTHRU;
+	}
+
+	ModResult OnPreCommand(std::string& command, Command::Params&, LocalUser* user, bool validated) CXX11_OVERRIDE
+	{
+		if (validated && command == "TESTBAN")
+			reportto = user;
 		return MOD_RES_PASSTHRU;
 	}
 
+	void OnPostCommand(Command*, const Command::Params&, LocalUser*, CmdResult, bool) CXX11_OVERRIDE
+	{
+		reportto = NULL;
+	}
+
+	void OnUserQuit(User* user, const std::string&, const std::string&) CXX11_OVERRIDE
+	{
+		if (user == reportto)
+			reportto = NULL;
+	}
+
+	void OnUserPostNick(User* user, const std::string&) CXX11_OVERRIDE
+	{
+		verdicts.unset(user);
+	}
+
+	void OnChangeHost(User* user, const std::string&) CXX11_OVERRIDE
+	{
+		verdicts.unset(user);
+	}
+
+	void OnChangeIdent(User* user, const std::string&) CXX11_OVERRIDE
+	{
+		verdicts.unset(user);
+	}
+
+	void OnChangeRealName(User* user, const std::string&) CXX11_OVERRIDE
+	{
+		verdicts.unset(user);
+	}
+
+	void OnSetUserIP(LocalUser* user) CXX11_OVERRIDE
+	{
+		verdicts.unset(user);
+	}
+
+	void OnAccountChange(User* user, const std::string&) CXX11_OVERRIDE
+	{
+		verdicts.unset(user);
+	}
+
 	void On005Numeric(std::map<std::string, std::string>& tokens) CXX11_OVERRIDE
 	{
 		tokens["EXTBAN"].push_back('b');
@@ -34,10 +34,79 @@ enum
 	ERR_REDIRECT = 690
 };
 
+// A redirect extban split into the name of its target channel and the mask
+// it applies to. The target is kept by name and looked up whenever it is
+// used so this stays valid when the target channel is destroyed.
+struct RedirectBan
+{
+	std::string targetname;
+	std::string mask;
+};
+
+// Caches redirect extbans which have been split. These can't go stale so the
+// cache is simply emptied once it holds too many masks.
+class RedirectBanCache
+{
+ private:
+	typedef TR1NS::unordered_map<std::string, RedirectBan> RedirectBanMap;
+	RedirectBanMap bans;
+	static const size_t maxcache = 4096;
+
+	// Entries are used by reference while the inner mask is checked so the
+	// cache can only be emptied when no check is in progress.
+	unsigned int users;
+
+ public:
+	RedirectBanCache()
+		: users(0)
+	{
+	}
+
+	// Returns the split extban or NULL if the extban is malformed.
+	const RedirectBan* Get(const std::string& param)
+	{
+		RedirectBanMap::const_iterator iter = bans.find(param);
+		if (iter != bans.end())
+			return &iter->second;
+
+		std::string::size_type p = param.find(':', 2);
+		if (p == std::string::npos)
+			return NULL;
+
+		if (!users && bans.size() >= maxcache)
+			bans.clear();
+
+		if (bans.size() >= maxcache)
+			return NULL;
+
+		RedirectBan& ban = bans[param];
+		ban.targetname.assign(param, 2, p - 2);
+		ban.mask.assign(param, p + 1, std::string::npos);
+		return &ban;
+	}
+
+	void Clear()
+	{
+		if (!users)
+			bans.clear();
+	}
+
+	void Lock()
+	{
+		users++;
+	}
+
+	void Unlock()
+	{
+		users--;
+	}
+};
+
 class BanWatcher : public ModeWatcher
 {
  public:
 	char extbanchar;
+	RedirectBanCache cache;
 
 	BanWatcher(Module* parent)
 		: ModeWatcher(parent, "ban", MODETYPE_CHANNEL)
@@ -65,7 +134,7 @@ class BanWatcher : public ModeWatcher
 			return false;
 		}
 
-		std::string targetname(param, 2, p - 2);
+		const std::string targetname(param, 2, p - 2);
 		if (!ServerInstance->IsChannel(targetname))
 		{
 			source->WriteNumeric(ERR_NOSUCHCHANNEL, channel->name, InspIRCd::Format("Invalid channel name in redirection (%s)", targetname.c_str()));
@@ -91,6 +160,8 @@ class BanWatcher : public ModeWatcher
 			return false;
 		}
 
+		// Split the extban now rather than when it is first checked.
+		cache.Get(param);
 		return true;
 	}
 };
@@ -102,6 +173,32 @@ class ModuleExtBanRedirect : public Module
 	BanWatcher banwatcher;
 	bool active;
 
+	ModResult Redirect(LocalUser* localuser, Channel* chan, const RedirectBan& ban)
+	{
+		if (!chan->CheckBan(localuser, ban.mask))
+			return MOD_RES_PASSTHRU;
+
+		const std::string& targetname = ban.targetname;
+		Channel* const target = ServerInstance->FindChan(targetname);
+		if (target && target->IsModeSet(limitmode))
+		{
+			if (target->IsModeSet(limitredirect) && target->GetUserCounter() >= ConvToNum<size_t>(target->GetModeParameter(limitmode)))
+			{
+				// The core will send "You're banned"
+				return MOD_RES_DENY;
+			}
+		}
+
+		// Ok to redirect
+		// The core will send "You're banned"
+		localuser->WriteNumeric(ERR_LINKCHANNEL, chan->name, targetname, "You are banned from this channel, so you are automatically being transferred to the redirected channel.");
+		active = true;
+		Channel::JoinUser(localuser, targetname);
+		active = false;
+
+		return MOD_RES_DENY;
+	}
+
  public:
 	ModuleExtBanRedirect()
 		: limitmode(this, "limit")
@@ -115,6 +212,7 @@ class ModuleExtBanRedirect : public Module
 	{
 		ConfigTag* tag = ServerInstance->Config->ConfValue("extbanredirect");
 		banwatcher.extbanchar = tag->getString("char", "d", 1, 1)[0];
+		banwatcher.cache.Clear();
 	}
 
 	void On005Numeric(std::map<std::string, std::string>& tokens) CXX11_OVERRIDE
@@ -132,32 +230,24 @@ class ModuleExtBanRedirect : public Module
 		if (!banwatcher.IsExtBanRedirect(mask))
 			return MOD_RES_PASSTHRU;
 
-		std::string::size_type p = mask.find(':', 2);
-		if (p == std::string::npos)
-			return MOD_RES_PASSTHRU;
-
-		if (!chan->CheckBan(localuser, mask.substr(p + 1)))
-			return MOD_RES_PASSTHRU;
-
-		const std::string targetname = mask.substr(2, p - 2);
-		Channel* const target = ServerInstance->FindChan(targetname);
-		if (target && target->IsModeSet(limitmode))
+		const RedirectBan* ban = banwatcher.cache.Get(mask);
+		if (!ban)
 		{
-			if (target->IsModeSet(limitredirect) && target->GetUserCounter() >= ConvToNum<size_t>(target->GetModeParameter(limitmode)))
-			{
-				// The core will send "You're banned"
-				return MOD_RES_DENY;
-			}
-		}
+			// Malformed or the cache is full and in use.
+			std::string::size_type p = mask.find(':', 2);
+			if (p == std::string::npos)
+				return MOD_RES_PASSTHRU;
 
-		// Ok to redirect
-		// The core will send "You're banned"
-		localuser->WriteNumeric(ERR_LINKCHANNEL, chan->name, targetname, "You are banned from this channel, so you are automatically being transferred to the redirected channel.");
-		active = true;
-		Channel::JoinUser(localuser, targetname);
-		active = false;
+			RedirectBan uncached;
+			uncached.targetname.assign(mask, 2, p - 2);
+			uncached.mask.assign(mask, p + 1, std::string::npos);
+			return Redirect(localuser, chan, uncached);
+		}
 
-		return MOD_RES_DENY;
+		banwatcher.cache.Lock();
+		ModResult res = Redirect(localuser, chan, *ban);
+		banwatcher.cache.Unlock();
+		return res;
 	}
 
 	Version GetVersion() CXX11_OVERRIDE
@@ -18,7 +18,7 @@
 
 /// $ModAuthor: genius3000
 /// $ModAuthorMail: genius3000@g3k.solutions
-/// $ModConfig: <extbanregex engine="pcre" opersonly="yes">
+/// $ModConfig: <extbanregex engine="pcre" opersonly="yes" budget="1000" budgetwindow="1m">
 /// $ModDepends: core 3
 /// $ModDesc: Provides extban 'x' - Regex matching to n!u@h\sr
 
@@ -26,7 +26,13 @@
  * to limit the use of this extban to opers only and with an oper privilege
  * for control (channels/regex-extban). Default is true.
  * A SNOTICE is sent to the 'a' SNOMASK if a match from this extban takes
- * more than half a second.
+ * more than half a second. A histogram of how long matches take is shown
+ * by /STATS x.
+ * A pattern which spends more than budget milliseconds matching on a
+ * channel within budgetwindow is disabled on that channel and its ops are
+ * told. A disabled pattern matches nobody, so it neither bans nor exempts
+ * anyone, until it has been unset. A budget of 0 disables this. Defaults
+ * are 1000 (one second) and 1m.
  */
 
 /* Helpop Lines for the EXTBANS section
@@ -40,6 +46,7 @@
 #include "inspircd.h"
 #include "listmode.h"
 #include "modules/regex.h"
+#include "modules/stats.h"
 
 namespace
 {
@@ -59,7 +66,27 @@ bool IsNestedExtBanRegex(const std::string &mask)
 	return ((mask.length() > 3) && (mask.find(":x:") != std::string::npos));
 }
 
-void RemoveAll(const std::string& engine, ChanModeReference& ban, ChanModeReference& exc, ChanModeReference& inv)
+// Sends a notice to the halfops (or ops if there are none) of a channel
+void NoticeOps(Channel* chan, const std::string& msg)
+{
+	PrefixMode* hop = ServerInstance->Modes->FindPrefixMode('h');
+	char pfxchar = (hop && hop->name == "halfop") ? hop->GetPrefix() : '@';
+
+#if defined INSPIRCD_VERSION_BEFORE && INSPIRCD_VERSION_BEFORE(3, 5)
+	ClientProtocol::Messages::Privmsg notice(ServerInstance->FakeClient, chan, msg, MSG_NOTICE);
+	chan->Write(ServerInstance->GetRFCEvents().privmsg, notice, pfxchar);
+	ServerInstance->PI->SendMessage(chan, pfxchar, msg, MSG_NOTICE);
+#else
+	chan->WriteNotice(msg, pfxchar);
+#endif
+}
+
+// The channels which may have regex entries in one of the watched list modes.
+// Channels are added when an entry is set and only dropped when they are
+// deleted or have had every regex entry removed by RemoveAll.
+typedef TR1NS::unordered_set<Channel*> ChannelSet;
+
+std::vector<ListModeBase*> GetListModes(ChanModeReference& ban, ChanModeReference& exc, ChanModeReference& inv)
 {
 	std::vector<ListModeBase*> listmodes;
 	listmodes.push_back(ban->IsListModeBase());
@@ -67,60 +94,217 @@ void RemoveAll(const std::string& engine, ChanModeReference& ban, ChanModeRefere
 		listmodes.push_back(exc->IsListModeBase());
 	if (inv)
 		listmodes.push_back(inv->IsListModeBase());
+	return listmodes;
+}
 
-	// Loop each channel checking for any regex extbans
-	// Batch removals with a Modes::ChangeList and Process()
-	// Send a notice to hop/op if anything was removed
-	const chan_hash& chans = ServerInstance->GetChans();
-	for (chan_hash::const_iterator c = chans.begin(); c != chans.end(); ++c)
+// Adds the regex entries of a channel to changelist if it is given and
+// returns whether there were any.
+bool FindRegexEntries(const std::vector<ListModeBase*>& listmodes, Channel* chan, Modes::ChangeList* changelist)
+{
+	bool found = false;
+	for (std::vector<ListModeBase*>::const_iterator i = listmodes.begin(); i != listmodes.end(); ++i)
 	{
-		Channel* chan = c->second;
-		Modes::ChangeList changelist;
+		ListModeBase* lm = *i;
+		ListModeBase::ModeList* list = lm ? lm->GetList(chan) : NULL;
+		if (!list)
+			continue;
 
-		for (std::vector<ListModeBase*>::const_iterator i = listmodes.begin(); i != listmodes.end(); ++i)
+		for (ListModeBase::ModeList::const_iterator iter = list->begin(); iter != list->end(); ++iter)
 		{
-			ListModeBase* lm = *i;
-			ListModeBase::ModeList* list = lm ? lm->GetList(chan) : NULL;
-			if (!list)
+			if (!IsExtBanRegex(iter->mask) && !IsNestedExtBanRegex(iter->mask))
 				continue;
 
-			for (ListModeBase::ModeList::const_iterator iter = list->begin(); iter != list->end(); ++iter)
-			{
-				if (IsExtBanRegex(iter->mask) || IsNestedExtBanRegex(iter->mask))
-					changelist.push_remove(lm, iter->mask);
-			}
+			if (!changelist)
+				return true;
+
+			changelist->push_remove(lm, iter->mask);
+			found = true;
 		}
+	}
+	return found;
+}
 
-		if (changelist.empty())
+// Finds the channels which had regex entries before the module was loaded.
+void IndexAll(ChannelSet& regexchans, ChanModeReference& ban, ChanModeReference& exc, ChanModeReference& inv)
+{
+	const std::vector<ListModeBase*> listmodes = GetListModes(ban, exc, inv);
+	const chan_hash& chans = ServerInstance->GetChans();
+	for (chan_hash::const_iterator c = chans.begin(); c != chans.end(); ++c)
+	{
+		if (FindRegexEntries(listmodes, c->second, NULL))
+			regexchans.insert(c->second);
+	}
+}
+
+void RemoveAll(const std::string& engine, ChannelSet& regexchans, ChanModeReference& ban, ChanModeReference& exc, ChanModeReference& inv)
+{
+	const std::vector<ListModeBase*> listmodes = GetListModes(ban, exc, inv);
+
+	// Only the channels which have had regex extbans set need checking
+	// Batch removals with a Modes::ChangeList and Process()
+	// Send a notice to hop/op if anything was removed
+	ChannelSet pending;
+	pending.swap(regexchans);
+	for (ChannelSet::const_iterator c = pending.begin(); c != pending.end(); ++c)
+	{
+		Channel* chan = *c;
+		Modes::ChangeList changelist;
+		if (!FindRegexEntries(listmodes, chan, &changelist))
 			continue;
 
 		ServerInstance->Modes.Process(ServerInstance->FakeClient, chan, NULL, changelist);
+		NoticeOps(chan, "Regex engine has changed to '" + engine + "'. All regex extbans have been removed");
+	}
+}
 
-		const std::string msg = "Regex engine has changed to '" + engine + "'. All regex extbans have been removed";
-		PrefixMode* hop = ServerInstance->Modes->FindPrefixMode('h');
-		char pfxchar = (hop && hop->name == "halfop") ? hop->GetPrefix() : '@';
+// The time a pattern has spent matching on a channel in the current window.
+struct PatternBudget
+{
+	time_t windowstart;
+	long spent;
+	bool disabled;
+
+	PatternBudget()
+		: windowstart(ServerInstance->Time())
+		, spent(0)
+		, disabled(false)
+	{
+	}
 
-#if defined INSPIRCD_VERSION_BEFORE && INSPIRCD_VERSION_BEFORE(3, 5)
-		ClientProtocol::Messages::Privmsg notice(ServerInstance->FakeClient, chan, msg, MSG_NOTICE);
-		chan->Write(ServerInstance->GetRFCEvents().privmsg, notice, pfxchar);
-		ServerInstance->PI->SendMessage(chan, pfxchar, msg, MSG_NOTICE);
-#else
-		chan->WriteNotice(msg, pfxchar);
-#endif
+	// Adds the time taken by a match and returns true if the pattern has
+	// just gone over its budget and has been disabled.
+	bool AddTime(long microseconds, long budget, time_t window)
+	{
+		if (disabled || !budget)
+			return false;
+
+		if (ServerInstance->Time() >= windowstart + window)
+		{
+			windowstart = ServerInstance->Time();
+			spent = 0;
+		}
+
+		spent += microseconds;
+		if (spent <= budget)
+			return false;
+
+		disabled = true;
+		return true;
 	}
-}
+};
+
+// The budgets of the patterns which have been checked on a channel.
+typedef std::map<std::string, PatternBudget> BudgetMap;
+
+// Caches compiled regexes by pattern so that OnCheckBan only has to execute
+// them. The cache belongs to a single engine and is emptied whenever the
+// engine it was built with changes. At most maxcached patterns are kept and
+// one is dropped to make room whenever a new one has to be compiled.
+class RegexCache
+{
+	typedef std::map<std::string, Regex*> CacheMap;
+
+	static const size_t maxcached = 1000;
+
+	CacheMap cache;
+	RegexFactory* engine;
+
+ public:
+	RegexCache()
+		: engine(NULL)
+	{
+	}
+
+	~RegexCache()
+	{
+		Clear();
+	}
+
+	Regex* Get(RegexFactory* factory, const std::string& pattern)
+	{
+		if (factory != engine)
+		{
+			Clear();
+			engine = factory;
+		}
+
+		CacheMap::iterator it = cache.find(pattern);
+		if (it != cache.end())
+			return it->second;
+
+		Regex* regex = factory->Create(pattern);
+		if (cache.size() >= maxcached)
+		{
+			delete cache.begin()->second;
+			cache.erase(cache.begin());
+		}
+		cache[pattern] = regex;
+		return regex;
+	}
+
+	void Remove(const std::string& pattern)
+	{
+		CacheMap::iterator it = cache.find(pattern);
+		if (it == cache.end())
+			return;
+
+		delete it->second;
+		cache.erase(it);
+	}
+
+	void Clear()
+	{
+		for (CacheMap::iterator it = cache.begin(); it != cache.end(); ++it)
+			delete it->second;
+		cache.clear();
+		engine = NULL;
+	}
+
+	RegexFactory* GetEngine() const
+	{
+		return engine;
+	}
+};
+
+// The strings a regex extban is matched against. These only change when the
+// nick, ident, host or real name of the user does so they are built once and
+// kept on the user until one of those changes.
+struct MatchSubjects
+{
+	std::string dhost;
+	std::string host;
+	std::string ip;
+
+	MatchSubjects(User* user)
+		: dhost(user->GetFullHost() + " " + user->GetRealName())
+		, host(user->GetFullRealHost() + " " + user->GetRealName())
+		, ip(user->nick + "!" + user->MakeHostIP() + " " + user->GetRealName())
+	{
+	}
+
+	bool Matches(Regex* regex) const
+	{
+		return (regex->Matches(dhost) || regex->Matches(host) || regex->Matches(ip));
+	}
+};
 } // namespace
 
 class WatchedMode : public ModeWatcher
 {
 	bool& opersonly;
 	dynamic_reference<RegexFactory>& rxfactory;
+	RegexCache& rxcache;
+	ChannelSet& regexchans;
+	SimpleExtItem<BudgetMap>& budgets;
 
  public:
-	WatchedMode(Module *mod, bool& oo, dynamic_reference<RegexFactory>& rf, const std::string modename)
+	WatchedMode(Module *mod, bool& oo, dynamic_reference<RegexFactory>& rf, RegexCache& rc, ChannelSet& chans, SimpleExtItem<BudgetMap>& bm, const std::string modename)
 		: ModeWatcher(mod, modename, MODETYPE_CHANNEL)
 		, opersonly(oo)
 		, rxfactory(rf)
+		, rxcache(rc)
+		, regexchans(chans)
+		, budgets(bm)
 	{
 	}
 
@@ -165,6 +349,28 @@ class WatchedMode : public ModeWatcher
 
 		return true;
 	}
+
+	void AfterMode(User*, User*, Channel* chan, const std::string& param, bool adding) CXX11_OVERRIDE
+	{
+		if (!IsExtBanRegex(param) && !IsNestedExtBanRegex(param))
+			return;
+
+		// The same pattern may still be set elsewhere; if so it will simply
+		// be compiled again the next time it is checked.
+		if (adding)
+		{
+			regexchans.insert(chan);
+			return;
+		}
+
+		const std::string pattern = param.substr(param.find("x:") + 2);
+		rxcache.Remove(pattern);
+
+		// Setting the pattern again gives it a fresh budget.
+		BudgetMap* bm = budgets.get(chan);
+		if (bm)
+			bm->erase(pattern);
+	}
 };
 
 class ModuleExtBanRegex : public Module
@@ -180,6 +386,25 @@ class ModuleExtBanRegex : public Module
 
 	dynamic_reference<RegexFactory> rxfactory;
 	RegexFactory* factory;
+	RegexCache rxcache;
+	ChannelSet regexchans;
+	SimpleExtItem<MatchSubjects> subjects;
+	SimpleExtItem<BudgetMap> budgets;
+
+	// How long in microseconds a pattern may spend matching on a channel in each window before it is disabled there.
+	long budget;
+	time_t budgetwindow;
+
+	// The number of matches which took under 1, 2, 4, ... microseconds.
+	unsigned long matchtimes[20];
+
+	void RecordMatchTime(long microseconds)
+	{
+		size_t bucket = 0;
+		while (bucket < 19 && microseconds >= (1L << bucket))
+			bucket++;
+		matchtimes[bucket]++;
+	}
 
  public:
 	ModuleExtBanRegex()
@@ -188,17 +413,24 @@ class ModuleExtBanRegex : public Module
 		, banmode(this, "ban")
 		, banexceptionmode(this, "banexception")
 		, inviteexceptionmode(this, "invex")
-		, banwatcher(this, opersonly, rxfactory, "ban")
-		, exceptionwatcher(this, opersonly, rxfactory, "banexception")
-		, inviteexceptionwatcher(this, opersonly, rxfactory, "invex")
+		, banwatcher(this, opersonly, rxfactory, rxcache, regexchans, budgets, "ban")
+		, exceptionwatcher(this, opersonly, rxfactory, rxcache, regexchans, budgets, "banexception")
+		, inviteexceptionwatcher(this, opersonly, rxfactory, rxcache, regexchans, budgets, "invex")
 		, rxfactory(this, "regex")
+		, subjects("extbanregex-subjects", ExtensionItem::EXT_USER, this)
+		, budgets("extbanregex-budgets", ExtensionItem::EXT_CHANNEL, this)
+		, budget(1000000)
+		, budgetwindow(60)
 	{
+		std::fill(matchtimes, matchtimes + 20, 0);
 	}
 
 	void ReadConfig(ConfigStatus&) CXX11_OVERRIDE
 	{
 		ConfigTag* tag = ServerInstance->Config->ConfValue("extbanregex");
 		opersonly = tag->getBool("opersonly", true);
+		budget = tag->getInt("budget", 1000, 0) * 1000;
+		budgetwindow = tag->getDuration("budgetwindow", 60, 1);
 		std::string newrxengine = tag->getString("engine");
 		factory = rxfactory ? rxfactory.operator->() : NULL;
 
@@ -207,6 +439,9 @@ class ModuleExtBanRegex : public Module
 		else
 			rxfactory.SetProvider("regex/" + newrxengine);
 
+		if (initing)
+			IndexAll(regexchans, banmode, banexceptionmode, inviteexceptionmode);
+
 		if (!rxfactory)
 		{
 			if (newrxengine.empty())
@@ -214,17 +449,32 @@ class ModuleExtBanRegex : public Module
 			else
 				ServerInstance->SNO->WriteToSnoMask('a', "WARNING: Regex engine '%s' is not loaded - regex extban functionality disabled until this is corrected.", newrxengine.c_str());
 
-			RemoveAll("none", banmode, banexceptionmode, inviteexceptionmode);
+			RemoveAll("none", regexchans, banmode, banexceptionmode, inviteexceptionmode);
 		}
 		else if (!initing && rxfactory.operator->() != factory)
 		{
 			ServerInstance->SNO->WriteToSnoMask('a', "Regex engine has changed to '%s', removing all regex extbans.", rxfactory->name.c_str());
-			RemoveAll(rxfactory->name, banmode, banexceptionmode, inviteexceptionmode);
+			RemoveAll(rxfactory->name, regexchans, banmode, banexceptionmode, inviteexceptionmode);
 		}
 
+		// Compiled regexes are only valid for the engine that created them.
+		factory = rxfactory ? rxfactory.operator->() : NULL;
+		if (rxcache.GetEngine() != factory)
+			rxcache.Clear();
+
 		initing = false;
 	}
 
+	void OnUnloadModule(Module* mod) CXX11_OVERRIDE
+	{
+		// The cached regexes must be freed before the code that created them goes away.
+		if (factory && factory->creator == mod)
+		{
+			rxcache.Clear();
+			factory = NULL;
+		}
+	}
+
 	ModResult OnCheckBan(User* user, Channel* chan, const std::string& mask) CXX11_OVERRIDE
 	{
 		if (!factory)
@@ -233,28 +483,107 @@ class ModuleExtBanRegex : public Module
 		if (!IsExtBanRegex(mask))
 			return MOD_RES_PASSTHRU;
 
-		std::string dhost = user->GetFullHost() + " " + user->GetRealName();
-		std::string host = user->GetFullRealHost() + " " + user->GetRealName();
-		std::string ip = user->nick + "!" + user->MakeHostIP() + " " + user->GetRealName();
+		// Hosts can still change before registration completes so
+		// only keep the match subjects of fully registered users.
+		MatchSubjects* ms = subjects.get(user);
+		if (!ms && user->registered == REG_ALL)
+		{
+			ms = new MatchSubjects(user);
+			subjects.set(user, ms);
+		}
 
 		struct timeval pretv, posttv;
 		gettimeofday(&pretv, NULL);
 
-		Regex* regex = factory->Create(mask.substr(2));
-		bool matched = (regex->Matches(dhost) || regex->Matches(host) || regex->Matches(ip));
-		delete regex;
+		const std::string pattern = mask.substr(2);
+		BudgetMap* bm = budgets.get(chan);
+		if (!bm)
+		{
+			bm = new BudgetMap;
+			budgets.set(chan, bm);
+		}
+
+		PatternBudget& pb = (*bm)[pattern];
+		if (pb.disabled)
+			return MOD_RES_PASSTHRU;
+
+		Regex* regex = rxcache.Get(factory, pattern);
+		bool matched = ms ? ms->Matches(regex) : MatchSubjects(user).Matches(regex);
 
 		gettimeofday(&posttv, NULL);
-		float timediff = ((double)(posttv.tv_usec - pretv.tv_usec) / 1000000) + (double)(posttv.tv_sec - pretv.tv_sec);
+		long elapsed = ((posttv.tv_sec - pretv.tv_sec) * 1000000) + (posttv.tv_usec - pretv.tv_usec);
+		RecordMatchTime(elapsed);
+
+		if (pb.AddTime(elapsed, budget, budgetwindow))
+		{
+			ServerInstance->SNO->WriteGlobalSno('a', "*** extbanregex disabled %s on %s after it spent more than %ld microseconds matching in %ld seconds",
+				pattern.c_str(), chan->name.c_str(), budget, static_cast<long>(budgetwindow));
+			NoticeOps(chan, "The regex extban " + mask + " has been disabled on this channel because it is too slow to match and no longer matches anyone. Please replace it with a simpler pattern.");
+		}
+
+		float timediff = (double)elapsed / 1000000;
 		if (timediff > 0.5)
 		{
 			ServerInstance->SNO->WriteGlobalSno('a', "*** extbanregex match took %f seconds on %s %s",
-				timediff, chan->name.c_str(), mask.substr(2).c_str());
+				timediff, chan->name.c_str(), pattern.c_str());
 		}
 
 		return (matched ? MOD_RES_DENY : MOD_RES_PASSTHRU);
 	}
 
+	ModResult OnStats(Stats::Context& stats) CXX11_OVERRIDE
+	{
+		if (stats.GetSymbol() != 'x')
+			return MOD_RES_PASSTHRU;
+
+		unsigned long total = 0;
+		for (size_t bucket = 0; bucket < 20; ++bucket)
+			total += matchtimes[bucket];
+		stats.AddRow(249, InspIRCd::Format("%lu regex extban matches", total));
+
+		for (size_t bucket = 0; bucket < 20; ++bucket)
+		{
+			if (!matchtimes[bucket])
+				continue;
+
+			if (bucket == 19)
+				stats.AddRow(249, InspIRCd::Format("%lu took at least %ld microseconds", matchtimes[bucket], 1L << 18));
+			else
+				stats.AddRow(249, InspIRCd::Format("%lu took under %ld microseconds", matchtimes[bucket], 1L << bucket));
+		}
+		return MOD_RES_DENY;
+	}
+
+	void OnChannelDelete(Channel* chan) CXX11_OVERRIDE
+	{
+		regexchans.erase(chan);
+	}
+
+	void OnUserPostNick(User* user, const std::string&) CXX11_OVERRIDE
+	{
+		subjects.unset(user);
+	}
+
+	void OnChangeHost(User* user, const std::string&) CXX11_OVERRIDE
+	{
+		subjects.unset(user);
+	}
+
+	void OnChangeIdent(User* user, const std::string&) CXX11_OVERRIDE
+	{
+		subjects.unset(user);
+	}
+
+	void OnChangeRealName(User* user, const std::string&) CXX11_OVERRIDE
+	{
+		subjects.unset(user);
+	}
+
+	void OnSetUserIP(LocalUser* user) CXX11_OVERRIDE
+	{
+		subjects.unset(user);
+	}
+
 	void On005Numeric(std::map<std::string, std::string>& tokens) CXX11_OVERRIDE
 	{
 		tokens["EXTBAN"].push_back('x');
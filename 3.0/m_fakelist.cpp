@@ -29,7 +29,75 @@
 /// $ModDesc: Turns /list into a honeypot for newly connected users
 /// $ModConfig: <fakelist waittime="30s" reason="User hit a spam trap" target="#spamtrap" minusers="20" maxusers="50" topic="SPAM TRAP: DO NOT JOIN, YOU WILL BE DISCONNECTED! (try again later for a real reply)" killonjoin="true">
 
-typedef std::vector<std::string> AllowList;
+/** The <securehost> exceptions, split up at rehash so that checking a user
+ * doesn't have to glob against every entry.
+ */
+class AllowList
+{
+ private:
+	// Exceptions without wildcards, lowercased.
+	TR1NS::unordered_set<std::string> literals;
+
+	// Exceptions in the form *@ip/len.
+	std::vector<irc::sockets::cidr_mask> cidrs;
+
+	// Everything else.
+	std::vector<std::string> globs;
+
+ public:
+	void Add(const std::string& mask)
+	{
+		std::string::size_type atpos = mask.find('@');
+		if (atpos == 1 && mask[0] == '*' && mask.find('/', atpos) != std::string::npos
+			&& mask.find_first_of("*?", atpos) == std::string::npos)
+		{
+			cidrs.push_back(irc::sockets::cidr_mask(mask.substr(atpos + 1)));
+			return;
+		}
+
+		if (mask.find_first_of("*?") == std::string::npos)
+		{
+			std::string lowermask(mask);
+			std::transform(lowermask.begin(), lowermask.end(), lowermask.begin(), ::tolower);
+			literals.insert(lowermask);
+			return;
+		}
+
+		globs.push_back(mask);
+	}
+
+	bool Matches(LocalUser* user) const
+	{
+		for (std::vector<irc::sockets::cidr_mask>::const_iterator iter = cidrs.begin(); iter != cidrs.end(); ++iter)
+			if (iter->match(user->client_sa))
+				return true;
+
+		if (literals.empty() && globs.empty())
+			return false;
+
+		const std::string host = user->MakeHost();
+		if (!literals.empty())
+		{
+			std::string lowerhost(host);
+			std::transform(lowerhost.begin(), lowerhost.end(), lowerhost.begin(), ::tolower);
+			if (literals.count(lowerhost))
+				return true;
+		}
+
+		for (std::vector<std::string>::const_iterator iter = globs.begin(); iter != globs.end(); ++iter)
+			if (InspIRCd::Match(host, *iter, ascii_case_insensitive_map))
+				return true;
+
+		return false;
+	}
+
+	void swap(AllowList& other)
+	{
+		literals.swap(other.literals);
+		cidrs.swap(other.cidrs);
+		globs.swap(other.globs);
+	}
+};
 
 class ModuleFakeList : public Module
 {
@@ -60,7 +128,7 @@ class ModuleFakeList : public Module
 			std::string host = i->second->getString("exception");
 			if (host.empty())
 				throw ModuleException("<securehost:exception> is a required field at " + i->second->getTagLocation());
-			newallows.push_back(host);
+			newallows.Add(host);
 		}
 
 		ConfigTag* tag = ServerInstance->Config->ConfValue("fakelist");
@@ -91,9 +159,8 @@ class ModuleFakeList : public Module
 		if ((command == "LIST") && (ServerInstance->Time() < (user->signon+WaitTime)) && (!user->IsOper()))
 		{
 			/* Normally wouldnt be allowed here, are they exempt? */
-			for (std::vector<std::string>::iterator x = allowlist.begin(); x != allowlist.end(); x++)
-				if (InspIRCd::Match(user->MakeHost(), *x, ascii_case_insensitive_map))
-					return MOD_RES_PASSTHRU;
+			if (allowlist.Matches(user))
+				return MOD_RES_PASSTHRU;
 
 			const AccountExtItem* ext = GetAccountExtItem();
 			if (exemptregistered && ext && ext->get(user))
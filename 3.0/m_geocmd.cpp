@@ -25,29 +25,202 @@
 #include "inspircd.h"
 #include "modules/geolocation.h"
 
+// The name and code of a location or empty strings if the address could not be geolocated.
+struct CachedLocation
+{
+	std::string name;
+	std::string code;
+
+	bool IsKnown() const
+	{
+		return !code.empty();
+	}
+
+	std::string GetLabel() const
+	{
+		return IsKnown() ? InspIRCd::Format("%s (%s)", name.c_str(), code.c_str()) : "an unknown location";
+	}
+};
+
+// Caches lookups by the /24 (IPv4) or /48 (IPv6) they are in. The names are
+// copied so that nothing is held on to when the Geolocation provider changes.
+class LocationCache
+{
+ private:
+	typedef std::list<std::pair<irc::sockets::cidr_mask, CachedLocation> > EntryList;
+	typedef std::map<irc::sockets::cidr_mask, EntryList::iterator> EntryMap;
+
+	// The most recently used entries are at the front.
+	EntryList entries;
+	EntryMap index;
+	static const size_t maxentries = 4096;
+
+ public:
+	static irc::sockets::cidr_mask GetPrefix(const irc::sockets::sockaddrs& sa)
+	{
+		return irc::sockets::cidr_mask(sa, sa.family() == AF_INET6 ? 48 : 24);
+	}
+
+	const CachedLocation& Get(Geolocation::API& geoapi, irc::sockets::sockaddrs& sa)
+	{
+		const irc::sockets::cidr_mask prefix = GetPrefix(sa);
+		EntryMap::iterator iter = index.find(prefix);
+		if (iter != index.end())
+		{
+			entries.splice(entries.begin(), entries, iter->second);
+			return iter->second->second;
+		}
+
+		if (entries.size() >= maxentries)
+		{
+			index.erase(entries.back().first);
+			entries.pop_back();
+		}
+
+		CachedLocation cached;
+		Geolocation::Location* location = geoapi ? geoapi->GetLocation(sa) : NULL;
+		if (location)
+		{
+			cached.name = location->GetName();
+			cached.code = location->GetCode();
+		}
+
+		entries.push_front(std::make_pair(prefix, cached));
+		index[prefix] = entries.begin();
+		return entries.front().second;
+	}
+
+	void Clear()
+	{
+		entries.clear();
+		index.clear();
+	}
+};
+
 class CommandGeolocate
 	: public SplitCommand
 {
  private:
 	Geolocation::API geoapi;
 
+	// The most /24s or /48s that can be looked up for one range.
+	static const unsigned int maxblocks = 4096;
+
+	typedef std::map<std::string, std::vector<std::string> > AddressesByLabel;
+	typedef std::map<std::string, unsigned long> CountsByLabel;
+
+	static void SetBits(unsigned char* bytes, unsigned int start, unsigned int count, unsigned long value)
+	{
+		for (unsigned int bit = 0; bit < count; ++bit)
+		{
+			unsigned int pos = start + bit;
+			unsigned char mask = 1 << (7 - (pos % 8));
+			if (value & (1UL << (count - bit - 1)))
+				bytes[pos / 8] |= mask;
+			else
+				bytes[pos / 8] &= ~mask;
+		}
+	}
+
+	bool ParseRange(const std::string& range, irc::sockets::cidr_mask& mask)
+	{
+		std::string::size_type slash = range.find('/');
+		irc::sockets::sockaddrs sa;
+		if (slash == std::string::npos || !irc::sockets::aptosa(range.substr(0, slash), 0, sa))
+			return false;
+
+		const std::string lengthstr = range.substr(slash + 1);
+		if (lengthstr.empty() || lengthstr.find_first_not_of("0123456789") != std::string::npos)
+			return false;
+
+		unsigned int length = ConvToNum<unsigned int>(lengthstr);
+		if (length > (sa.family() == AF_INET6 ? 128 : 32))
+			return false;
+
+		mask = irc::sockets::cidr_mask(sa, length);
+		return true;
+	}
+
+	void LocateRange(LocalUser* user, const std::string& range)
+	{
+		irc::sockets::cidr_mask mask;
+		if (!ParseRange(range, mask))
+		{
+			user->WriteNotice("*** GEOLOCATE: " + range + " is not a valid CIDR range!");
+			return;
+		}
+
+		// One address is looked up in each /24 or /48 of the range.
+		const bool ipv6 = (mask.type == AF_INET6);
+		const unsigned int blockbits = (ipv6 ? 48 : 24);
+		const unsigned int freebits = (mask.length < blockbits ? blockbits - mask.length : 0);
+		if (freebits > 12)
+		{
+			user->WriteNotice(InspIRCd::Format("*** GEOLOCATE: %s is too large, at most %u /%u ranges can be looked up at once!",
+				range.c_str(), maxblocks, blockbits));
+			return;
+		}
+
+		CountsByLabel counts;
+		irc::sockets::sockaddrs sa;
+		unsigned char bytes[16];
+		memcpy(bytes, mask.bits, sizeof(bytes));
+		for (unsigned long block = 0; block < (1UL << freebits); ++block)
+		{
+			SetBits(bytes, mask.length, freebits, block);
+			memset(&sa, 0, sizeof(sa));
+			if (ipv6)
+			{
+				sa.in6.sin6_family = AF_INET6;
+				memcpy(&sa.in6.sin6_addr, bytes, 16);
+			}
+			else
+			{
+				sa.in4.sin_family = AF_INET;
+				memcpy(&sa.in4.sin_addr, bytes, 4);
+			}
+			counts[cache.Get(geoapi, sa).GetLabel()]++;
+		}
+
+		std::string summary;
+		for (CountsByLabel::const_iterator iter = counts.begin(); iter != counts.end(); ++iter)
+		{
+			if (!summary.empty())
+				summary.append(", ");
+			summary.append(InspIRCd::Format("%s x%lu", iter->first.c_str(), iter->second));
+		}
+
+		user->WriteNotice(InspIRCd::Format("*** GEOLOCATE: %s has %lu /%u ranges located in %s.", mask.str().c_str(),
+			1UL << freebits, std::max<unsigned int>(mask.length, blockbits), summary.c_str()));
+	}
+
  public:
+	LocationCache cache;
+
 	CommandGeolocate(Module* Creator)
 		: SplitCommand(Creator, "GEOLOCATE", 1)
 		, geoapi(Creator)
 	{
 		allow_empty_last_param = false;
 		flags_needed = 'o';
-		syntax = "<ipaddr> [<ipaddr>]+";
+		syntax = "<ipaddr>|<cidr> [<ipaddr>|<cidr>]+";
 	}
 
 	CmdResult HandleLocal(LocalUser* user, const Params& parameters) CXX11_OVERRIDE
 	{
+		// Addresses are grouped by their location to keep the output short.
+		AddressesByLabel located;
 		irc::sockets::sockaddrs sa;
 		for (Command::Params::const_iterator iter = parameters.begin(); iter != parameters.end(); ++iter)
 		{
-			// Try to parse the address.
 			const std::string& address = *iter;
+			if (address.find('/') != std::string::npos)
+			{
+				LocateRange(user, address);
+				continue;
+			}
+
+			// Try to parse the address.
 			if (!irc::sockets::aptosa(address, 0, sa))
 			{
 				user->WriteNotice("*** GEOLOCATE: " + address + " is not a valid IP address!");
@@ -55,15 +228,21 @@ class CommandGeolocate
 			}
 
 			// Try to geolocate the IP address.
-			Geolocation::Location* location = geoapi ? geoapi->GetLocation(sa) : NULL;
-			if (!location)
+			const CachedLocation& location = cache.Get(geoapi, sa);
+			if (!location.IsKnown())
 			{
 				user->WriteNotice("*** GEOLOCATE: " + sa.addr() + " could not be geolocated!");
 				continue;
 			}
 
-			user->WriteNotice(InspIRCd::Format("*** GEOLOCATE: %s is located in %s (%s).", sa.addr().c_str(),
-				location->GetName().c_str(), location->GetCode().c_str()));
+			located[location.GetLabel()].push_back(sa.addr());
+		}
+
+		for (AddressesByLabel::const_iterator iter = located.begin(); iter != located.end(); ++iter)
+		{
+			const char* verb = (iter->second.size() == 1 ? "is" : "are");
+			user->WriteNotice(InspIRCd::Format("*** GEOLOCATE: %s %s located in %s.", stdalgo::string::join(iter->second).c_str(),
+				verb, iter->first.c_str()));
 		}
 		return CMD_SUCCESS;
 	}
@@ -81,6 +260,17 @@ class ModuleGeoCommand
 	{
 	}
 
+	void ReadConfig(ConfigStatus&) CXX11_OVERRIDE
+	{
+		// Geolocation databases are usually reloaded with a rehash.
+		cmd.cache.Clear();
+	}
+
+	void OnUnloadModule(Module*) CXX11_OVERRIDE
+	{
+		cmd.cache.Clear();
+	}
+
 	Version GetVersion() CXX11_OVERRIDE
 	{
 		return Version("Provides the /GEOLOCATE command which performs Geolocation lookups on arbitrary IP addresses");
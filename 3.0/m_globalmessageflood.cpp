@@ -25,12 +25,20 @@
 
 #include "inspircd.h"
 
+/// $ModConfig: <globalflood networklines="0" syncinterval="5">
 /// $ModDesc: Provides channel mode +x (oper only top-level channel flood protection with SNOMASK +F)
 /// $ModDepends: core 3
 
-typedef std::map<User*, unsigned int> counter_t;
+/* When <globalflood networklines> is set to more than 0 the total number of
+ * lines sent to a +x channel by users on all servers is also limited to that
+ * many lines every <seconds> of the +x window. Each server counts the lines
+ * of its own users and sends the counts of all channels which changed to the
+ * other servers in one batch every <globalflood syncinterval> seconds, so the
+ * network-wide count lags behind by up to that long. Windows are aligned to
+ * the clock so the servers agree on them without exchanging anything else.
+ */
 
-/** Holds flood settings and state for mode +x
+/** Holds flood settings for mode +x
  */
 class globalfloodsettings
 {
@@ -38,32 +46,112 @@ class globalfloodsettings
 	bool ban;
 	unsigned int secs;
 	unsigned int lines;
-	time_t reset;
-	counter_t counters;
 
 	globalfloodsettings(bool a, int b, int c) : ban(a), secs(b), lines(c)
 	{
-		reset = ServerInstance->Time() + secs;
+	}
+};
+
+/** Holds the flood state of a member of a channel with mode +x. The window
+ * is expired lazily when the member next sends a message.
+ */
+class globalfloodcounter
+{
+ public:
+	time_t reset;
+	unsigned int counter;
+
+	globalfloodcounter() : reset(0), counter(0)
+	{
 	}
 
-	bool addmessage(User* who)
+	bool addmessage(const globalfloodsettings* gfs)
 	{
 		if (ServerInstance->Time() > reset)
 		{
-			counters.clear();
-			reset = ServerInstance->Time() + secs;
+			counter = 0;
+			reset = ServerInstance->Time() + gfs->secs;
 		}
 
-		return (++counters[who] >= this->lines);
+		return (++counter >= gfs->lines);
 	}
 
-	void clear(User* who)
+	void clear()
+	{
+		counter = 0;
+	}
+};
+
+/** Holds the globalfloodcounter of each member. The counters are kept across
+ * a module reload so a flood can't be restarted by reloading the module.
+ */
+class GlobalFloodCounterExt : public SimpleExtItem<globalfloodcounter>
+{
+ public:
+	GlobalFloodCounterExt(Module* Creator)
+		: SimpleExtItem<globalfloodcounter>("globalflood-counter", ExtensionItem::EXT_MEMBERSHIP, Creator)
+	{
+	}
+
+	std::string ToInternal(const Extensible* container, void* item) const CXX11_OVERRIDE
+	{
+		// The leading 1 is the format version.
+		const globalfloodcounter* counter = static_cast<globalfloodcounter*>(item);
+		return InspIRCd::Format("1 %ld %u", static_cast<long>(counter->reset), counter->counter);
+	}
+
+	void FromInternal(Extensible* container, const std::string& value) CXX11_OVERRIDE
+	{
+		irc::spacesepstream stream(value);
+		unsigned int version;
+		long reset;
+		globalfloodcounter counter;
+		if (!stream.GetNumericToken(version) || version != 1 || !stream.GetNumericToken(reset)
+			|| !stream.GetNumericToken(counter.counter))
+			return;
+
+		counter.reset = reset;
+		set(container, counter);
+	}
+};
+
+/** Holds the network-wide flood state of a channel with mode +x
+ */
+class networkfloodstate
+{
+ public:
+	typedef std::map<std::string, unsigned int> remote_t;
+
+	time_t window;
+	unsigned int local;
+	unsigned int sent;
+	remote_t remote;
+	bool announced;
+
+	networkfloodstate() : window(0), local(0), sent(0), announced(false)
 	{
-		counter_t::iterator iter = counters.find(who);
-		if (iter != counters.end())
-		{
-			counters.erase(iter);
-		}
+	}
+
+	/** Moves on to the window which the current time is in. */
+	void update(const globalfloodsettings* gfs)
+	{
+		const time_t now = ServerInstance->Time();
+		const time_t start = now - (now % gfs->secs);
+		if (start == window)
+			return;
+
+		window = start;
+		local = sent = 0;
+		remote.clear();
+		announced = false;
+	}
+
+	unsigned int total() const
+	{
+		unsigned int lines = local;
+		for (remote_t::const_iterator iter = remote.begin(); iter != remote.end(); ++iter)
+			lines += iter->second;
+		return lines;
 	}
 };
 
@@ -117,14 +205,150 @@ class GlobalMsgFlood : public ParamMode<GlobalMsgFlood, SimpleExtItem<globalfloo
 	}
 };
 
-class ModuleGlobalMsgFlood : public Module
+/** Handles the batched line counts sent by other servers
+ */
+class CommandGlobalFlood : public Command
+{
+ public:
+	GlobalMsgFlood& mf;
+	SimpleExtItem<networkfloodstate>& states;
+
+	CommandGlobalFlood(Module* Creator, GlobalMsgFlood& mode, SimpleExtItem<networkfloodstate>& ext)
+		: Command(Creator, "GLOBALFLOOD", 2, 2)
+		, mf(mode)
+		, states(ext)
+	{
+		flags_needed = FLAG_SERVERONLY;
+	}
+
+	CmdResult Handle(User* user, const Params& parameters) CXX11_OVERRIDE
+	{
+		// GLOBALFLOOD <window> :<lines> <channel> [<lines> <channel>]+
+		time_t window = ConvToNum<time_t>(parameters[0]);
+		irc::spacesepstream stream(parameters[1]);
+		std::string lines;
+		std::string channame;
+		while (stream.GetToken(lines) && stream.GetToken(channame))
+		{
+			Channel* chan = ServerInstance->FindChan(channame);
+			globalfloodsettings* f = chan ? mf.ext.get(chan) : NULL;
+			if (!f)
+				continue;
+
+			networkfloodstate* state = states.get(chan);
+			if (!state)
+			{
+				state = new networkfloodstate;
+				states.set(chan, state);
+			}
+
+			// Counts for any window but the current one are useless.
+			state->update(f);
+			if (state->window == window)
+				state->remote[user->uuid] = ConvToNum<unsigned int>(lines);
+		}
+		return CMD_SUCCESS;
+	}
+};
+
+class ModuleGlobalMsgFlood
+	: public Module
+	, public Timer
 {
 	GlobalMsgFlood mf;
+	GlobalFloodCounterExt counters;
+	SimpleExtItem<networkfloodstate> states;
+	CommandGlobalFlood cmd;
+	insp::flat_set<Channel*> changed;
+	unsigned int networklines;
+
+	bool CheckNetwork(User* user, Channel* dest, globalfloodsettings* f)
+	{
+		networkfloodstate* state = states.get(dest);
+		if (!state)
+		{
+			state = new networkfloodstate;
+			states.set(dest, state);
+		}
+
+		state->update(f);
+		state->local++;
+		changed.insert(dest);
+
+		if (state->total() < networklines)
+			return false;
+
+		if (!state->announced)
+		{
+			state->announced = true;
+			ServerInstance->SNO->WriteGlobalSno('f', "Network-wide channel flood triggered by %s (%s) in %s (limit was %u lines in %u secs)",
+				user->GetFullRealHost().c_str(), user->GetFullHost().c_str(), dest->name.c_str(), networklines, f->secs);
+		}
+		return true;
+	}
+
+	void SendBatch(time_t window, const std::string& batch)
+	{
+		CommandBase::Params params;
+		params.push_back(ConvToStr(window));
+		params.push_back(batch);
+		ServerInstance->PI->BroadcastEncap(cmd.name, params);
+	}
 
  public:
 	ModuleGlobalMsgFlood()
-		: mf(this)
+		: Timer(5, true)
+		, mf(this)
+		, counters(this)
+		, states("globalflood-network", ExtensionItem::EXT_CHANNEL, this)
+		, cmd(this, mf, states)
+		, networklines(0)
+	{
+	}
+
+	void ReadConfig(ConfigStatus&) CXX11_OVERRIDE
 	{
+		ConfigTag* tag = ServerInstance->Config->ConfValue("globalflood");
+		networklines = tag->getUInt("networklines", 0);
+		SetInterval(tag->getDuration("syncinterval", 5, 1, 60));
+	}
+
+	bool Tick(time_t) CXX11_OVERRIDE
+	{
+		// Send the counts of every channel that changed, batched by window.
+		std::map<time_t, std::string> batches;
+		for (insp::flat_set<Channel*>::const_iterator iter = changed.begin(); iter != changed.end(); ++iter)
+		{
+			Channel* chan = *iter;
+			networkfloodstate* state = states.get(chan);
+			if (!state || state->sent == state->local)
+				continue;
+
+			std::string& batch = batches[state->window];
+			if (batch.length() > 400)
+			{
+				SendBatch(state->window, batch);
+				batch.clear();
+			}
+
+			if (!batch.empty())
+				batch.push_back(' ');
+			batch.append(ConvToStr(state->local)).append(" ").append(chan->name);
+			state->sent = state->local;
+		}
+		changed.clear();
+
+		for (std::map<time_t, std::string>::const_iterator iter = batches.begin(); iter != batches.end(); ++iter)
+		{
+			if (!iter->second.empty())
+				SendBatch(iter->first, iter->second);
+		}
+		return true;
+	}
+
+	void OnChannelDelete(Channel* chan) CXX11_OVERRIDE
+	{
+		changed.erase(chan);
 	}
 
 	void init() CXX11_OVERRIDE
@@ -141,12 +365,21 @@ class ModuleGlobalMsgFlood : public Module
 		if (user->IsModeSet('o'))
 			return MOD_RES_PASSTHRU;
 
+		// The counters live on the membership so users outside of the channel are not counted.
 		globalfloodsettings *f = mf.ext.get(dest);
-		if (f)
+		Membership* memb = f ? dest->GetUser(user) : NULL;
+		if (memb)
 		{
-			if (f->addmessage(user))
+			globalfloodcounter* counter = counters.get(memb);
+			if (!counter)
 			{
-				f->clear(user);
+				counter = new globalfloodcounter;
+				counters.set(memb, counter);
+			}
+
+			if (counter->addmessage(f))
+			{
+				counter->clear();
 				/* Generate the SNOTICE when someone triggers the flood limit */
 
 				ServerInstance->SNO->WriteGlobalSno('f', "Global channel flood triggered by %s (%s) in %s (limit was %u lines in %u secs)",
@@ -156,6 +389,9 @@ class ModuleGlobalMsgFlood : public Module
 			}
 		}
 
+		if (f && networklines && CheckNetwork(user, dest, f))
+			return MOD_RES_DENY;
+
 		return MOD_RES_PASSTHRU;
 	}
 
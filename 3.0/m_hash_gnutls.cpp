@@ -48,11 +48,13 @@ class GnuTLSHash : public HashProvider
 {
  private:
 	const gnutls_digest_algorithm_t algo;
+	const gnutls_mac_algorithm_t macalgo;
 
  public:
-	GnuTLSHash(Module* parent, const std::string& Name, const size_t outputsize, const size_t blocksize, gnutls_digest_algorithm_t digestalgo)
+	GnuTLSHash(Module* parent, const std::string& Name, const size_t outputsize, const size_t blocksize, gnutls_digest_algorithm_t digestalgo, gnutls_mac_algorithm_t mac = GNUTLS_MAC_UNKNOWN)
 		: HashProvider(parent, Name, outputsize, blocksize)
 		, algo(digestalgo)
+		, macalgo(mac)
 	{
 	}
 
@@ -62,6 +64,16 @@ class GnuTLSHash : public HashProvider
 		gnutls_hash_fast(algo, data.data(), data.length(), (unsigned char*)digest);
 		return std::string(digest, this->out_size);
 	}
+
+	std::string hmac(const std::string& key, const std::string& data) CXX11_OVERRIDE
+	{
+		if (macalgo == GNUTLS_MAC_UNKNOWN)
+			return HashProvider::hmac(key, data);
+
+		char digest[this->out_size];
+		gnutls_hmac_fast(macalgo, key.data(), key.length(), data.data(), data.length(), digest);
+		return std::string(digest, this->out_size);
+	}
 };
 
 class ModuleHashGnuTLS : public Module
@@ -81,11 +93,11 @@ class ModuleHashGnuTLS : public Module
 
  public:
 	ModuleHashGnuTLS()
-		: md5(this, "hash/md5", 16, 64, GNUTLS_DIG_MD5)
-		, sha1(this, "hash/sha1", 20, 64, GNUTLS_DIG_SHA1)
-		, sha256(this, "hash/sha256", 32, 64, GNUTLS_DIG_SHA256)
-		, sha512(this, "hash/sha512", 64, 128, GNUTLS_DIG_SHA512)
-		, ripemd160(this, "hash/ripemd160", 20, 64, GNUTLS_DIG_RMD160)
+		: md5(this, "hash/md5", 16, 64, GNUTLS_DIG_MD5, GNUTLS_MAC_MD5)
+		, sha1(this, "hash/sha1", 20, 64, GNUTLS_DIG_SHA1, GNUTLS_MAC_SHA1)
+		, sha256(this, "hash/sha256", 32, 64, GNUTLS_DIG_SHA256, GNUTLS_MAC_SHA256)
+		, sha512(this, "hash/sha512", 64, 128, GNUTLS_DIG_SHA512, GNUTLS_MAC_SHA512)
+		, ripemd160(this, "hash/ripemd160", 20, 64, GNUTLS_DIG_RMD160, GNUTLS_MAC_RMD160)
 #if defined GNUTLS_HAS_DIG_SHA3
 		, sha3_224(this, "hash/sha3-224", 28, 144, GNUTLS_DIG_SHA3_224)
 		, sha3_256(this, "hash/sha3-256", 32, 136, GNUTLS_DIG_SHA3_256)
@@ -22,13 +22,49 @@
 /// $ModDesc: Sends server notices when a user joins/parts a channel.
 /// $ModDepends: core 3
 
+/** Counts the joins sent by a server which is bursting and sends one server
+ * notice per channel every second instead of one per join.
+ */
+class BurstJoinTimer : public Timer
+{
+	private:
+		typedef TR1NS::unordered_map<std::string, unsigned int, irc::insensitive, irc::StrHashComp> JoinCounts;
+		JoinCounts joins;
+
+	public:
+		BurstJoinTimer()
+			: Timer(1, true)
+		{
+		}
+
+		void Add(Channel* chan)
+		{
+			joins[chan->name]++;
+		}
+
+		bool Tick(time_t) CXX11_OVERRIDE
+		{
+			for (JoinCounts::const_iterator iter = joins.begin(); iter != joins.end(); ++iter)
+			{
+				ServerInstance->SNO->WriteToSnoMask('E', "%u %s joined %s during a netburst", iter->second,
+					iter->second == 1 ? "user" : "users", iter->first.c_str());
+			}
+			joins.clear();
+			return true;
+		}
+};
+
 class ModuleJoinPartSNO : public Module
 {
+	private:
+		BurstJoinTimer burstjoins;
+
 	public:
 		void init() CXX11_OVERRIDE
 		{
 			ServerInstance->SNO->EnableSnomask('e', "JOIN");
 			ServerInstance->SNO->EnableSnomask('p', "PART");
+			ServerInstance->Timers.AddTimer(&burstjoins);
 		}
 
 		Version GetVersion() CXX11_OVERRIDE
@@ -38,6 +74,13 @@ class ModuleJoinPartSNO : public Module
 
 		void OnUserJoin(Membership* memb, bool sync, bool created, CUList& except) CXX11_OVERRIDE
 		{
+			/* Joins from a burst are summarised once a second. */
+			if (sync)
+			{
+				burstjoins.Add(memb->chan);
+				return;
+			}
+
 			/* If it's a local user do e, else E. */
 			ServerInstance->SNO->WriteToSnoMask((IS_LOCAL(memb->user) ? 'e' : 'E'), "User %s joined %s", memb->user->GetFullRealHost().c_str(), memb->chan->name.c_str());
 		}
@@ -26,6 +26,7 @@
  * allowredirect: Whether channel redirection is allowed or not. Default: no
  * freeredirect:  Skip the channel operator checks for redirection. Default: no
  * TIP: You can remove a block on a user with a /INVITE
+ * TIP: /STATS J shows how many cyclers are tracked and roughly how much memory they use
  *
  * Helpop Lines for the CHMODES section:
  * Find: '<helpop key="chmodes" title="Channel Modes" value="'
@@ -39,6 +40,7 @@
 
 
 #include "inspircd.h"
+#include "modules/stats.h"
 
 enum
 {
@@ -49,14 +51,67 @@ class joinpartspamsettings
 {
 	struct Tracking
 	{
+		uint64_t key;
 		time_t reset;
 		unsigned int counter;
-		Tracking() : reset(0), counter(0) { }
+		time_t blocked;
+		Tracking(uint64_t k) : key(k), reset(0), counter(0), blocked(0) { }
+
+		// Whether the entry is neither counting cycles nor blocking
+		bool expired(time_t now) const { return now > reset && now > blocked; }
 	};
 
-	std::map<std::string, Tracking> cycler;
-	std::map<std::string, time_t> blocked;
-	time_t lastcleanup;
+	typedef std::list<Tracking> TrackingList;
+	typedef TR1NS::unordered_map<uint64_t, TrackingList::iterator> TrackingMap;
+
+	// The most cyclers which are tracked on a channel at once
+	static const size_t maxtracked = 4096;
+
+	// Tracked cyclers with the most recently seen first
+	TrackingList lru;
+	TrackingMap tracked;
+
+	Tracking* find(uint64_t key)
+	{
+		TrackingMap::iterator it = tracked.find(key);
+		if (it == tracked.end())
+			return NULL;
+
+		lru.splice(lru.begin(), lru, it->second);
+		return &*it->second;
+	}
+
+	Tracking& get(uint64_t key)
+	{
+		Tracking* tracking = find(key);
+		if (tracking)
+			return *tracking;
+
+		lru.push_front(Tracking(key));
+		tracked[key] = lru.begin();
+
+		// Forget the least recently seen cycler if the channel is full
+		if (lru.size() > maxtracked)
+		{
+			tracked.erase(lru.back().key);
+			lru.pop_back();
+		}
+		return lru.front();
+	}
+
+	// Drop a few expired entries from the least recently seen end
+	void expire()
+	{
+		for (unsigned int i = 0; i < 2 && !lru.empty(); ++i)
+		{
+			const Tracking& tracking = lru.back();
+			if (!tracking.expired(ServerInstance->Time()))
+				break;
+
+			tracked.erase(tracking.key);
+			lru.pop_back();
+		}
+	}
 
  public:
 	unsigned int cycles;
@@ -65,8 +120,7 @@ class joinpartspamsettings
 	std::string redirect;
 
 	joinpartspamsettings(unsigned int c, unsigned int s, unsigned int b, std::string& r)
-		: lastcleanup(ServerInstance->Time())
-		, cycles(c)
+		: cycles(c)
 		, secs(s)
 		, block(b)
 		, redirect(r)
@@ -74,14 +128,14 @@ class joinpartspamsettings
 	}
 
 	// Called by PostJoin to possibly reset a cycler's Tracking and increment the counter
-	void addcycle(const std::string& mask)
+	void addcycle(uint64_t key)
 	{
-		/* If mask isn't already tracked, set reset time
+		/* If key isn't already tracked, set reset time
 		 * If tracked and reset time is up, reset counter and reset time
 		 * Also assume another server blocked, with the block timing out or a
 		 * user removed it if counter >= cycles, reset counter and reset time
 		 */
-		Tracking& tracking = cycler[mask];
+		Tracking& tracking = get(key);
 
 		if (tracking.reset == 0)
 			tracking.reset = ServerInstance->Time() + secs;
@@ -93,82 +147,70 @@ class joinpartspamsettings
 
 		++tracking.counter;
 
-		this->cleanup();
+		this->expire();
 	}
 
 	/* Called by PreJoin to check if a cycler's counter exceeds the set cycles,
-	 * adds them to the blocked list if so.
+	 * blocks them if so.
 	 * Will first clear a cycler if their reset time is up.
 	 */
-	bool zapme(const std::string& mask)
+	bool zapme(uint64_t key)
 	{
+		this->expire();
+
 		// Only check reset time and counter if they are already tracked as a cycler
-		std::map<std::string, Tracking>::iterator it = cycler.find(mask);
-		if (it == cycler.end())
+		Tracking* tracking = find(key);
+		if (!tracking || tracking->reset == 0)
 			return false;
 
-		const Tracking& tracking = it->second;
-
-		if (ServerInstance->Time() > tracking.reset)
-			cycler.erase(it);
-		else if (tracking.counter >= cycles)
+		bool zap = false;
+		if (ServerInstance->Time() <= tracking->reset && tracking->counter >= cycles)
 		{
-			blocked[mask] = ServerInstance->Time() + block;
-			cycler.erase(it);
-			return true;
+			tracking->blocked = ServerInstance->Time() + block;
+			zap = true;
 		}
 
-		return false;
+		if (zap || ServerInstance->Time() > tracking->reset)
+		{
+			tracking->reset = 0;
+			tracking->counter = 0;
+		}
+		return zap;
 	}
 
 	// Check if a joining user is blocked, clear them if blocktime is up
-	bool isblocked(const std::string& mask)
+	bool isblocked(uint64_t key)
 	{
-		std::map<std::string, time_t>::iterator it = blocked.find(mask);
-		if (it == blocked.end())
+		Tracking* tracking = find(key);
+		if (!tracking || tracking->blocked == 0)
 			return false;
 
-		if (ServerInstance->Time() > it->second)
-			blocked.erase(it);
+		if (ServerInstance->Time() > tracking->blocked)
+			tracking->blocked = 0;
 		else
 			return true;
 
 		return false;
 	}
 
-	void removeblock(const std::string& mask)
+	void removeblock(uint64_t key)
 	{
-		std::map<std::string, time_t>::iterator it = blocked.find(mask);
-		if (it != blocked.end())
-			blocked.erase(it);
+		Tracking* tracking = find(key);
+		if (tracking)
+			tracking->blocked = 0;
 	}
 
-	// Clear expired entries of non cyclers and blocked cyclers
-	void cleanup()
+	size_t size() const
 	{
-		// 10 minutes should be a reasonable wait time
-		if (ServerInstance->Time() - lastcleanup < 600)
-			return;
-
-		lastcleanup = ServerInstance->Time();
-
-		for (std::map<std::string, Tracking>::iterator it = cycler.begin(); it != cycler.end(); )
-		{
-			const Tracking& tracking = it->second;
-
-			if (ServerInstance->Time() > tracking.reset)
-				cycler.erase(it++);
-			else
-				++it;
-		}
+		return lru.size();
+	}
 
-		for (std::map<std::string, time_t>::iterator i = blocked.begin(); i != blocked.end(); )
-		{
-			if (ServerInstance->Time() > i->second)
-				blocked.erase(i++);
-			else
-				++i;
-		}
+	// Roughly how much memory the tracked cyclers are using
+	size_t memoryusage() const
+	{
+		const size_t listnode = sizeof(Tracking) + 2 * sizeof(void*);
+		const size_t mapnode = sizeof(TrackingMap::value_type) + sizeof(void*);
+		return (lru.size() * (listnode + mapnode)) + (tracked.bucket_count() * sizeof(void*));
 	}
 };
 
@@ -316,12 +358,47 @@ class ModuleJoinPartSpam : public Module
 	bool freeredirect;
 	JoinPartSpam jps;
 
+	// The tracking key of each user, until their ident or real host changes
+	SimpleExtItem<uint64_t> trackingkey;
+
+	// Hashes a user's ident@host into the key they are tracked by
+	uint64_t GetTrackingKey(User* user)
+	{
+		uint64_t* cached = trackingkey.get(user);
+		if (cached)
+			return *cached;
+
+		const std::string mask(user->ident + "@" + user->GetRealHost());
+
+		// FNV-1a
+		uint64_t hash = 14695981039346656037ULL;
+		for (std::string::const_iterator i = mask.begin(); i != mask.end(); ++i)
+		{
+			hash ^= static_cast<unsigned char>(*i);
+			hash *= 1099511628211ULL;
+		}
+
+		trackingkey.set(user, hash);
+		return hash;
+	}
+
  public:
 	ModuleJoinPartSpam()
 		: allowredirect(false)
 		, freeredirect(false)
 		, jps(this, allowredirect, freeredirect)
+		, trackingkey("joinpartspam-key", ExtensionItem::EXT_USER, this)
+	{
+	}
+
+	void OnChangeIdent(User* user, const std::string&) CXX11_OVERRIDE
 	{
+		trackingkey.unset(user);
+	}
+
+	void OnChangeRealHost(User* user, const std::string&) CXX11_OVERRIDE
+	{
+		trackingkey.unset(user);
 	}
 
 	void Prioritize() CXX11_OVERRIDE
@@ -344,9 +421,9 @@ class ModuleJoinPartSpam : public Module
 		if (!jpss)
 			return false;
 
-		const std::string& mask(user->MakeHost());
+		const uint64_t key = GetTrackingKey(user);
 
-		if (jpss->isblocked(mask))
+		if (jpss->isblocked(key))
 		{
 			if (quiet)
 				return true;
@@ -356,7 +433,7 @@ class ModuleJoinPartSpam : public Module
 
 			return true;
 		}
-		else if (jpss->zapme(mask))
+		else if (jpss->zapme(key))
 		{
 			if (quiet)
 				return true;
@@ -416,10 +493,7 @@ class ModuleJoinPartSpam : public Module
 
 		joinpartspamsettings* jpss = jps.ext.get(memb->chan);
 		if (jpss)
-		{
-			const std::string& mask(memb->user->MakeHost());
-			jpss->addcycle(mask);
-		}
+			jpss->addcycle(GetTrackingKey(memb->user));
 	}
 
 	// Remove a block on a user on a successful invite
@@ -432,8 +506,32 @@ class ModuleJoinPartSpam : public Module
 		if (!jpss)
 			return;
 
-		const std::string& mask(user->MakeHost());
-		jpss->removeblock(mask);
+		jpss->removeblock(GetTrackingKey(user));
+	}
+
+	ModResult OnStats(Stats::Context& stats) CXX11_OVERRIDE
+	{
+		if (stats.GetSymbol() != 'J')
+			return MOD_RES_PASSTHRU;
+
+		size_t channels = 0;
+		size_t entries = 0;
+		size_t bytes = 0;
+		const chan_hash& chans = ServerInstance->GetChans();
+		for (chan_hash::const_iterator iter = chans.begin(); iter != chans.end(); ++iter)
+		{
+			joinpartspamsettings* jpss = jps.ext.get(iter->second);
+			if (!jpss)
+				continue;
+
+			channels++;
+			entries += jpss->size();
+			bytes += jpss->memoryusage();
+		}
+
+		stats.AddRow(249, InspIRCd::Format("Tracking %lu cyclers on %lu channels using about %lu bytes",
+			static_cast<unsigned long>(entries), static_cast<unsigned long>(channels), static_cast<unsigned long>(bytes)));
+		return MOD_RES_DENY;
 	}
 
 	Version GetVersion() CXX11_OVERRIDE
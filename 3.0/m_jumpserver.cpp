@@ -20,6 +20,7 @@
 
 /// $ModAuthor: InspIRCd Developers
 /// $ModAuthorMail: noreply@inspircd.org
+/// $ModConfig: <jumpserverpool server="leaf.example.com" address="irc.example.com" port="6667" sslport="6697" weight="1" draining="no">
 /// $ModDepends: core 3
 /// $ModDesc: Provides support for the RPL_REDIR numeric and the /JUMPSERVER command.
 
@@ -33,6 +34,103 @@ enum
 	RPL_REDIR = 10
 };
 
+/** A server which users can be redirected to when the JUMPSERVER target is "*".
+ */
+struct PoolServer
+{
+	// The name of the server on the network.
+	std::string name;
+
+	// The address users are sent to.
+	std::string address;
+
+	int port;
+	int sslport;
+	unsigned long weight;
+	bool draining;
+
+	// Users redirected here who might not have shown up in its user count yet.
+	unsigned long pending;
+
+	// The user count of the server from the last time the server list was fetched.
+	unsigned long users;
+};
+
+/** Spreads redirected users over the configured pool of servers.
+ */
+class JumpServerPool
+{
+	std::vector<PoolServer> servers;
+
+ public:
+	void Clear()
+	{
+		servers.clear();
+	}
+
+	void Add(const PoolServer& server)
+	{
+		servers.push_back(server);
+	}
+
+	bool Empty() const
+	{
+		return servers.empty();
+	}
+
+	/** Fetches the current user counts from the linking protocol. This server and
+	 * servers which are not linked are left with a user count of ULONG_MAX so they
+	 * are skipped.
+	 */
+	void Update()
+	{
+		ProtocolInterface::ServerList linked;
+		ServerInstance->PI->GetServerList(linked);
+		for (std::vector<PoolServer>::iterator i = servers.begin(); i != servers.end(); ++i)
+		{
+			// Users are never sent back to the server they are leaving.
+			i->users = ULONG_MAX;
+			if (irc::equals(i->name, ServerInstance->Config->ServerName))
+				continue;
+
+			for (ProtocolInterface::ServerList::const_iterator j = linked.begin(); j != linked.end(); ++j)
+			{
+				if (irc::equals(i->name, j->servername))
+				{
+					i->users = j->usercount;
+					break;
+				}
+			}
+		}
+	}
+
+	/** Picks the linked server which is not draining with the fewest users for its weight. */
+	PoolServer* Select()
+	{
+		PoolServer* best = NULL;
+		for (std::vector<PoolServer>::iterator i = servers.begin(); i != servers.end(); ++i)
+		{
+			if (i->draining || i->users == ULONG_MAX)
+				continue;
+
+			// The user counts fit in 32 bits and weights are at most 1000 so this can't overflow.
+			if (!best || static_cast<unsigned long long>(i->users + i->pending) * best->weight < static_cast<unsigned long long>(best->users + best->pending) * i->weight)
+				best = &*i;
+		}
+
+		if (best)
+			best->pending++;
+		return best;
+	}
+
+	/** Forgets about older redirects as they will have reached the user counts by now. */
+	void Decay()
+	{
+		for (std::vector<PoolServer>::iterator i = servers.begin(); i != servers.end(); ++i)
+			i->pending /= 2;
+	}
+};
+
 /** Handle /JUMPSERVER
  */
 class CommandJumpserver : public Command
@@ -44,13 +142,14 @@ class CommandJumpserver : public Command
 	int port;
 	int sslport;
 	UserCertificateAPI sslapi;
+	JumpServerPool pool;
 
 	CommandJumpserver(Module* Creator)
 		: Command(Creator, "JUMPSERVER", 0, 4)
 		, sslapi(Creator)
 	{
 		flags_needed = 'o';
-		syntax = "[<server> <port>[:<sslport>] <+/-an> <reason>]";
+		syntax = "[<server>|* <port>[:<sslport>] <+/-an> <reason>]";
 		port = 0;
 		sslport = 0;
 		redirect_new_users = false;
@@ -119,21 +218,24 @@ class CommandJumpserver : public Command
 				return CMD_FAILURE;
 			}
 
+			if (parameters[0] == "*" && pool.Empty())
+			{
+				user->WriteNotice("*** There are no <jumpserverpool> servers configured");
+				return CMD_FAILURE;
+			}
+
 			if (redirect_all_immediately)
 			{
 				/* Redirect everyone but the oper sending the command */
+				pool.Update();
 				const UserManager::LocalList& list = ServerInstance->Users.GetLocalUsers();
 				for (UserManager::LocalList::const_iterator i = list.begin(); i != list.end(); )
 				{
 					// Quitting the user removes it from the list
 					LocalUser* t = *i;
 					++i;
-					if (!t->IsOper())
-					{
-						t->WriteNumeric(RPL_REDIR, parameters[0], GetPort(t), "Please use this Server/Port instead");
-						ServerInstance->Users->QuitUser(t, reason);
+					if (!t->IsOper() && Redirect(t, parameters[0]))
 						n_done++;
-					}
 				}
 				if (n_done)
 				{
@@ -152,13 +254,37 @@ class CommandJumpserver : public Command
 		return CMD_SUCCESS;
 	}
 
-	int GetPort(LocalUser* user)
+	int GetPort(LocalUser* user, const PoolServer* target = NULL)
 	{
-		int p = (sslapi && sslapi->GetCertificate(user) ? sslport : port);
+		bool ssl = sslapi && sslapi->GetCertificate(user);
+		int p = 0;
+		if (target)
+			p = (ssl ? target->sslport : target->port);
+		if (p == 0)
+			p = (ssl ? sslport : port);
 		if (p == 0)
 			p = user->server_sa.port();
 		return p;
 	}
+
+	/** Redirects a user to a server or to one from the pool if the server is *. */
+	bool Redirect(LocalUser* user, const std::string& server)
+	{
+		if (server != "*")
+		{
+			user->WriteNumeric(RPL_REDIR, server, GetPort(user), "Please use this Server/Port instead");
+			ServerInstance->Users->QuitUser(user, reason);
+			return true;
+		}
+
+		const PoolServer* target = pool.Select();
+		if (!target)
+			return false;
+
+		user->WriteNumeric(RPL_REDIR, target->address, GetPort(user, target), "Please use this Server/Port instead");
+		ServerInstance->Users->QuitUser(user, reason);
+		return true;
+	}
 };
 
 class ModuleJumpServer : public Module
@@ -179,19 +305,46 @@ class ModuleJumpServer : public Module
 	{
 		if (js.redirect_new_users)
 		{
-			int port = js.GetPort(user);
-			user->WriteNumeric(RPL_REDIR, js.redirect_to, port, "Please use this Server/Port instead");
-			ServerInstance->Users->QuitUser(user, js.reason);
-			return MOD_RES_DENY;
+			// If no pool server is available the user is let through instead.
+			if (js.redirect_to == "*")
+				js.pool.Update();
+			if (js.Redirect(user, js.redirect_to))
+				return MOD_RES_DENY;
 		}
 		return MOD_RES_PASSTHRU;
 	}
 
+	void OnBackgroundTimer(time_t) CXX11_OVERRIDE
+	{
+		js.pool.Decay();
+	}
+
 	void ReadConfig(ConfigStatus& status) CXX11_OVERRIDE
 	{
 		// Emergency way to unlock
 		if (!status.srcuser)
 			js.redirect_new_users = false;
+
+		js.pool.Clear();
+		ConfigTagList tags = ServerInstance->Config->ConfTags("jumpserverpool");
+		for (ConfigIter i = tags.first; i != tags.second; ++i)
+		{
+			ConfigTag* tag = i->second;
+
+			PoolServer server;
+			server.name = tag->getString("server");
+			if (server.name.empty())
+				throw ModuleException("<jumpserverpool:server> must be set, at " + tag->getTagLocation());
+
+			server.address = tag->getString("address", server.name);
+			server.port = tag->getUInt("port", 0, 0, 65535);
+			server.sslport = tag->getUInt("sslport", 0, 0, 65535);
+			server.weight = tag->getUInt("weight", 1, 1, 1000);
+			server.draining = tag->getBool("draining");
+			server.pending = 0;
+			server.users = ULONG_MAX;
+			js.pool.Add(server);
+		}
 	}
 
 	Version GetVersion() CXX11_OVERRIDE
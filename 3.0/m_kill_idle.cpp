@@ -36,6 +36,8 @@
 #include "inspircd.h"
 #include "modules/account.h"
 
+#include <queue>
+
 inline std::string* GetUserAccount(User* user)
 {
 	AccountExtItem* ext = GetAccountExtItem();
@@ -119,10 +121,23 @@ struct IdleProfile
 
 typedef std::map<std::string, IdleProfile> ProfileMap;
 
+// The idle profile of each connect class or NULL if it has none.
+typedef insp::flat_map<ConnectClass*, IdleProfile*> ClassProfileMap;
+
+// A local user and the time at which they should next be checked.
+typedef std::pair<time_t, std::string> IdleEntry;
+typedef std::priority_queue<IdleEntry, std::vector<IdleEntry>, std::greater<IdleEntry> > IdleQueue;
+
 class ModuleKillIdle
 	: public Module
 {
 	ProfileMap profiles;
+	ClassProfileMap classprofiles;
+	IdleQueue idlequeue;
+	bool queuebuilt;
+
+	// How often to check idle users who don't match their profile for other reasons.
+	static const time_t recheck = 60;
 
 	IdleProfile* GetProfile(LocalUser* user)
 	{
@@ -130,6 +145,11 @@ class ModuleKillIdle
 		if (!cls)
 			return NULL;
 
+		// Classes are bound to their profile the first time they are seen after a rehash.
+		std::pair<ClassProfileMap::iterator, bool> res = classprofiles.insert(std::make_pair(cls, static_cast<IdleProfile*>(NULL)));
+		if (!res.second)
+			return res.first->second;
+
 		std::string name = cls->config->getString("idleprofile");
 		if (name.empty())
 			return NULL;
@@ -138,10 +158,40 @@ class ModuleKillIdle
 		if (it == profiles.end())
 			return NULL;
 
+		res.first->second = &it->second;
 		return &it->second;
 	}
 
+	void Queue(LocalUser* user, time_t when)
+	{
+		idlequeue.push(std::make_pair(when, user->uuid));
+	}
+
+	void Queue(LocalUser* user)
+	{
+		IdleProfile* profile = GetProfile(user);
+		if (profile)
+			Queue(user, user->idle_lastmsg + profile->mintime);
+	}
+
+	void BuildQueue()
+	{
+		IdleQueue().swap(idlequeue);
+		const UserManager::LocalList& users = ServerInstance->Users.GetLocalUsers();
+		for (UserManager::LocalList::const_iterator it = users.begin(); it != users.end(); ++it)
+		{
+			if ((*it)->registered == REG_ALL)
+				Queue(*it);
+		}
+		queuebuilt = true;
+	}
+
  public:
+	ModuleKillIdle()
+		: queuebuilt(false)
+	{
+	}
+
 	void ReadConfig(ConfigStatus& status) CXX11_OVERRIDE
 	{
 		ConfigTagList tags = ServerInstance->Config->ConfTags("idleprofile");
@@ -173,19 +223,50 @@ class ModuleKillIdle
 				profile.away = IdleProfile::AWAY_NONE;
 		}
 		profiles.swap(newprofiles);
+
+		// The profiles and possibly the classes have changed so everyone needs to be looked at again.
+		classprofiles.clear();
+		queuebuilt = false;
+	}
+
+	void OnPostConnect(User* user) CXX11_OVERRIDE
+	{
+		LocalUser* lu = IS_LOCAL(user);
+		if (lu && queuebuilt)
+			Queue(lu);
 	}
 
 	void OnBackgroundTimer(time_t) CXX11_OVERRIDE
 	{
-		UserManager::LocalList users = ServerInstance->Users.GetLocalUsers();
-		for (UserManager::LocalList::const_iterator it = users.begin(); it != users.end();)
+		if (!queuebuilt)
+			BuildQueue();
+
+		const time_t now = ServerInstance->Time();
+		while (!idlequeue.empty() && idlequeue.top().first <= now)
 		{
-			// The iterator may be invalidated by QuitUser()
-			LocalUser* u = *it;
-			++it;
+			const IdleEntry top = idlequeue.top();
+			idlequeue.pop();
+
+			LocalUser* u = IS_LOCAL(ServerInstance->FindUUID(top.second));
+			if (!u || u->quitting)
+				continue;
+
 			IdleProfile* profile = GetProfile(u);
-			if (profile && profile->Matches(u))
+			if (!profile)
+				continue;
+
+			// The user has spoken since they were queued, put them back in the right place.
+			const time_t deadline = u->idle_lastmsg + profile->mintime;
+			if (deadline > now)
+			{
+				Queue(u, deadline);
+				continue;
+			}
+
+			if (profile->Matches(u))
 				ServerInstance->Users.QuitUser(u, profile->reason);
+			else
+				Queue(u, now + recheck);
 		}
 	}
 
@@ -19,11 +19,61 @@
 
 /// $ModAuthor: Sadie Powell
 /// $ModAuthorMail: sadie@witchery.services
+/// $ModConfig: <messagelength unit="bytes">
 /// $ModDesc: Adds a channel mode which limits the length of messages.
 /// $ModDepends: core 3
 
+/* Config descriptions:
+ * unit: what the maximum length counts, either bytes or codepoints. When
+ *       counting codepoints messages are cut at a UTF-8 character boundary.
+ *       Default: bytes
+ */
+
 #include "inspircd.h"
 
+namespace
+{
+/** Finds the offset at which a UTF-8 message has to be cut so that it has at
+ * most maxlength codepoints. Whole words are checked at a time: a codepoint
+ * starts at every byte which is not a continuation byte (10xxxxxx) so those
+ * are found with a mask and counted, and a pure ASCII word simply counts as
+ * eight. Only the word containing the cut is checked a byte at a time.
+ */
+size_t FindCodepointCut(const std::string& text, size_t maxlength)
+{
+	const char* data = text.data();
+	const size_t length = text.length();
+	const uint64_t highbits = 0x8080808080808080ULL;
+
+	size_t pos = 0;
+	size_t codepoints = 0;
+	for ( ; pos + sizeof(uint64_t) <= length; pos += sizeof(uint64_t))
+	{
+		uint64_t word;
+		memcpy(&word, data + pos, sizeof(word));
+
+		size_t starts = sizeof(uint64_t);
+		if (word & highbits)
+		{
+			// Set the high bit of every byte with the top two bits set to 10 and sum them.
+			const uint64_t continuation = word & ~(word << 1) & highbits;
+			starts -= static_cast<size_t>(((continuation >> 7) * 0x0101010101010101ULL) >> 56);
+		}
+
+		if (codepoints + starts > maxlength)
+			break;
+		codepoints += starts;
+	}
+
+	for ( ; pos < length; ++pos)
+	{
+		if ((data[pos] & 0xC0) != 0x80 && codepoints++ == maxlength)
+			return pos;
+	}
+	return length;
+}
+} // namespace
+
 class MessageLengthMode : public ParamMode<MessageLengthMode, LocalIntExt>
 {
  public:
@@ -55,13 +105,26 @@ class ModuleMessageLength : public Module
 {
  private:
 	MessageLengthMode mode;
+	bool codepoints;
 
  public:
 	ModuleMessageLength()
 		: mode(this)
+		, codepoints(false)
 	{
 	}
 
+	void ReadConfig(ConfigStatus&) CXX11_OVERRIDE
+	{
+		ConfigTag* tag = ServerInstance->Config->ConfValue("messagelength");
+
+		const std::string unit = tag->getString("unit", "bytes");
+		if (!stdalgo::string::equalsci(unit, "bytes") && !stdalgo::string::equalsci(unit, "codepoints"))
+			throw ModuleException("Invalid \"unit\" of '" + unit + "' in <messagelength>, must be bytes or codepoints.");
+
+		codepoints = stdalgo::string::equalsci(unit, "codepoints");
+	}
+
 	ModResult OnUserPreMessage(User* user, const MessageTarget& target, MessageDetails& details) CXX11_OVERRIDE
 	{
 		if (target.type != MessageTarget::TYPE_CHANNEL)
@@ -71,9 +134,12 @@ class ModuleMessageLength : public Module
 		if (!channel->IsModeSet(&mode))
 			return MOD_RES_PASSTHRU;
 
+		// A message can never have more codepoints than bytes.
 		unsigned int msglength = mode.ext.get(channel);
-		if (details.text.length() > msglength)
-			details.text.resize(msglength);
+		if (details.text.length() <= msglength)
+			return MOD_RES_PASSTHRU;
+
+		details.text.resize(codepoints ? FindCodepointCut(details.text, msglength) : msglength);
 
 		return MOD_RES_PASSTHRU;
 	}
@@ -58,6 +58,15 @@ class ModuleNamedStats : public Module
 		statsmap["geoip"] = 'G';
 		statsmap["svshold"] = 'S';
 		statsmap["socketengine"] = 'E';
+
+		// Statistics kept by contrib modules.
+		statsmap["galine"] = 'A';
+		statsmap["aline"] = 'a';
+		statsmap["nocreate"] = 'N';
+		statsmap["antirandom"] = 'r';
+		statsmap["unlinked"] = 'X';
+		statsmap["extbanregex"] = 'x';
+		statsmap["joinpartspam"] = 'J';
 	}
 
  public:
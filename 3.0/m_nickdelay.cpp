@@ -18,10 +18,14 @@
 
 /// $ModAuthor: Attila Molnar
 /// $ModAuthorMail: attilamolnar@hush.com
-/// $ModConfig: <nickdelay delay="10" hint="true">
+/// $ModConfig: <nickdelay delay="10" hint="true" maxfanout="0">
 /// $ModDepends: core 3
 /// $ModDesc: Enforces a delay between nick changes per user
 // If you want opers to be exempt, add the priv 'users/ignore-nickdelay' to their oper class.
+// If maxfanout is set then once local users' nick changes have been sent to
+// that many channel members in a second any more nick changes are refused.
+// Only changes which went through are counted and a single change counts for
+// at most a quarter of maxfanout, so one client can't use up the budget alone.
 
 
 #include "inspircd.h"
@@ -32,17 +36,48 @@ class ModuleNickDelay : public Module
 	unsigned int delay;
 	bool hint;
 
+	// The most channel members sent nick changes per second and how many have been this second.
+	unsigned long maxfanout;
+	unsigned long fanout;
+	time_t fanouttime;
+
+	static unsigned long GetFanout(User* user)
+	{
+		unsigned long members = 0;
+		for (User::ChanList::const_iterator i = user->chans.begin(); i != user->chans.end(); ++i)
+			members += (*i)->chan->GetUserCounter();
+		return members;
+	}
+
+	void ResetFanout()
+	{
+		if (fanouttime != ServerInstance->Time())
+		{
+			fanouttime = ServerInstance->Time();
+			fanout = 0;
+		}
+	}
+
  public:
 	ModuleNickDelay()
 		: lastchanged("nickdelay", ExtensionItem::EXT_USER, this)
+		, fanout(0)
+		, fanouttime(0)
 	{
 	}
 
 	void OnUserPostNick(User* user, const std::string& oldnick) CXX11_OVERRIDE
 	{
 		// Ignore remote users and nick changes to uuid
-		if ((IS_LOCAL(user)) && (user->nick != user->uuid))
-			lastchanged.set(user, ServerInstance->Time());
+		if ((!IS_LOCAL(user)) || (user->nick == user->uuid))
+			return;
+
+		lastchanged.set(user, ServerInstance->Time());
+		if (maxfanout && user->registered == REG_ALL)
+		{
+			ResetFanout();
+			fanout += std::min(GetFanout(user), std::max(maxfanout / 4, 1UL));
+		}
 	}
 
 	ModResult OnUserPreNick(LocalUser* user, const std::string& newnick) CXX11_OVERRIDE
@@ -69,6 +104,18 @@ class ModuleNickDelay : public Module
 			return MOD_RES_DENY;
 		}
 
+		// The change is only charged once it has gone through in OnUserPostNick.
+		if (maxfanout && user->registered == REG_ALL)
+		{
+			ResetFanout();
+			if (fanout >= maxfanout)
+			{
+				user->WriteNumeric(ERR_CANTCHANGENICK, user->nick,
+					"You cannot change your nickname (the server is busy, try again later)");
+				return MOD_RES_DENY;
+			}
+		}
+
 		return MOD_RES_PASSTHRU;
 	}
 
@@ -77,6 +124,7 @@ class ModuleNickDelay : public Module
 		ConfigTag* tag = ServerInstance->Config->ConfValue("nickdelay");
 		delay = tag->getUInt("delay", 10, 1);
 		hint = tag->getBool("hint", true);
+		maxfanout = tag->getUInt("maxfanout", 0);
 	}
 
 	Version GetVersion() CXX11_OVERRIDE
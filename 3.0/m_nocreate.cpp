@@ -58,19 +58,45 @@ class NoCreate : public XLine
 	bool unreg;
 	std::string mask;
 
+	// The parts of the mask, if it splits cleanly into nick!user@host.
+	bool split;
+	std::string nickpart;
+	std::string identpart;
+	std::string hostpart;
+
  public:
 	NoCreate(time_t _set_time, unsigned long _duration, const std::string& _source, const std::string& _reason, const std::string& _mask)
 		: XLine(_set_time, _duration, _source, _reason, "NOCREATE")
 		, unreg(false)
 		, mask(_mask)
+		, split(false)
 	{
 		if ((mask.length() > 2) && (mask[0] == 'U') && (mask[1] == ':'))
 			unreg = true;
+
+		// Nicks, idents and hosts can't contain '!' or '@' so matching each part on
+		// its own gives the same result as matching the whole mask.
+		const std::string::size_type start = unreg ? 2 : 0;
+		const std::string::size_type bang = mask.find('!', start);
+		const std::string::size_type at = mask.find('@', start);
+		if (bang != std::string::npos && at != std::string::npos && bang < at
+			&& mask.find('!', bang + 1) == std::string::npos && mask.find('@', at + 1) == std::string::npos)
+		{
+			split = true;
+			nickpart.assign(mask, start, bang - start);
+			identpart.assign(mask, bang + 1, at - bang - 1);
+			hostpart.assign(mask, at + 1, std::string::npos);
+		}
+	}
+
+	// Returns the host part of the mask or an empty string if the mask doesn't split.
+	const std::string& GetHostMask() const
+	{
+		return hostpart;
 	}
 
 	bool Matches(User* user) CXX11_OVERRIDE
 	{
-		const std::string match_mask = unreg ? mask.substr(2) : mask;
 		if (unreg)
 		{
 			const AccountExtItem* accountext = GetAccountExtItem();
@@ -79,6 +105,15 @@ class NoCreate : public XLine
 				return false;
 		}
 
+		if (split)
+		{
+			return (InspIRCd::Match(user->nick, nickpart) && InspIRCd::Match(user->ident, identpart) &&
+				(InspIRCd::Match(user->GetDisplayedHost(), hostpart) ||
+				InspIRCd::Match(user->GetRealHost(), hostpart) ||
+				InspIRCd::MatchCIDR(user->GetIPString(), hostpart)));
+		}
+
+		const std::string match_mask = unreg ? mask.substr(2) : mask;
 		return (InspIRCd::Match(user->GetFullHost(), match_mask) ||
 			InspIRCd::Match(user->GetFullRealHost(), match_mask) ||
 			InspIRCd::MatchCIDR(user->nick+"!"+user->ident+"@"+user->GetIPString(), match_mask));
@@ -103,6 +138,151 @@ class NoCreate : public XLine
 	}
 };
 
+// Finds the NOCREATE lines which might match a user without checking every
+// line. Lines with a literal host are looked up by host, lines on a CIDR
+// range by the range the user's IP falls in for each prefix length in use
+// and the rest are matched one at a time.
+class NoCreateIndex
+{
+	typedef std::vector<NoCreate*> LineList;
+	typedef TR1NS::unordered_map<std::string, LineList, irc::insensitive, irc::StrHashComp> HostMap;
+	typedef std::map<irc::sockets::cidr_mask, LineList> RangeMap;
+
+	// The number of ranges of each address family and prefix length.
+	typedef std::map<std::pair<unsigned char, unsigned char>, size_t> LengthMap;
+
+	HostMap hosts;
+	RangeMap ranges;
+	LengthMap lengths;
+	LineList others;
+
+	static bool IsLiteral(const std::string& hostmask)
+	{
+		return !hostmask.empty() && hostmask.find_first_of("*?/") == std::string::npos;
+	}
+
+	// Parses an IP/bits host mask, which can only match through MatchCIDR.
+	static bool GetRange(const std::string& hostmask, irc::sockets::cidr_mask& range)
+	{
+		const std::string::size_type slash = hostmask.find('/');
+		if (slash == std::string::npos || hostmask.find_first_of("*?") != std::string::npos)
+			return false;
+
+		irc::sockets::sockaddrs sa;
+		const std::string bits(hostmask, slash + 1);
+		if (!irc::sockets::aptosa(hostmask.substr(0, slash), 0, sa) || bits.empty() || bits.length() > 3
+			|| bits.find_first_not_of("0123456789") != std::string::npos)
+			return false;
+
+		const unsigned int length = ConvToNum<unsigned int>(bits);
+		if (length > (sa.family() == AF_INET6 ? 128U : 32U))
+			return false;
+
+		range = irc::sockets::cidr_mask(sa, length);
+		return true;
+	}
+
+	static NoCreate* MatchList(const LineList& lines, User* user)
+	{
+		for (LineList::const_iterator i = lines.begin(); i != lines.end(); ++i)
+		{
+			NoCreate* line = *i;
+			if ((!line->duration || ServerInstance->Time() <= line->expiry) && line->Matches(user))
+				return line;
+		}
+		return NULL;
+	}
+
+	NoCreate* MatchHost(const std::string& host, User* user)
+	{
+		HostMap::const_iterator it = hosts.find(host);
+		return it != hosts.end() ? MatchList(it->second, user) : NULL;
+	}
+
+	NoCreate* MatchRange(User* user)
+	{
+		for (LengthMap::const_iterator l = lengths.begin(); l != lengths.end(); ++l)
+		{
+			if (l->first.first != user->client_sa.family())
+				continue;
+
+			RangeMap::const_iterator it = ranges.find(irc::sockets::cidr_mask(user->client_sa, l->first.second));
+			NoCreate* line = (it != ranges.end() ? MatchList(it->second, user) : NULL);
+			if (line)
+				return line;
+		}
+		return NULL;
+	}
+
+ public:
+	void Add(NoCreate* line)
+	{
+		const std::string& hostmask = line->GetHostMask();
+		irc::sockets::cidr_mask range;
+		if (IsLiteral(hostmask))
+			hosts[hostmask].push_back(line);
+		else if (GetRange(hostmask, range))
+		{
+			ranges[range].push_back(line);
+			lengths[std::make_pair(range.type, range.length)]++;
+		}
+		else
+			others.push_back(line);
+	}
+
+	void Remove(NoCreate* line)
+	{
+		const std::string& hostmask = line->GetHostMask();
+		irc::sockets::cidr_mask range;
+		if (GetRange(hostmask, range))
+		{
+			RangeMap::iterator it = ranges.find(range);
+			if (it == ranges.end() || !stdalgo::vector::swaperase(it->second, line))
+				return;
+
+			if (it->second.empty())
+				ranges.erase(it);
+
+			LengthMap::iterator l = lengths.find(std::make_pair(range.type, range.length));
+			if (l != lengths.end() && !--l->second)
+				lengths.erase(l);
+			return;
+		}
+
+		if (!IsLiteral(hostmask))
+		{
+			stdalgo::vector::swaperase(others, line);
+			return;
+		}
+
+		HostMap::iterator it = hosts.find(hostmask);
+		if (it != hosts.end())
+		{
+			stdalgo::vector::swaperase(it->second, line);
+			if (it->second.empty())
+				hosts.erase(it);
+		}
+	}
+
+	NoCreate* Match(User* user)
+	{
+		const std::string& dhost = user->GetDisplayedHost();
+		const std::string& rhost = user->GetRealHost();
+		const std::string& ip = user->GetIPString();
+		NoCreate* line = MatchHost(dhost, user);
+		if (!line && rhost != dhost)
+			line = MatchHost(rhost, user);
+		if (!line && ip != dhost && ip != rhost)
+			line = MatchHost(ip, user);
+		if (!line)
+			line = MatchRange(user);
+		if (line)
+			return line;
+
+		return MatchList(others, user);
+	}
+};
+
 // A specialized XLineFactory for NOCREATE pointers
 class NoCreateFactory : public XLineFactory
 {
@@ -147,12 +327,29 @@ class CommandNoCreate : public Command
 		nick = mask.substr(0, n);
 		userhost = mask.substr(n+1);
 
+		// Idents and hosts can't contain '@' so if the mask only has one the
+		// parts can be matched separately without building ident@host.
+		std::string::size_type at = userhost.find('@');
+		const bool split = (at != std::string::npos && userhost.find('@', at + 1) == std::string::npos);
+		const std::string ident = split ? userhost.substr(0, at) : "";
+		const std::string host = split ? userhost.substr(at + 1) : "";
+
 		const user_hash& users = ServerInstance->Users->GetUsers();
 		for (user_hash::const_iterator u = users.begin(); u != users.end(); ++u)
 		{
-			if (InspIRCd::Match(u->second->nick, nick) &&
-			   (InspIRCd::Match(u->second->MakeHost(), userhost, ascii_case_insensitive_map) ||
-			   InspIRCd::MatchCIDR(u->second->MakeHostIP(), userhost, ascii_case_insensitive_map)))
+			User* target = u->second;
+			if (!InspIRCd::Match(target->nick, nick))
+				continue;
+
+			if (split)
+			{
+				if (InspIRCd::Match(target->ident, ident, ascii_case_insensitive_map) &&
+				   (InspIRCd::Match(target->GetRealHost(), host, ascii_case_insensitive_map) ||
+				   InspIRCd::MatchCIDR(target->GetIPString(), host, ascii_case_insensitive_map)))
+					matches++;
+			}
+			else if (InspIRCd::Match(target->MakeHost(), userhost, ascii_case_insensitive_map) ||
+			   InspIRCd::MatchCIDR(target->MakeHostIP(), userhost, ascii_case_insensitive_map))
 			{
 				matches++;
 			}
@@ -270,6 +467,7 @@ class ModuleNoCreate : public Module, public Stats::EventListener
 {
 	CommandNoCreate cmd;
 	NoCreateFactory factory;
+	NoCreateIndex index;
 	bool telluser;
 	bool noisy;
 	std::string default_reason;
@@ -321,7 +519,7 @@ class ModuleNoCreate : public Module, public Stats::EventListener
 		if (user->IsOper() || user->exempt)
 			return MOD_RES_PASSTHRU;
 
-		XLine* nc = ServerInstance->XLines->MatchesLine("NOCREATE", user);
+		XLine* nc = index.Match(user);
 		if (!nc)
 			return MOD_RES_PASSTHRU;
 
@@ -338,6 +536,23 @@ class ModuleNoCreate : public Module, public Stats::EventListener
 		return MOD_RES_DENY;
 	}
 
+	void OnAddLine(User*, XLine* line) CXX11_OVERRIDE
+	{
+		if (line->type == "NOCREATE")
+			index.Add(static_cast<NoCreate*>(line));
+	}
+
+	void OnDelLine(User*, XLine* line) CXX11_OVERRIDE
+	{
+		if (line->type == "NOCREATE")
+			index.Remove(static_cast<NoCreate*>(line));
+	}
+
+	void OnExpireLine(XLine* line) CXX11_OVERRIDE
+	{
+		OnDelLine(NULL, line);
+	}
+
 	Version GetVersion() CXX11_OVERRIDE
 	{
 		return Version("Gives /nocreate, an X-line to block users from creating new channels");
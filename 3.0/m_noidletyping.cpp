@@ -20,18 +20,80 @@
 /// $ModAuthorMail: sadie@witchery.services
 /// $ModDepends: core 3
 /// $ModDesc: Prevents typing notifications from being sent to idle users.
+/// $ModConfig: <noidletyping duration="10m" coalesce="3">
 
 
 #include "inspircd.h"
 #include "modules/ctctags.h"
 
+#include <queue>
+
 class ModuleNoIdleTyping
 	: public Module
 	, public CTCTags::EventListener
+	, public Timer
 {
  private:
+	// When a local user will become idle if they don't send a message before then.
+	typedef std::pair<time_t, std::string> Deadline;
+	typedef std::priority_queue<Deadline, std::vector<Deadline>, std::greater<Deadline> > DeadlineQueue;
+
+	// The last typing state a local user sent to a target.
+	struct TypingState
+	{
+		std::string state;
+		time_t sent;
+	};
+
+	// The typing states of a local user by channel name or user UUID.
+	typedef insp::flat_map<std::string, TypingState> TypingStates;
+
 	unsigned long duration;
 
+	// How long a repeated typing state is dropped for.
+	unsigned long coalesce;
+
+	// The typing states which have been forwarded for each local user.
+	SimpleExtItem<TypingStates> typingstates;
+
+	// Local users who are not idle yet, by when they will be.
+	DeadlineQueue deadlines;
+
+	// Whether a local user has been marked as idle.
+	LocalIntExt idle;
+
+	// The idle local members of each channel.
+	SimpleExtItem<CUList> idlemembers;
+
+	// Determines whether a typing notification repeats the last one sent to the same target.
+	bool IsRepeat(LocalUser* source, const std::string& target, const std::string& state)
+	{
+		TypingStates* states = typingstates.get(source);
+		if (!states)
+		{
+			states = new TypingStates;
+			typingstates.set(source, states);
+		}
+
+		const time_t now = ServerInstance->Time();
+		TypingState& last = (*states)[target];
+		if (last.state == state && last.sent + static_cast<time_t>(coalesce) > now)
+			return true;
+
+		last.state = state;
+		last.sent = now;
+
+		// Forget about the targets which would not be coalesced any more.
+		for (TypingStates::iterator iter = states->begin(); iter != states->end(); )
+		{
+			if (iter->second.sent + static_cast<time_t>(coalesce) <= now)
+				iter = states->erase(iter);
+			else
+				++iter;
+		}
+		return false;
+	}
+
 	bool IsIdle(User* source)
 	{
 		LocalUser* lsource = IS_LOCAL(source);
@@ -45,27 +107,154 @@ class ModuleNoIdleTyping
 		return diff > duration;
 	}
 
-	ModResult BuildChannelExempts(User* source, Channel* channel, CTCTags::TagMessageDetails& details)
+	void Watch(LocalUser* user)
+	{
+		deadlines.push(std::make_pair(static_cast<time_t>(user->idle_lastmsg + duration + 1), user->uuid));
+	}
+
+	void AddIdleMember(Channel* chan, User* user)
 	{
-		const Channel::MemberMap& members = channel->GetUsers();
-		for (Channel::MemberMap::const_iterator member = members.begin(); member != members.end(); ++member)
+		CUList* members = idlemembers.get(chan);
+		if (!members)
 		{
-			if (IsIdle(source))
-				details.exemptions.insert(member->first);
+			members = new CUList;
+			idlemembers.set(chan, members);
 		}
+		members->insert(user);
+	}
+
+	void RemoveIdleMember(Channel* chan, User* user)
+	{
+		CUList* members = idlemembers.get(chan);
+		if (!members)
+			return;
+
+		members->erase(user);
+		if (members->empty())
+			idlemembers.unset(chan);
+	}
+
+	void MarkIdle(LocalUser* user)
+	{
+		idle.set(user, 1);
+		for (User::ChanList::iterator i = user->chans.begin(); i != user->chans.end(); ++i)
+			AddIdleMember((*i)->chan, user);
+	}
+
+	void MarkActive(LocalUser* user)
+	{
+		idle.set(user, 0);
+		for (User::ChanList::iterator i = user->chans.begin(); i != user->chans.end(); ++i)
+			RemoveIdleMember((*i)->chan, user);
+	}
+
+	ModResult BuildChannelExempts(User* source, Channel* channel, CTCTags::TagMessageDetails& details)
+	{
+		const CUList* members = idlemembers.get(channel);
+		if (members)
+			details.exemptions.insert(members->begin(), members->end());
 		return MOD_RES_PASSTHRU;
 	}
 
  public:
 	ModuleNoIdleTyping()
 		: CTCTags::EventListener(this, 200)
+		, Timer(5, true)
+		, typingstates("noidletyping-states", ExtensionItem::EXT_USER, this)
+		, idle("noidletyping-idle", ExtensionItem::EXT_USER, this)
+		, idlemembers("noidletyping-members", ExtensionItem::EXT_CHANNEL, this)
 	{
 	}
 
+	void init() CXX11_OVERRIDE
+	{
+		ServerInstance->Timers.AddTimer(this);
+	}
+
 	void ReadConfig(ConfigStatus&) CXX11_OVERRIDE
 	{
 		ConfigTag* tag = ServerInstance->Config->ConfValue("noidletyping");
 		duration = tag->getDuration("duration", 60*10, 60);
+
+		// Clients repeat the active state every few seconds and receivers forget it
+		// after six so this has to be shorter than that.
+		coalesce = tag->getDuration("coalesce", 3, 0, 5);
+
+		// Work out who is idle from scratch as the duration may have changed.
+		deadlines = DeadlineQueue();
+		const UserManager::LocalList& users = ServerInstance->Users.GetLocalUsers();
+		for (UserManager::LocalList::const_iterator iter = users.begin(); iter != users.end(); ++iter)
+		{
+			LocalUser* user = *iter;
+			if (user->registered != REG_ALL)
+				continue;
+
+			if (!IsIdle(user))
+			{
+				if (idle.get(user))
+					MarkActive(user);
+				Watch(user);
+			}
+			else if (!idle.get(user))
+			{
+				MarkIdle(user);
+			}
+		}
+	}
+
+	bool Tick(time_t now) CXX11_OVERRIDE
+	{
+		while (!deadlines.empty() && deadlines.top().first <= now)
+		{
+			LocalUser* user = IS_LOCAL(ServerInstance->FindUUID(deadlines.top().second));
+			deadlines.pop();
+			if (!user || idle.get(user))
+				continue;
+
+			// The user might have sent a message since they were queued.
+			if (IsIdle(user))
+				MarkIdle(user);
+			else
+				Watch(user);
+		}
+		return true;
+	}
+
+	void OnUserConnect(LocalUser* user) CXX11_OVERRIDE
+	{
+		Watch(user);
+	}
+
+	void OnUserPostMessage(User* user, const MessageTarget&, const MessageDetails&) CXX11_OVERRIDE
+	{
+		LocalUser* luser = IS_LOCAL(user);
+		if (!luser || !idle.get(luser))
+			return;
+
+		MarkActive(luser);
+		Watch(luser);
+	}
+
+	void OnUserJoin(Membership* memb, bool, bool, CUList&) CXX11_OVERRIDE
+	{
+		if (IS_LOCAL(memb->user) && idle.get(memb->user))
+			AddIdleMember(memb->chan, memb->user);
+	}
+
+	void OnUserPart(Membership* memb, std::string&, CUList&) CXX11_OVERRIDE
+	{
+		RemoveIdleMember(memb->chan, memb->user);
+	}
+
+	void OnUserKick(User*, Membership* memb, const std::string&, CUList&) CXX11_OVERRIDE
+	{
+		RemoveIdleMember(memb->chan, memb->user);
+	}
+
+	void OnUserQuit(User* user, const std::string&, const std::string&) CXX11_OVERRIDE
+	{
+		for (User::ChanList::iterator i = user->chans.begin(); i != user->chans.end(); ++i)
+			RemoveIdleMember((*i)->chan, user);
 	}
 
 	ModResult OnUserPreTagMessage(User* user, const MessageTarget& target, CTCTags::TagMessageDetails& details) CXX11_OVERRIDE
@@ -74,6 +263,20 @@ class ModuleNoIdleTyping
 		if (iter == details.tags_out.end())
 			return MOD_RES_PASSTHRU;
 
+		// Drop repeated states which only carry the typing tag before they reach anyone.
+		LocalUser* lsource = IS_LOCAL(user);
+		if (coalesce && lsource && details.tags_out.size() == 1)
+		{
+			const std::string* targetname = NULL;
+			if (target.type == MessageTarget::TYPE_CHANNEL)
+				targetname = &target.Get<Channel>()->name;
+			else if (target.type == MessageTarget::TYPE_USER)
+				targetname = &target.Get<User>()->uuid;
+
+			if (targetname && IsRepeat(lsource, *targetname, iter->second.value))
+				return MOD_RES_DENY;
+		}
+
 		switch (target.type)
 		{
 			case MessageTarget::TYPE_CHANNEL:
@@ -94,4 +297,3 @@ class ModuleNoIdleTyping
 };
 
 MODULE_INIT(ModuleNoIdleTyping)
-
@@ -28,10 +28,51 @@ class ModuleOpModerated : public Module
 	SimpleChannelModeHandler opmod;
 	CheckExemption::EventProvider exemptionprov;
 
+	// The members of a +U channel below op level. This is built when it is first
+	// needed and then kept up to date as members join, leave and change status.
+	SimpleExtItem<CUList> unprivileged;
+
+	CUList* GetUnprivileged(Channel* chan)
+	{
+		CUList* users = unprivileged.get(chan);
+		if (users)
+			return users;
+
+		users = new CUList;
+		const Channel::MemberMap& members = chan->GetUsers();
+		for (Channel::MemberMap::const_iterator i = members.begin(); i != members.end(); ++i)
+		{
+			if (i->second->getRank() < OP_VALUE)
+				users->insert(i->first);
+		}
+		unprivileged.set(chan, users);
+		return users;
+	}
+
+	void UpdateMember(Membership* memb)
+	{
+		CUList* users = unprivileged.get(memb->chan);
+		if (!users)
+			return;
+
+		if (memb->getRank() < OP_VALUE)
+			users->insert(memb->user);
+		else
+			users->erase(memb->user);
+	}
+
+	void RemoveMember(Membership* memb)
+	{
+		CUList* users = unprivileged.get(memb->chan);
+		if (users)
+			users->erase(memb->user);
+	}
+
  public:
 	ModuleOpModerated()
 		: opmod(this, "opmoderated", 'U')
 		, exemptionprov(this)
+		, unprivileged("opmoderated-unprivileged", ExtensionItem::EXT_CHANNEL, this)
 	{
 	}
 
@@ -59,17 +100,59 @@ class ModuleOpModerated : public Module
 		if (!chan->GetExtBanStatus(user, 'u').check(!chan->IsModeSet(&opmod)) && chan->GetPrefixValue(user) < VOICE_VALUE)
 		{
 			// Add any unprivileged users to the exemption list.
-			const Channel::MemberMap& users = chan->GetUsers();
-			for (Channel::MemberMap::const_iterator i = users.begin(); i != users.end(); ++i)
-			{
-				if (i->second->getRank() < OP_VALUE)
-					details.exemptions.insert(i->first);
-			}
+			const CUList* users = GetUnprivileged(chan);
+			details.exemptions.insert(users->begin(), users->end());
 		}
 
 		return MOD_RES_PASSTHRU;
 	}
 
+	void OnUserJoin(Membership* memb, bool, bool, CUList&) CXX11_OVERRIDE
+	{
+		UpdateMember(memb);
+	}
+
+	void OnUserPart(Membership* memb, std::string&, CUList&) CXX11_OVERRIDE
+	{
+		RemoveMember(memb);
+	}
+
+	void OnUserKick(User*, Membership* memb, const std::string&, CUList&) CXX11_OVERRIDE
+	{
+		RemoveMember(memb);
+	}
+
+	void OnUserQuit(User* user, const std::string&, const std::string&) CXX11_OVERRIDE
+	{
+		for (User::ChanList::iterator i = user->chans.begin(); i != user->chans.end(); ++i)
+			RemoveMember(*i);
+	}
+
+	void OnMode(User*, User*, Channel* chan, const Modes::ChangeList& changelist, ModeParser::ModeProcessFlag) CXX11_OVERRIDE
+	{
+		if (!chan)
+			return;
+
+		const Modes::ChangeList::List& list = changelist.getlist();
+		for (Modes::ChangeList::List::const_iterator i = list.begin(); i != list.end(); ++i)
+		{
+			if (i->mh == &opmod && !i->adding)
+			{
+				// Nothing needs to be tracked once the channel is no longer +U.
+				unprivileged.unset(chan);
+				return;
+			}
+
+			if (!i->mh->IsPrefixMode())
+				continue;
+
+			User* target = ServerInstance->FindNick(i->param);
+			Membership* memb = target ? chan->GetUser(target) : NULL;
+			if (memb)
+				UpdateMember(memb);
+		}
+	}
+
 	void On005Numeric(std::map<std::string, std::string>& tokens) CXX11_OVERRIDE
 	{
 		tokens["EXTBAN"].push_back('u');
@@ -107,16 +107,90 @@ private:
 	ChanModeReference privatemode;
 	ChanModeReference secretmode;
 
-	std::string FormatPixel(bool dark)
+	typedef std::vector<std::string> RenderedCode;
+
+	// The most QR codes which are kept rendered.
+	static const size_t maxcached = 100;
+
+	// Codes which have been rendered by URL and the order they were rendered in.
+	std::map<std::string, RenderedCode> cache;
+	std::deque<std::string> cacheorder;
+
+	// Appends a run of identical pixels with a single colour code.
+	void AppendPixels(std::string& buffer, bool dark, size_t count)
 	{
-		std::string buffer;
-		buffer.append("\x3");
-		buffer.append(dark ? darkcolour : lightcolour);
-		buffer.append(",");
-		buffer.append(dark ? darkcolour : lightcolour);
-		buffer.append(blockchar);
-		buffer.append(blockchar);
-		return buffer;
+		buffer.append(dark ? darkcode : lightcode);
+		for (size_t i = 0; i < count; ++i)
+			buffer.append(pixel);
+	}
+
+	void Render(const QRCode& code, RenderedCode& lines)
+	{
+		const size_t size = code.GetSize();
+
+		std::string border;
+		AppendPixels(border, false, size + 2);
+		lines.push_back(border);
+
+		for (size_t y = 0; y < size; ++y)
+		{
+			std::string row;
+			bool dark = false;
+			size_t run = 1; // The left border.
+			for (size_t x = 0; x < size; ++x)
+			{
+				if (code.GetPixel(x, y) == dark)
+				{
+					run++;
+					continue;
+				}
+
+				AppendPixels(row, dark, run);
+				dark = !dark;
+				run = 1;
+			}
+
+			// The right border is light so it can join a trailing light run.
+			if (dark)
+			{
+				AppendPixels(row, true, run);
+				run = 0;
+			}
+			AppendPixels(row, false, run + 1);
+			lines.push_back(row);
+		}
+
+		lines.push_back(border);
+	}
+
+	// Retrieves the rendered lines of the QR code for a URL.
+	const RenderedCode* GetCode(LocalUser* source, const std::string& url)
+	{
+		std::map<std::string, RenderedCode>::const_iterator iter = cache.find(url);
+		if (iter != cache.end())
+			return &iter->second;
+
+		// Encoding is much more expensive than sending a cached code so charge the source for it.
+		if (!source->HasPrivPermission("users/flood/no-fakelag"))
+			source->CommandFloodPenalty += 2000;
+
+		QRCode code(url);
+		if (code.GetError())
+		{
+			source->WriteNotice(InspIRCd::Format("QR generation failed: %s", strerror(code.GetError())));
+			return NULL;
+		}
+
+		if (cacheorder.size() >= maxcached)
+		{
+			cache.erase(cacheorder.front());
+			cacheorder.pop_front();
+		}
+
+		RenderedCode& lines = cache[url];
+		Render(code, lines);
+		cacheorder.push_back(url);
+		return &lines;
 	}
 
 	std::string URLEncode(const std::string& data)
@@ -146,9 +220,23 @@ private:
 	}
 
  public:
-	std::string blockchar;
-	std::string darkcolour;
-	std::string lightcolour;
+	// The colour codes which start a run of dark or light pixels.
+	std::string darkcode;
+	std::string lightcode;
+
+	// The text of a single pixel.
+	std::string pixel;
+
+	void SetFormat(const std::string& blockchar, const std::string& darkcolour, const std::string& lightcolour)
+	{
+		darkcode = "\x3" + darkcolour + "," + darkcolour;
+		lightcode = "\x3" + lightcolour + "," + lightcolour;
+		pixel = blockchar + blockchar;
+
+		// The cached codes were rendered with the old format.
+		cache.clear();
+		cacheorder.clear();
+	}
 
 	CommandQRCode(Module* Creator)
 		: SplitCommand(Creator, "QRCODE", 0, 1)
@@ -196,12 +284,9 @@ private:
 		url.insert(0, source->server_sa.str());
 		url.insert(0, SSLIOHook::IsSSL(&source->eh) ? "ircs://" : "irc://");
 
-		QRCode code(url);
-		if (code.GetError())
-		{
-			source->WriteNotice(InspIRCd::Format("QR generation failed: %s", strerror(code.GetError())));
+		const RenderedCode* lines = GetCode(source, url);
+		if (!lines)
 			return CMD_FAILURE;
-		}
 
 		// Give a friendly message to tell the user what to do with this code.
 		if (parameters.empty())
@@ -210,22 +295,9 @@ private:
 			WriteMessage(source, "Use this QR code to connect to " + ServerInstance->Config->Network + " and chat with " + parameters[0] + ":");
 
 
-		// Format the QR code and send it to the user.
-		std::string border;
-		for (size_t c = 0; c < code.GetSize() + 2; ++c)
-			border.append(FormatPixel(false)); 
-
-		WriteMessage(source, border);
-		for (size_t y = 0; y < code.GetSize(); ++y)
-		{
-			std::string row(FormatPixel(false));
-			for (size_t x = 0; x < code.GetSize(); ++x)
-				row.append(FormatPixel(code.GetPixel(x, y)));
-			row.append(FormatPixel(false));
-
-			WriteMessage(source, row);
-		}
-		WriteMessage(source, border);
+		// Send the QR code to the user.
+		for (RenderedCode::const_iterator iter = lines->begin(); iter != lines->end(); ++iter)
+			WriteMessage(source, *iter);
 
 		return CMD_SUCCESS;
 	}
@@ -319,9 +391,7 @@ class ModuleQRCode : public Module
 		std::string lightcolour = GetColourCode(tag, "lightcolour", "white");
 
 		// Store the values in the command handler.
-		cmd.blockchar.swap(blockchar);
-		cmd.darkcolour.swap(darkcolour);
-		cmd.lightcolour.swap(lightcolour);
+		cmd.SetFormat(blockchar, darkcolour, lightcolour);
 	}
 
 	Version GetVersion() CXX11_OVERRIDE
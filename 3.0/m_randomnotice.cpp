@@ -23,23 +23,106 @@
 
 /// $ModAuthor: genius3000
 /// $ModAuthorMail: genius3000@g3k.solutions
-/// $ModConfig: <randomnotice file="randomnotices.txt" interval="30m" prefix="" suffix="">
+/// $ModConfig: <randomnotice file="randomnotices.txt" interval="30m" window="0" prefix="" suffix="">
 /// $ModDepends: core 3
 /// $ModDesc: Send a random notice (quote) from a file to all users at a set interval.
 // "file" needs to be a text file with each 'notice' on a new line
 // "interval" is a time-string (1y7d8h6m3s format)
+// "window" is a time-string to spread sending each notice over, by default it is sent to everyone at once
 
 
 #include "inspircd.h"
 
+/** Sends a notice to the local users a slice at a time over a window so that
+ * the writes are spread out instead of all happening in one go.
+ */
+class NoticeBroadcast : public Timer
+{
+ private:
+	// The message is kept between ticks so it is only serialised once.
+	ClientProtocol::Messages::Privmsg* msg;
+	ClientProtocol::Event* msgevent;
+
+	// The users who have not been sent the notice yet.
+	std::deque<std::string> pending;
+
+	// When the notice should have been sent to everyone.
+	time_t finish;
+
+	void Clear()
+	{
+		delete msgevent;
+		delete msg;
+		msgevent = NULL;
+		msg = NULL;
+		pending.clear();
+	}
+
+	void SendSlice(time_t now)
+	{
+		const time_t left = std::max<time_t>(finish - now, 1);
+		for (size_t count = (pending.size() + left - 1) / left; count && !pending.empty(); --count)
+		{
+			LocalUser* user = IS_LOCAL(ServerInstance->FindUUID(pending.front()));
+			if (user && !user->quitting)
+				user->Send(*msgevent);
+			pending.pop_front();
+		}
+
+		if (pending.empty())
+			Clear();
+	}
+
+ public:
+	NoticeBroadcast()
+		: Timer(1, true)
+		, msg(NULL)
+		, msgevent(NULL)
+		, finish(0)
+	{
+	}
+
+	~NoticeBroadcast()
+	{
+		Clear();
+	}
+
+	void Start(const std::string& text, unsigned long window)
+	{
+		Clear();
+		msg = new ClientProtocol::Messages::Privmsg(ServerInstance->FakeClient, ServerInstance->Config->ServerName, text, MSG_NOTICE);
+		msgevent = new ClientProtocol::Event(ServerInstance->GetRFCEvents().privmsg, *msg);
+
+		for (UserManager::LocalList::const_iterator i = ServerInstance->Users.GetLocalUsers().begin(); i != ServerInstance->Users.GetLocalUsers().end(); ++i)
+		{
+			LocalUser* user = *i;
+
+			if (user->registered == REG_ALL)
+				pending.push_back(user->uuid);
+		}
+
+		finish = ServerInstance->Time() + window;
+		SendSlice(ServerInstance->Time());
+	}
+
+	bool Tick(time_t now) CXX11_OVERRIDE
+	{
+		if (!pending.empty())
+			SendSlice(now);
+		return true;
+	}
+};
+
 class RandomNoticeTimer : public Timer
 {
  public:
 	std::vector<std::string> notices;
 	std::string prefix;
 	std::string suffix;
+	unsigned long window;
+	NoticeBroadcast broadcast;
 
-	RandomNoticeTimer() : Timer(1800, true) { }
+	RandomNoticeTimer() : Timer(1800, true), window(0) { }
 
 	bool Tick(time_t) CXX11_OVERRIDE
 	{
@@ -49,14 +132,8 @@ class RandomNoticeTimer : public Timer
 		unsigned long random = ServerInstance->GenRandomInt(notices.size());
 		const std::string& notice = notices[random];
 
-		for (UserManager::LocalList::const_iterator i = ServerInstance->Users.GetLocalUsers().begin(); i != ServerInstance->Users.GetLocalUsers().end(); ++i)
-		{
-			LocalUser* user = *i;
-
-			if (user->registered == REG_ALL)
-				user->WriteNotice(prefix + notice + suffix);
-		}
-
+		// The message is serialised once for each kind of client rather than once per user.
+		broadcast.Start(prefix + notice + suffix, window);
 		return true;
 	}
 };
@@ -73,12 +150,14 @@ class ModuleRandomNotice : public Module
 
 	~ModuleRandomNotice()
 	{
+		ServerInstance->Timers.DelTimer(&timer->broadcast);
 		ServerInstance->Timers.DelTimer(timer);
 	}
 
 	void init() CXX11_OVERRIDE
 	{
 		ServerInstance->Timers.AddTimer(timer);
+		ServerInstance->Timers.AddTimer(&timer->broadcast);
 	}
 
 	void ReadConfig(ConfigStatus&) CXX11_OVERRIDE
@@ -92,6 +171,9 @@ class ModuleRandomNotice : public Module
 		if (timer->GetInterval() != interval)
 			timer->SetInterval(interval);
 
+		// A notice must be sent to everyone before the next one starts.
+		timer->window = tag->getDuration("window", 0, 0, interval);
+
 		if (timer->notices.empty())
 			throw ModuleException("Random Notices file is empty!! Please add quotes to the file.");
 	}
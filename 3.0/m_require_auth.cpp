@@ -68,13 +68,23 @@ class GALine : public XLine
 			type.c_str(), identmask.c_str(), hostmask.c_str(), source.c_str(), InspIRCd::DurationString(ServerInstance->Time() - this->set_time).c_str(), reason.c_str());
 	}
 
-	bool Matches(User* u) CXX11_OVERRIDE
+	const std::string& GetHostMask() const
+	{
+		return hostmask;
+	}
+
+	bool MatchesIdent(User* u)
 	{
 		LocalUser* lu = IS_LOCAL(u);
 		if (lu && lu->exempt)
 			return false;
 
-		if (InspIRCd::Match(u->ident, this->identmask, ascii_case_insensitive_map))
+		return InspIRCd::Match(u->ident, this->identmask, ascii_case_insensitive_map);
+	}
+
+	bool Matches(User* u) CXX11_OVERRIDE
+	{
+		if (MatchesIdent(u))
 		{
 			if (InspIRCd::MatchCIDR(u->GetRealHost(), this->hostmask, ascii_case_insensitive_map) || InspIRCd::MatchCIDR(u->GetIPString(), this->hostmask, ascii_case_insensitive_map))
 			{
@@ -108,6 +118,159 @@ class ALine : public GALine
 	}
 };
 
+/** Indexes the lines of one type so that a connecting user can be checked
+ * without matching every line. Lines on a literal host or IP address are
+ * looked up by it, lines on a CIDR range are looked up by the range the
+ * user's IP falls in for each prefix length in use and the rest are matched
+ * one by one.
+ */
+class GALineIndex
+{
+	typedef std::vector<GALine*> LineList;
+	typedef TR1NS::unordered_map<std::string, LineList, irc::insensitive, irc::StrHashComp> HostMap;
+	typedef std::map<irc::sockets::cidr_mask, LineList> RangeMap;
+
+	// The number of ranges of each address family and prefix length.
+	typedef std::map<std::pair<unsigned char, unsigned char>, size_t> LengthMap;
+
+	HostMap hosts;
+	RangeMap ranges;
+	LengthMap lengths;
+	LineList globs;
+
+	static bool IsLiteral(const std::string& hostmask)
+	{
+		return !hostmask.empty() && hostmask.find_first_of("*?/") == std::string::npos;
+	}
+
+	// Parses an IP/bits hostmask, which is the only kind of mask the
+	// CIDR half of InspIRCd::MatchCIDR can match.
+	static bool GetRange(const std::string& hostmask, irc::sockets::cidr_mask& range)
+	{
+		const std::string::size_type slash = hostmask.find('/');
+		if (slash == std::string::npos || hostmask.find_first_of("*?") != std::string::npos)
+			return false;
+
+		irc::sockets::sockaddrs sa;
+		const std::string bits(hostmask, slash + 1);
+		if (!irc::sockets::aptosa(hostmask.substr(0, slash), 0, sa) || bits.empty() || bits.length() > 3
+			|| bits.find_first_not_of("0123456789") != std::string::npos)
+			return false;
+
+		const unsigned int length = ConvToNum<unsigned int>(bits);
+		if (length > (sa.family() == AF_INET6 ? 128U : 32U))
+			return false;
+
+		range = irc::sockets::cidr_mask(sa, length);
+		return true;
+	}
+
+	static bool IsActive(GALine* line)
+	{
+		return !line->duration || ServerInstance->Time() <= line->expiry;
+	}
+
+	GALine* MatchHost(const std::string& host, User* user)
+	{
+		HostMap::iterator it = hosts.find(host);
+		if (it == hosts.end())
+			return NULL;
+
+		for (LineList::iterator i = it->second.begin(); i != it->second.end(); ++i)
+		{
+			if (IsActive(*i) && (*i)->MatchesIdent(user))
+				return *i;
+		}
+		return NULL;
+	}
+
+	GALine* MatchRange(User* user)
+	{
+		for (LengthMap::const_iterator l = lengths.begin(); l != lengths.end(); ++l)
+		{
+			if (l->first.first != user->client_sa.family())
+				continue;
+
+			RangeMap::iterator it = ranges.find(irc::sockets::cidr_mask(user->client_sa, l->first.second));
+			if (it == ranges.end())
+				continue;
+
+			for (LineList::iterator i = it->second.begin(); i != it->second.end(); ++i)
+			{
+				if (IsActive(*i) && (*i)->MatchesIdent(user))
+					return *i;
+			}
+		}
+		return NULL;
+	}
+
+ public:
+	void Add(GALine* line)
+	{
+		irc::sockets::cidr_mask range;
+		if (IsLiteral(line->GetHostMask()))
+			hosts[line->GetHostMask()].push_back(line);
+		else if (GetRange(line->GetHostMask(), range))
+		{
+			ranges[range].push_back(line);
+			lengths[std::make_pair(range.type, range.length)]++;
+		}
+		else
+			globs.push_back(line);
+	}
+
+	void Remove(GALine* line)
+	{
+		irc::sockets::cidr_mask range;
+		if (GetRange(line->GetHostMask(), range))
+		{
+			RangeMap::iterator it = ranges.find(range);
+			if (it == ranges.end() || !stdalgo::vector::swaperase(it->second, line))
+				return;
+
+			if (it->second.empty())
+				ranges.erase(it);
+
+			LengthMap::iterator l = lengths.find(std::make_pair(range.type, range.length));
+			if (l != lengths.end() && !--l->second)
+				lengths.erase(l);
+			return;
+		}
+
+		if (!IsLiteral(line->GetHostMask()))
+		{
+			stdalgo::vector::swaperase(globs, line);
+			return;
+		}
+
+		HostMap::iterator it = hosts.find(line->GetHostMask());
+		if (it != hosts.end())
+		{
+			stdalgo::vector::swaperase(it->second, line);
+			if (it->second.empty())
+				hosts.erase(it);
+		}
+	}
+
+	GALine* Match(User* user)
+	{
+		GALine* line = MatchHost(user->GetRealHost(), user);
+		if (!line && user->GetIPString() != user->GetRealHost())
+			line = MatchHost(user->GetIPString(), user);
+		if (!line)
+			line = MatchRange(user);
+		if (line)
+			return line;
+
+		for (LineList::iterator i = globs.begin(); i != globs.end(); ++i)
+		{
+			if (IsActive(*i) && (*i)->Matches(user))
+				return *i;
+		}
+		return NULL;
+	}
+};
+
 class ALineFactory : public XLineFactory
 {
  public:
@@ -242,6 +405,17 @@ class ModuleRequireAuth : public Module, public Stats::EventListener
 	CommandGALine cmd2;
 	ALineFactory fact1;
 	GALineFactory fact2;
+	GALineIndex localindex;
+	GALineIndex globalindex;
+
+	GALineIndex* GetIndex(XLine* line)
+	{
+		if (line->type == "A")
+			return &localindex;
+		if (line->type == "GA")
+			return &globalindex;
+		return NULL;
+	}
 
  public:
 	ModuleRequireAuth()
@@ -257,6 +431,25 @@ class ModuleRequireAuth : public Module, public Stats::EventListener
 		ServerInstance->XLines->RegisterFactory(&fact2);
 	}
 
+	void OnAddLine(User*, XLine* line) CXX11_OVERRIDE
+	{
+		GALineIndex* index = GetIndex(line);
+		if (index)
+			index->Add(static_cast<GALine*>(line));
+	}
+
+	void OnDelLine(User*, XLine* line) CXX11_OVERRIDE
+	{
+		GALineIndex* index = GetIndex(line);
+		if (index)
+			index->Remove(static_cast<GALine*>(line));
+	}
+
+	void OnExpireLine(XLine* line) CXX11_OVERRIDE
+	{
+		OnDelLine(NULL, line);
+	}
+
 	ModResult OnStats(Stats::Context& stats) CXX11_OVERRIDE
 	{
 		/*stats A does global lines, stats a local lines.*/
@@ -299,8 +492,8 @@ class ModuleRequireAuth : public Module, public Stats::EventListener
 		/*I'm afraid that using the normal xline methods would then result in this line being checked at the wrong time.*/
 		if (!isLoggedIn(user))
 		{
-			XLine* locallines = ServerInstance->XLines->MatchesLine("A", user);
-			XLine* globallines = ServerInstance->XLines->MatchesLine("GA", user);
+			XLine* locallines = localindex.Match(user);
+			XLine* globallines = locallines ? NULL : globalindex.Match(user);
 			if (locallines)
 			{
 				user->WriteNotice("*** NOTICE -- You need to identify via SASL to use this server (your host is A-lined).");
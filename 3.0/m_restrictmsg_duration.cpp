@@ -37,8 +37,32 @@
 #include "inspircd.h"
 #include "modules/account.h"
 
+// The policy flags of a connect class which are checked on every message.
+struct ClassPolicy
+{
+	bool exemptrestrictmsg;
+
+	ClassPolicy(ConnectClass* klass)
+		: exemptrestrictmsg(klass->config->getBool("exemptrestrictmsg"))
+	{
+	}
+};
+
 class ModuleRestrictMsgDuration : public Module
 {
+	// Connect classes are only created and destroyed on rehash so the policy
+	// of each is resolved from its config tag once and then kept until then.
+	typedef insp::flat_map<ConnectClass*, ClassPolicy> PolicyTable;
+	PolicyTable policies;
+
+	const ClassPolicy& GetPolicy(ConnectClass* klass)
+	{
+		PolicyTable::const_iterator iter = policies.find(klass);
+		if (iter == policies.end())
+			iter = policies.insert(std::make_pair(klass, ClassPolicy(klass))).first;
+		return iter->second;
+	}
+
 	bool blockuser;
 	bool blockchan;
 	bool exemptoper;
@@ -71,6 +95,11 @@ class ModuleRestrictMsgDuration : public Module
 		exemptregistered = tag->getBool("exemptregistered", true);
 		notify = tag->getBool("notify");
 		duration = tag->getDuration("duration", 60);
+
+		policies.clear();
+		const ServerConfig::ClassVector& classes = ServerInstance->Config->Classes;
+		for (ServerConfig::ClassVector::const_iterator iter = classes.begin(); iter != classes.end(); ++iter)
+			GetPolicy(*iter);
 	}
 
 	ModResult OnUserPreMessage(User* user, const MessageTarget& target, MessageDetails& details) CXX11_OVERRIDE
@@ -89,7 +118,7 @@ class ModuleRestrictMsgDuration : public Module
 			return MOD_RES_PASSTHRU;
 
 		// Check for connect class exemption
-		if (src->MyClass->config->getBool("exemptrestrictmsg"))
+		if (GetPolicy(src->MyClass).exemptrestrictmsg)
 			return MOD_RES_PASSTHRU;
 
 		// Source is registered (and identified) exemption
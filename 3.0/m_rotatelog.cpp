@@ -18,26 +18,262 @@
 
 /// $ModAuthor: Sadie Powell
 /// $ModAuthorMail: sadie@witchery.services
-/// $ModConfig: <rotatelog period="3600">
+/// $ModConfig: <rotatelog period="3600" compress="gzip|zstd|none" keep="0">
 /// $ModDepends: core 3
 /// $ModDesc: Rotates the log files after a defined period.
 
 
 #include "inspircd.h"
+#include "threadengine.h"
+
+#ifndef _WIN32
+# include <spawn.h>
+# include <sys/wait.h>
+extern char** environ;
+#endif
 
 static volatile sig_atomic_t signaled;
 
+// How rotated log files are archived.
+struct RotateSettings
+{
+	// The program used to compress rotated logs or empty to leave them alone.
+	std::string compressor;
+
+	// The number of rotated logs to keep for each log file or 0 to keep them all.
+	unsigned long keep;
+
+	RotateSettings()
+		: keep(0)
+	{
+	}
+};
+
+// A log file which has been renamed and needs archiving.
+struct RotatedLog
+{
+	// The path the log is written to.
+	std::string target;
+
+	// The path the log was renamed to.
+	std::string path;
+
+	RotateSettings settings;
+};
+
+/** Compresses and prunes rotated logs so that the main thread only has to
+ * rename and reopen the files.
+ */
+class RotateLogWorker : public SocketThread
+{
+ private:
+	std::deque<RotatedLog> queue;
+	bool started;
+
+	static void Compress(const RotatedLog& log)
+	{
+#ifndef _WIN32
+		std::vector<std::string> args;
+		args.push_back(log.settings.compressor);
+		args.push_back("-q");
+		if (log.settings.compressor == "zstd")
+			args.push_back("--rm");
+		args.push_back(log.path);
+
+		std::vector<char*> argv;
+		for (std::vector<std::string>::iterator iter = args.begin(); iter != args.end(); ++iter)
+			argv.push_back(&(*iter)[0]);
+		argv.push_back(NULL);
+
+		pid_t pid;
+		if (posix_spawnp(&pid, argv[0], NULL, NULL, &argv[0], environ) == 0)
+		{
+			int status;
+			while (waitpid(pid, &status, 0) < 0 && errno == EINTR) { }
+		}
+#endif
+	}
+
+	// Checks whether entry is a rotated copy of the log called name, i.e.
+	// name.YYYYMMDD-HHMMSS with an optional -N and a compressor extension.
+	static bool IsRotated(const std::string& name, const std::string& entry)
+	{
+		if (entry.compare(0, name.length() + 1, name + ".") != 0)
+			return false;
+
+		const std::string suffix = entry.substr(name.length() + 1);
+		if (suffix.length() < 15 || suffix[8] != '-')
+			return false;
+
+		for (size_t i = 0; i < 15; ++i)
+		{
+			if (i != 8 && !isdigit(static_cast<unsigned char>(suffix[i])))
+				return false;
+		}
+
+		size_t pos = 15;
+		if (pos < suffix.length() && suffix[pos] == '-')
+		{
+			const size_t end = suffix.find_first_not_of("0123456789", pos + 1);
+			if (end == pos + 1)
+				return false;
+			pos = (end == std::string::npos ? suffix.length() : end);
+		}
+
+		if (pos < suffix.length())
+		{
+			if (suffix[pos] != '.' || pos + 1 == suffix.length())
+				return false;
+
+			for (size_t i = pos + 1; i < suffix.length(); ++i)
+			{
+				if (!isalnum(static_cast<unsigned char>(suffix[i])))
+					return false;
+			}
+		}
+		return true;
+	}
+
+	static void Prune(const RotatedLog& log)
+	{
+		const std::string::size_type sep = log.target.find_last_of("/\\");
+		const std::string directory = sep == std::string::npos ? "." : log.target.substr(0, sep);
+		const std::string name = sep == std::string::npos ? log.target : log.target.substr(sep + 1);
+
+		std::vector<std::string> candidates;
+		if (!FileSystem::GetFileList(directory, candidates, name + ".*"))
+			return;
+
+		std::vector<std::string> entries;
+		for (std::vector<std::string>::const_iterator i = candidates.begin(); i != candidates.end(); ++i)
+		{
+			if (IsRotated(name, *i))
+				entries.push_back(*i);
+		}
+
+		// Rotated logs are suffixed with the time so the oldest sort first.
+		std::sort(entries.begin(), entries.end());
+		for (size_t i = 0; i + log.settings.keep < entries.size(); ++i)
+			remove((directory + "/" + entries[i]).c_str());
+	}
+
+ public:
+	RotateLogWorker()
+		: started(false)
+	{
+	}
+
+	~RotateLogWorker()
+	{
+		if (started)
+		{
+			this->LockQueue();
+			this->SetExitFlag();
+			this->UnlockQueueWakeup();
+			this->join();
+		}
+	}
+
+	void Queue(const RotatedLog& log)
+	{
+		if (!started)
+		{
+			ServerInstance->Threads.Start(this);
+			started = true;
+		}
+
+		this->LockQueue();
+		queue.push_back(log);
+		this->UnlockQueueWakeup();
+	}
+
+	void Run() CXX11_OVERRIDE
+	{
+		this->LockQueue();
+		for (;;)
+		{
+			if (queue.empty())
+			{
+				if (this->GetExitFlag())
+					break;
+
+				this->WaitForQueue();
+				continue;
+			}
+
+			RotatedLog log = queue.front();
+			queue.pop_front();
+			this->UnlockQueue();
+
+			if (!log.settings.compressor.empty())
+				Compress(log);
+			if (log.settings.keep)
+				Prune(log);
+
+			this->LockQueue();
+		}
+		this->UnlockQueue();
+	}
+
+	void OnNotify() CXX11_OVERRIDE
+	{
+	}
+};
+
 class RotateLogTimer : public Timer
 {
+ private:
+	RotateLogWorker& worker;
+
  public:
-	RotateLogTimer() : Timer(3600, true) { }
+	RotateSettings settings;
+
+	RotateLogTimer(RotateLogWorker& Worker)
+		: Timer(3600, true)
+		, worker(Worker)
+	{
+	}
 
 	bool Tick(time_t) CXX11_OVERRIDE
 	{
 		ServerInstance->Logs->Log(MODNAME, LOG_DEFAULT, "Rotating log files ...");
-		ServerInstance->Logs->CloseLogs();
 
+		// Renaming an open file is atomic and writes carry on going to it
+		// until it is closed so nothing is lost between here and reopening.
+		std::vector<RotatedLog> rotated;
+		const std::string suffix = InspIRCd::TimeString(ServerInstance->Time(), ".%Y%m%d-%H%M%S");
+		ConfigTagList tags = ServerInstance->Config->ConfTags("log");
+		for (ConfigIter i = tags.first; i != tags.second; ++i)
+		{
+			ConfigTag* tag = i->second;
+			if (!stdalgo::string::equalsci(tag->getString("method", "file"), "file"))
+				continue;
+
+			// Logs with a time in their name rotate themselves.
+			const std::string target = tag->getString("target");
+			if (target.empty() || target.find('%') != std::string::npos)
+				continue;
+
+			RotatedLog log;
+			log.target = ServerInstance->Config->Paths.PrependLog(target);
+			log.path = log.target + suffix;
+			for (unsigned int n = 1; FileSystem::FileExists(log.path); ++n)
+				log.path = log.target + suffix + "-" + ConvToStr(n);
+
+			log.settings = settings;
+			if (rename(log.target.c_str(), log.path.c_str()) == 0)
+				rotated.push_back(log);
+		}
+
+		ServerInstance->Logs->CloseLogs();
 		ServerInstance->Logs->OpenFileLogs();
+
+		for (std::vector<RotatedLog>::const_iterator iter = rotated.begin(); iter != rotated.end(); ++iter)
+		{
+			if (!iter->settings.compressor.empty() || iter->settings.keep)
+				worker.Queue(*iter);
+		}
+
 		ServerInstance->Logs->Log(MODNAME, LOG_DEFAULT, "Log files have been rotated!");
 		return true;
 	}
@@ -46,6 +282,7 @@ class RotateLogTimer : public Timer
 class ModuleRotateLog : public Module
 {
  private:
+	RotateLogWorker worker;
 	RotateLogTimer* timer;
 
 	static void SignalHandler(int)
@@ -56,7 +293,7 @@ class ModuleRotateLog : public Module
  public:
 	ModuleRotateLog()
 	{
-		timer = new RotateLogTimer();
+		timer = new RotateLogTimer(worker);
 		signal(SIGUSR2, SignalHandler);
 	}
 
@@ -75,6 +312,17 @@ class ModuleRotateLog : public Module
 	{
 		ConfigTag* tag = ServerInstance->Config->ConfValue("rotatelog");
 		timer->SetInterval(tag->getDuration("period", 3600, 60));
+
+		RotateSettings settings;
+		const std::string compress = tag->getString("compress", "none");
+		if (stdalgo::string::equalsci(compress, "gzip"))
+			settings.compressor = "gzip";
+		else if (stdalgo::string::equalsci(compress, "zstd"))
+			settings.compressor = "zstd";
+		else if (!stdalgo::string::equalsci(compress, "none"))
+			throw ModuleException("<rotatelog:compress> must be gzip, zstd, or none, at " + tag->getTagLocation());
+		settings.keep = tag->getUInt("keep", 0);
+		timer->settings = settings;
 	}
 
 	void OnBackgroundTimer(time_t) CXX11_OVERRIDE
@@ -31,23 +31,162 @@
 
 #include "inspircd.h"
 
+/** Moves the local users picked by a bulk SAMOVE a chunk at a time so a large
+ * channel can be split without stalling the server.
+ */
+class MoveJobs : public Timer
+{
+	struct Job
+	{
+		std::string from;
+		std::string to;
+		std::vector<std::string> targets;
+		size_t next;
+	};
+
+	std::deque<Job> jobs;
+
+	static void Move(LocalUser* user, const std::string& from, const std::string& to)
+	{
+		Channel* from_chan = ServerInstance->FindChan(from);
+		if (!from_chan || !from_chan->HasUser(user))
+			return; // The user has left since the SAMOVE.
+
+		std::string msg; //PartUser doesn't accept a const reference atm
+		from_chan->PartUser(user, msg);
+
+		Channel* to_chan = ServerInstance->FindChan(to);
+		if (!to_chan || !to_chan->HasUser(user))
+			Channel::JoinUser(user, to, true);
+	}
+
+ public:
+	// The most users moved per second.
+	static const size_t chunksize = 500;
+
+	MoveJobs()
+		: Timer(1, true)
+	{
+	}
+
+	void Start(const std::string& from, const std::string& to, std::vector<std::string>& targets)
+	{
+		if (targets.empty())
+			return;
+
+		jobs.push_back(Job());
+		Job& job = jobs.back();
+		job.from = from;
+		job.to = to;
+		job.targets.swap(targets);
+		job.next = 0;
+
+		// Small moves are done straight away.
+		if (job.targets.size() <= chunksize)
+			Tick(ServerInstance->Time());
+	}
+
+	bool Tick(time_t) CXX11_OVERRIDE
+	{
+		size_t budget = chunksize;
+		while (!jobs.empty() && budget)
+		{
+			Job& job = jobs.front();
+			for (; job.next < job.targets.size() && budget; ++job.next, --budget)
+			{
+				LocalUser* user = IS_LOCAL(ServerInstance->FindUUID(job.targets[job.next]));
+				if (user)
+					Move(user, job.from, job.to);
+			}
+
+			if (job.next < job.targets.size())
+				break;
+			jobs.pop_front();
+		}
+		return true;
+	}
+};
+
 /** Handle /SAMOVE
  *
  * Basically it's a SAPART + SAJOIN in 1 command
  */
 class CommandSamove : public Command
 {
+	MoveJobs& jobs;
+
+	/** Handles SAMOVE <fromchannel> <tochannel> [<mask>|<count>]
+	 *
+	 * This is broadcast to every server which then moves its own local members
+	 * of the channel so the whole operation is a single S2S message.
+	 */
+	CmdResult HandleBulk(User* user, const Params& parameters)
+	{
+		const std::string& from_channel = parameters[0];
+		const std::string& to_channel = parameters[1];
+
+		if (IS_LOCAL(user) && (!ServerInstance->IsChannel(from_channel) || !ServerInstance->IsChannel(to_channel)))
+		{
+			user->WriteNotice("*** Invalid characters in channel name or name too long");
+			return CMD_FAILURE;
+		}
+
+		Channel* from_chan = ServerInstance->FindChan(from_channel);
+		Channel* to_chan = ServerInstance->FindChan(to_channel);
+		if (!from_chan || !to_chan)
+		{
+			user->WriteRemoteNotice("*** invalid channel " + (from_chan ? to_channel : from_channel));
+			return CMD_FAILURE;
+		}
+
+		// A number is the most users to move from each server, anything else is a mask.
+		std::string mask("*");
+		unsigned long count = ULONG_MAX;
+		if (parameters.size() > 2)
+		{
+			if (parameters[2].find_first_not_of("0123456789") == std::string::npos)
+				count = ConvToNum<unsigned long>(parameters[2]);
+			else
+				mask = parameters[2];
+		}
+
+		std::vector<std::string> targets;
+		const Channel::MemberMap& users = from_chan->GetUsers();
+		for (Channel::MemberMap::const_iterator i = users.begin(); i != users.end() && targets.size() < count; ++i)
+		{
+			LocalUser* member = IS_LOCAL(i->first);
+			if (!member || to_chan->HasUser(member))
+				continue;
+
+			if (InspIRCd::Match(member->GetFullHost(), mask) || InspIRCd::Match(member->GetFullRealHost(), mask))
+				targets.push_back(member->uuid);
+		}
+
+		if (IS_LOCAL(user))
+		{
+			ServerInstance->SNO->WriteGlobalSno('a', user->nick + " used SAMOVE to move " + (count == ULONG_MAX ? "users matching " + mask : ConvToStr(count) + " users from each server")
+				+ " from " + from_channel + " to " + to_channel);
+		}
+
+		jobs.Start(from_channel, to_channel, targets);
+		return CMD_SUCCESS;
+	}
+
  public:
-	CommandSamove(Module* Creator) : Command(Creator,"SAMOVE", 1)
+	CommandSamove(Module* Creator, MoveJobs& Jobs) : Command(Creator,"SAMOVE", 2, 3)
+		, jobs(Jobs)
 	{
 		allow_empty_last_param = false;
 		flags_needed = 'o';
-		syntax = "<nick> <fromchannel> <tochannel>";
-		TRANSLATE3(TR_NICK, TR_TEXT, TR_TEXT);		
+		syntax = "<nick> <fromchannel> <tochannel>|<fromchannel> <tochannel> [<mask>|<count>]";
+		TRANSLATE3(TR_NICK, TR_TEXT, TR_TEXT);
 	}
 
 	CmdResult Handle(User* user, const Params& parameters) CXX11_OVERRIDE				
 	{
+		if (ServerInstance->IsChannel(parameters[0]))
+			return HandleBulk(user, parameters);
+
 		if (parameters.size() != 3) 
 		{
 			return CMD_FAILURE;			
@@ -142,17 +281,25 @@ class CommandSamove : public Command
 
 	RouteDescriptor GetRouting(User* user, const Params& parameters) CXX11_OVERRIDE
 	{
+		if (ServerInstance->IsChannel(parameters[0]))
+			return ROUTE_OPT_BCAST;
 		return ROUTE_OPT_UCAST(parameters[0]);
 	}
 };
 
 class ModuleSamove : public Module
 {
+	MoveJobs jobs;
 	CommandSamove cmd;
  public:
 	ModuleSamove()
-		: cmd(this)
+		: cmd(this, jobs)
+	{
+	}
+
+	void init() CXX11_OVERRIDE
 	{
+		ServerInstance->Timers.AddTimer(&jobs);
 	}
 
 	Version GetVersion() CXX11_OVERRIDE
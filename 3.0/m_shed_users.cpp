@@ -20,20 +20,32 @@
 /// $ModAuthorMail: linuxdaemonirc@gmail.com
 /// $ModDepends: core 3
 /// $ModDesc: Slowly disconnects idle users for maintenance
-/// $ModConfig: <shedusers shedopers="no" kill="yes" shutdown="no" blockconnect="yes" minidle="3600" maxusers="0" message="This server has entered maintenance mode." blockmessage="This server is in maintenance mode.">
+/// $ModConfig: <shedusers shedopers="no" kill="yes" shutdown="no" blockconnect="yes" minidle="3600" maxusers="0" shedrate="1" message="This server has entered maintenance mode." blockmessage="This server is in maintenance mode." redirecthost="" redirectport="0">
 
 // Maintenance mode can be triggered with the /SHEDUSERS command
 // as well as sending SIGUSR2 to the inspircd process
 
 // If shedding is enabled, the inspircd.org/shedding cap will be advertised
 
+// While shedding, up to <shedusers:shedrate> of the most idle users are disconnected
+// every time the background timer runs (roughly every five seconds)
+
 // If shedding is enabled while a user is online, the user will received a CAP ADD with the cap,
 // if capnotify is available
 
+// While any server on the network is shedding every server shares its user count and
+// shedding state. A server which sets <shedusers:redirectport> also shares the host
+// (<shedusers:redirecthost>, the server name by default) and port clients should use
+// to reach it. Users who are shed or blocked are sent RPL_REDIR pointing at the least
+// loaded of these servers which is not shedding
+
 // Shedding can also be controlled via the HTTPApi
 // - /shedding or /shedding/status - Get the current shedding status
 // - /shedding/start - Enable shedding
 // - /shedding/stop - Disable shedding
+// - /shedding/progress - Get the progress of the current drain
+// - /shedding/rate/<n> - Shed up to n users per background tick until the next rehash
+// - /shedding/metrics - Get the progress in the Prometheus text format
 //
 // Note: Requires m_httpd be loaded, the rest of the module will work without it though
 
@@ -42,8 +54,19 @@
 #include "modules/cap.h"
 #include "modules/httpd.h"
 
+#include <queue>
+
 #define CAP_NAME "inspircd.org/shedding"
 
+// How often the background timer runs, used to turn the shed rate into a time.
+static const unsigned long BACKGROUND_INTERVAL = 5;
+
+enum
+{
+	// From ircd-ratbox.
+	RPL_REDIR = 10
+};
+
 inline unsigned long GetIdle(LocalUser* lu)
 {
 	return ServerInstance->Time() - lu->idle_lastmsg;
@@ -54,6 +77,21 @@ static volatile sig_atomic_t notified;
 
 static Module* me;
 
+// The progress of the current drain, shared with the HTTP API.
+struct SheddingProgress
+{
+	// Users shed and connections blocked since shedding started.
+	unsigned long shed;
+	unsigned long blocked;
+	time_t started;
+
+	// Users shed per background tick and the number to stop at.
+	unsigned long rate;
+	unsigned long maxusers;
+};
+
+static SheddingProgress progress;
+
 bool IsShedding()
 {
 	return active;
@@ -148,6 +186,9 @@ class SheddingHTTPApi
 		STATUS,
 		START,
 		STOP,
+		PROGRESS,
+		METRICS,
+		RATE,
 
 		NOT_FOUND,
 		WRONG_PREFIX
@@ -162,7 +203,7 @@ class SheddingHTTPApi
 	{
 	}
 
-	Endpoint PathToEndpoint(const std::string& path) const
+	Endpoint PathToEndpoint(const std::string& path, std::string& arg) const
 	{
 		if (!(path == urlprefix || path.compare(0, urlprefix.length() + 1, urlprefix + "/") == 0))
 			return WRONG_PREFIX;
@@ -186,13 +227,62 @@ class SheddingHTTPApi
 			return START;
 		else if (stripped == "stop")
 			return STOP;
+		else if (stripped == "progress")
+			return PROGRESS;
+		else if (stripped == "metrics")
+			return METRICS;
+		else if (stripped.compare(0, 5, "rate/") == 0)
+		{
+			arg = stripped.substr(5);
+			return RATE;
+		}
 
 		return NOT_FOUND;
 	}
 
+	static void WriteProgress(std::stringstream& sstr)
+	{
+		const unsigned long users = ServerInstance->Users.LocalUserCount();
+		const unsigned long elapsed = IsShedding() ? ServerInstance->Time() - progress.started : 0;
+
+		sstr << "{\"active\":" << (IsShedding() ? "true" : "false")
+			<< ",\"users\":" << users
+			<< ",\"maxusers\":" << progress.maxusers
+			<< ",\"shed\":" << progress.shed
+			<< ",\"blocked\":" << progress.blocked
+			<< ",\"elapsed\":" << elapsed
+			<< ",\"rate\":" << progress.rate
+			<< ",\"interval\":" << BACKGROUND_INTERVAL;
+
+		// Assumes enough users are idle to shed at the full rate.
+		if (IsShedding())
+		{
+			const unsigned long left = users > progress.maxusers ? users - progress.maxusers : 0;
+			sstr << ",\"eta\":" << (left + progress.rate - 1) / progress.rate * BACKGROUND_INTERVAL;
+		}
+		sstr << "}";
+	}
+
+	static void WriteMetrics(std::stringstream& sstr)
+	{
+		sstr << "# TYPE inspircd_shedding_active gauge\n"
+			<< "inspircd_shedding_active " << (IsShedding() ? 1 : 0) << "\n"
+			<< "# TYPE inspircd_shedding_users gauge\n"
+			<< "inspircd_shedding_users " << ServerInstance->Users.LocalUserCount() << "\n"
+			<< "# TYPE inspircd_shedding_maxusers gauge\n"
+			<< "inspircd_shedding_maxusers " << progress.maxusers << "\n"
+			<< "# TYPE inspircd_shedding_rate gauge\n"
+			<< "inspircd_shedding_rate " << progress.rate << "\n"
+			<< "# TYPE inspircd_shedding_shed_total counter\n"
+			<< "inspircd_shedding_shed_total " << progress.shed << "\n"
+			<< "# TYPE inspircd_shedding_blocked_total counter\n"
+			<< "inspircd_shedding_blocked_total " << progress.blocked << "\n";
+	}
+
 	ModResult OnHTTPRequest(HTTPRequest& req) CXX11_OVERRIDE
 	{
-		Endpoint endpoint = PathToEndpoint(req.GetPath());
+		std::string arg;
+		Endpoint endpoint = PathToEndpoint(req.GetPath(), arg);
 
 		std::stringstream sstr;
 
@@ -219,6 +309,24 @@ class SheddingHTTPApi
 					sstr << "{\"status\":\"success\"}";
 				}
 				break;
+			case PROGRESS:
+				WriteProgress(sstr);
+				break;
+			case METRICS:
+				WriteMetrics(sstr);
+				break;
+			case RATE:
+			{
+				unsigned long rate = ConvToNum<unsigned long>(arg);
+				if (!rate)
+					sstr << "{\"error\":\"invalid_rate\",\"message\":\"The rate must be a positive number\"}";
+				else
+				{
+					progress.rate = rate;
+					sstr << "{\"status\":\"success\"}";
+				}
+				break;
+			}
 			case NOT_FOUND:
 				sstr << "{\"error\":\"unknown_action\"}";
 				break;
@@ -230,12 +338,30 @@ class SheddingHTTPApi
 		/* Send the document back to m_httpd */
 		HTTPDocumentResponse response(creator, req, &sstr, endpoint != NOT_FOUND ? 200 : 404);
 		response.headers.SetHeader("X-Powered-By", MODNAME);
-		response.headers.SetHeader("Content-Type", "application/json");
+		response.headers.SetHeader("Content-Type", endpoint == METRICS ? "text/plain; version=0.0.4" : "application/json");
 		httpd->SendResponse(response);
 		return MOD_RES_DENY; // Handled
 	}
 };
 
+// The users which might be shed ordered by when they last sent a message, oldest first.
+typedef std::pair<time_t, std::string> ShedCandidate;
+typedef std::priority_queue<ShedCandidate, std::vector<ShedCandidate>, std::greater<ShedCandidate> > ShedQueue;
+
+// The last load reported by another server.
+struct ServerLoad
+{
+	bool shedding;
+	unsigned long users;
+	time_t updated;
+
+	// Where clients should connect to, if the server takes redirected users.
+	std::string host;
+	unsigned int port;
+};
+
+typedef std::map<std::string, ServerLoad> ServerLoads;
+
 class ModuleShedUsers
 	: public Module
 {
@@ -255,6 +381,16 @@ class ModuleShedUsers
 
 	unsigned long maxusers;
 	unsigned long minidle;
+	std::string redirecthost;
+	unsigned int redirectport;
+
+	// The load of the other servers and whether we told them ours last tick.
+	ServerLoads loads;
+	bool reporting;
+
+	// Built when shedding starts so each victim can be found without scanning every user.
+	ShedQueue candidates;
+	bool candidatesbuilt;
 
 	bool shedopers;
 	bool shutdown;
@@ -269,6 +405,9 @@ class ModuleShedUsers
 		, httpapi(this, "/shedding")
 		, maxusers(0)
 		, minidle(0)
+		, redirectport(0)
+		, reporting(false)
+		, candidatesbuilt(false)
 		, shedopers(false)
 		, shutdown(false)
 		, blockconnects(false)
@@ -297,12 +436,93 @@ class ModuleShedUsers
 		blockmessage = tag->getString("blockmessage", "This server is in maintenance mode.");
 		maxusers = tag->getUInt("maxusers", 0);
 		minidle = tag->getDuration("minidle", 60, 1);
+		redirecthost = tag->getString("redirecthost", ServerInstance->Config->ServerName, 1);
+		redirectport = tag->getUInt("redirectport", 0, 0, 65535);
+		progress.rate = tag->getUInt("shedrate", 1, 1);
+		progress.maxusers = maxusers;
 		shedopers = tag->getBool("shedopers");
 		shutdown = tag->getBool("shutdown");
 		blockconnects = tag->getBool("blockconnect", true);
 		kill = tag->getBool("kill", true);
 	}
 
+	bool IsNetworkShedding() const
+	{
+		for (ServerLoads::const_iterator it = loads.begin(); it != loads.end(); ++it)
+		{
+			if (it->second.shedding)
+				return true;
+		}
+		return false;
+	}
+
+	void UpdateLoads()
+	{
+		// Servers which stopped reporting have split or stopped caring.
+		const time_t expiry = ServerInstance->Time() - BACKGROUND_INTERVAL * 3;
+		for (ServerLoads::iterator it = loads.begin(); it != loads.end(); )
+		{
+			if (it->second.updated < expiry)
+				loads.erase(it++);
+			else
+				++it;
+		}
+
+		// Send one last report after shedding stops so the others know.
+		const bool shouldreport = IsShedding() || IsNetworkShedding();
+		if (shouldreport || reporting)
+		{
+			ServerInstance->PI->SendMetaData("shedusers", InspIRCd::Format("%s %d %lu %s %u", ServerInstance->Config->ServerName.c_str(),
+				IsShedding() ? 1 : 0, static_cast<unsigned long>(ServerInstance->Users.LocalUserCount()),
+				redirecthost.c_str(), redirectport));
+		}
+		reporting = shouldreport;
+	}
+
+	void Redirect(LocalUser* lu)
+	{
+		// Only servers which advertise a port take redirected users, this
+		// leaves out hubs and other servers without client listeners.
+		ServerLoads::const_iterator target = loads.end();
+		for (ServerLoads::const_iterator it = loads.begin(); it != loads.end(); ++it)
+		{
+			if (it->second.port && !it->second.shedding && (target == loads.end() || it->second.users < target->second.users))
+				target = it;
+		}
+
+		if (target != loads.end())
+			lu->WriteNumeric(RPL_REDIR, target->second.host, target->second.port, "Please use this Server/Port instead");
+	}
+
+	void OnDecodeMetaData(Extensible* target, const std::string& extname, const std::string& extdata) CXX11_OVERRIDE
+	{
+		if (target || extname != "shedusers")
+			return;
+
+		irc::spacesepstream stream(extdata);
+		std::string server;
+		std::string shedding;
+		std::string users;
+		if (!stream.GetToken(server) || !stream.GetToken(shedding) || !stream.GetToken(users))
+			return;
+
+		if (server == ServerInstance->Config->ServerName)
+			return;
+
+		// Servers running an older version don't say where to redirect to.
+		std::string host;
+		std::string port;
+		stream.GetToken(host);
+		stream.GetToken(port);
+
+		ServerLoad& load = loads[server];
+		load.shedding = (shedding == "1");
+		load.users = ConvToNum<unsigned long>(users);
+		load.updated = ServerInstance->Time();
+		load.host = host;
+		load.port = host.empty() ? 0 : ConvToNum<unsigned int>(port);
+	}
+
 	bool CanShed(LocalUser* lu) const
 	{
 		if (!shedopers && lu->IsOper())
@@ -317,19 +537,92 @@ class ModuleShedUsers
 		return true;
 	}
 
+	void BuildCandidates()
+	{
+		ShedQueue().swap(candidates);
+		const UserManager::LocalList& localusers = ServerInstance->Users.GetLocalUsers();
+		for (UserManager::LocalList::const_iterator it = localusers.begin(); it != localusers.end(); ++it)
+		{
+			LocalUser* lu = *it;
+			if (lu->registered == REG_ALL)
+				candidates.push(std::make_pair(lu->idle_lastmsg, lu->uuid));
+		}
+		candidatesbuilt = true;
+	}
+
+	// Finds the most idle user which can be shed or NULL if none can be yet.
+	LocalUser* NextVictim()
+	{
+		while (!candidates.empty())
+		{
+			const ShedCandidate top = candidates.top();
+			LocalUser* lu = IS_LOCAL(ServerInstance->FindUUID(top.second));
+			if (!lu || lu->quitting)
+			{
+				candidates.pop();
+				continue;
+			}
+
+			// The user has spoken since they were queued, put them back in the right place.
+			if (lu->idle_lastmsg != top.first)
+			{
+				candidates.pop();
+				candidates.push(std::make_pair(lu->idle_lastmsg, lu->uuid));
+				continue;
+			}
+
+			if (!shedopers && lu->IsOper())
+			{
+				candidates.pop();
+				continue;
+			}
+
+			// Everyone else has been idle for less time than this user.
+			if (!CanShed(lu))
+				return NULL;
+
+			candidates.pop();
+			return lu;
+		}
+		return NULL;
+	}
+
+	void OnPostConnect(User* user) CXX11_OVERRIDE
+	{
+		LocalUser* lu = IS_LOCAL(user);
+		if (lu && candidatesbuilt)
+			candidates.push(std::make_pair(lu->idle_lastmsg, lu->uuid));
+	}
+
 	void OnSetUserIP(LocalUser* user) CXX11_OVERRIDE
 	{
 		if (IsShedding() && blockconnects && user->registered != REG_ALL)
+		{
+			progress.blocked++;
+			Redirect(user);
 			ServerInstance->Users.QuitUser(user, blockmessage);
+		}
 	}
 
 	void OnBackgroundTimer(time_t) CXX11_OVERRIDE
 	{
+		UpdateLoads();
+
 		if (!IsShedding())
+		{
+			progress.shed = 0;
+			progress.blocked = 0;
+			if (candidatesbuilt)
+			{
+				ShedQueue().swap(candidates);
+				candidatesbuilt = false;
+			}
 			return;
+		}
 
 		if (!HasNotified())
 		{
+			progress.started = ServerInstance->Time();
 			ClientProtocol::Messages::Privmsg msg(ClientProtocol::Messages::Privmsg::nocopy, ServerInstance->FakeClient, ServerInstance->Config->ServerName, message, MSG_NOTICE);
 			ClientProtocol::Event msgevent(ServerInstance->GetRFCEvents().privmsg, msg);
 
@@ -353,19 +646,20 @@ class ModuleShedUsers
 		if (!kill)
 			return;
 
-		LocalUser* to_quit = NULL;
-		const UserManager::LocalList& localusers = ServerInstance->Users.GetLocalUsers();
-		for (UserManager::LocalList::const_iterator it = localusers.begin(); it != localusers.end(); ++it)
-		{
-			LocalUser* lu = *it;
-			if (CanShed(lu) && (!to_quit || lu->idle_lastmsg < to_quit->idle_lastmsg))
-				to_quit = lu;
-		}
+		if (!candidatesbuilt)
+			BuildCandidates();
 
-		if (!to_quit)
-			return;
+		size_t remaining = ServerInstance->Users.LocalUserCount();
+		for (unsigned long shed = 0; shed < progress.rate && remaining > maxusers; ++shed, --remaining)
+		{
+			LocalUser* to_quit = NextVictim();
+			if (!to_quit)
+				break;
 
-		ServerInstance->Users.QuitUser(to_quit, message);
+			progress.shed++;
+			Redirect(to_quit);
+			ServerInstance->Users.QuitUser(to_quit, message);
+		}
 	}
 
 	Version GetVersion() CXX11_OVERRIDE
@@ -32,53 +32,93 @@
 class slowmodesettings
 {
  public:
-	typedef std::map<User*, unsigned int> user_counter_t;
-
 	unsigned int lines;
 	unsigned int secs;
 
 	bool user;
 
-	union
-	{
-		unsigned int counter;
-		user_counter_t* user_counter;
-	};
-
+	unsigned int counter;
 	time_t reset;
 
-	slowmodesettings(int l, int s, bool u = false) : lines(l), secs(s), user(u), user_counter(0)
+	slowmodesettings(int l, int s, bool u = false) : lines(l), secs(s), user(u), counter(0)
 	{
-		this->clear();
 		reset = ServerInstance->Time() + secs;
 	}
 
-	bool addmessage(User *who)
+	bool addmessage()
 	{
 		if (ServerInstance->Time() > reset)
 		{
-			this->clear();
+			counter = 0;
 			reset = ServerInstance->Time() + secs;
 		}
 
-		if (user)
-			if (IS_LOCAL(who))
-				return ++((*user_counter)[who]) >= lines;
-			else
-				return false;
-		else
-			return ++counter >= lines;
+		return ++counter >= lines;
 	}
+};
 
-	void clear()
+/** Holds the per-member state for a "u" mode +W. This is a sliding window:
+ * the count from the previous window is weighted by how much of it still
+ * overlaps the current one so there is no burst allowance at window edges.
+ */
+class slowmodecounter
+{
+ public:
+	time_t window;
+	unsigned int current;
+	unsigned int previous;
+
+	slowmodecounter() : window(0), current(0), previous(0)
 	{
-		if (user)
-			if (user_counter)
-				user_counter->clear();
-			else
-				user_counter = new user_counter_t;
-		else
-			counter = 0;
+	}
+
+	bool addmessage(const slowmodesettings* sms)
+	{
+		const time_t now = ServerInstance->Time();
+		const time_t windowstart = now - (now % sms->secs);
+		if (windowstart != window)
+		{
+			previous = (windowstart == window + static_cast<time_t>(sms->secs)) ? current : 0;
+			current = 0;
+			window = windowstart;
+		}
+
+		++current;
+		const unsigned long remaining = sms->secs - (now - windowstart);
+		return (static_cast<unsigned long>(previous) * remaining / sms->secs) + current >= sms->lines;
+	}
+};
+
+/** Holds the slowmodecounter of each member. The counters are kept across a
+ * module reload so a flood can't be restarted by reloading the module.
+ */
+class SlowModeCounterExt : public SimpleExtItem<slowmodecounter>
+{
+ public:
+	SlowModeCounterExt(Module* Creator)
+		: SimpleExtItem<slowmodecounter>("slowmode-counter", ExtensionItem::EXT_MEMBERSHIP, Creator)
+	{
+	}
+
+	std::string ToInternal(const Extensible* container, void* item) const CXX11_OVERRIDE
+	{
+		// The leading 1 is the format version.
+		const slowmodecounter* counter = static_cast<slowmodecounter*>(item);
+		return InspIRCd::Format("1 %ld %u %u", static_cast<long>(counter->window), counter->current, counter->previous);
+	}
+
+	void FromInternal(Extensible* container, const std::string& value) CXX11_OVERRIDE
+	{
+		irc::spacesepstream stream(value);
+		unsigned int version;
+		long window;
+		slowmodecounter counter;
+		if (!stream.GetNumericToken(version) || version != 1 || !stream.GetNumericToken(window)
+			|| !stream.GetNumericToken(counter.current) || !stream.GetNumericToken(counter.previous))
+			return;
+
+		counter.window = window;
+		set(container, counter);
 	}
 };
 
@@ -153,11 +193,35 @@ class MsgFlood : public ParamMode<MsgFlood, SimpleExtItem<slowmodesettings> >
 class ModuleMsgFlood : public Module
 {
 	MsgFlood mf;
+	SlowModeCounterExt counters;
 	CheckExemption::EventProvider exemptionprov;
 
+	bool AddMessage(User* user, Channel* chan, slowmodesettings* f)
+	{
+		if (!f->user)
+			return f->addmessage();
+
+		if (!IS_LOCAL(user))
+			return false;
+
+		// The counter lives on the membership so it goes away when the user parts.
+		Membership* memb = chan->GetUser(user);
+		if (!memb)
+			return false;
+
+		slowmodecounter* counter = counters.get(memb);
+		if (!counter)
+		{
+			counter = new slowmodecounter;
+			counters.set(memb, counter);
+		}
+		return counter->addmessage(f);
+	}
+
  public:
 	ModuleMsgFlood()
 		: mf(this)
+		, counters(this)
 		, exemptionprov(this)
 	{
 	}
@@ -169,12 +233,13 @@ class ModuleMsgFlood : public Module
 
 		Channel* dest = target.Get<Channel>();
 		if (!dest->IsModeSet(mf))
+			return MOD_RES_PASSTHRU;
 
 		if (CheckExemption::Call(exemptionprov, user, dest, "slowmode") == MOD_RES_ALLOW)
 			return MOD_RES_PASSTHRU;
 
 		slowmodesettings *f = mf.ext.get(dest);
-		if (f == NULL || !f->addmessage(user))
+		if (f == NULL || !AddMessage(user, dest, f))
 			return MOD_RES_PASSTHRU;
 
 		if (!IS_LOCAL(user))
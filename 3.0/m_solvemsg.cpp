@@ -24,20 +24,45 @@
 
 #include "inspircd.h"
 
-struct Problem
+/** The problem a user has to solve is packed into a LocalIntExt so that
+ * connecting users don't need an allocation. Users who have solved their
+ * problem (or connected before the module was loaded) have no value set.
+ */
+namespace Problem
 {
-	int first;
-	int second;
-	bool warned;
-};
+	// The operands are stored in the low two nibbles.
+	const intptr_t OPERAND_MASK = 0xF;
+	const unsigned int SECOND_SHIFT = 4;
+
+	// Set once the user has been told about their problem.
+	const intptr_t WARNED = 1 << 8;
+
+	// Set on every unsolved problem so that a 0+0 problem is never unset.
+	const intptr_t PENDING = 1 << 9;
+
+	intptr_t Create(int first, int second)
+	{
+		return PENDING | (first & OPERAND_MASK) | ((second & OPERAND_MASK) << SECOND_SHIFT);
+	}
+
+	int GetFirst(intptr_t problem)
+	{
+		return problem & OPERAND_MASK;
+	}
+
+	int GetSecond(intptr_t problem)
+	{
+		return (problem >> SECOND_SHIFT) & OPERAND_MASK;
+	}
+}
 
 class CommandSolve : public SplitCommand
 {
  private:
-	SimpleExtItem<Problem>& ext;
+	LocalIntExt& ext;
 
  public:
-	CommandSolve(Module* Creator, SimpleExtItem<Problem>& Ext)
+	CommandSolve(Module* Creator, LocalIntExt& Ext)
 		: SplitCommand(Creator, "SOLVE", 1, 1)
 		, ext(Ext)
 	{
@@ -51,7 +76,7 @@ class CommandSolve : public SplitCommand
 			return CMD_FAILURE;
 		}
 
-		Problem* problem = ext.get(user);
+		const intptr_t problem = ext.get(user);
 		if (!problem)
 		{
 			user->WriteNotice("** You have already solved your problem!");
@@ -59,7 +84,7 @@ class CommandSolve : public SplitCommand
 		}
 
 		int result = ConvToNum<int>(parameters[0]);
-		if (result != (problem->first + problem->second))
+		if (result != (Problem::GetFirst(problem) + Problem::GetSecond(problem)))
 		{
 			user->WriteNotice(InspIRCd::Format("*** %s is not the correct answer.", parameters[0].c_str()));
 			user->CommandFloodPenalty += 10000;
@@ -75,7 +100,7 @@ class CommandSolve : public SplitCommand
 class ModuleSolveMessage : public Module
 {
  private:
-	SimpleExtItem<Problem> ext;
+	LocalIntExt ext;
 	CommandSolve cmd;
 
  public:
@@ -87,11 +112,7 @@ class ModuleSolveMessage : public Module
 
 	void OnUserPostInit(LocalUser* user) CXX11_OVERRIDE
 	{
-		Problem problem;
-		problem.first = ServerInstance->GenRandomInt(9);
-		problem.second = ServerInstance->GenRandomInt(9);
-		problem.warned = false;
-		ext.set(user, problem);
+		ext.set(user, Problem::Create(ServerInstance->GenRandomInt(9), ServerInstance->GenRandomInt(9)));
 	}
 
 	ModResult OnUserPreMessage(User* user, const MessageTarget& msgtarget, MessageDetails& details) CXX11_OVERRIDE
@@ -100,21 +121,21 @@ class ModuleSolveMessage : public Module
 		if (!source || source->exempt || msgtarget.type != MessageTarget::TYPE_USER)
 			return MOD_RES_PASSTHRU;
 
-		User* target = msgtarget.Get<User>();
-		if (target->server->IsULine())
+		const intptr_t problem = ext.get(user);
+		if (!problem)
 			return MOD_RES_PASSTHRU;
 
-		Problem* problem = ext.get(user);
-		if (!problem)
+		User* target = msgtarget.Get<User>();
+		if (target->server->IsULine())
 			return MOD_RES_PASSTHRU;
 
-		if (problem->warned)
+		if (problem & Problem::WARNED)
 			return MOD_RES_DENY;
 
 		user->WriteNotice("*** Before you can send messages you must solve the following problem:");
-		user->WriteNotice(InspIRCd::Format("*** What is %d + %d?", problem->first, problem->second));
+		user->WriteNotice(InspIRCd::Format("*** What is %d + %d?", Problem::GetFirst(problem), Problem::GetSecond(problem)));
 		user->WriteNotice("*** You can enter your answer using /QUOTE SOLVE <answer>");
-		problem->warned = true;
+		ext.set(user, problem | Problem::WARNED);
 		return MOD_RES_DENY;
 	}
 
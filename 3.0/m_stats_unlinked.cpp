@@ -21,34 +21,116 @@
 /// $ModDepends: core 3
 /// $ModDesc: Adds stats character 'X' which shows unlinked servers.
 
+// The state of the servers can also be fetched as JSON from /unlinked
+// when m_httpd is loaded.
+
 
 #include "inspircd.h"
+#include "modules/httpd.h"
+#include "modules/server.h"
 #include "modules/stats.h"
 
-class ModuleStatsUnlinked : public Module, public Stats::EventListener
+// A server which can be linked to from the config.
+struct LinkableServer
 {
- private:
-	std::map<std::string, unsigned int> LinkableServers;
+	// The port from the <link> block.
+	unsigned int port;
+
+	// Whether the server is currently linked to the network.
+	bool linked;
+
+	// When the server last linked or unlinked.
+	time_t since;
 
-	static bool IsServerLinked(const ProtocolInterface::ServerList& linkedServers, const std::string& serverName)
+	LinkableServer()
+		: port(0)
+		, linked(false)
+		, since(0)
 	{
-		for (ProtocolInterface::ServerList::const_iterator it = linkedServers.begin(); it != linkedServers.end(); ++it)
+	}
+};
+
+typedef std::map<std::string, LinkableServer> LinkableServerMap;
+
+class UnlinkedHTTPApi
+	: public HTTPRequestEventListener
+{
+	Module* creator;
+	HTTPdAPI httpd;
+	const LinkableServerMap& servers;
+
+ public:
+	UnlinkedHTTPApi(Module* Creator, const LinkableServerMap& Servers)
+		: HTTPRequestEventListener(Creator)
+		, creator(Creator)
+		, httpd(Creator)
+		, servers(Servers)
+	{
+	}
+
+	ModResult OnHTTPRequest(HTTPRequest& req) CXX11_OVERRIDE
+	{
+		const std::string& path = req.GetPath();
+		if (path != "/unlinked" && path != "/unlinked/")
+			return MOD_RES_PASSTHRU;
+
+		unsigned long unlinked = 0;
+		std::stringstream sstr;
+		sstr << "{\"servers\":[";
+		for (LinkableServerMap::const_iterator it = servers.begin(); it != servers.end(); ++it)
 		{
-			if (it->servername == serverName)
-				return true;
+			if (it != servers.begin())
+				sstr << ",";
+			sstr << "{\"name\":\"" << it->first << "\""
+				<< ",\"port\":" << it->second.port
+				<< ",\"linked\":" << (it->second.linked ? "true" : "false")
+				<< ",\"since\":" << it->second.since << "}";
+
+			if (!it->second.linked)
+				unlinked++;
 		}
-		return false;
+		sstr << "],\"unlinked\":" << unlinked << "}";
+
+		HTTPDocumentResponse response(creator, req, &sstr, 200);
+		response.headers.SetHeader("X-Powered-By", MODNAME);
+		response.headers.SetHeader("Content-Type", "application/json");
+		httpd->SendResponse(response);
+		return MOD_RES_DENY;
+	}
+};
+
+class ModuleStatsUnlinked
+	: public Module
+	, public Stats::EventListener
+	, public ServerProtocol::LinkEventListener
+{
+ private:
+	LinkableServerMap LinkableServers;
+	UnlinkedHTTPApi httpapi;
+
+	void SetLinked(const std::string& serverName, bool linked)
+	{
+		LinkableServerMap::iterator it = LinkableServers.find(serverName);
+		if (it == LinkableServers.end() || it->second.linked == linked)
+			return;
+
+		it->second.linked = linked;
+		it->second.since = ServerInstance->Time();
 	}
 
  public:
+	using ServerProtocol::LinkEventListener::OnServerSplit;
+
 	ModuleStatsUnlinked()
-		:  Stats::EventListener(this)
+		: Stats::EventListener(this)
+		, ServerProtocol::LinkEventListener(this)
+		, httpapi(this, LinkableServers)
 	{
 	}
 
 	void ReadConfig(ConfigStatus&) CXX11_OVERRIDE
 	{
-		LinkableServers.clear();
+		LinkableServerMap newservers;
 
 		ConfigTagList tags = ServerInstance->Config->ConfTags("link");
 		for (ConfigIter it = tags.first; it != tags.second; ++it)
@@ -59,9 +141,51 @@ class ModuleStatsUnlinked : public Module, public Stats::EventListener
 			{
 				// There is currently no way to prioritize the init() function so we
 				// reimplement the checks from m_spanningtree here.
-				LinkableServers[serverName] = serverPort;
+				LinkableServer& server = newservers[serverName];
+				server.port = serverPort;
+
+				// Servers which were already known keep their state.
+				LinkableServerMap::const_iterator oldserver = LinkableServers.find(serverName);
+				if (oldserver != LinkableServers.end())
+				{
+					server.linked = oldserver->second.linked;
+					server.since = oldserver->second.since;
+				}
 			}
 		}
+		LinkableServers.swap(newservers);
+
+		// Find out which servers are linked now. After this the link events keep it up to date.
+		ProtocolInterface::ServerList linkedServers;
+		ServerInstance->PI->GetServerList(linkedServers);
+		for (LinkableServerMap::iterator it = LinkableServers.begin(); it != LinkableServers.end(); ++it)
+		{
+			bool linked = false;
+			for (ProtocolInterface::ServerList::const_iterator sit = linkedServers.begin(); sit != linkedServers.end(); ++sit)
+			{
+				if (sit->servername == it->first)
+				{
+					linked = true;
+					break;
+				}
+			}
+
+			if (it->second.linked != linked || !it->second.since)
+			{
+				it->second.linked = linked;
+				it->second.since = ServerInstance->Time();
+			}
+		}
+	}
+
+	void OnServerLink(const Server* server) CXX11_OVERRIDE
+	{
+		SetLinked(server->GetName(), true);
+	}
+
+	void OnServerSplit(const Server* server, bool error) CXX11_OVERRIDE
+	{
+		SetLinked(server->GetName(), false);
 	}
 
 	ModResult OnStats(Stats::Context& stats) CXX11_OVERRIDE
@@ -69,15 +193,12 @@ class ModuleStatsUnlinked : public Module, public Stats::EventListener
 		if (stats.GetSymbol() != 'X')
 			return MOD_RES_PASSTHRU;
 
-		ProtocolInterface::ServerList linkedServers;
-		ServerInstance->PI->GetServerList(linkedServers);
-
-		for (std::map<std::string, unsigned int>::const_iterator it = LinkableServers.begin(); it != LinkableServers.end(); ++it)
+		for (LinkableServerMap::const_iterator it = LinkableServers.begin(); it != LinkableServers.end(); ++it)
 		{
-			if (!IsServerLinked(linkedServers, it->first))
+			if (!it->second.linked)
 			{
 				// ProtoServer does not have a port so we use the port from the config here.
-				stats.AddRow(247, " X " + it->first + " " + ConvToStr(it->second));
+				stats.AddRow(247, " X " + it->first + " " + ConvToStr(it->second.port));
 			}
 		}
 		return MOD_RES_DENY;
@@ -90,4 +211,3 @@ class ModuleStatsUnlinked : public Module, public Stats::EventListener
 };
 
 MODULE_INIT(ModuleStatsUnlinked)
-
@@ -34,8 +34,101 @@ enum
 // Represents a list of teams that a user is a member of.
 typedef insp::flat_set<std::string, irc::insensitive_swo> TeamList;
 
+// Represents the users who are a member of a team.
+typedef insp::flat_set<User*> TeamMembers;
+
+// Maps team names to the users who are a member of them.
+typedef insp::flat_map<std::string, TeamMembers, irc::insensitive_swo> TeamIndex;
+
+// Represents the team part of a t: extban which has been classified.
+struct TeamMask
+{
+	// The mask with the t: prefix removed.
+	std::string team;
+
+	// Whether the mask contains glob characters and has to be matched.
+	bool glob;
+
+	TeamMask(const std::string& mask)
+		: team(mask, 2)
+		, glob(team.find_first_of("*?") != std::string::npos)
+	{
+	}
+};
+
+// Caches classified t: extbans. These can't go stale so the cache is simply
+// emptied once it holds too many masks.
+class TeamMaskCache
+{
+ private:
+	typedef TR1NS::unordered_map<std::string, TeamMask> MaskMap;
+	MaskMap masks;
+	static const size_t maxcache = 4096;
+
+ public:
+	static bool IsTeamBan(const std::string& mask)
+	{
+		return mask.length() > 2 && mask[0] == 't' && mask[1] == ':';
+	}
+
+	const TeamMask& Get(const std::string& mask)
+	{
+		MaskMap::const_iterator iter = masks.find(mask);
+		if (iter != masks.end())
+			return iter->second;
+
+		if (masks.size() >= maxcache)
+			masks.clear();
+
+		return masks.insert(std::make_pair(mask, TeamMask(mask))).first->second;
+	}
+};
+
+class TeamBanWatcher : public ModeWatcher
+{
+ private:
+	TeamMaskCache& cache;
+
+ public:
+	TeamBanWatcher(Module* Creator, TeamMaskCache& Cache)
+		: ModeWatcher(Creator, "ban", MODETYPE_CHANNEL)
+		, cache(Cache)
+	{
+	}
+
+	void AfterMode(User*, User*, Channel*, const std::string& parameter, bool adding) CXX11_OVERRIDE
+	{
+		// Classify new team bans when they are set rather than when first checked.
+		if (adding && TeamMaskCache::IsTeamBan(parameter))
+			cache.Get(parameter);
+	}
+};
+
 class TeamExt : public SimpleExtItem<TeamList>
 {
+ private:
+	TeamIndex index;
+
+	void AddToIndex(User* user, const TeamList& teams)
+	{
+		for (TeamList::const_iterator iter = teams.begin(); iter != teams.end(); ++iter)
+			index[*iter].insert(user);
+	}
+
+	void RemoveFromIndex(User* user, const TeamList& teams)
+	{
+		for (TeamList::const_iterator iter = teams.begin(); iter != teams.end(); ++iter)
+		{
+			TeamIndex::iterator members = index.find(*iter);
+			if (members == index.end())
+				continue;
+
+			members->second.erase(user);
+			if (members->second.empty())
+				index.erase(members);
+		}
+	}
+
  public:
 	TeamExt(Module* Creator)
 		: SimpleExtItem<TeamList>("teams", ExtensionItem::EXT_USER, Creator)
@@ -59,15 +152,36 @@ class TeamExt : public SimpleExtItem<TeamList>
 		if (newteamlist->empty())
 		{
 			// If the new team list is empty then delete both the new and old team lists.
-			unset(container);
+			Remove(static_cast<User*>(container));
 			delete newteamlist;
 		}
 		else
 		{
 			// Otherwise install the new team list.
-			set(container, newteamlist);
+			User* user = static_cast<User*>(container);
+			TeamList* oldteamlist = get(user);
+			if (oldteamlist)
+				RemoveFromIndex(user, *oldteamlist);
+			AddToIndex(user, *newteamlist);
+			set(user, newteamlist);
 		}
 	}
+
+	const TeamMembers* GetMembers(const std::string& team) const
+	{
+		TeamIndex::const_iterator iter = index.find(team);
+		return iter != index.end() ? &iter->second : NULL;
+	}
+
+	void Remove(User* user)
+	{
+		TeamList* teamlist = get(user);
+		if (!teamlist)
+			return;
+
+		RemoveFromIndex(user, *teamlist);
+		unset(user);
+	}
 };
 
 class ModuleTeams
@@ -77,23 +191,27 @@ class ModuleTeams
  private:
 	bool active;
 	TeamExt ext;
+	TeamMaskCache maskcache;
+	TeamBanWatcher banwatcher;
 	std::string teamchar;
 
 	size_t ExecuteCommand(LocalUser* source, const char* cmd, CommandBase::Params& parameters,
 		const std::string& team, size_t nickindex)
 	{
+		const TeamMembers* members = ext.GetMembers(team);
+		if (!members)
+			return 0;
+
+		// Copy the members in case a command handler changes the team index.
+		const std::vector<User*> users(members->begin(), members->end());
+
 		size_t targets = 0;
 		std::string command(cmd);
-		const user_hash& users = ServerInstance->Users->GetUsers();
-		for (user_hash::const_iterator iter = users.begin(); iter != users.end(); ++iter)
+		for (std::vector<User*>::const_iterator iter = users.begin(); iter != users.end(); ++iter)
 		{
-			User* user = iter->second;
+			User* user = *iter;
 			if (user->registered != REG_ALL)
 				continue;
-	
-			TeamList* teams = ext.get(user);
-			if (!teams || teams->count(team))
-				continue;
 
 			parameters[nickindex] = user->nick;
 			ModResult modres;
@@ -112,7 +230,7 @@ class ModuleTeams
 		if (param.length() <= teamchar.length() || param.compare(0, teamchar.length(), teamchar) != 0)
 			return false;
 
-		team.assign(param, teamchar.length() - 1, std::string::npos);
+		team.assign(param, teamchar.length(), std::string::npos);
 		return true;
 	}
 
@@ -135,6 +253,7 @@ class ModuleTeams
 		: Whois::EventListener(this)
 		, active(false)
 		, ext(this)
+		, banwatcher(this, maskcache)
 	{
 	}
 
@@ -151,23 +270,32 @@ class ModuleTeams
 
 	ModResult OnCheckBan(User* user, Channel* channel, const std::string& mask) CXX11_OVERRIDE
 	{
-		if (mask.length() <= 2 || mask[0] != 't' || mask[1] != ':')
+		if (!TeamMaskCache::IsTeamBan(mask))
 			return MOD_RES_PASSTHRU;
 
 		TeamList* teams = ext.get(user);
 		if (!teams)
 			return MOD_RES_PASSTHRU;
 
-		const std::string submask = mask.substr(2);
+		// Masks without glob characters only need a lookup.
+		const TeamMask& teammask = maskcache.Get(mask);
+		if (!teammask.glob)
+			return teams->count(teammask.team) ? MOD_RES_DENY : MOD_RES_PASSTHRU;
+
 		for (TeamList::const_iterator iter = teams->begin(); iter != teams->end(); ++iter)
 		{
-			if (InspIRCd::Match(*iter, submask))
+			if (InspIRCd::Match(*iter, teammask.team))
 				return MOD_RES_DENY;
 		}
 
 		return MOD_RES_PASSTHRU;
 	}
 
+	void OnUserQuit(User* user, const std::string&, const std::string&) CXX11_OVERRIDE
+	{
+		ext.Remove(user);
+	}
+
 	ModResult OnPreCommand(std::string& command, CommandBase::Params& parameters, LocalUser* user, bool validated) CXX11_OVERRIDE
 	{
 		if (user->registered != REG_ALL || !validated || active)
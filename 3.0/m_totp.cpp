@@ -128,17 +128,42 @@ class TOTP
 	{
 	}
 
-	std::string Generate(const std::string secret, unsigned long time = 0)
+	// The padded HMAC keys for a secret, prepared once per validation.
+	struct HMACKey
 	{
-		if (!Hash)
-			return "";
+		std::string inner;
+		std::string outer;
+	};
 
-		std::vector<uint8_t> challenge(8);
+	void PrepareKey(const std::string& secret, HMACKey& hkey)
+	{
+		std::string key = Base32::Decode(secret);
+		if (key.length() > Hash->block_size)
+			key = Hash->GenerateRaw(key);
+		key.resize(Hash->block_size);
+
+		hkey.inner.resize(Hash->block_size);
+		hkey.outer.resize(Hash->block_size);
+		for (size_t i = 0; i < key.length(); ++i)
+		{
+			hkey.inner[i] = static_cast<char>(key[i] ^ 0x36);
+			hkey.outer[i] = static_cast<char>(key[i] ^ 0x5C);
+		}
+	}
+
+	std::string Generate(const HMACKey& hkey, unsigned long time)
+	{
+		char challenge[8];
 		for (int i = 8; i--; time >>= 8)
-			challenge[i] = time;
+			challenge[i] = static_cast<char>(time & 0xFF);
 
-		std::string key = Base32::Decode(secret);
-		std::string hash = Hash->hmac(key, std::string(challenge.begin(), challenge.end()));
+		std::string buffer(hkey.inner);
+		buffer.append(challenge, sizeof(challenge));
+		const std::string inner = Hash->GenerateRaw(buffer);
+
+		buffer.assign(hkey.outer);
+		buffer.append(inner);
+		const std::string hash = Hash->GenerateRaw(buffer);
 
 		int offset = hash[Hash->out_size - 1] & 0xF;
 		unsigned int truncatedHash = 0;
@@ -158,11 +183,24 @@ class TOTP
 
 	bool Validate(const std::string& secret, const std::string& code)
 	{
-		unsigned long time = (ServerInstance->Time() - 30 * Window) / 30;
-		unsigned long time_end = (ServerInstance->Time() + 30 * Window) / 30;
-		for (; time < time_end; ++time)
-			if (Generate(secret, time) == code)
+		if (!Hash)
+			return false;
+
+		HMACKey hkey;
+		PrepareKey(secret, hkey);
+
+		// Most codes are for the current step so check it first.
+		const unsigned long now = ServerInstance->Time() / 30;
+		if (InspIRCd::TimingSafeCompare(Generate(hkey, now), code))
+			return true;
+
+		for (unsigned long step = 1; step <= static_cast<unsigned long>(Window); ++step)
+		{
+			if (InspIRCd::TimingSafeCompare(Generate(hkey, now - step), code))
 				return true;
+			if (InspIRCd::TimingSafeCompare(Generate(hkey, now + step), code))
+				return true;
+		}
 		return false;
 	}
 };
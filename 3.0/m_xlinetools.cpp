@@ -19,7 +19,8 @@
 /// $ModAuthor: genius3000
 /// $ModAuthorMail: genius3000@g3k.solutions
 /// $ModDepends: core 3
-/// $ModDesc: X-line management with XCOPY, XCOUNT, XREMOVE, and XSEARCH
+/// $ModConfig: <xlinetools aggregatemin="0" aggregatev4="24" aggregatev6="64" aggregateall="no">
+/// $ModDesc: X-line management with XAGGREGATE, XCOPY, XCOUNT, XREMOVE, and XSEARCH
 
 /* XCOUNT, XREMOVE, and XSEARCH are the same except for the end action:
  * XCOUNT will just return a count of matching X-lines.
@@ -35,31 +36,54 @@
  * -duration=<time string> (actual set duration) Exact match, prefix '+' for longer than, or '-' for shorter than
  * -expires=<time string> (time ahead) Prefix with '+' for more than
  * -config=<yes|no> Only match or don't match config lines
+ * -offset=<number> (XSEARCH only) Skip this many matches before listing
+ * -limit=<number> (XSEARCH only) List at most this many matches
+ *
+ * -snapshot=<yes|no> (XCOUNT and XSEARCH only) Match against a copy of the
+ *   X-lines on a separate thread instead of holding up the server
+ *
+ * Long XSEARCH results are sent a page per second, slowing down
+ * further if the oper's SendQ starts to fill up.
  *
  * XCOPY copies a specified X-line (by type and mask) to a
  * new X-line of same type with a new mask.
  * Original reason and expiry time are copied but can be
  * overridden with the 'duration' or 'reason' arguments.
  *
- * Note: Both XCOPY and XREMOVE will check for the appropriate
+ * XAGGREGATE replaces clusters of single address Z-lines with one
+ * Z-line on the range covering them. Any range (by default a /24 for
+ * IPv4 and a /64 for IPv6) holding at least the given number of Z-lines
+ * gets a Z-line which expires when the last of them would have, or never
+ * if any of them is permanent.
+ * Setting <xlinetools:aggregatemin> does this automatically every minute,
+ * but only for Z-lines set by a server (such as those from connectban or
+ * dnsbl) unless <xlinetools:aggregateall> is enabled.
+ *
+ * Note: XAGGREGATE, XCOPY and XREMOVE will check for the appropriate
  * command permissions before acting.
  */
 
 /* Helpop Lines for the COPER section
  * Find: '<helpop key="coper" title="Oper Commands" value="'
- * Add 'XCOPY XCOUNT XREMOVE XSEARCH' before 'ZLINE'
+ * Add 'XAGGREGATE XCOPY XCOUNT XREMOVE XSEARCH' before 'ZLINE'
  * and space accordingly to match.
  * Find: '<helpop key="kline" ...'
  * Place just above that line:
+<helpop key="xaggregate" title="/XAGGREGATE <minimum> [IPv4 prefix] [IPv6 prefix]" value="
+Replaces the single address Z-lines in any IPv4 (default /24) or IPv6 (default /64) range
+holding at least <minimum> of them with one Z-line on the range.
+">
+
 <helpop key="xcopy" title="/XCOPY <X-line type> <old mask> <new mask> [-duration=<> -reason=<>]" value="
 Copies the specified X-line (if found) to a new X-line. The original reason and expiry time
 are copied unless overridden with '-duration=' or '-reason='
 ">
 
-<helpop key="xcount" title="/XCOUNT -type=<X-line type|*> -mask=[!]<m> -reason=[!]<r> -source=[!]<s> -set=[-]<t> -duration=[-+]<t> -expires=[+]<t> -config=<yes|no>" value="
+<helpop key="xcount" title="/XCOUNT -type=<X-line type|*> -mask=[!]<m> -reason=[!]<r> -source=[!]<s> -set=[-]<t> -duration=[-+]<t> -expires=[+]<t> -config=<yes|no> -snapshot=<yes|no>" value="
 Returns a count of matching X-lines of the specified type (or all types). Mask(m) supports CIDR, reason(r) can include spaces, source(s)
 is a nick or server, config (yes or no) will either match only config lines or none. 'Prefix your value for these 3 arguments with a '!' to negate
-the match. 't' is a time-string (seconds or 1y2w3d4h5m6s) and can be prefixed with '+' or '-' to adjust matching. All arguments are optional.
+the match. 't' is a time-string (seconds or 1y2w3d4h5m6s) and can be prefixed with '+' or '-' to adjust matching. Snapshot (yes or no) will
+match a copy of the X-lines in the background. All arguments are optional.
 ">
 
 <helpop key="xremove" title="/XREMOVE -type=<X-line type|*> -mask=[!]<m> -reason=[!]<r> -source=[!]<s> -set=[-]<t> -duration=[-+]<t> -expires=[+]<t> -config=<yes|no>" value="
@@ -69,16 +93,19 @@ the match. 't' is a time-string (seconds or 1y2w3d4h5m6s) and can be prefixed wi
 Use /XSEARCH to test before removing.
 ">
 
-<helpop key="xsearch" title="/XSEARCH -type=<X-line type|*> -mask=[!]<m> -reason=[!]<r> -source=[!]<s> -set=[-]<t> -duration=[-+]<t> -expires=[+]<t> -config=<yes|no>" value="
+<helpop key="xsearch" title="/XSEARCH -type=<X-line type|*> -mask=[!]<m> -reason=[!]<r> -source=[!]<s> -set=[-]<t> -duration=[-+]<t> -expires=[+]<t> -config=<yes|no> -offset=<n> -limit=<n> -snapshot=<yes|no>" value="
 Lists matching X-lines of the specified type (or all types). Mask(m) supports CIDR, reason(r) can include spaces, source(s)
 is a nick or server, config (yes or no) will either match only config lines or none. Prefix your value for these 3 arguments with a '!' to negate
-the match. 't' is a time-string (seconds or 1y2w3d4h5m6s) and can be prefixed with '+' or '-' to adjust matching. All arguments are optional.
+the match. 't' is a time-string (seconds or 1y2w3d4h5m6s) and can be prefixed with '+' or '-' to adjust matching. Offset and limit(n) page
+through the matches. Snapshot (yes or no) will match a copy of the X-lines in the background. All arguments are optional.
+Long lists are sent a page at a time.
 ">
 
  */
 
 
 #include "inspircd.h"
+#include "threadengine.h"
 #include "xline.h"
 
 namespace
@@ -100,13 +127,19 @@ namespace
 		std::string set;
 		std::string duration;
 		std::string expires;
+		unsigned long offset;
+		unsigned long limit;
+		bool snapshot;
 
-		Criteria() { }
+		Criteria() : offset(0), limit(0), snapshot(false) { }
 		Criteria(const std::string& t, const std::string& m, const std::string& r, const std::string& s)
 			: type(t)
 			, mask(m)
 			, reason(r)
 			, source(s)
+			, offset(0)
+			, limit(0)
+			, snapshot(false)
 		{
 			config = MATCH_ANY;
 		}
@@ -137,6 +170,9 @@ namespace
 		const std::string mset("-set=");
 		const std::string mduration("-duration=");
 		const std::string mexpires("-expires=");
+		const std::string moffset("-offset=");
+		const std::string mlimit("-limit=");
+		const std::string msnapshot("-snapshot=");
 
 		for (std::vector<std::string>::const_iterator p = params.begin(); p != params.end(); ++p)
 		{
@@ -208,6 +244,22 @@ namespace
 				const std::string val(param.substr(mexpires.length()));
 				args.expires = ServerInstance->IsValidDuration(val[0] == '+' ? val.substr(1) : val) ? val : "";
 			}
+			else if (irc::find(param, moffset) != std::string::npos)
+			{
+				argreason = false;
+				args.offset = ConvToNum<unsigned long>(param.substr(moffset.length()));
+			}
+			else if (irc::find(param, mlimit) != std::string::npos)
+			{
+				argreason = false;
+				args.limit = ConvToNum<unsigned long>(param.substr(mlimit.length()));
+			}
+			else if (irc::find(param, msnapshot) != std::string::npos)
+			{
+				argreason = false;
+				const std::string val(param.substr(msnapshot.length()));
+				args.snapshot = (irc::equals(val, "yes") || irc::equals(val, "true"));
+			}
 			else
 			{
 				if (argreason)
@@ -239,6 +291,10 @@ namespace
 			criteria.append("Duration: " + args.duration + sep);
 		if (!args.expires.empty())
 			criteria.append("Expires: " + args.expires + sep);
+		if (args.offset)
+			criteria.append("Offset: " + ConvToStr(args.offset) + sep);
+		if (args.limit)
+			criteria.append("Limit: " + ConvToStr(args.limit) + sep);
 
 		if (criteria.empty())
 			criteria.append("No specific criteria");
@@ -249,6 +305,127 @@ namespace
 		return criteria;
 	}
 
+	// A glob criterion with the negation prefix already stripped.
+	struct GlobCriterion
+	{
+		bool any;
+		bool negate;
+		std::string pattern;
+
+		GlobCriterion(const std::string& value)
+			: any(value == "*")
+			, negate(!value.empty() && value[0] == '!')
+			, pattern(negate ? value.substr(1) : value)
+		{
+		}
+
+		bool Matches(const std::string& str) const
+		{
+			return any || (InspIRCd::Match(str, pattern) != negate);
+		}
+
+		// CIDR and glob mask matching.
+		// MatchCIDR takes the first argument as a non-CIDR address, so run it both ways.
+		bool MatchesMask(const std::string& mask) const
+		{
+			return any || ((InspIRCd::MatchCIDR(mask, pattern) || InspIRCd::MatchCIDR(pattern, mask)) != negate);
+		}
+	};
+
+	// The criteria of a search worked out once so they can be checked against
+	// every X-line without any parsing or allocation.
+	class CompiledCriteria
+	{
+		MatchType config;
+		GlobCriterion mask;
+		GlobCriterion reason;
+		GlobCriterion source;
+
+		bool hasset;
+		bool setprefixed;
+		time_t setbound;
+
+		bool hasduration;
+		bool nodurationwanted;
+		char durationprefix;
+		unsigned long duration;
+
+		bool hasexpires;
+		bool expiresprefixed;
+		unsigned long expiresbound;
+
+	 public:
+		CompiledCriteria(const Criteria& args)
+			: config(args.config)
+			, mask(args.mask)
+			, reason(args.reason)
+			, source(args.source)
+			, hasset(!args.set.empty())
+			, setprefixed(hasset && args.set[0] == '-')
+			, setbound(0)
+			, hasduration(!args.duration.empty())
+			, nodurationwanted(args.duration == "0")
+			, durationprefix(0)
+			, duration(0)
+			, hasexpires(!args.expires.empty())
+			, expiresprefixed(hasexpires && args.expires[0] == '+')
+			, expiresbound(0)
+		{
+			if (hasset)
+				setbound = ServerInstance->Time() - ServerInstance->Duration(setprefixed ? args.set.substr(1) : args.set);
+
+			if (hasduration)
+			{
+				if (args.duration[0] == '+' || args.duration[0] == '-')
+					durationprefix = args.duration[0];
+				duration = ServerInstance->Duration(durationprefix ? args.duration.substr(1) : args.duration);
+			}
+
+			if (hasexpires)
+				expiresbound = ServerInstance->Time() + ServerInstance->Duration(expiresprefixed ? args.expires.substr(1) : args.expires);
+		}
+
+		bool Matches(XLine* xline) const
+		{
+			return Matches(xline->from_config, xline->Displayable(), xline->reason, xline->source, xline->set_time, xline->duration);
+		}
+
+		// Only reads its arguments and members so it is also safe to call from a thread.
+		bool Matches(bool from_config, const std::string& display, const std::string& xreason, const std::string& xsource, time_t set_time, unsigned long xduration) const
+		{
+			// Config X-line matching
+			// For legacy purposes, check for a source of '<Config>' as well.
+			if ((config == MATCH_ONLY && (!from_config && xsource != "<Config>"))
+			   || (config == MATCH_NONE && (from_config || xsource == "<Config>")))
+				return false;
+
+			// Mask, reason and source matching, with negation
+			if (!mask.MatchesMask(display) || !reason.Matches(xreason) || !source.Matches(xsource))
+				return false;
+
+			// Set (time ago): Prefix '-' means less than; no prefix means more than; both match exact (to the second)
+			if (hasset && ((setprefixed && set_time < setbound) || (!setprefixed && set_time > setbound)))
+				return false;
+
+			// Duration: Prefix '+' means longer than; '-' means shorter than; no prefix means exact; '0' matches no expiry
+			if (hasduration &&
+			   ((xduration == 0 && !nodurationwanted) ||
+			    (durationprefix == '+' && xduration <= duration) ||
+			    (durationprefix == '-' && xduration >= duration) ||
+			    (!durationprefix && xduration != duration)))
+				return false;
+
+			// Expires (time ahead): Prefix '+' means more than; no prefix means less than; both match exact (to the second)
+			if (hasexpires &&
+			   ((xduration == 0) ||
+			    (expiresprefixed && set_time + xduration < expiresbound) ||
+			    (!expiresprefixed && set_time + xduration > expiresbound)))
+				return false;
+
+			return true;
+		}
+	};
+
 	const std::string BuildTypeStr(const std::string& type)
 	{
 		std::string typestr;
@@ -264,151 +441,455 @@ namespace
 	}
 }
 
-class CommandXBase : public SplitCommand
+// An X-line which matched an XREMOVE and is waiting to be removed.
+struct PendingRemoval
 {
-	void ProcessLines(LocalUser* user, const Criteria& args, const std::string& linetype, XLineLookup* xlines, unsigned int& matched, unsigned int& total, const bool count, const bool remove)
+	std::string type;
+	std::string mask;
+	std::string reason;
+
+	PendingRemoval(const std::string& t, const std::string& m, const std::string& r)
+		: type(t)
+		, mask(m)
+		, reason(r)
 	{
-		total += xlines->size();
-		LookupIter safei;
-		bool negate;
-		bool match;
+	}
+};
+typedef std::vector<PendingRemoval> RemovalList;
 
-		for (LookupIter i = xlines->begin(); i != xlines->end(); )
+// An X-line which matched an XSEARCH, copied so it can still be listed after the X-line is gone.
+struct SearchResult
+{
+	std::string type;
+	std::string mask;
+	std::string source;
+	std::string reason;
+	time_t set_time;
+	unsigned long duration;
+	time_t expiry;
+	bool from_config;
+
+	SearchResult(const std::string& t, XLine* xline)
+		: type(t)
+		, mask(xline->Displayable())
+		, source(xline->source)
+		, reason(xline->reason)
+		, set_time(xline->set_time)
+		, duration(xline->duration)
+		, expiry(xline->expiry)
+		, from_config(xline->from_config)
+	{
+	}
+
+	std::string Format() const
+	{
+		std::string expires;
+		if (duration == 0)
+			expires = "doesn't expire";
+		else
+			expires = InspIRCd::Format("expires in %s (on %s)",
+				InspIRCd::DurationString(expiry - ServerInstance->Time()).c_str(),
+				ServerInstance->TimeString(expiry).c_str());
+
+		return InspIRCd::Format("%s on %s set by %s on %s, duration '%s', %s: %s",
+			BuildTypeStr(type).c_str(), mask.c_str(), source.c_str(),
+			ServerInstance->TimeString(set_time).c_str(),
+			(duration == 0 ? "permanent" : InspIRCd::DurationString(duration).c_str()),
+			expires.c_str(), reason.c_str());
+	}
+};
+typedef std::vector<SearchResult> ResultList;
+
+// The page of matches an XSEARCH wants listed.
+struct SearchPage
+{
+	unsigned long offset;
+	unsigned long limit;
+	ResultList results;
+
+	SearchPage(const Criteria& args)
+		: offset(args.offset)
+		, limit(args.limit)
+	{
+	}
+
+	// Whether the match at the given position (from zero) is on this page.
+	bool Wanted(unsigned long pos) const
+	{
+		return pos >= offset && (!limit || pos - offset < limit);
+	}
+};
+
+/** Sends long XSEARCH results a page at a time so that a broad search can't
+ * fill an oper's SendQ and get them disconnected. Each oper has at most one
+ * listing in progress and a new search replaces it.
+ */
+class SearchStreamer : public Timer
+{
+	struct Cursor
+	{
+		ResultList results;
+		size_t next;
+		std::string footer;
+	};
+
+	typedef std::map<std::string, Cursor> CursorMap;
+	CursorMap cursors;
+
+	// Whether the user has room in their SendQ for more output.
+	static bool HasRoom(LocalUser* user)
+	{
+		return user->eh.getSendQSize() < user->GetClass()->GetSendqHardMax() / 2;
+	}
+
+	// Sends up to a page of results, returns true once all of them are sent.
+	static bool SendPage(LocalUser* user, Cursor& cursor)
+	{
+		for (size_t sent = 0; cursor.next < cursor.results.size(); ++sent, ++cursor.next)
 		{
-			safei = i;
-			safei++;
+			if (sent >= pagesize || !HasRoom(user))
+				return false;
 
-			XLine* xline = i->second;
+			user->WriteNotice(cursor.results[cursor.next].Format());
+		}
 
-			// Config X-line matching
-			// For legacy purposes, check for a source of '<Config>' as well.
-			if ((args.config == MATCH_ONLY && (!xline->from_config && xline->source != "<Config>"))
-			   || (args.config == MATCH_NONE && (xline->from_config || xline->source == "<Config>")))
-			{
-				i = safei;
-				continue;
-			}
+		user->WriteNotice(cursor.footer);
+		return true;
+	}
 
-			// CIDR and glob mask matching, with negation
-			// MatchCIDR takes the first argument as a non-CIDR address, so run it both ways.
-			negate = args.mask[0] == '!';
-			match = InspIRCd::MatchCIDR(xline->Displayable(), (negate ? args.mask.substr(1) : args.mask)) ||
-				InspIRCd::MatchCIDR((negate ? args.mask.substr(1) : args.mask), xline->Displayable());
-			if ((negate && match) || (!negate && !match))
-			{
-				i = safei;
+ public:
+	// The most results sent to an oper per second.
+	static const size_t pagesize = 100;
+
+	SearchStreamer()
+		: Timer(1, true)
+	{
+	}
+
+	void Send(LocalUser* user, ResultList& results, const std::string& footer)
+	{
+		CursorMap::iterator it = cursors.find(user->uuid);
+		if (it != cursors.end())
+		{
+			user->WriteNotice(InspIRCd::Format("Abandoned the previous search with %u results left to list",
+				static_cast<unsigned int>(it->second.results.size() - it->second.next)));
+			cursors.erase(it);
+		}
+
+		Cursor cursor;
+		cursor.results.swap(results);
+		cursor.next = 0;
+		cursor.footer = footer;
+
+		if (SendPage(user, cursor))
+			return;
+
+		user->WriteNotice(InspIRCd::Format("Listing the remaining %u results at up to %u per second",
+			static_cast<unsigned int>(cursor.results.size() - cursor.next), static_cast<unsigned int>(pagesize)));
+		Cursor& stored = cursors[user->uuid];
+		stored.results.swap(cursor.results);
+		stored.next = cursor.next;
+		stored.footer = footer;
+	}
+
+	bool Tick(time_t) CXX11_OVERRIDE
+	{
+		for (CursorMap::iterator i = cursors.begin(); i != cursors.end(); )
+		{
+			LocalUser* user = IS_LOCAL(ServerInstance->FindUUID(i->first));
+			if (!user || user->quitting || SendPage(user, i->second))
+				cursors.erase(i++);
+			else
+				++i;
+		}
+		return true;
+	}
+};
+
+// An XCOUNT or XSEARCH over a copy of the X-lines which is matched on the SnapshotSearcher thread.
+struct SnapshotJob
+{
+	std::string uuid;
+	bool count;
+	std::string typestr;
+	std::string criteriastr;
+	CompiledCriteria criteria;
+	ResultList lines;
+	SearchPage page;
+	unsigned int matched;
+
+	SnapshotJob(LocalUser* user, bool c, const Criteria& args)
+		: uuid(user->uuid)
+		, count(c)
+		, criteriastr(BuildCriteriaStr(args))
+		, criteria(args)
+		, page(args)
+		, matched(0)
+	{
+	}
+
+	void Add(const std::string& linetype, XLineLookup* xlines)
+	{
+		for (LookupIter i = xlines->begin(); i != xlines->end(); ++i)
+			lines.push_back(SearchResult(linetype, i->second));
+	}
+
+	// Runs on the SnapshotSearcher thread.
+	void Run()
+	{
+		for (ResultList::const_iterator i = lines.begin(); i != lines.end(); ++i)
+		{
+			if (!criteria.Matches(i->from_config, i->mask, i->reason, i->source, i->set_time, i->duration))
 				continue;
-			}
 
-			// Glob reason matching, with negation
-			negate = args.reason[0] == '!';
-			match = InspIRCd::Match(xline->reason, (negate ? args.reason.substr(1) : args.reason));
-			if ((negate && match) || (!negate && !match))
+			if (!count && page.Wanted(matched))
+				page.results.push_back(*i);
+			matched++;
+		}
+	}
+};
+
+/** Matches snapshots of the X-lines on a separate thread so that a search
+ * over many X-lines doesn't hold up the server. The results are sent from
+ * the main thread once the match is finished.
+ */
+class SnapshotSearcher : public SocketThread
+{
+	SearchStreamer& streamer;
+	std::deque<SnapshotJob*> queue;
+	std::deque<SnapshotJob*> finished;
+	bool started;
+
+ public:
+	SnapshotSearcher(SearchStreamer& Streamer)
+		: streamer(Streamer)
+		, started(false)
+	{
+	}
+
+	~SnapshotSearcher()
+	{
+		if (started)
+		{
+			this->LockQueue();
+			this->SetExitFlag();
+			this->UnlockQueueWakeup();
+			this->join();
+		}
+		stdalgo::delete_all(queue);
+		stdalgo::delete_all(finished);
+	}
+
+	void Start()
+	{
+		ServerInstance->Threads.Start(this);
+		started = true;
+	}
+
+	// Takes ownership of the job.
+	void Queue(SnapshotJob* job)
+	{
+		this->LockQueue();
+		queue.push_back(job);
+		this->UnlockQueueWakeup();
+	}
+
+	void Run() CXX11_OVERRIDE
+	{
+		this->LockQueue();
+		while (!this->GetExitFlag())
+		{
+			if (queue.empty())
 			{
-				i = safei;
+				this->WaitForQueue();
 				continue;
 			}
 
-			// Glob source matching, with negation
-			negate = args.source[0] == '!';
-			match = InspIRCd::Match(xline->source, (negate ? args.source.substr(1) : args.source));
-			if ((negate && match) || (!negate && !match))
+			SnapshotJob* job = queue.front();
+			queue.pop_front();
+			this->UnlockQueue();
+
+			job->Run();
+
+			this->LockQueue();
+			finished.push_back(job);
+			this->NotifyParent();
+		}
+		this->UnlockQueue();
+	}
+
+	void OnNotify() CXX11_OVERRIDE
+	{
+		std::deque<SnapshotJob*> done;
+		this->LockQueue();
+		done.swap(finished);
+		this->UnlockQueue();
+
+		for (std::deque<SnapshotJob*>::const_iterator i = done.begin(); i != done.end(); ++i)
+		{
+			SnapshotJob* job = *i;
+			LocalUser* user = IS_LOCAL(ServerInstance->FindUUID(job->uuid));
+			if (user && !user->quitting)
 			{
-				i = safei;
-				continue;
+				const unsigned int total = job->lines.size();
+				if (job->count)
+					user->WriteNotice(InspIRCd::Format("%u of %u X-lines%s matched (%s)",
+						job->matched, total, job->typestr.c_str(), job->criteriastr.c_str()));
+				else
+					streamer.Send(user, job->page.results, InspIRCd::Format("End of list, %u/%u X-lines%s matched",
+						job->matched, total, job->typestr.c_str()));
 			}
+			delete job;
+		}
+	}
+};
 
-			// Set (time ago): Prefix '-' means less than; no prefix means more than; both match exact (to the second)
-			if (!args.set.empty())
-			{
-				bool prefixed = args.set[0] == '-';
-				long set = ServerInstance->Time() - ServerInstance->Duration(prefixed ? args.set.substr(1) : args.set);
+/** Removes the X-lines matched by large XREMOVEs a chunk at a time so that the
+ * server and its links are not tied up by them. These removals are summarised
+ * in one snotice instead of one per X-line.
+ */
+class BulkRemover : public Timer
+{
+	struct Job
+	{
+		std::string uuid;
+		std::string nick;
+		std::string criteria;
+		RemovalList lines;
+		size_t next;
+		unsigned int removed;
+	};
 
-				if ((prefixed && xline->set_time < set) ||
-				    (!prefixed && xline->set_time > set))
-				{
-					i = safei;
-					continue;
-				}
-			}
+	std::deque<Job> jobs;
 
-			// Duration: Prefix '+' means longer than; '-' means shorter than; no prefix means exact; '0' matches no expiry
-			if (!args.duration.empty())
-			{
-				bool prefixed = args.duration[0] == '+' || args.duration[0] == '-';
-				unsigned long duration = ServerInstance->Duration(prefixed ? args.duration.substr(1) : args.duration);
+ public:
+	// The most X-lines removed per second and in one go before removals are done in the background.
+	static const size_t chunksize = 500;
 
-				if ((xline->duration == 0 && args.duration != "0") ||
-				    (args.duration[0] == '+' && xline->duration <= duration) ||
-				    (args.duration[0] == '-' && xline->duration >= duration) ||
-				    (!prefixed && xline->duration != duration))
-				{
-					i = safei;
-					continue;
-				}
-			}
+	BulkRemover()
+		: Timer(1, true)
+	{
+	}
 
-			// Expires (time ahead): Prefix '+' means more than; no prefix means less than; both match exact (to the second)
-			if (!args.expires.empty())
-			{
-				bool prefixed = args.expires[0] == '+';
-				unsigned long expires = ServerInstance->Time() + ServerInstance->Duration(prefixed ? args.expires.substr(1) : args.expires);
+	static bool Remove(User* user, const PendingRemoval& line)
+	{
+		std::string ret;
+		return ServerInstance->XLines->DelLine(line.mask.c_str(), line.type, ret, user);
+	}
 
-				if ((xline->duration == 0) ||
-				    (prefixed && xline->set_time + xline->duration < expires) ||
-				    (!prefixed && xline->set_time + xline->duration > expires))
-				{
-					i = safei;
-					continue;
-				}
+	void Queue(User* user, const std::string& criteria, RemovalList& lines)
+	{
+		jobs.push_back(Job());
+		Job& job = jobs.back();
+		job.uuid = user->uuid;
+		job.nick = user->nick;
+		job.criteria = criteria;
+		job.lines.swap(lines);
+		job.next = 0;
+		job.removed = 0;
+	}
+
+	bool Tick(time_t) CXX11_OVERRIDE
+	{
+		size_t budget = chunksize;
+		while (!jobs.empty() && budget)
+		{
+			Job& job = jobs.front();
+			User* user = ServerInstance->FindUUID(job.uuid);
+			for (; job.next < job.lines.size() && budget; ++job.next, --budget)
+			{
+				if (Remove(user ? user : ServerInstance->FakeClient, job.lines[job.next]))
+					job.removed++;
 			}
 
-			matched++;
+			if (job.next < job.lines.size())
+				break;
 
-			// Skip the rest when just counting matches
-			if (count)
+			ServerInstance->SNO->WriteToSnoMask('x', "%s removed %u X-lines (%s)", job.nick.c_str(),
+				job.removed, job.criteria.c_str());
+			if (user)
+				user->WriteNotice(InspIRCd::Format("Finished removing %u X-lines (%s)", job.removed, job.criteria.c_str()));
+			jobs.pop_front();
+		}
+		return true;
+	}
+};
+
+class CommandXBase : public SplitCommand
+{
+	BulkRemover& remover;
+	SearchStreamer& streamer;
+	SnapshotSearcher& searcher;
+
+	void ProcessLines(const CompiledCriteria& criteria, const std::string& linetype, XLineLookup* xlines, unsigned int& matched, unsigned int& total, RemovalList* removals, SearchPage* page)
+	{
+		total += xlines->size();
+		LookupIter safei;
+
+		for (LookupIter i = xlines->begin(); i != xlines->end(); )
+		{
+			safei = i;
+			safei++;
+
+			XLine* xline = i->second;
+			if (!criteria.Matches(xline))
 			{
 				i = safei;
 				continue;
 			}
 
-			std::string expires;
-			const std::string display = xline->Displayable();
-			const std::string duration = (xline->duration == 0 ? "permanent" : InspIRCd::DurationString(xline->duration));
-			const std::string reason = xline->reason;
-			const std::string settime = ServerInstance->TimeString(xline->set_time);
-			if (xline->duration == 0)
-				expires = "doesn't expire";
-			else
-				expires = InspIRCd::Format("expires in %s (on %s)",
-					InspIRCd::DurationString(xline->expiry - ServerInstance->Time()).c_str(),
-					ServerInstance->TimeString(xline->expiry).c_str());
-
-			std::string ret;
-			if (remove && ServerInstance->XLines->DelLine(display.c_str(), linetype, ret, user))
-			{
-				ServerInstance->SNO->WriteToSnoMask('x', "%s removed %s on %s: %s", user->nick.c_str(),
-					BuildTypeStr(linetype).c_str(), display.c_str(), reason.c_str());
-			}
-			else if (!remove)
-			{
-				user->WriteNotice(InspIRCd::Format("%s on %s set by %s on %s, duration '%s', %s: %s",
-					BuildTypeStr(linetype).c_str(), display.c_str(), xline->source.c_str(),
-					settime.c_str(), duration.c_str(), expires.c_str(), reason.c_str()));
-			}
+			// Matches are removed or listed once the scan is finished
+			if (removals)
+				removals->push_back(PendingRemoval(linetype, xline->Displayable(), xline->reason));
+			else if (page && page->Wanted(matched))
+				page->results.push_back(SearchResult(linetype, xline));
 
+			matched++;
 			i = safei;
 		}
 	}
 
+	// Small removals are done straight away as before and larger ones are left to the BulkRemover.
+	bool RemoveLines(LocalUser* user, const std::string& criteria, RemovalList& removals)
+	{
+		if (removals.size() > BulkRemover::chunksize)
+		{
+			user->WriteNotice(InspIRCd::Format("Removing %u X-lines in the background, %u per second",
+				static_cast<unsigned int>(removals.size()), static_cast<unsigned int>(BulkRemover::chunksize)));
+			remover.Queue(user, criteria, removals);
+			return false;
+		}
+
+		for (RemovalList::const_iterator i = removals.begin(); i != removals.end(); ++i)
+		{
+			if (BulkRemover::Remove(user, *i))
+				ServerInstance->SNO->WriteToSnoMask('x', "%s removed %s on %s: %s", user->nick.c_str(),
+					BuildTypeStr(i->type).c_str(), i->mask.c_str(), i->reason.c_str());
+		}
+		return true;
+	}
+
+	void QueueSnapshot(LocalUser* user, SnapshotJob* job)
+	{
+		user->WriteNotice(InspIRCd::Format("Matching a snapshot of %u X-lines in the background",
+			static_cast<unsigned int>(job->lines.size())));
+		searcher.Queue(job);
+	}
+
 	bool HandleCmd(LocalUser* user, const Criteria& args, Command* cmd)
 	{
 		bool count = (cmd->name == "XCOUNT");
 		bool remove = (cmd->name == "XREMOVE");
 		const std::string action = (remove ? "Removing" : "Listing");
 		const std::string criteria = BuildCriteriaStr(args);
+		const CompiledCriteria compiled(args);
 		unsigned int matched = 0;
 		unsigned int total = 0;
+		RemovalList removals;
+		RemovalList* removalsptr = (remove ? &removals : NULL);
+		SearchPage page(args);
+		SearchPage* pageptr = (!count && !remove ? &page : NULL);
+		const bool snapshot = (args.snapshot && !remove);
 
 		if (args.type == "*")
 		{
@@ -416,6 +897,7 @@ class CommandXBase : public SplitCommand
 				user->WriteNotice(InspIRCd::Format("%s matches from all X-line types (%s)",
 					action.c_str(), criteria.c_str()));
 
+			SnapshotJob* job = (snapshot ? new SnapshotJob(user, count, args) : NULL);
 			std::vector<std::string> xlinetypes = ServerInstance->XLines->GetAllTypes();
 			for (std::vector<std::string>::const_iterator x = xlinetypes.begin(); x != xlinetypes.end(); ++x)
 			{
@@ -428,16 +910,21 @@ class CommandXBase : public SplitCommand
 				}
 
 				XLineLookup* xlines = ServerInstance->XLines->GetAll(*x);
-				if (xlines)
-					ProcessLines(user, args, *x, xlines, matched, total, count, remove);
+				if (xlines && job)
+					job->Add(*x, xlines);
+				else if (xlines)
+					ProcessLines(compiled, *x, xlines, matched, total, removalsptr, pageptr);
 			}
 
-			if (count)
+			if (job)
+				QueueSnapshot(user, job);
+			else if (count)
 				user->WriteNotice(InspIRCd::Format("%u of %u X-lines matched (%s)",
 					matched, total, criteria.c_str()));
-			else
-				user->WriteNotice(InspIRCd::Format("End of list, %u/%u X-lines %s",
-					matched, total, (remove ? "removed" : "matched")));
+			else if (remove && RemoveLines(user, criteria, removals))
+				user->WriteNotice(InspIRCd::Format("End of list, %u/%u X-lines removed", matched, total));
+			else if (!remove)
+				streamer.Send(user, page.results, InspIRCd::Format("End of list, %u/%u X-lines matched", matched, total));
 		}
 		else
 		{
@@ -469,23 +956,43 @@ class CommandXBase : public SplitCommand
 				user->WriteNotice(InspIRCd::Format("%s matches of X-line type '%s' (%s)",
 					action.c_str(), linetype.c_str(), criteria.c_str()));
 
-			ProcessLines(user, args, linetype, xlines, matched, total, count, remove);
+			if (snapshot)
+			{
+				SnapshotJob* job = new SnapshotJob(user, count, args);
+				job->typestr = " of type '" + linetype + "'";
+				job->Add(linetype, xlines);
+				QueueSnapshot(user, job);
+				return true;
+			}
+
+			ProcessLines(compiled, linetype, xlines, matched, total, removalsptr, pageptr);
 
 			if (count)
 				user->WriteNotice(InspIRCd::Format("%u of %u X-lines of type '%s' matched (%s)",
 					matched, total, linetype.c_str(), criteria.c_str()));
-			else
-				user->WriteNotice(InspIRCd::Format("End of list, %u/%u X-lines of type '%s' %s",
-					matched, total, linetype.c_str(), (remove ? "removed" : "matched")));
+			else if (remove && RemoveLines(user, criteria, removals))
+				user->WriteNotice(InspIRCd::Format("End of list, %u/%u X-lines of type '%s' removed",
+					matched, total, linetype.c_str()));
+			else if (!remove)
+				streamer.Send(user, page.results, InspIRCd::Format("End of list, %u/%u X-lines of type '%s' matched",
+					matched, total, linetype.c_str()));
 		}
 
 		return true;
 	}
 
  public:
-	CommandXBase(Module* Creator, const std::string& cmdname) : SplitCommand(Creator, cmdname, 1)
+	CommandXBase(Module* Creator, const std::string& cmdname, BulkRemover& Remover, SearchStreamer& Streamer, SnapshotSearcher& Searcher)
+		: SplitCommand(Creator, cmdname, 1)
+		, remover(Remover)
+		, streamer(Streamer)
+		, searcher(Searcher)
 	{
 		syntax = "-type=<type|*> -mask=[!]<> -reason=[!]<> -source=[!]<> -set=[-]<time> -duration=[-+]<time> -expires=[+]<time> -config=<yes|no>";
+		if (cmdname == "XSEARCH")
+			syntax.append(" -offset=<number> -limit=<number>");
+		if (cmdname != "XREMOVE")
+			syntax.append(" -snapshot=<yes|no>");
 		flags_needed = 'o';
 	}
 
@@ -622,22 +1129,192 @@ class CommandXCopy : public SplitCommand
 	}
 };
 
+class CommandXAggregate : public SplitCommand
+{
+	// The single address Z-lines within a range.
+	struct Cluster
+	{
+		RemovalList lines;
+		time_t expiry;
+		bool permanent;
+
+		Cluster() : expiry(0), permanent(false) { }
+	};
+	typedef std::map<std::string, Cluster> ClusterMap;
+
+	BulkRemover& remover;
+
+ public:
+	CommandXAggregate(Module* Creator, BulkRemover& Remover)
+		: SplitCommand(Creator, "XAGGREGATE", 1, 3)
+		, remover(Remover)
+	{
+		syntax = "<minimum> [IPv4 prefix] [IPv6 prefix]";
+		flags_needed = 'o';
+	}
+
+	// Returns the number of covering Z-lines which were added. If serveronly
+	// is set only the Z-lines set by a server rather than an oper are merged.
+	unsigned int Aggregate(User* user, unsigned int minimum, unsigned int v4bits, unsigned int v6bits, bool serveronly)
+	{
+		XLineLookup* xlines = ServerInstance->XLines->GetAll("Z");
+		XLineFactory* xlf = ServerInstance->XLines->GetFactory("Z");
+		if (!xlines || !xlf || minimum < 2)
+			return 0;
+
+		ClusterMap clusters;
+		for (LookupIter i = xlines->begin(); i != xlines->end(); ++i)
+		{
+			XLine* xline = i->second;
+			if (xline->from_config)
+				continue;
+
+			// Nicks can't contain a '.' but server names always do.
+			if (serveronly && xline->source.find('.') == std::string::npos)
+				continue;
+
+			// Only Z-lines on a single address are aggregated.
+			irc::sockets::sockaddrs sa;
+			if (!irc::sockets::aptosa(xline->Displayable(), 0, sa))
+				continue;
+
+			const unsigned int bits = (sa.family() == AF_INET6 ? v6bits : v4bits);
+			Cluster& cluster = clusters[irc::sockets::cidr_mask(sa, bits).str()];
+			cluster.lines.push_back(PendingRemoval("Z", xline->Displayable(), xline->reason));
+			if (!xline->duration)
+				cluster.permanent = true;
+			else if (xline->expiry > cluster.expiry)
+				cluster.expiry = xline->expiry;
+		}
+
+		unsigned int added = 0;
+		RemovalList removals;
+		for (ClusterMap::iterator i = clusters.begin(); i != clusters.end(); ++i)
+		{
+			Cluster& cluster = i->second;
+			if (cluster.lines.size() < minimum)
+				continue;
+
+			const unsigned long duration = (cluster.permanent ? 0 : std::max<long>(cluster.expiry - ServerInstance->Time(), 1));
+			const std::string reason = InspIRCd::Format("%s (aggregated from %u Z-lines)", cluster.lines.front().reason.c_str(),
+				static_cast<unsigned int>(cluster.lines.size()));
+
+			XLine* zline = xlf->Generate(ServerInstance->Time(), duration, user->nick, reason, i->first);
+			if (!ServerInstance->XLines->AddLine(zline, user))
+			{
+				delete zline;
+				continue;
+			}
+
+			ServerInstance->SNO->WriteToSnoMask('x', "%s added %s Z-line for %s covering %u Z-lines: %s", user->nick.c_str(),
+				(duration == 0 ? "permanent" : "timed"), i->first.c_str(), static_cast<unsigned int>(cluster.lines.size()), reason.c_str());
+			removals.insert(removals.end(), cluster.lines.begin(), cluster.lines.end());
+			added++;
+		}
+
+		if (removals.empty())
+			return added;
+
+		const std::string criteria = InspIRCd::Format("aggregated into %u Z-lines", added);
+		if (removals.size() > BulkRemover::chunksize)
+		{
+			remover.Queue(user, criteria, removals);
+			return added;
+		}
+
+		unsigned int removed = 0;
+		for (RemovalList::const_iterator i = removals.begin(); i != removals.end(); ++i)
+		{
+			if (BulkRemover::Remove(user, *i))
+				removed++;
+		}
+		ServerInstance->SNO->WriteToSnoMask('x', "%s removed %u X-lines (%s)", user->nick.c_str(), removed, criteria.c_str());
+		return added;
+	}
+
+	CmdResult HandleLocal(LocalUser* user, const Params& parameters) CXX11_OVERRIDE
+	{
+		if (!HasCommandPermission(user, "Z"))
+		{
+			user->WriteNumeric(ERR_NOPRIVILEGES, "%s :Permission Denied - Oper type '%s' does not have access to aggregate Z-lines",
+				user->nick.c_str(), user->oper->name.c_str());
+			return CMD_FAILURE;
+		}
+
+		const unsigned int minimum = ConvToNum<unsigned int>(parameters[0]);
+		const unsigned int v4bits = (parameters.size() > 1 ? ConvToNum<unsigned int>(parameters[1]) : 24);
+		const unsigned int v6bits = (parameters.size() > 2 ? ConvToNum<unsigned int>(parameters[2]) : 64);
+		if (minimum < 2 || v4bits < 8 || v4bits > 32 || v6bits < 16 || v6bits > 128)
+		{
+			user->WriteNotice("The minimum must be at least 2, the IPv4 prefix 8-32 and the IPv6 prefix 16-128");
+			return CMD_FAILURE;
+		}
+
+		const unsigned int added = Aggregate(user, minimum, v4bits, v6bits, false);
+		user->WriteNotice(InspIRCd::Format("Added %u Z-lines covering ranges with at least %u Z-lines", added, minimum));
+		return CMD_SUCCESS;
+	}
+};
+
 class ModuleXLineTools : public Module
 {
+	BulkRemover remover;
+	SearchStreamer streamer;
+	SnapshotSearcher searcher;
 	CommandXBase xcount;
 	CommandXBase xremove;
 	CommandXBase xsearch;
 	CommandXCopy xcopy;
+	CommandXAggregate xaggregate;
+
+	// The settings for automatically aggregating Z-lines.
+	unsigned int aggregatemin;
+	unsigned int aggregatev4;
+	unsigned int aggregatev6;
+	bool aggregateall;
+	time_t nextaggregate;
 
  public:
 	ModuleXLineTools()
-		: xcount(this, "XCOUNT")
-		, xremove(this, "XREMOVE")
-		, xsearch(this, "XSEARCH")
+		: searcher(streamer)
+		, xcount(this, "XCOUNT", remover, streamer, searcher)
+		, xremove(this, "XREMOVE", remover, streamer, searcher)
+		, xsearch(this, "XSEARCH", remover, streamer, searcher)
 		, xcopy(this)
+		, xaggregate(this, remover)
+		, aggregatemin(0)
+		, aggregatev4(24)
+		, aggregatev6(64)
+		, aggregateall(false)
+		, nextaggregate(0)
 	{
 	}
 
+	void init() CXX11_OVERRIDE
+	{
+		ServerInstance->Timers.AddTimer(&remover);
+		ServerInstance->Timers.AddTimer(&streamer);
+		searcher.Start();
+	}
+
+	void ReadConfig(ConfigStatus& status) CXX11_OVERRIDE
+	{
+		ConfigTag* tag = ServerInstance->Config->ConfValue("xlinetools");
+		aggregatemin = tag->getUInt("aggregatemin", 0);
+		aggregatev4 = tag->getUInt("aggregatev4", 24, 8, 32);
+		aggregatev6 = tag->getUInt("aggregatev6", 64, 16, 128);
+		aggregateall = tag->getBool("aggregateall");
+	}
+
+	void OnBackgroundTimer(time_t now) CXX11_OVERRIDE
+	{
+		if (aggregatemin < 2 || now < nextaggregate)
+			return;
+
+		nextaggregate = now + 60;
+		xaggregate.Aggregate(ServerInstance->FakeClient, aggregatemin, aggregatev4, aggregatev6, !aggregateall);
+	}
+
 	Version GetVersion() CXX11_OVERRIDE
 	{
 		return Version("X-line management tools");
@@ -26,10 +26,31 @@
 #include "inspircd.h"
 #include "modules/server.h"
 
-typedef insp::flat_map<std::string, std::vector<std::string> > NeighbourMap;
+// A local user and the id of a channel they were in when a zombie was marked.
+typedef std::pair<size_t, std::string> ChannelNeighbour;
+typedef std::vector<ChannelNeighbour> ChannelNeighbourList;
+
+// A channel which zombies from a split were in. This is shared by all of the
+// zombies from the split which were in the channel.
+struct ZombieChannel
+{
+	// The name of the channel.
+	std::string name;
+
+	// The sorted uuids of the local users in the channel when it was first seen.
+	std::vector<std::string> neighbors;
+};
+
+class ZombieTimer;
 
 struct ZombieUser
 {
+	// The uuid of the zombie.
+	std::string uuid;
+
+	// The timer of the server the zombie split from.
+	ZombieTimer* timer;
+
 	// The nick used by the zombie.
 	std::string nick;
 
@@ -39,37 +60,147 @@ struct ZombieUser
 	// The display hostname used by the zombie.
 	std::string host;
 
-	// The neighbors that can see this zombie.
-	NeighbourMap neighbors;
+	// The ids of the channels the zombie was in.
+	std::vector<size_t> chans;
+
+	// Users other modules made visible or invisible to the zombie in a channel.
+	ChannelNeighbourList shown;
+	ChannelNeighbourList hidden;
+
+	bool IsHidden(size_t chan, const std::string& neighbor) const
+	{
+		return !hidden.empty() && stdalgo::isin(hidden, std::make_pair(chan, neighbor));
+	}
 };
 
 typedef insp::flat_map<std::string, ZombieUser*> ZombieUserMap;
 
+// The zombies from every split server by nick.
+struct ZombieIndex
+{
+	typedef TR1NS::unordered_map<std::string, ZombieUser*, irc::insensitive, irc::StrHashComp> NickMap;
+	NickMap nicks;
+
+	// Changed whenever a zombie is added or removed.
+	unsigned long generation;
+
+	ZombieIndex()
+		: generation(0)
+	{
+	}
+
+	void Add(ZombieUser* zombie)
+	{
+		nicks[zombie->nick] = zombie;
+		generation++;
+	}
+
+	void Remove(ZombieUser* zombie)
+	{
+		NickMap::iterator iter = nicks.find(zombie->nick);
+		if (iter != nicks.end() && iter->second == zombie)
+			nicks.erase(iter);
+		generation++;
+	}
+
+	ZombieUser* Find(const std::string& nick) const
+	{
+		NickMap::const_iterator iter = nicks.find(nick);
+		return iter != nicks.end() ? iter->second : NULL;
+	}
+};
+
 class ZombieTimer
 	: public Timer
 {
  public:
+	// The most zombies expired per second.
+	static const size_t chunksize = 500;
+
 	// Whether this timer is dead.
 	bool dead;
 
+	// Whether the zombies of this timer are being expired.
+	bool expiring;
+
 	// The zombie users who are presently visible.
 	ZombieUserMap users;
 
 	// The id of the server this timer is waiting on.
 	const std::string sid;
 
-	ZombieTimer(const Server* server, unsigned duration)
-		: Timer(duration)
+	// The zombies from every split server by nick.
+	ZombieIndex& index;
+
+	// The channels zombies from this split were in.
+	std::vector<ZombieChannel> channels;
+	TR1NS::unordered_map<std::string, size_t, irc::insensitive, irc::StrHashComp> channelids;
+
+	// Finds the id of a channel, remembering who is in it if it is new.
+	size_t GetChannel(Channel* chan)
+	{
+		std::pair<TR1NS::unordered_map<std::string, size_t, irc::insensitive, irc::StrHashComp>::iterator, bool> res =
+			channelids.insert(std::make_pair(chan->name, channels.size()));
+		if (!res.second)
+			return res.first->second;
+
+		channels.push_back(ZombieChannel());
+		ZombieChannel& zchan = channels.back();
+		zchan.name = chan->name;
+
+		const Channel::MemberMap& userlist = chan->GetUsers();
+		for (Channel::MemberMap::const_iterator miter = userlist.begin(); miter != userlist.end(); ++miter)
+		{
+			if (IS_LOCAL(miter->first))
+				zchan.neighbors.push_back(miter->first->uuid);
+		}
+		std::sort(zchan.neighbors.begin(), zchan.neighbors.end());
+		return res.first->second;
+	}
+
+	ZombieTimer(const Server* server, unsigned duration, ZombieIndex& Index)
+		: Timer(duration, true)
 		, dead(false)
+		, expiring(false)
 		, sid(server->GetId())
+		, index(Index)
+	{
+	}
+
+	// Sends a QUIT for a zombie and then forgets about it.
+	void Remove(ZombieUser* zombie)
 	{
+		SendQuit(zombie);
+		index.Remove(zombie);
+		users.erase(zombie->uuid);
+		delete zombie;
 	}
 
-	void Cleanup()
+	// Forgets about the zombies which came back when the server reconnected.
+	void Reconnected()
 	{
 		for (ZombieUserMap::iterator uiter = users.begin(); uiter != users.end(); )
 		{
-			// Check that the user still exists.
+			User* user = ServerInstance->FindUUID(uiter->first);
+			if (user && irc::equals(user->nick, uiter->second->nick))
+			{
+				index.Remove(uiter->second);
+				delete uiter->second;
+				uiter = users.erase(uiter);
+			}
+			else
+				uiter++;
+		}
+		expiring = true;
+	}
+
+	// Expires up to the given number of zombies. Returns true if any are left.
+	bool Expire(size_t budget)
+	{
+		// Zombies are taken from the back as erasing from a flat_map is cheapest there.
+		for (; !users.empty() && budget; --budget)
+		{
+			ZombieUserMap::iterator uiter = users.end() - 1;
 			User* user = ServerInstance->FindUUID(uiter->first);
 			if (!user || !irc::equals(user->nick, uiter->second->nick))
 			{
@@ -77,14 +208,21 @@ class ZombieTimer
 				SendQuit(uiter->second);
 			}
 
+			index.Remove(uiter->second);
 			delete uiter->second;
-			uiter = users.erase(uiter);
+			users.erase(uiter);
 		}
+		return !users.empty();
 	}
 
 	void MarkAsZombie(User* user)
 	{
-		NeighbourMap neighbors;
+		// This is called for each recipient of the quit.
+		if (users.find(user->uuid) != users.end())
+			return;
+
+		ZombieUser* zombie = new ZombieUser();
+		bool visible = false;
 		std::map<User*, bool> exceptions;
 		IncludeChanList include_chans;
 		for (User::ChanList::const_iterator citer = user->chans.begin(); citer != user->chans.end(); ++citer)
@@ -94,48 +232,52 @@ class ZombieTimer
 			include_chans.push_back(*citer);
 
 			FOREACH_MOD(OnBuildNeighborList, (user, include_chans, exceptions));
-			const already_sent_t newid = ServerInstance->Users.NextAlreadySentId();
+
+			const size_t chanid = GetChannel((*citer)->chan);
+			zombie->chans.push_back(chanid);
 
 			// Handle special users.
+			size_t hidden = 0;
 			for (std::map<User*, bool>::const_iterator eiter = exceptions.begin(); eiter != exceptions.end(); ++eiter)
 			{
 				LocalUser* luser = IS_LOCAL(eiter->first);
 				if (!luser)
 					continue;
 
-				luser->already_sent = newid;
 				if (eiter->second)
-					neighbors[luser->uuid].push_back((*citer)->chan->name.c_str());
-			}
-
-			// Handle normal users.
-			const Channel::MemberMap& userlist = (*citer)->chan->GetUsers();
-			for (Channel::MemberMap::const_iterator miter = userlist.begin(); miter != userlist.end(); ++miter)
-			{
-				LocalUser* luser = IS_LOCAL(miter->first);
-				if (luser && luser->already_sent != newid)
 				{
-					neighbors[luser->uuid].push_back((*citer)->chan->name.c_str());
-					luser->already_sent = newid;
+					zombie->shown.push_back(std::make_pair(chanid, luser->uuid));
+					visible = true;
+				}
+				else
+				{
+					zombie->hidden.push_back(std::make_pair(chanid, luser->uuid));
+					hidden++;
 				}
- 			}
+			}
+
+			// Normal users are in the shared neighbor list for the channel.
+			if (channels[chanid].neighbors.size() > hidden)
+				visible = true;
 		}
 
-		if (neighbors.empty())
+		if (!visible)
 		{
 			ServerInstance->Logs->Log(MODNAME, LOG_DEBUG, "Not marking %s as a zombie as nobody can see them",
 				user->uuid.c_str());
+			delete zombie;
 			return;
 		}
 
-		ServerInstance->Logs->Log(MODNAME, LOG_DEBUG, "Marking %s as a zombie until %s with %lu neighbors in %lu channels",
-			user->uuid.c_str(), InspIRCd::TimeString(GetTrigger()).c_str(), neighbors.size(), user->chans.size());
-		ZombieUser* zombie = new ZombieUser();
+		ServerInstance->Logs->Log(MODNAME, LOG_DEBUG, "Marking %s as a zombie until %s in %lu channels",
+			user->uuid.c_str(), InspIRCd::TimeString(GetTrigger()).c_str(), user->chans.size());
+		zombie->uuid = user->uuid;
+		zombie->timer = this;
 		zombie->nick = user->nick;
 		zombie->user = user->ident;
 		zombie->host = user->GetDisplayedHost();
-		std::swap(zombie->neighbors, neighbors);
 		users.insert(std::make_pair(user->uuid, zombie));
+		index.Add(zombie);
 	}
 
 	void SendQuit(ZombieUser* user)
@@ -147,34 +289,62 @@ class ZombieTimer
 		quitmsg.PushParam("Zombie connection timed out");
 
 		ClientProtocol::Event quitevent(ServerInstance->GetRFCEvents().quit, quitmsg);
-		for (NeighbourMap::const_iterator niter = user->neighbors.begin(); niter != user->neighbors.end(); ++niter)
+		const already_sent_t newid = ServerInstance->Users.NextAlreadySentId();
+		for (std::vector<size_t>::const_iterator iter = user->chans.begin(); iter != user->chans.end(); ++iter)
 		{
-			LocalUser* luser = IS_LOCAL(ServerInstance->FindUUID(niter->first));
-			if (!luser)
+			// Only users who are still in the channel need to be told.
+			const ZombieChannel& zchan = channels[*iter];
+			Channel* chan = ServerInstance->FindChan(zchan.name);
+			if (!chan)
 				continue;
 
-			// Attempt to find any common channels.
-			bool found_chan = false;
-			for (User::ChanList::const_iterator citer = luser->chans.begin(); citer != luser->chans.end(); ++citer)
+			// Handle normal users.
+			const Channel::MemberMap& userlist = chan->GetUsers();
+			for (Channel::MemberMap::const_iterator miter = userlist.begin(); miter != userlist.end(); ++miter)
 			{
-				Channel* chan = (*citer)->chan;
-				if (stdalgo::isin(niter->second, chan->name))
-				{
-					found_chan = true;
-					break;
-				}
-			}
+				LocalUser* luser = IS_LOCAL(miter->first);
+				if (!luser || luser->already_sent == newid)
+					continue;
+
+				if (!std::binary_search(zchan.neighbors.begin(), zchan.neighbors.end(), luser->uuid))
+					continue;
+
+				if (user->IsHidden(*iter, luser->uuid))
+					continue;
 
-			// If we didn't find any common channels then we don't need to send a quit.
-			if (found_chan)
+				luser->already_sent = newid;
 				luser->Send(quitevent);
+			}
+		}
+
+		// Handle special users.
+		for (ChannelNeighbourList::const_iterator niter = user->shown.begin(); niter != user->shown.end(); ++niter)
+		{
+			LocalUser* luser = IS_LOCAL(ServerInstance->FindUUID(niter->second));
+			if (!luser || luser->already_sent == newid)
+				continue;
+
+			Channel* chan = ServerInstance->FindChan(channels[niter->first].name);
+			if (!chan || !chan->HasUser(luser))
+				continue;
+
+			luser->already_sent = newid;
+			luser->Send(quitevent);
 		}
 	}
 
 	bool Tick(time_t currtime) CXX11_OVERRIDE
 	{
-		ServerInstance->Logs->Log(MODNAME, LOG_DEBUG, "Server %s timed out; cleaning up dead sessions", sid.c_str());
-		Cleanup();
+		if (!expiring)
+		{
+			ServerInstance->Logs->Log(MODNAME, LOG_DEBUG, "Server %s timed out; cleaning up dead sessions", sid.c_str());
+			expiring = true;
+			SetInterval(1, false);
+		}
+
+		if (Expire(chunksize))
+			return true;
+
 		dead = true;
 		return false;
 	}
@@ -187,13 +357,39 @@ class JoinHook
 	: public ClientProtocol::EventHook
 {
  private:
-	// The timers for servers which have split recently.
-	ZombieServerMap& servers;
+	// The zombies from every split server by nick.
+	ZombieIndex& index;
+
+	// The join which was last looked at. This is called once for each
+	// recipient of a join so the answer is remembered until the join,
+	// the joiner's nick, or the zombies change.
+	const ClientProtocol::Event* lastevent;
+	User* lastjoiner;
+	std::string lastnick;
+	unsigned long lastgeneration;
+	ModResult lastresult;
+
+	ModResult Check(User* joiner)
+	{
+		ZombieUser* zombie = index.Find(joiner->nick);
+		if (!zombie)
+			return MOD_RES_PASSTHRU;
+
+		// Check whether its the same joiner.
+		if (zombie->uuid == joiner->uuid)
+			return MOD_RES_DENY;
+
+		zombie->timer->Remove(zombie);
+		return MOD_RES_PASSTHRU;
+	}
 
  public:
-	JoinHook(Module* mod, ZombieServerMap& Servers)
+	JoinHook(Module* mod, ZombieIndex& Index)
 		: ClientProtocol::EventHook(mod, "JOIN", 25)
-		, servers(Servers)
+		, index(Index)
+		, lastevent(NULL)
+		, lastjoiner(NULL)
+		, lastgeneration(0)
 	{
 	}
 
@@ -202,27 +398,15 @@ class JoinHook
 		const ClientProtocol::Events::Join& join = static_cast<const ClientProtocol::Events::Join&>(ev);
 
 		User* joiner = join.GetMember()->user;
-		for (ZombieServerMap::iterator siter = servers.begin(); siter != servers.end(); ++siter)
-		{
-			ZombieTimer* server = siter->second;
-			for (ZombieUserMap::iterator uiter = server->users.begin(); uiter != server->users.end(); ++uiter)
-			{
-				if (!irc::equals(uiter->second->nick, joiner->nick))
-					continue;
-
-				// Check whether its the same joiner.
-				if (uiter->first == joiner->uuid)
-					return MOD_RES_DENY;
-
-				server->SendQuit(uiter->second);
-				delete uiter->second;
-
-				server->users.erase(uiter);
-				return MOD_RES_PASSTHRU;
-			}
-		}
-
-		return MOD_RES_PASSTHRU;
+		if (&ev == lastevent && joiner == lastjoiner && index.generation == lastgeneration && joiner->nick == lastnick)
+			return lastresult;
+
+		lastresult = index.nicks.empty() ? MOD_RES_PASSTHRU : Check(joiner);
+		lastevent = &ev;
+		lastjoiner = joiner;
+		lastnick = joiner->nick;
+		lastgeneration = index.generation;
+		return lastresult;
 	}
 };
 
@@ -264,6 +448,8 @@ class ModuleZombie
 {
 private:
 	ZombieServerMap servers;
+	std::vector<ZombieTimer*> reconnected;
+	ZombieIndex index;
 	JoinHook joinhook;
 	QuitHook quithook;
 	unsigned int zombietime;
@@ -275,7 +461,7 @@ private:
 
 	ModuleZombie()
 		: ServerProtocol::LinkEventListener(this)
-		, joinhook(this, servers)
+		, joinhook(this, index)
 		, quithook(this, servers)
 	{
 	}
@@ -301,6 +487,17 @@ private:
 			else
 				siter++;
 		}
+
+		for (std::vector<ZombieTimer*>::iterator riter = reconnected.begin(); riter != reconnected.end(); )
+		{
+			if ((*riter)->dead)
+			{
+				delete *riter;
+				riter = reconnected.erase(riter);
+			}
+			else
+				riter++;
+		}
 	}
 
 	void OnServerBurst(const Server* server) CXX11_OVERRIDE
@@ -312,11 +509,25 @@ private:
 		// This server is no longer a zombie.
 		ServerInstance->Logs->Log(MODNAME, LOG_DEBUG, "Server %s reconnected; cleaning up dead sessions",
 			server->GetId().c_str());
-		ServerInstance->Timers.DelTimer(siter->second);
-		siter->second->Cleanup();
-
-		delete siter->second;
+		ZombieTimer* timer = siter->second;
 		servers.erase(siter);
+		if (timer->dead)
+		{
+			delete timer;
+			return;
+		}
+
+		// Users who did not come back are sent a QUIT a chunk at a time.
+		timer->Reconnected();
+		if (timer->users.empty())
+		{
+			ServerInstance->Timers.DelTimer(timer);
+			delete timer;
+			return;
+		}
+
+		timer->SetInterval(1);
+		reconnected.push_back(timer);
 	}
 
 	void OnServerSplit(const Server* server, bool error) CXX11_OVERRIDE
@@ -328,7 +539,7 @@ private:
 			return;
 
 		ServerInstance->Logs->Log(MODNAME, LOG_DEBUG, "Marking server %s as a zombie", server->GetName().c_str());
-		ZombieTimer* timer = new ZombieTimer(server, zombietime);
+		ZombieTimer* timer = new ZombieTimer(server, zombietime, index);
 		ServerInstance->Timers.AddTimer(timer);
 		servers.insert(std::make_pair(server->GetId(), timer));
 	}